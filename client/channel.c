@@ -22,7 +22,11 @@
  */
 #include "r2tcli.h"
 #include "msgparser.h"
+#include "compress.h"
+#include "workers.h"
+#include "dedup.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -31,26 +35,159 @@
 
 extern int debug_level;
 
+/** shortest interval between two ping probes (microseconds) */
+#define CHANNEL_PING_MIN    1000000
+/** longest interval between two ping probes (microseconds) */
+#define CHANNEL_PING_MAX    (RDP2TCP_PING_DELAY * 1000000)
+/** shortest disconnect timeout (microseconds) */
+#define CHANNEL_TIMEOUT_MIN 3000000
+/** disconnect timeout used until the round-trip time is known */
+#define CHANNEL_TIMEOUT_MAX ((RDP2TCP_PING_DELAY + 4) * 1000000)
+
+/** batches of frames whose queueing time is tracked */
+#define CHANNEL_QMARKS 64
+
 /** TS virtual channel singleton  */
 typedef struct _vchannel {
-	time_t ts;      /**< timestamp of last channel activity */
+	unsigned long long rx_ts;   /**< last channel input (us), 0 if none */
+	unsigned long long wr_ts;   /**< last channel output progress (us) */
+	unsigned long long ping_ts; /**< last ping probe (us) */
+	unsigned int ping_seq;      /**< last ping probe sequence number */
+	unsigned char ping_pending; /**< 1 while the last probe is unanswered */
+	unsigned int srtt;          /**< smoothed round-trip time (us), 0 if unknown */
+	unsigned int rttvar;        /**< round-trip time variation (us) */
+	unsigned int last_rtt;      /**< previous round-trip sample (us) */
+	unsigned int jitter;        /**< round-trip jitter (us) */
+	evtimer_t ping_timer;       /**< next ping probe */
+	evtimer_t watchdog;         /**< wakes the main loop when the channel may be down */
 	int last_state; /**< virtual channel previous state */
 	iobuf_t ibuf;   /**< input buffer */
-	iobuf_t obuf;   /**< output buffer */
+	iobuf_t obuf;   /**< output buffer (plain frames) */
+	iobuf_t zbuf;   /**< output buffer written before obuf (wire format) */
+	iobuf_t zibuf;  /**< decompressed channel-wide stream input */
+	iobuf_t scratch; /**< per-tunnel (de)compression buffer */
+	unsigned char want_mode;  /**< requested R2TCOMP_MODE_xxx */
+	unsigned char want_algo;  /**< requested compression algorithm */
+	unsigned char want_level; /**< requested compression level */
+	unsigned char comp_mode;  /**< negotiated R2TCOMP_MODE_xxx */
+	unsigned char comp_algo;  /**< negotiated compression algorithm */
+	unsigned char comp_level; /**< negotiated compression level */
+	compress_stream_t zout;   /**< channel-wide output stream */
+	compress_stream_t zin;    /**< channel-wide input stream */
+	unsigned char zin_lost;   /**< 1 until the server restarts its stream */
+	unsigned int dd_want;     /**< requested chunk cache size (R2T_DEDUP) */
+	dedup_cache_t dd_out;     /**< chunks held by the server */
+	dedup_cache_t dd_in;      /**< chunks received from the server */
+	ratelimit_t pace;         /**< tunnel data rate of the channel */
+	evtimer_t pace_timer;     /**< end of tunnel reads pacing */
+	unsigned char paced;      /**< 1 while tunnels exceed the channel rate */
+	netstats_t st;            /**< traffic counters */
+	unsigned long long ob_out; /**< bytes that have left obuf */
+	unsigned int qm_head;     /**< oldest queue mark */
+	unsigned int qm_count;    /**< number of queue marks */
+	struct {
+		unsigned long long pos; /**< obuf offset following the marked frames */
+		unsigned long long ts;  /**< time the frames were queued (us) */
+	} qmarks[CHANNEL_QMARKS]; /**< frames waiting in obuf */
 } vchannel_t;
 
 static vchannel_t vc;
 
+/**
+ * parse R2T_COMPRESS environment variable
+ * @note syntax is mode[:algorithm[:level]] with mode "tunnel" or "channel"
+ */
+static void channel_compress_setup(void)
+{
+	char *val, *algo, *level;
+	int n;
+
+	vc.want_mode  = R2TCOMP_MODE_NONE;
+	vc.want_algo  = COMPRESS_GZIP;
+	vc.want_level = 6;
+
+	val = getenv("R2T_COMPRESS");
+	if (!val || !*val)
+		return;
+
+	val = strdup(val);
+	if (!val)
+		return;
+
+	algo = strchr(val, ':');
+	level = NULL;
+	if (algo) {
+		*algo++ = 0;
+		level = strchr(algo, ':');
+		if (level)
+			*level++ = 0;
+	}
+
+	if (!strcmp(val, "tunnel"))
+		vc.want_mode = R2TCOMP_MODE_TUNNEL;
+	else if (!strcmp(val, "channel"))
+		vc.want_mode = R2TCOMP_MODE_CHANNEL;
+	else if (strcmp(val, "none"))
+		warn("invalid compression mode \"%s\"", val);
+
+	if (algo && *algo) {
+		n = get_compression_algorithm(algo);
+		if ((n <= COMPRESS_NONE)
+				|| !compress_supported((unsigned char)n,
+							vc.want_mode == R2TCOMP_MODE_CHANNEL)) {
+			warn("compression algorithm \"%s\" not supported", algo);
+			vc.want_mode = R2TCOMP_MODE_NONE;
+		} else {
+			vc.want_algo = (unsigned char) n;
+		}
+	}
+
+	if (level && *level) {
+		n = atoi(level);
+		if ((n < 1) || (n > 16))
+			warn("invalid compression level %i", n);
+		else
+			vc.want_level = (unsigned char) n;
+	}
+
+	free(val);
+}
+
 /**
  * initialize TS virtual channel
  */
 int channel_init(void)
 {
+	char *val;
+	unsigned int rate;
+
 	trace_chan("");
 
-	vc.ts = 0;
+	vc.rx_ts = 0;
 	vc.last_state = -1;
+	vc.st.start_ts = timer_clock();
 	iobuf_init2(&vc.ibuf, &vc.obuf, "chan");
+	iobuf_init2(&vc.zibuf, &vc.zbuf, "zchan");
+	iobuf_init(&vc.scratch, 'w', "zscratch");
+	vc.comp_mode = R2TCOMP_MODE_NONE;
+	channel_compress_setup();
+
+	// R2T_DEDUP is the chunk cache size in MB
+	val = getenv("R2T_DEDUP");
+	vc.dd_want = (val ? (unsigned int)atoi(val) * 1024 * 1024 : 0);
+	if (vc.dd_want > DEDUP_MAX_CACHE)
+		vc.dd_want = DEDUP_MAX_CACHE;
+
+	// R2T_CHANNEL_RATE leaves room to the RDP session itself
+	rate = 0;
+	val = getenv("R2T_CHANNEL_RATE");
+	if (val && ratelimit_parse(val, &rate))
+		warn("invalid R2T_CHANNEL_RATE");
+	ratelimit_init(&vc.pace, rate);
+
+	// per-tunnel compression can be spread over several cores
+	if (vc.want_mode == R2TCOMP_MODE_TUNNEL)
+		workers_init();
 
 	return 0;
 }
@@ -62,26 +199,148 @@ void channel_kill(void)
 {
 	trace_chan("");
 
+	workers_kill();
+	dedup_kill(&vc.dd_out);
+	dedup_kill(&vc.dd_in);
+	compress_stream_kill(&vc.zout);
+	compress_stream_kill(&vc.zin);
+	iobuf_kill(&vc.scratch);
+	iobuf_kill2(&vc.zibuf, &vc.zbuf);
 	iobuf_kill2(&vc.ibuf, &vc.obuf);
 }
 
+/**
+ * get the channel round-trip time estimates
+ * @param[out] rttvar round-trip time variation in microseconds (may be NULL)
+ * @param[out] jitter round-trip jitter in microseconds (may be NULL)
+ * @return smoothed round-trip time in microseconds, 0 if not yet measured
+ */
+unsigned int channel_rtt(unsigned int *rttvar, unsigned int *jitter)
+{
+	if (rttvar)
+		*rttvar = vc.rttvar;
+	if (jitter)
+		*jitter = vc.jitter;
+	return vc.srtt;
+}
+
+/**
+ * get the adaptive ping probe interval
+ * @return interval in microseconds
+ * @note probes are frequent on fast channels and sparse on slow ones
+ */
+unsigned int channel_ping_interval(void)
+{
+	unsigned int interval;
+
+	if (!vc.srtt)
+		return CHANNEL_PING_MIN;
+
+	interval = 4 * (vc.srtt + 4 * vc.rttvar);
+	if (interval < CHANNEL_PING_MIN)
+		return CHANNEL_PING_MIN;
+	if (interval > CHANNEL_PING_MAX)
+		return CHANNEL_PING_MAX;
+	return interval;
+}
+
+/**
+ * get the channel disconnect timeout
+ * @return timeout in microseconds
+ * @note two probes may be missed before the channel is declared down
+ */
+unsigned int channel_timeout(void)
+{
+	unsigned int timeout;
+
+	if (!vc.srtt)
+		return CHANNEL_TIMEOUT_MAX;
+
+	timeout = 2 * channel_ping_interval() + 4 * (vc.srtt + 4 * vc.rttvar);
+	if (timeout < CHANNEL_TIMEOUT_MIN)
+		return CHANNEL_TIMEOUT_MIN;
+	if (timeout > CHANNEL_TIMEOUT_MAX)
+		return CHANNEL_TIMEOUT_MAX;
+	return timeout;
+}
+
+static void channel_ping_event(void *);
+
+static void channel_watchdog_event(void *ctx)
+{
+	// nothing to do, the main loop checks the channel state at each wakeup
+}
+
+/**
+ * record a virtual channel state change
+ * @param[in] connected new state
+ * @note probes are sent as long as the channel is connected
+ */
+static void channel_set_state(int connected)
+{
+	if (vc.last_state == connected)
+		return;
+
+	vc.last_state = connected;
+	frec_record(FREC_CHAN_STATE, (unsigned char) connected, 0xff, 0);
+	info(0, "virtual channel %s", connected?"connected":"disconnected");
+
+	if (connected) {
+		vc.st.up_ts = timer_clock();
+		timer_arm(&vc.ping_timer, 0, channel_ping_event, NULL);
+	} else {
+		vc.st.up_ts = 0;
+		timer_cancel(&vc.ping_timer);
+		timer_cancel(&vc.watchdog);
+	}
+}
+
+/**
+ * get the channel traffic counters
+ * @param[out] st traffic counters
+ * @param[out] last_ts last channel input (us), 0 if none
+ * @return bytes waiting to be written to the channel
+ */
+unsigned int channel_stats(netstats_t *st, unsigned long long *last_ts)
+{
+	assert(st && last_ts);
+
+	memcpy(st, &vc.st, sizeof(*st));
+	*last_ts = vc.rx_ts;
+	return iobuf_datalen(&vc.obuf) + iobuf_datalen(&vc.zbuf);
+}
+
 /**
  * check whether virtual channel is currently connected
  * @return 0 if rcp2tcp.exe is not started on TS server
+ * @note the channel stays up while bulk output keeps flowing, answers may
+ *       be queued behind it, but never longer than CHANNEL_TIMEOUT_MAX
  */
 int channel_is_connected(void)
 {
 	int connected;
-	time_t now;
+	unsigned long long now, idle, deadline, wr_deadline;
+	unsigned int timeout;
 
-	time(&now);
+	now = timer_clock();
+	idle = now - vc.rx_ts;
+	timeout = channel_timeout();
 
-	connected = (vc.ts && (vc.ts + RDP2TCP_PING_DELAY + 4 > now));
+	connected = (vc.rx_ts && ((idle < timeout)
+				|| ((idle < CHANNEL_TIMEOUT_MAX) && (now - vc.wr_ts < timeout))));
 	//trace_chan(connected ? "yes" : "no");
 
-	if (vc.last_state != connected) {
-		vc.last_state = connected;
-		info(0, "virtual channel %s", connected?"connected":"disconnected");
+	channel_set_state(connected);
+
+	if (connected) {
+		// wake up exactly when the channel would be declared down
+		deadline    = vc.rx_ts + timeout;
+		wr_deadline = vc.wr_ts + timeout;
+		if (wr_deadline > vc.rx_ts + CHANNEL_TIMEOUT_MAX)
+			wr_deadline = vc.rx_ts + CHANNEL_TIMEOUT_MAX;
+		if (wr_deadline > deadline)
+			deadline = wr_deadline;
+		timer_arm(&vc.watchdog, deadline - now, channel_watchdog_event, NULL);
 	}
 
 	return connected;
@@ -140,8 +399,15 @@ int channel_read_event(void)
 	} while (avail > 0);
 
 	iobuf_commit(&vc.ibuf, msglen);
-	commands_parse(&vc.ibuf);
-	time(&vc.ts);
+	frec_record(FREC_CHAN_READ, 0, 0xff, msglen);
+	vc.st.rx_bytes += 4 + msglen;
+	++vc.st.rx_msgs;
+	if (commands_parse(&vc.ibuf) < 0) {
+		// cannot resync on a corrupted stream, drop pending input
+		if (iobuf_datalen(&vc.ibuf) > 0)
+			iobuf_consume(&vc.ibuf, iobuf_datalen(&vc.ibuf));
+	}
+	vc.rx_ts = timer_clock();
 
 	return 0;
 
@@ -159,8 +425,59 @@ chan_read_err:
  */
 int channel_want_write(void)
 {
+	unsigned long long pos;
+	unsigned int i;
+
 	//trace_chan(iobuf_datalen(&vc.obuf) > 0 ? "yes" : "no");
-	return iobuf_datalen(&vc.obuf) > 0;
+
+	// frames queued since the last loop share one timestamp
+	pos = vc.ob_out + iobuf_datalen(&vc.obuf);
+	i = (vc.qm_head + vc.qm_count - 1) % CHANNEL_QMARKS;
+	if (pos > (vc.qm_count ? vc.qmarks[i].pos : vc.ob_out)) {
+		if (vc.qm_count < CHANNEL_QMARKS) {
+			i = (i + 1) % CHANNEL_QMARKS;
+			vc.qmarks[i].ts = timer_clock();
+			++vc.qm_count;
+		}
+		// merged into the last batch when all marks are used
+		vc.qmarks[i].pos = pos;
+	}
+
+	return (iobuf_datalen(&vc.obuf) > 0) || (iobuf_datalen(&vc.zbuf) > 0);
+}
+
+/**
+ * account bytes leaving the channel output buffer
+ * @param[in] len bytes written to the pipe or compressed
+ */
+static void channel_dequeue(unsigned int len)
+{
+	unsigned long long now;
+
+	vc.ob_out += len;
+	if (!vc.qm_count || (vc.qmarks[vc.qm_head].pos > vc.ob_out))
+		return;
+
+	now = timer_clock();
+	do {
+		hist_record(HIST_QUEUE, now - vc.qmarks[vc.qm_head].ts);
+		vc.qm_head = (vc.qm_head + 1) % CHANNEL_QMARKS;
+		--vc.qm_count;
+	} while (vc.qm_count && (vc.qmarks[vc.qm_head].pos <= vc.ob_out));
+}
+
+/**
+ * compress pending output frames into channel-wide stream chunks
+ * @return 0 on success
+ */
+static int channel_flush_stream(void)
+{
+	int ret;
+
+	while ((ret = compress_stream_chunk(&vc.zout, &vc.obuf, &vc.zbuf)) > 0)
+		channel_dequeue((unsigned int)ret);
+
+	return ret;
 }
 
 /**
@@ -171,17 +488,43 @@ void channel_write_event(void)
 {
 	int ret, fd;
 	unsigned int w;
+	iobuf_t *wbuf;
 
 	trace_chan("");
 #ifdef DEBUG
 	if (debug_level > 2) iobuf_dump(&vc.obuf);
 #endif
 
+	// frames queued before compression was enabled go first
+	wbuf = &vc.zbuf;
+	if (!iobuf_datalen(wbuf)) {
+		if (vc.comp_mode != R2TCOMP_MODE_CHANNEL) {
+			wbuf = &vc.obuf;
+		} else if (channel_flush_stream() < 0) {
+			error("failed to compress channel stream");
+			bye();
+		}
+	}
+
+	w = iobuf_datalen(&vc.obuf) + iobuf_datalen(&vc.zbuf);
+	if (w > vc.st.peak_buf)
+		vc.st.peak_buf = w;
+	frec_record(FREC_QUEUE, 0xff, 0xff, w);
+
 	fd = RDP_FD_OUT;
-	ret = net_write(&fd, &vc.obuf, NULL, 0, &w);
+	ret = net_write(&fd, wbuf, NULL, 0, &w);
 	if (ret >= 0) {
-		if (w > 0)
+		frec_record(FREC_CHAN_WRITE, 0, 0xff, w);
+		if (w > 0) {
+			vc.st.tx_bytes += w;
+			++vc.st.tx_msgs;
 			print_xfer("chan", 'w', (unsigned int) w);
+			if (wbuf == &vc.obuf)
+				channel_dequeue(w);
+		}
+		// probes alone do not prove the channel is draining
+		if (w > sizeof(r2tmsg_ping_t) + 4)
+			vc.wr_ts = timer_clock();
 
 	} else { 
 		if (ret == NETERR_CLOSED) 
@@ -225,40 +568,565 @@ static void *write_reserve(unsigned int size, unsigned int *out_avail)
  */
 static void write_commit(unsigned int size)
 {
+	unsigned char *frame;
+
 	assert(size);
 	//trace_chan("size=%u", size);
 
-	*(unsigned int *)(iobuf_allocptr(&vc.obuf)) = htonl(size);
+	frame = iobuf_allocptr(&vc.obuf);
+	frec_record(FREC_FRAME_OUT, frame[4], frame[5], size);
+	*(unsigned int *)frame = htonl(size);
 	iobuf_commit(&vc.obuf, size+4);
 }
 
 /**
- * send a ping message to rdp2tcp server
- * @return 0 if message cannot be queued
+ * send the compression request (R2T_COMPRESS)
+ * @note the server restarts its channel-wide stream when answering
+ */
+static void channel_request_compress(void)
+{
+	r2tmsg_compneg_t *msg;
+
+	if (vc.want_mode == R2TCOMP_MODE_NONE)
+		return;
+
+	trace_chan("mode=%u, algo=%u, level=%u",
+			vc.want_mode, vc.want_algo, vc.want_level);
+
+	msg = write_reserve(sizeof(*msg), NULL);
+	if (msg) {
+		msg->cmd       = R2TCMD_COMPRESS;
+		msg->id        = R2TCOMP_NEGOTIATE;
+		msg->algorithm = vc.want_algo;
+		msg->level     = vc.want_level;
+		msg->mode      = vc.want_mode;
+		write_commit(sizeof(*msg));
+	}
+}
+
+/**
+ * request compression and chunk cache from rdp2tcp server
+ */
+void channel_negotiate(void)
+{
+	r2tmsg_dedupneg_t *dmsg;
+
+	if (vc.dd_want > 0) {
+		dmsg = write_reserve(sizeof(*dmsg), NULL);
+		if (dmsg) {
+			dmsg->cmd    = R2TCMD_DEDUP;
+			dmsg->id     = R2TDEDUP_NEGOTIATE;
+			dmsg->budget = htonl(vc.dd_want);
+			write_commit(sizeof(*dmsg));
+		}
+	}
+
+	channel_request_compress();
+}
+
+/**
+ * stop output compression (channel disconnected)
+ */
+void channel_compress_stop(void)
+{
+	trace_chan("mode=%u", vc.comp_mode);
+
+	// already compressed chunks in zbuf are still written first
+	compress_stream_kill(&vc.zout);
+	vc.comp_mode = R2TCOMP_MODE_NONE;
+
+	// chunk caches are rebuilt by the next negotiation
+	dedup_kill(&vc.dd_out);
+	dedup_kill(&vc.dd_in);
+}
+
+/**
+ * handle server chunk cache answer
+ * @param[in] msg negotiation answer
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_dedup_answer(const r2tmsg_dedupneg_t *msg, unsigned int len)
+{
+	unsigned int budget;
+
+	assert(msg);
+	if (len < sizeof(*msg))
+		return error("invalid dedup answer size");
+
+	budget = ntohl(msg->budget);
+	trace_chan("budget=%u", budget);
+
+	dedup_kill(&vc.dd_out);
+	dedup_kill(&vc.dd_in);
+
+	if (!budget) {
+		info(0, "deduplication refused by server");
+		return 0;
+	}
+
+	if (dedup_init(&vc.dd_in, budget, 0)
+			|| dedup_init(&vc.dd_out, budget, 1)) {
+		dedup_kill(&vc.dd_in);
+		return -1;
+	}
+
+	info(0, "deduplication enabled (%u KB chunk cache)", budget / 1024);
+	return 0;
+}
+
+/**
+ * decode a R2TCMD_DEDUP message
+ * @param[in] msg R2TCMD_DEDUP message
+ * @param[in] len message size
+ * @param[out] out_len decoded payload size
+ * @return decoded payload or NULL on error
+ * @note the chunk cache is updated even if the tunnel is already closed
+ */
+const void *channel_dedup_decode(const r2tmsg_t *msg, unsigned int len,
+												unsigned int *out_len)
+{
+	int ret;
+	const void *data;
+
+	assert(msg && out_len);
+
+	if (!dedup_active(&vc.dd_in)) {
+		error("unexpected dedup message");
+		return NULL;
+	}
+
+	ret = dedup_decode(&vc.dd_in, ((const char *)msg)+2, len-2, &vc.scratch);
+	data = iobuf_dataptr(&vc.scratch);
+
+	// scratch is left empty, data stays valid until its next use
+	if (iobuf_datalen(&vc.scratch) > 0)
+		iobuf_truncate(&vc.scratch, 0);
+
+	if (ret <= 0)
+		return NULL;
+
+	*out_len = (unsigned int)ret;
+	return data;
+}
+
+/**
+ * replace a DATA frame by a R2TCMD_DEDUP frame
+ * @param[in] off offset of the frame in channel output buffer
+ * @param[in] len size of DATA payload
+ * @return 0 if the frame has been encoded
+ */
+static int channel_dedup_frame(unsigned int off, unsigned int len)
+{
+	int ret;
+	char *frame;
+
+	if (len < DEDUP_MIN_SIZE)
+		return 1;
+
+	// the encoder updates the cache, so the rewritten frame must fit in
+	// place: each record adds at most 5 bytes to a chunk and all but the
+	// last chunk are longer than DEDUP_MIN_CHUNK
+	if (!iobuf_reserve(&vc.obuf, 5 * (len / DEDUP_MIN_CHUNK + 1), NULL))
+		return 1;
+
+	frame = ((char *)iobuf_dataptr(&vc.obuf)) + off;
+	ret = dedup_encode(&vc.dd_out, frame + 6, len, &vc.scratch);
+	if (ret < 0) {
+		// the server never sees the partial update, stop deduplicating
+		dedup_kill(&vc.dd_out);
+		if (iobuf_datalen(&vc.scratch) > 0)
+			iobuf_consume(&vc.scratch, iobuf_datalen(&vc.scratch));
+		return 1;
+	}
+
+	// cannot fail, the room was reserved above
+	iobuf_truncate(&vc.obuf, off + 6);
+	iobuf_append(&vc.obuf, iobuf_dataptr(&vc.scratch), (unsigned int)ret);
+	iobuf_consume(&vc.scratch, (unsigned int)ret);
+
+	frame = ((char *)iobuf_dataptr(&vc.obuf)) + off;
+	*(unsigned int *)frame = htonl((unsigned int)ret + 2);
+	frame[4] = R2TCMD_DEDUP;
+
+	return 0;
+}
+
+/**
+ * handle server compression answer
+ * @param[in] msg negotiation answer
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_compress_answer(const r2tmsg_compneg_t *msg, unsigned int len)
+{
+	unsigned int used;
+
+	assert(msg);
+	if (len < sizeof(*msg))
+		return error("invalid compression answer size");
+
+	trace_chan("mode=%u, algo=%u, level=%u", msg->mode, msg->algorithm,
+					msg->level);
+
+	// the chunk caches have their own negotiation
+	compress_stream_kill(&vc.zout);
+	vc.comp_mode = R2TCOMP_MODE_NONE;
+
+	if ((msg->mode == R2TCOMP_MODE_NONE) || (msg->algorithm == COMPRESS_NONE)) {
+		info(0, "compression refused by server");
+		return 0;
+	}
+
+	if (!compress_supported(msg->algorithm,
+								msg->mode == R2TCOMP_MODE_CHANNEL))
+		return error("server selected unsupported compression");
+
+	if (msg->mode == R2TCOMP_MODE_CHANNEL) {
+		if (compress_stream_init(&vc.zout, msg->algorithm, msg->level, 0))
+			return -1;
+
+		// frames already queued must reach the pipe uncompressed
+		used = iobuf_datalen(&vc.obuf);
+		if (used > 0) {
+			if (!iobuf_append(&vc.zbuf, iobuf_dataptr(&vc.obuf), used)) {
+				compress_stream_kill(&vc.zout);
+				return error("failed to allocate channel memory");
+			}
+			iobuf_consume(&vc.obuf, used);
+			channel_dequeue(used);
+		}
+
+	} else if (msg->mode != R2TCOMP_MODE_TUNNEL) {
+		return error("invalid compression mode 0x%02x", msg->mode);
+	}
+
+	vc.comp_mode  = msg->mode;
+	vc.comp_algo  = msg->algorithm;
+	vc.comp_level = msg->level;
+
+	info(0, "%s compression enabled (%s level %u)",
+			(msg->mode == R2TCOMP_MODE_CHANNEL ? "channel" : "tunnel"),
+			get_compression_name(msg->algorithm), msg->level);
+
+	return 0;
+}
+
+/**
+ * handle a chunk of the server channel-wide compressed stream
+ * @param[in] msg compressed chunk
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_recv_stream(const r2tmsg_compress_t *msg, unsigned int len)
+{
+	int ret;
+	static int nested = 0;
+
+	assert(msg);
+	if (nested)
+		return error("nested compressed stream chunk");
+
+	// chunks of the lost stream are dropped until the server restarts it
+	if (vc.zin_lost) {
+		if ((len < sizeof(*msg)) || !(msg->level & R2TCOMP_LEVEL_RESET))
+			return 0;
+		vc.zin_lost = 0;
+	}
+
+	ret = compress_stream_recv(&vc.zin, msg, len, &vc.zibuf);
+	if (!ret && (iobuf_datalen(&vc.zibuf) > 0)) {
+		nested = 1;
+		ret = commands_parse(&vc.zibuf);
+		nested = 0;
+	}
+
+	if (ret < 0) {
+		// frames already handled must not run again with the next chunk
+		warn("channel stream lost, asking the server to restart it");
+		compress_stream_kill(&vc.zin);
+		if (iobuf_datalen(&vc.zibuf) > 0)
+			iobuf_consume(&vc.zibuf, iobuf_datalen(&vc.zibuf));
+		vc.zin_lost = 1;
+		channel_request_compress();
+	}
+
+	return 0;
+}
+
+/**
+ * decompress a per-tunnel compressed payload
+ * @param[in] msg compressed message
+ * @param[in] len message size
+ * @param[out] out_len decompressed size
+ * @return decompressed data or NULL on error
+ */
+const void *channel_decompress(
+						const r2tmsg_compress_t *msg,
+						unsigned int len,
+						unsigned int *out_len)
+{
+	return decompress_message(msg, len, &vc.scratch, out_len);
+}
+
+/**
+ * replace a DATA frame by a R2TCMD_COMPRESS frame if it is worth it
+ * @param[in] off offset of the frame in channel output buffer
+ * @param[in] len size of DATA payload
+ * @return 0 if the frame has been compressed
+ */
+static int channel_compress_frame(unsigned int off, unsigned int len)
+{
+	char *frame;
+	void *out;
+	unsigned int clen;
+	r2tmsg_compress_t *msg;
+
+	frame = ((char *)iobuf_dataptr(&vc.obuf)) + off;
+	if (!should_compress(frame + 6, len))
+		return 1;
+
+	clen = get_max_compressed_size(vc.comp_algo, len);
+	out = iobuf_reserve(&vc.scratch, clen, NULL);
+	if (!out)
+		return 1;
+
+	if (compress_data(vc.comp_algo, vc.comp_level, frame + 6, len, out, &clen)
+			|| (clen + sizeof(*msg) - 2 >= len))
+		return 1;
+
+	msg = (r2tmsg_compress_t *)(frame + 4);
+	msg->cmd = R2TCMD_COMPRESS;
+	msg->algorithm = vc.comp_algo;
+	msg->level = vc.comp_level;
+	msg->original_size = htonl(len);
+	memcpy(msg->data, out, clen);
+	*(unsigned int *)frame = htonl(sizeof(*msg) + clen);
+	iobuf_truncate(&vc.obuf, off + 4 + sizeof(*msg) + clen);
+
+	return 0;
+}
+
+/**
+ * hand a DATA frame over to the compression workers
+ * @param[in] off offset of the frame in channel output buffer
+ * @param[in] len size of DATA payload
+ * @param[in] tid tunnel identifier
+ * @return 0 if the frame has been moved to the worker pool
+ */
+static int channel_offload_frame(unsigned int off, unsigned int len,
+											unsigned char tid)
+{
+	unsigned char op;
+	char *data;
+
+	data = ((char *)iobuf_dataptr(&vc.obuf)) + off + 6;
+
+	// deduplication needs payloads in clear when they reach the channel
+	if ((vc.comp_mode == R2TCOMP_MODE_TUNNEL) && !dedup_active(&vc.dd_out)
+			&& should_compress(data, len))
+		op = WORKER_OP_COMPRESS;
+	else if (workers_busy(WORKER_OUT, tid))
+		op = WORKER_OP_NONE; // queued behind previous data
+	else
+		return 1;
+
+	if (workers_submit(WORKER_OUT, tid, R2TCMD_DATA, op, vc.comp_algo,
+						vc.comp_level, 0, data, len))
+		return 1;
+
+	iobuf_truncate(&vc.obuf, off);
+	return 0;
+}
+
+/**
+ * hand a per-tunnel compressed message over to the decompression workers
+ * @param[in] msg compressed message
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_offload_decompress(const r2tmsg_compress_t *msg, unsigned int len)
+{
+	unsigned int orig;
+
+	if (len <= sizeof(*msg))
+		return error("compressed message too short");
+
+	orig = ntohl(msg->original_size);
+	if (!orig || (orig > RDP2TCP_MAX_MSGLEN))
+		return error("invalid compressed message size %u", orig);
+
+	return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA,
+						WORKER_OP_DECOMPRESS, msg->algorithm, 0, orig,
+						msg->data, len - sizeof(*msg));
+}
+
+/**
+ * deliver a completed worker job
+ * @param[in] job completed job
+ * @return 0 on success
+ */
+static int channel_job_done(r2t_job_t *job)
+{
+	r2tmsg_t *msg;
+	netsock_t *ns;
+	unsigned int off;
+
+	if (job->dir == WORKER_OUT) {
+		off = iobuf_datalen(&vc.obuf);
+		msg = write_reserve(job->len + 2, NULL);
+		if (!msg)
+			return -1;
+		msg->cmd = job->cmd;
+		msg->id  = job->tid;
+		if (job->len > 0)
+			memcpy(((char *)msg)+2, job->data, job->len);
+		write_commit(job->len + 2);
+
+		if ((job->cmd == R2TCMD_DATA) && dedup_active(&vc.dd_out))
+			channel_dedup_frame(off, job->len);
+		return 0;
+	}
+
+	ns = tunnel_lookup(job->tid);
+	if (!ns)
+		return 0;
+
+	if (job->status < 0) {
+		error("failed to decompress tunnel 0x%02x data", job->tid);
+		tunnel_close(ns, 1);
+		return 0;
+	}
+
+	if (job->cmd == R2TCMD_SHUTDOWN)
+		return tunnel_remote_shutdown(ns);
+
+	return tunnel_write(ns, job->data, job->len);
+}
+
+/**
+ * handle compression workers completion event
+ */
+void channel_jobs_event(void)
+{
+	trace_chan("pending=%i", workers_pending());
+	workers_collect(channel_job_done);
+}
+
+/**
+ * send a timestamped ping probe to rdp2tcp server
+ * @return 0 on success
  */
 int channel_ping(void)
 {
-	r2tmsg_t msg;
+	r2tmsg_ping_t *msg;
 
-	trace_chan("");
-	msg.cmd = R2TCMD_PING;
-	msg.id  = 0;
+	msg = write_reserve(sizeof(*msg), NULL);
+	if (!msg)
+		return -1;
 
-	return !iobuf_append(&vc.obuf, &msg, 2);
+	vc.ping_ts = timer_clock();
+	vc.ping_pending = 1;
+	++vc.ping_seq;
+	trace_chan("seq=%u", vc.ping_seq);
+
+	msg->cmd = R2TCMD_PING;
+	msg->id  = R2TPING_PROBE;
+	msg->seq = htonl(vc.ping_seq);
+	msg->ts  = htonl((unsigned int) vc.ping_ts);
+	write_commit(sizeof(*msg));
+	R2T_PROBE1(ping__send, vc.ping_seq);
+
+	return 0;
+}
+
+/**
+ * send a ping probe whenever the adaptive interval has elapsed
+ * @param[in] ctx unused
+ * @note an unanswered probe is only given up after the disconnect timeout
+ */
+static void channel_ping_event(void *ctx)
+{
+	unsigned long long elapsed;
+	unsigned int wait;
+
+	elapsed = timer_clock() - vc.ping_ts;
+	wait = (vc.ping_pending ? channel_timeout() : channel_ping_interval());
+
+	if (vc.ping_ts && (elapsed < wait)) {
+		wait -= (unsigned int) elapsed;
+	} else {
+		wait = (channel_ping() ? CHANNEL_PING_MIN : channel_ping_interval());
+	}
+
+	timer_arm(&vc.ping_timer, wait, channel_ping_event, NULL);
+}
+
+/**
+ * update round-trip time estimates with a new sample (RFC 6298)
+ * @param[in] rtt round-trip time in microseconds
+ */
+static void channel_rtt_sample(unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (!rtt)
+		rtt = 1;
+	hist_record(HIST_RTT, rtt);
+
+	if (!vc.srtt) {
+		vc.srtt   = rtt;
+		vc.rttvar = rtt / 2;
+		vc.jitter = 0;
+	} else {
+		delta = (vc.srtt > rtt ? vc.srtt - rtt : rtt - vc.srtt);
+		vc.rttvar = (3 * vc.rttvar + delta) / 4;
+		vc.srtt   = (7 * vc.srtt + rtt) / 8;
+
+		// RFC 3550 interarrival jitter applied to consecutive samples
+		delta = (vc.last_rtt > rtt ? vc.last_rtt - rtt : rtt - vc.last_rtt);
+		if (delta > vc.jitter)
+			vc.jitter += (delta - vc.jitter) / 16;
+		else
+			vc.jitter -= (vc.jitter - delta) / 16;
+	}
+	vc.last_rtt = rtt;
+
+	trace_chan("rtt=%u srtt=%u rttvar=%u jitter=%u timeout=%u", rtt,
+			vc.srtt, vc.rttvar, vc.jitter, channel_timeout());
 }
 
 /**
  * function called whenever a ping message is sent by rdp2tcp server
+ * @param[in] msg R2TCMD_PING message
+ * @param[in] len message length
  */
-void channel_pong(void)
+void channel_pong(const r2tmsg_ping_t *msg, unsigned int len)
 {
+	unsigned long long now;
+
 	//trace_chan("");
 
-	if (vc.last_state != 1) {
-		vc.last_state = 1;
-		info(0, "virtual channel connected");
+	now = timer_clock();
+	vc.rx_ts = now;
+	channel_set_state(1);
+
+	// short pings are plain keepalives
+	if ((len < 2) || (msg->id != R2TPING_ECHO))
+		return;
+
+	if (len != sizeof(*msg)) {
+		error("invalid ping echo");
+		return;
 	}
-	time(&vc.ts);
+
+	// late answers of given up probes are ignored
+	if (!vc.ping_pending || (ntohl(msg->seq) != vc.ping_seq))
+		return;
+
+	vc.ping_pending = 0;
+	R2T_PROBE2(ping__recv, vc.ping_seq, (unsigned int) now - ntohl(msg->ts));
+	channel_rtt_sample((unsigned int) now - ntohl(msg->ts));
 }
 
 #if 0
@@ -278,13 +1146,15 @@ static unsigned int purify_strlen(const char *x)
  * @param[in] rhost remote tunnel hostname
  * @param[in] rport remote tunnel port
  * @param[in] reverse_connect 0 for tcp-connect or 1 for tcp-bind
+ * @param[in] profile NETPROF_xxx tuning profile of the server socket
  * @return the tunnel ID or 0xff on error
  */
 unsigned char channel_request_tunnel(
 							unsigned char tunaf,
 							const char *rhost,
 							unsigned short rport,
-							int reverse_connect)
+							int reverse_connect,
+							int profile)
 {
 	unsigned char tid;
 	unsigned int hlen;
@@ -305,14 +1175,138 @@ unsigned char channel_request_tunnel(
 	msg->cmd  = (!reverse_connect ? R2TCMD_CONN : R2TCMD_BIND);
 	msg->id   = tid;
 	msg->port = htons(rport);
-	msg->af   = tunaf;
+	msg->af   = tunaf | TUNAF_SET_PROFILE(profile);
 	memcpy(msg->hostname, rhost, hlen);
 
 	write_commit(5 + hlen);
+	R2T_PROBE4(tunnel__create, tid, (reverse_connect ? 1 : 0), rhost, rport);
 
 	return tid;
 }
 
+/**
+ * ask the rdp2tcp server to keep connections ready for a destination
+ * @param[in] rhost remote hostname
+ * @param[in] rport remote port
+ * @param[in] size number of spare connections (0 removes the pool)
+ * @return 0 if the request has been queued
+ */
+int channel_request_pool(
+				const char *rhost,
+				unsigned short rport,
+				unsigned char size)
+{
+	unsigned int hlen;
+	r2tmsg_connreq_t *msg;
+
+	assert(rhost && *rhost && rport);
+	trace_chan("rhost=%s, rport=%hu, size=%u", rhost, rport, size);
+
+	hlen = 1 + strlen(rhost);
+	msg = write_reserve(5 + hlen, NULL);
+	if (!msg)
+		return -1;
+
+	msg->cmd  = R2TCMD_POOL;
+	msg->id   = size;
+	msg->port = htons(rport);
+	msg->af   = TUNAF_ANY;
+	memcpy(msg->hostname, rhost, hlen);
+
+	write_commit(5 + hlen);
+
+	return 0;
+}
+
+/**
+ * ask the rdp2tcp server to resolve a hostname
+ * @param[in] tunaf preferred address family (TUNAF_IPV4/IPV6/ANY)
+ * @param[in] host hostname to resolve
+ * @return 0 if the request has been queued
+ */
+int channel_request_resolve(unsigned char tunaf, const char *host)
+{
+	unsigned int hlen;
+	r2tmsg_resolvereq_t *msg;
+
+	assert((tunaf <= TUNAF_IPV6) && host && *host);
+	trace_chan("tunaf=0x%02x, host=%s", tunaf, host);
+
+	hlen = 1 + strlen(host);
+	msg = write_reserve(2 + hlen, NULL);
+	if (!msg)
+		return -1;
+
+	msg->cmd = R2TCMD_RESOLVE;
+	msg->af  = tunaf;
+	memcpy(msg->hostname, host, hlen);
+
+	write_commit(2 + hlen);
+
+	return 0;
+}
+
+/**
+ * ask the rdp2tcp server to resume a tunnel after a channel outage
+ * @param[in] tid the tunnel ID
+ * @param[in] seq payload bytes received on the tunnel
+ * @return 0 if the request has been queued
+ */
+int channel_request_resume(unsigned char tid, unsigned int seq)
+{
+	r2tmsg_resume_t *msg;
+
+	assert(tid != 0xff);
+	trace_chan("tid=0x%02x, seq=%u", tid, seq);
+
+	msg = write_reserve(sizeof(*msg), NULL);
+	if (!msg)
+		return -1;
+
+	msg->cmd = R2TCMD_RESUME;
+	msg->id  = tid;
+	msg->seq = htonl(seq);
+	write_commit(sizeof(*msg));
+
+	return 0;
+}
+
+/**
+ * send again the tunnel payload the server missed
+ * @param[in] ns tunnel socket
+ * @param[in] from sequence number of the first missed byte
+ * @return 0 on success
+ */
+int channel_replay(netsock_t *ns, unsigned int from)
+{
+	r2tmsg_t *msg;
+	unsigned int len;
+	const void *data;
+
+	assert(valid_netsock(ns) && (ns->tid != 0xff)
+			&& (replay_held(&ns->tx, from) >= 0));
+	trace_chan("tid=0x%02x, from=%u, seq=%u", ns->tid, from, ns->tx.seq);
+
+	while (from != ns->tx.seq) {
+		len = replay_peek(&ns->tx, from, &data);
+		if (len > RDP2TCP_MAX_MSGLEN / 2)
+			len = RDP2TCP_MAX_MSGLEN / 2;
+
+		msg = write_reserve(len + 2, NULL);
+		if (!msg)
+			return -1;
+
+		msg->cmd = R2TCMD_DATA;
+		msg->id  = ns->tid;
+		memcpy(((char *)msg)+2, data, len);
+		write_commit(len + 2);
+
+		from += len;
+	}
+
+	return 0;
+}
+
 /**
  * notify the server a tunnel has been closed
  * @param[in] tid the tunnel ID
@@ -324,6 +1318,13 @@ void channel_close_tunnel(unsigned char tid)
 	assert(tid != 0xff);
 	trace_chan("tid=0x%02x", tid);
 
+	// tunnel data still being compressed must reach the server first
+	if (workers_busy(WORKER_OUT, tid)) {
+		workers_submit(WORKER_OUT, tid, R2TCMD_CLOSE, WORKER_OP_NONE,
+								0, 0, 0, NULL, 0);
+		return;
+	}
+
 	msg = write_reserve(2, NULL);
 	if (msg) {
 		msg->cmd = R2TCMD_CLOSE;
@@ -332,6 +1333,88 @@ void channel_close_tunnel(unsigned char tid)
 	}
 }
 
+/**
+ * notify the server the local peer of a tunnel has sent FIN
+ * @param[in] tid rdp2tcp tunnel ID
+ */
+void channel_shutdown_tunnel(unsigned char tid)
+{
+	r2tmsg_t *msg;
+
+	assert(tid != 0xff);
+	trace_chan("tid=0x%02x", tid);
+
+	// sent right after the last tunnel data
+	if (workers_busy(WORKER_OUT, tid)) {
+		workers_submit(WORKER_OUT, tid, R2TCMD_SHUTDOWN, WORKER_OP_NONE,
+								0, 0, 0, NULL, 0);
+		return;
+	}
+
+	msg = write_reserve(2, NULL);
+	if (msg) {
+		msg->cmd = R2TCMD_SHUTDOWN;
+		msg->id  = tid;
+		write_commit(2);
+	}
+}
+
+/**
+ * check if tunnels must stop reading to honor the channel rate
+ * @return 1 if tunnel reads are paced
+ */
+int channel_paced(void)
+{
+	return vc.paced;
+}
+
+static void channel_unpace(void *ctx)
+{
+	trace_chan("");
+	vc.paced = 0;
+}
+
+static void channel_unthrottle(void *ctx)
+{
+	netsock_t *ns = (netsock_t *) ctx;
+
+	trace_chan("tid=0x%02x", ns->tid);
+	ns->throttled = 0;
+}
+
+/**
+ * account tunnel data against the rate limits
+ * @param[in] ns tunnel socket
+ * @param[in] len bytes read from the tunnel
+ * @note reads stop until the exhausted buckets are refilled
+ */
+static void channel_throttle(netsock_t *ns, unsigned int len)
+{
+	unsigned long long now, delay, d;
+
+	now   = timer_clock();
+	delay = ratelimit_take(&ns->rate, len, now);
+	if (ns->group) {
+		d = ratelimit_take(ns->group, len, now);
+		if (d > delay)
+			delay = d;
+	}
+
+	if (delay) {
+		trace_chan("tid=0x%02x, delay=%llu", ns->tid, delay);
+		ns->throttled = 1;
+		timer_arm(&ns->rate_timer, delay, channel_unthrottle, ns);
+		frec_record(FREC_THROTTLE, 0, ns->tid, (unsigned int) delay);
+	}
+
+	delay = ratelimit_take(&vc.pace, len, now);
+	if (delay) {
+		vc.paced = 1;
+		timer_arm(&vc.pace_timer, delay, channel_unpace, NULL);
+		frec_record(FREC_THROTTLE, 1, 0xff, (unsigned int) delay);
+	}
+}
+
 /**
  * receive data from tcp tunnel and forward it to the RDP channel
  * @param[in] ns tunnel socket
@@ -350,13 +1433,35 @@ int channel_forward_recv(netsock_t *ns)
 	off = iobuf_datalen(&vc.obuf);
 	ret = netsock_read(ns, &vc.obuf, 6, &r);
 	if (!ret) {
+		ns->io_ts = timer_clock();
+		channel_throttle(ns, r);
 		msg = iobuf_dataptr(&vc.obuf) + off;
 		*(unsigned int*)msg = htonl(r + 2);
 		msg[4] = R2TCMD_DATA;
 		msg[5] = ns->tid;
+		frec_record(FREC_FRAME_OUT, R2TCMD_DATA, ns->tid, r + 2);
+		R2T_PROBE3(tunnel__recv, ns->tid, r, iobuf_datalen(&vc.obuf));
+
+		// kept in clear to be sent again after a channel outage
+		replay_append(&ns->tx, msg+6, r);
+
+		// buffered by the server until the connection completes
+		if ((ns->type == NETSOCK_TUNCLI) && (ns->state == NETSTATE_CONNECTING))
+			ns->u.tuncli.early += r;
+		else if ((ns->type == NETSOCK_S5CLI) && ns->u.sockscli.pending)
+			ns->u.sockscli.early += r;
+
+		if ((workers_count() > 0) && !channel_offload_frame(off, r, ns->tid))
+			; // queued in the worker pool
+		else if (dedup_active(&vc.dd_out) && !channel_dedup_frame(off, r))
+			; // sent as chunk references
+		else if (vc.comp_mode == R2TCOMP_MODE_TUNNEL)
+			channel_compress_frame(off, r);
 	}
 
-	if (ret < 0)
+	if (ret == NETERR_CLOSED)
+		tunnel_shutdown(ns);
+	else if (ret < 0)
 		tunnel_close(ns, 1);
 
 	return 0;
@@ -365,20 +1470,32 @@ int channel_forward_recv(netsock_t *ns)
 /**
  * forward data from I/O buffer to the RDP channel
  * @param[in] ibuf input buffer
- * @param[in] tid tunnel identifier
+ * @param[in] ns tunnel socket
  * @return 0 or 1 on success
  */
-int channel_forward_iobuf(iobuf_t *ibuf, unsigned char tid)
+int channel_forward_iobuf(iobuf_t *ibuf, netsock_t *ns)
 {
 	r2tmsg_t *msg;
 	unsigned int len;
+	unsigned char tid;
 
-	assert(valid_iobuf(ibuf) && (tid != 0xff));
+	assert(valid_iobuf(ibuf) && valid_netsock(ns) && (ns->tid != 0xff));
+	tid = ns->tid;
 	trace_chan("tid=0x%02x", tid);
 
 	len = iobuf_datalen(ibuf);
 	assert(len > 0);
 
+	replay_append(&ns->tx, iobuf_dataptr(ibuf), len);
+
+	if (workers_busy(WORKER_OUT, tid)) {
+		if (workers_submit(WORKER_OUT, tid, R2TCMD_DATA, WORKER_OP_NONE,
+							0, 0, 0, iobuf_dataptr(ibuf), len))
+			return -1;
+		iobuf_consume(ibuf, len);
+		return 0;
+	}
+
 	msg = write_reserve(len+2, NULL);
 	if (!msg)
 		return -1;
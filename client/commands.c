@@ -22,6 +22,7 @@
  */
 #include "r2tcli.h"
 #include "msgparser.h"
+#include "workers.h"
 
 #include <arpa/inet.h>
 
@@ -112,10 +113,10 @@ static int check_binding_answer(
 
 		} else {
 
-			if (!tunnel_lookup(msg->err)) {
+			if ((msg->err <= R2T_TID_MAX) && !tunnel_lookup(msg->err)) {
 				tunnel_revconnect_event(cli, msg->err, af, &msg->addr[0], port);
 			} else {
-				// server allocated an already used tunnel ID
+				// server allocated an already used or reserved tunnel ID
 				channel_close_tunnel(msg->err);
 			}
 		}
@@ -125,6 +126,7 @@ static int check_binding_answer(
 			(mode ? "bind" : "connect"),
 			cli->tid,
 			(msg->err >= R2TERR_MAX ? "???" : r2t_errors[msg->err]));
+		metrics_connect_failure(msg->err);
 		tunnel_close(cli, 0);
 	}
 
@@ -149,12 +151,34 @@ static int cmd_close(const r2tmsg_t *msg, unsigned int len)
 	trace_chan("len=%u", len);
 
 	tun = check_tunnel_id(msg);
-	if (tun)
-		netsock_cancel(tun);
+	if (tun) {
+		workers_cancel(WORKER_OUT, msg->id);
+		workers_cancel(WORKER_IN, msg->id);
+		tunnel_remote_close(tun);
+	}
 
 	return 0;
 }
 
+static int cmd_shutdown(const r2tmsg_t *msg, unsigned int len)
+{
+	netsock_t *tun;
+
+	assert(msg && (len >= 2));
+	trace_chan("len=%u", len);
+
+	tun = check_tunnel_id(msg);
+	if (!tun || tun->suspended) // sent again once resumed
+		return 0;
+
+	// previous compressed data of this tunnel is still being inflated
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_SHUTDOWN,
+									WORKER_OP_NONE, 0, 0, 0, NULL, 0);
+
+	return tunnel_remote_shutdown(tun);
+}
+
 static int cmd_data(const r2tmsg_t *msg, unsigned int len)
 {
 	netsock_t *clitun;
@@ -163,9 +187,14 @@ static int cmd_data(const r2tmsg_t *msg, unsigned int len)
 	trace_chan("len=%u", len);
 
 	clitun = check_tunnel_id(msg);
-	if (!clitun)
+	if (!clitun || clitun->suspended) // sent again once resumed
 		return 0;
 
+	// previous compressed data of this tunnel is still being inflated
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA, WORKER_OP_NONE,
+									0, 0, 0, ((const char *)msg)+2, len-2);
+
 	return tunnel_write(clitun, ((const char *)msg)+2, len-2);
 }
 
@@ -174,7 +203,7 @@ static int cmd_ping(const r2tmsg_t *msg, unsigned int len)
 	assert(msg && (len >= 2));
 	//trace_chan("len=%u", len);
 
-	channel_pong();
+	channel_pong((const r2tmsg_ping_t *)msg, len);
 	return 0;
 }
 
@@ -183,17 +212,97 @@ static int cmd_rconn(const r2tmsg_t *msg, unsigned int len)
 	return check_binding_answer(2, (const r2tmsg_connans_t *)msg, len);
 }
 
-/**
- * handlers for each command
- */
 static int cmd_compress(const r2tmsg_t *msg, unsigned int len)
 {
-	// For now, just ignore compression commands to maintain compatibility
-	// TODO: Implement compression handling
-	trace_chan("compression command ignored (len=%u)", len);
-	return 0;
+	netsock_t *clitun;
+	const void *data;
+	unsigned int size;
+
+	assert(msg && (len >= 5));
+	trace_chan("id=0x%02x, len=%u", msg->id, len);
+
+	if (msg->id == R2TCOMP_NEGOTIATE)
+		return channel_compress_answer((const r2tmsg_compneg_t *)msg, len);
+
+	if (msg->id == R2TCOMP_STREAM)
+		return channel_recv_stream((const r2tmsg_compress_t *)msg, len);
+
+	clitun = check_tunnel_id(msg);
+	if (!clitun || clitun->suspended) // sent again once resumed
+		return 0;
+
+	if (workers_count() > 0) {
+		if (channel_offload_decompress((const r2tmsg_compress_t *)msg, len))
+			tunnel_close(clitun, 1);
+		return 0;
+	}
+
+	data = channel_decompress((const r2tmsg_compress_t *)msg, len, &size);
+	if (!data) {
+		tunnel_close(clitun, 1);
+		return 0;
+	}
+
+	return tunnel_write(clitun, data, size);
 }
 
+static int cmd_dedup(const r2tmsg_t *msg, unsigned int len)
+{
+	netsock_t *clitun;
+	const void *data;
+	unsigned int size;
+
+	assert(msg && (len >= 3));
+	trace_chan("id=0x%02x, len=%u", msg->id, len);
+
+	if (msg->id == R2TDEDUP_NEGOTIATE)
+		return channel_dedup_answer((const r2tmsg_dedupneg_t *)msg, len);
+
+	// decoded first to keep the chunk cache in sync
+	data = channel_dedup_decode(msg, len, &size);
+
+	clitun = check_tunnel_id(msg);
+	if (!clitun || clitun->suspended) // sent again once resumed
+		return 0;
+
+	if (!data) {
+		tunnel_close(clitun, 1);
+		return 0;
+	}
+
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA, WORKER_OP_NONE,
+									0, 0, 0, data, size);
+
+	return tunnel_write(clitun, data, size);
+}
+
+static int cmd_resolve(const r2tmsg_t *msg, unsigned int len)
+{
+	assert(msg && (len >= 3));
+	trace_chan("af=0x%02x, len=%u", msg->id, len);
+
+	return rdns_answer((const r2tmsg_resolveans_t *)msg, len);
+}
+
+static int cmd_resume(const r2tmsg_t *msg, unsigned int len)
+{
+	netsock_t *clitun;
+
+	assert(msg && (len >= 6));
+	trace_chan("id=0x%02x, len=%u", msg->id, len);
+
+	clitun = check_tunnel_id(msg);
+	if (!clitun)
+		return 0;
+
+	return tunnel_resumed(clitun,
+					ntohl(((const r2tmsg_resume_t *)msg)->seq));
+}
+
+/**
+ * handlers for each command
+ */
 const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	cmd_conn,     // R2TCMD_CONN
 	cmd_close,    // R2TCMD_CLOSE
@@ -201,6 +310,11 @@ const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	cmd_ping,     // R2TCMD_PING
 	cmd_bind,     // R2TCMD_BIND
 	cmd_rconn,    // R2TCMD_RCONN
-	cmd_compress  // R2TCMD_COMPRESS
+	cmd_compress, // R2TCMD_COMPRESS
+	cmd_dedup,    // R2TCMD_DEDUP
+	cmd_resolve,  // R2TCMD_RESOLVE
+	NULL,         // R2TCMD_POOL
+	cmd_resume,   // R2TCMD_RESUME
+	cmd_shutdown  // R2TCMD_SHUTDOWN
 };
 
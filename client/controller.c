@@ -52,6 +52,9 @@ int controller_answer(netsock_t *cli, const char *fmt, ...)
 	ret = vsnprintf(buf, MAX_CONTROLLER_MSG_LEN-2, fmt, va);
 	va_end(va);
 
+	if (ret > MAX_CONTROLLER_MSG_LEN-3)
+		ret = MAX_CONTROLLER_MSG_LEN-3; // truncated
+
 	if (ret > 0) {
 		buf[ret] = '\n';
 		ret = netsock_write(cli, buf, ret+1);
@@ -108,14 +111,17 @@ int controller_start(const char *host, unsigned short port)
  */
 void controller_accept_event(netsock_t *ns)
 {
+	unsigned int i;
 	netsock_t *cli;
 	char buf[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(ns) && (ns->type == NETSOCK_CTRLSRV));
 	trace_ctrl("");
 
-	cli = netsock_accept(ns);
-	if (cli) {
+	for (i=0; i<NET_ACCEPT_BURST; ++i) {
+		cli = netsock_accept(ns);
+		if (!cli)
+			break;
 		cli->type = NETSOCK_CTRLCLI;
 		cli->tid  = 0xff;
 		iobuf_init2(&cli->u.ctrlcli.ibuf, &cli->u.ctrlcli.obuf, "ctrl");
@@ -154,19 +160,29 @@ static int dump_sockets(netsock_t *cli)
 					ret = controller_answer(cli, "tunsrv  %s %s", host1,
 							ns->u.tunsrv.rhost);
 				} else {
-					ret = controller_answer(cli, "tunsrv  %s %s:%hu", host1,
-							ns->u.tunsrv.rhost, ns->u.tunsrv.rport);
+					ret = controller_answer(cli, "tunsrv  %s %s:%hu %s", host1,
+							ns->u.tunsrv.rhost, ns->u.tunsrv.rport,
+							net_profile_name(ns->profile));
 				}
 				break;
 
 			case NETSOCK_S5SRV:
-				ret = controller_answer(cli, "s5srv   %s", host1);
+				ret = controller_answer(cli, "s5srv   %s %s", host1,
+							net_profile_name(ns->profile));
 				break;
 
 			case NETSOCK_CTRLCLI:
 				ret = controller_answer(cli, "ctrlcli %s", host1);
 				break;
 
+			case NETSOCK_HTTPSRV:
+				ret = controller_answer(cli, "httpsrv %s", host1);
+				break;
+
+			case NETSOCK_HTTPCLI:
+				ret = controller_answer(cli, "httpcli %s", host1);
+				break;
+
 			case NETSOCK_TUNCLI:
 				//if (!ns->state != NETSTATE_CONNECTED) {
 				if (ns->state == NETSTATE_CONNECTED) {
@@ -194,10 +210,11 @@ static int dump_sockets(netsock_t *cli)
 				break;
 
 			case NETSOCK_RTUNSRV:
-				ret = controller_answer(cli, "rtunsrv %s:%hu %s:%hu 0x%x",
+				ret = controller_answer(cli, "rtunsrv %s:%hu %s:%hu 0x%x %s",
 										ns->u.rtunsrv.lhost, ns->u.rtunsrv.lport,
 										&ns->u.rtunsrv.lhost[ns->u.rtunsrv.lhost_len],
-										ns->u.rtunsrv.rport, ns->tid);
+										ns->u.rtunsrv.rport, ns->tid,
+										net_profile_name(ns->profile));
 				break;
 
 			//case NETSOCK_RTUNCLI:
@@ -218,6 +235,77 @@ static int dump_sockets(netsock_t *cli)
 	return ret;
 }
 
+/**
+ * answer the traffic counters of the channel and of the tunnels
+ * @param[in] cli controller client socket
+ * @return 0 on success
+ * @note one line per object made of a name followed by key=value pairs,
+ *       ages are in seconds, rx counts data received by the socket and tx
+ *       data sent by it
+ */
+static int dump_stats(netsock_t *cli)
+{
+	int ret;
+	unsigned int buffered, rtt;
+	unsigned long long now, last;
+	long long connect;
+	netstats_t st;
+	netsock_t *ns;
+	const char *type;
+	char host[NETADDRSTR_MAXSIZE];
+
+	assert(valid_netsock(cli));
+
+	now = timer_clock();
+	buffered = channel_stats(&st, &last);
+	rtt = channel_rtt(NULL, NULL);
+	ret = controller_answer(cli, "channel %s age=%llu uptime=%llu idle=%lld "
+					"rx_bytes=%llu rx_msgs=%u tx_bytes=%llu tx_msgs=%u "
+					"buf=%u peak=%u rtt_us=%u",
+					(st.up_ts ? "up" : "down"),
+					(now - st.start_ts) / 1000000,
+					(st.up_ts ? (now - st.up_ts) / 1000000 : 0),
+					(last ? (long long)((now - last) / 1000000) : -1LL),
+					st.rx_bytes, st.rx_msgs, st.tx_bytes, st.tx_msgs,
+					buffered, st.peak_buf, rtt);
+
+	list_for_each(ns, &all_sockets) {
+
+		if (ret)
+			break;
+
+		switch (ns->type) {
+			case NETSOCK_TUNCLI:  type = "tuncli"; break;
+			case NETSOCK_RTUNCLI: type = "rtuncli"; break;
+			case NETSOCK_S5CLI:   type = "s5cli"; break;
+			default: continue;
+		}
+
+		if (ns->addr.ip4.sin_family)
+			netaddr_print(&ns->addr, host);
+		else
+			strcpy(host, "-");
+
+		connect = (ns->st.up_ts ? (long long)(ns->st.up_ts - ns->st.start_ts)
+															/ 1000 : -1LL);
+
+		ret = controller_answer(cli, "tunnel 0x%02x %s %s age=%llu "
+					"connect_ms=%lld idle=%llu rx_bytes=%llu rx_msgs=%u "
+					"tx_bytes=%llu tx_msgs=%u buf=%u peak=%u",
+					ns->tid, type, host,
+					(now - ns->st.start_ts) / 1000000, connect,
+					(now - ns->io_ts) / 1000000,
+					ns->st.rx_bytes, ns->st.rx_msgs,
+					ns->st.tx_bytes, ns->st.tx_msgs,
+					iobuf_datalen(netsock_obuf(ns)), ns->st.peak_buf);
+	}
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
+
 static char *extract_port(char *data, unsigned short *out_port)
 {
 	char *ptr, *end;
@@ -241,17 +329,62 @@ static char *extract_port(char *data, unsigned short *out_port)
 	return end;
 }
 
+/**
+ * parse the optional arguments of a command
+ * ("[PROFILE] [idle=SECONDS] [rate=BPS] [connrate=BPS]")
+ * @param[in] data remaining arguments (may be NULL)
+ * @param[in] idle default idle timeout in seconds
+ * @param[out] opts listener options
+ * @return NULL on success or error description
+ */
+static const char *extract_options(char *data, unsigned int idle,
+													tunopts_t *opts)
+{
+	char *tok, *end;
+
+	opts->profile   = NETPROF_DEFAULT;
+	opts->idle      = idle;
+	opts->rate      = 0;
+	opts->conn_rate = tunnel_conn_rate;
+
+	if (!data)
+		return NULL;
+
+	for (tok=strtok(data, " "); tok; tok=strtok(NULL, " ")) {
+		if (!strncmp(tok, "idle=", 5)) {
+			opts->idle = (unsigned int) strtoul(tok+5, &end, 10);
+			if ((end == tok+5) || *end)
+				return "invalid idle timeout";
+		} else if (!strncmp(tok, "rate=", 5)) {
+			if (ratelimit_parse(tok+5, &opts->rate))
+				return "invalid rate";
+		} else if (!strncmp(tok, "connrate=", 9)) {
+			if (ratelimit_parse(tok+9, &opts->conn_rate))
+				return "invalid rate";
+		} else {
+			opts->profile = net_profile_lookup(tok);
+			if (opts->profile < 0)
+				return "unknown socket profile";
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * handle controller network read-event
  * @param[in] cli controller socket
  */
 int controller_read_event(netsock_t *cli)
 {
-	char cmd, *data, *end, *lhost, *rhost;
+	char cmd, *data, *end, *ptr, *lhost, *rhost;
+	const char *err;
 	int ret;
 	unsigned int avail, parsed;
+	tunopts_t opts;
 	unsigned short lport, rport;
-	const char valid_commands[] = "ltrxs-";
+	long size;
+	const char valid_commands[] = "lchftrxsp-";
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(cli) && (cli->type == NETSOCK_CTRLCLI));
@@ -291,6 +424,23 @@ int controller_read_event(netsock_t *cli)
 		if (cmd == 'l') { // list sockets
 			ret = dump_sockets(cli);
 
+		} else if (cmd == 'c') { // traffic counters
+			ret = dump_stats(cli);
+
+		} else if (cmd == 'h') { // latency histograms
+			if (!data[1]) {
+				ret = hist_dump(cli);
+			} else if (!strcmp(data+1, " reset")) {
+				hist_reset();
+				ret = controller_answer(cli, "histograms reset");
+			} else {
+				goto badproto;
+			}
+
+		} else if (cmd == 'f') { // flight recorder dump
+			if (data[1]) goto badproto;
+			ret = frec_controller_dump(cli);
+
 		} else {
 			// commands with argc >= 2
 
@@ -305,7 +455,12 @@ int controller_read_event(netsock_t *cli)
 				ret = tunnel_del(cli, lhost, lport);
 
 			} else if (cmd == 's') { // add socks5 server
-				ret = socks5_bind(cli, lhost, lport);
+				err = extract_options(data, tunnel_idle_timeout[TUNIDLE_SOCKS5],
+												&opts);
+				if (err)
+					ret = controller_answer(cli, "error: %s", err);
+				else
+					ret = socks5_bind(cli, lhost, lport, &opts);
 
 			} else {
 				// commands with argc >= 3
@@ -314,22 +469,36 @@ int controller_read_event(netsock_t *cli)
 				if (!*data) goto badproto;
 
 				if (cmd == 'x') { // exec & forward stdin/stdout
-					ret = tunnel_add(cli, lhost, lport, AF_UNSPEC, data, 0);
+					extract_options(NULL, tunnel_idle_timeout[TUNIDLE_PROCESS],
+												&opts);
+					ret = tunnel_add(cli, lhost, lport, AF_UNSPEC, data, 0, &opts);
+
+				} else if (cmd == 'p') { // server-side connection pool
+					size = strtol(data, &ptr, 10);
+					if ((ptr == data) || *ptr || (size < 0) || (size > 0xff))
+						goto badproto;
+					ret = tunnel_pool(cli, lhost, lport, (unsigned int) size);
 
 				} else {
 					// commands with argc == 4
 					
 					rhost = data;
-					if (!extract_port(data, &rport))
+					ptr = extract_port(data, &rport);
+					if (!ptr)
 						return -1;
-					
-					if (cmd == 't') { // add TCP tunnel
+					err = extract_options(ptr, tunnel_idle_timeout[cmd == 't'
+									? TUNIDLE_FORWARD : TUNIDLE_REVERSE], &opts);
+
+					if (err) {
+						ret = controller_answer(cli, "error: %s", err);
+
+					} else if (cmd == 't') { // add TCP tunnel
 						ret = tunnel_add(cli, lhost, lport,
-												AF_UNSPEC, rhost, rport);
+											AF_UNSPEC, rhost, rport, &opts);
 
 					} else { // cmd == 'r' reverse TCP connect
 						ret = tunnel_add_reverse(cli, lhost, lport,
-														AF_UNSPEC, rhost, rport);
+											AF_UNSPEC, rhost, rport, &opts);
 					}
 				}
 			}
@@ -0,0 +1,254 @@
+/**
+ * @file flightrec.c
+ * in-memory ring of the last event-loop and channel events
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "msgparser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/** default number of records (256 KB) */
+#define FREC_DEFAULT_SIZE 16384
+/** largest number of records (16 MB) */
+#define FREC_MAX_SIZE     (1 << 20)
+/** dump file format version */
+#define FREC_VERSION      1
+
+/** flight recorder record */
+typedef struct _frec {
+	unsigned long long ts;  /**< monotonic time (us) */
+	unsigned char type;     /**< FREC_xxx event */
+	unsigned char arg;      /**< command or socket type */
+	unsigned char id;       /**< tunnel identifier */
+	unsigned char pad;
+	unsigned int val;       /**< length, file descriptor or duration */
+} frec_t;
+
+/** dump file header, followed by the records from the oldest */
+typedef struct _frec_hdr {
+	char magic[8];             /**< "R2TFREC\0" */
+	unsigned int version;      /**< FREC_VERSION (host byte order) */
+	unsigned int count;        /**< number of records */
+	unsigned long long mono;   /**< monotonic time of the dump (us) */
+	unsigned long long wall;   /**< wall clock time of the dump (us) */
+} frec_hdr_t;
+
+static frec_t *frec_ring = NULL;
+static unsigned int frec_mask = 0;
+/** records ever written, the ring holds the last frec_mask+1 */
+static volatile unsigned long long frec_count = 0;
+static char frec_path[256];
+
+/**
+ * write a whole buffer (async-signal-safe)
+ * @return 0 on success
+ */
+static int frec_write(int fd, const void *buf, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = ((const char *)buf) + w;
+		len -= w;
+	}
+	return 0;
+}
+
+/**
+ * dump the records to the dump file
+ * @return number of records written or -1 on error
+ * @note only uses async-signal-safe calls so that a stuck event loop can
+ *       still be dumped from a signal handler
+ */
+int frec_dump(void)
+{
+	int fd;
+	unsigned long long count, first;
+	unsigned int n, start, size;
+	frec_hdr_t hdr;
+	struct timespec ts;
+
+	if (!frec_ring)
+		return -1;
+
+	// a previous dump is replaced by a new file, never followed through a
+	// symlink planted in a shared directory
+	unlink(frec_path);
+	fd = open(frec_path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+	if (fd < 0)
+		return -1;
+
+	count = frec_count;
+	size  = frec_mask + 1;
+	first = (count > size ? count - size : 0);
+	n     = (unsigned int)(count - first);
+	start = (unsigned int)first & frec_mask;
+
+	memcpy(hdr.magic, "R2TFREC", 8);
+	hdr.version = FREC_VERSION;
+	hdr.count   = n;
+	hdr.mono    = timer_clock();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.wall    = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	// the ring is read in two parts when it has wrapped
+	if (frec_write(fd, &hdr, sizeof(hdr))
+			|| frec_write(fd, frec_ring + start,
+						(start + n > size ? size - start : n) * sizeof(frec_t))
+			|| ((start + n > size)
+				&& frec_write(fd, frec_ring, (start + n - size) * sizeof(frec_t)))) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return (int)n;
+}
+
+/**
+ * dump the records on SIGUSR2
+ */
+static void frec_signal(int sig)
+{
+	int err;
+
+	err = errno;
+	frec_dump();
+	errno = err;
+}
+
+/**
+ * record an event
+ * @param[in] type FREC_xxx event
+ * @param[in] arg command or socket type
+ * @param[in] id tunnel identifier
+ * @param[in] val length, file descriptor or duration
+ * @note records are only written by the event loop thread
+ */
+void frec_record(unsigned char type, unsigned char arg,
+						unsigned char id, unsigned int val)
+{
+	frec_t *r;
+
+	if (!frec_ring)
+		return;
+
+	r = &frec_ring[(unsigned int)frec_count & frec_mask];
+	r->ts   = timer_clock();
+	r->type = type;
+	r->arg  = arg;
+	r->id   = id;
+	r->pad  = 0;
+	r->val  = val;
+	++frec_count;
+}
+
+/**
+ * record a frame parsed from the channel
+ */
+static void frec_frame_in(const r2tmsg_t *msg, unsigned int len)
+{
+	frec_record(FREC_FRAME_IN, msg->cmd, msg->id, len);
+}
+
+/**
+ * answer the flight recorder dump to the controller
+ * @param[in] cli controller client socket
+ * @return 0 on success
+ */
+int frec_controller_dump(netsock_t *cli)
+{
+	int n;
+
+	n = frec_dump();
+	if (n < 0) {
+		if (!frec_ring)
+			return controller_answer(cli, "error: flight recorder disabled");
+		return controller_answer(cli, "error: failed to write %s (%s)",
+									frec_path, strerror(errno));
+	}
+
+	return controller_answer(cli, "%i records dumped to %s", n, frec_path);
+}
+
+/**
+ * allocate the flight recorder (R2T_FLIGHTREC=RECORDS,
+ * R2T_FLIGHTREC_FILE=PATH)
+ */
+void frec_init(void)
+{
+	const char *env;
+	char *end;
+	unsigned long size;
+	unsigned int n;
+
+	size = FREC_DEFAULT_SIZE;
+	env = getenv("R2T_FLIGHTREC");
+	if (env && *env) {
+		size = strtoul(env, &end, 10);
+		if (*end || (size > FREC_MAX_SIZE)) {
+			warn("invalid R2T_FLIGHTREC value \"%s\"", env);
+			size = FREC_DEFAULT_SIZE;
+		}
+	}
+
+	if (!size) {
+		info(0, "flight recorder disabled");
+		return;
+	}
+
+	// power of two so that the ring index is a mask
+	for (n=1; n<size; n<<=1) ;
+
+	// private runtime directory when there is one
+	env = getenv("R2T_FLIGHTREC_FILE");
+	if (env && *env) {
+		snprintf(frec_path, sizeof(frec_path), "%s", env);
+	} else {
+		env = getenv("XDG_RUNTIME_DIR");
+		snprintf(frec_path, sizeof(frec_path), "%s/rdp2tcp-%u.frec",
+					(env && *env ? env : "/tmp"), (unsigned int) getpid());
+	}
+
+	frec_ring = calloc(n, sizeof(frec_t));
+	if (!frec_ring) {
+		error("failed to allocate flight recorder");
+		return;
+	}
+	frec_mask = n - 1;
+
+	commands_observer = frec_frame_in;
+	signal(SIGUSR2, frec_signal);
+	debug(0, "flight recorder of %u records dumped to %s", n, frec_path);
+}
@@ -0,0 +1,174 @@
+/**
+ * @file histogram.c
+ * log-linear latency histograms
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <string.h>
+
+/** bits of sub-buckets of each power of two (6.25% precision) */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_SIZE (1 << HIST_SUB_BITS)
+/** powers of two covered above the linear range (2^36 us, about 19 hours) */
+#define HIST_OCTAVES  32
+#define HIST_BUCKETS  ((HIST_OCTAVES + 1) * HIST_SUB_SIZE)
+
+/** latency histogram, values in microseconds */
+typedef struct _histogram {
+	unsigned long long count;   /**< number of samples */
+	unsigned long long sum;     /**< sum of samples */
+	unsigned long long min;     /**< smallest sample */
+	unsigned long long max;     /**< largest sample */
+	unsigned int buckets[HIST_BUCKETS]; /**< samples of each value range */
+} histogram_t;
+
+static histogram_t histograms[HIST_MAX];
+
+static const char *hist_names[HIST_MAX] = {
+	"connect", "socks5", "queue", "rtt"
+};
+
+/**
+ * get the bucket of a value
+ * @note values below HIST_SUB_SIZE have their own bucket, the others share
+ *       HIST_SUB_SIZE buckets with the values of the same power of two
+ */
+static unsigned int hist_bucket(unsigned long long val)
+{
+	unsigned int shift;
+
+	if (val < HIST_SUB_SIZE)
+		return (unsigned int) val;
+
+	for (shift=0; (val >> shift) >= 2*HIST_SUB_SIZE; ++shift) ;
+	if (shift >= HIST_OCTAVES)
+		return HIST_BUCKETS - 1;
+
+	return (shift + 1) * HIST_SUB_SIZE
+			+ (unsigned int)(val >> shift) - HIST_SUB_SIZE;
+}
+
+/**
+ * get the highest value of a bucket
+ */
+static unsigned long long hist_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB_SIZE)
+		return idx;
+
+	shift = idx / HIST_SUB_SIZE - 1;
+	return (((unsigned long long)(idx % HIST_SUB_SIZE + HIST_SUB_SIZE + 1))
+				<< shift) - 1;
+}
+
+/**
+ * record a latency sample
+ * @param[in] id HIST_xxx histogram
+ * @param[in] val latency in microseconds
+ */
+void hist_record(unsigned int id, unsigned long long val)
+{
+	histogram_t *h;
+
+	assert(id < HIST_MAX);
+
+	h = &histograms[id];
+	if (!h->count || (val < h->min))
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+	++h->count;
+	h->sum += val;
+	++h->buckets[hist_bucket(val)];
+}
+
+/**
+ * forget all the samples
+ */
+void hist_reset(void)
+{
+	memset(histograms, 0, sizeof(histograms));
+}
+
+/**
+ * get a percentile of a histogram
+ * @param[in] id HIST_xxx histogram
+ * @param[in] permille percentile in thousandths (500 is the median)
+ * @return highest value equivalent to the percentile (microseconds)
+ */
+unsigned long long hist_percentile(unsigned int id, unsigned int permille)
+{
+	unsigned long long rank, seen;
+	unsigned int i;
+	histogram_t *h;
+
+	assert((id < HIST_MAX) && (permille <= 1000));
+
+	h = &histograms[id];
+	if (!h->count)
+		return 0;
+
+	// nearest-rank method
+	rank = (h->count * permille + 999) / 1000;
+	if (!rank)
+		rank = 1;
+
+	for (i=0, seen=0; i<HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == HIST_BUCKETS)
+		return h->max;
+	seen = hist_bucket_max(i);
+	return (seen < h->max ? seen : h->max);
+}
+
+/**
+ * answer the percentiles of all histograms to the controller
+ * @param[in] cli controller client socket
+ * @return 0 on success
+ */
+int hist_dump(netsock_t *cli)
+{
+	int ret;
+	unsigned int i;
+	histogram_t *h;
+
+	ret = 0;
+	for (i=0; !ret && (i<HIST_MAX); ++i) {
+		h = &histograms[i];
+		ret = controller_answer(cli, "%s count=%llu min=%llu mean=%llu "
+					"p50=%llu p90=%llu p99=%llu p999=%llu max=%llu",
+					hist_names[i], h->count, h->min,
+					(h->count ? h->sum / h->count : 0),
+					hist_percentile(i, 500), hist_percentile(i, 900),
+					hist_percentile(i, 990), hist_percentile(i, 999), h->max);
+	}
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
@@ -29,6 +29,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "r2tcli.h"
+#include "workers.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,7 +47,8 @@
 #define R2T_PORT   8477
 
 extern struct list_head all_sockets;
-static int killme = 0;
+/** signal which requested the client to stop, 0 while running */
+static volatile sig_atomic_t killme = 0;
 
 void bye(void)
 {
@@ -56,14 +58,18 @@ void bye(void)
 		netsock_close(ns);
 
 	channel_kill();
+	net_resolver_kill();
 	exit(0);
 }
 
+/**
+ * request the event loop to stop
+ * @note the handler only runs while the event loop sleeps in pselect, the
+ *       cleanup is done by the loop (logging from here could deadlock)
+ */
 static void handle_cleanup(int sig)
 {
-	if (sig == SIGPIPE)
-		info(0, "rdesktop pipe is broken");
-	bye();
+	killme = sig;
 }
 
 static void setup(int argc, char **argv)
@@ -72,6 +78,7 @@ static void setup(int argc, char **argv)
 	int port;
 
 	print_init();
+	frec_init();
 
 	if (argc > 3)
 		exit(0);
@@ -94,15 +101,36 @@ static void setup(int argc, char **argv)
 	if (controller_start(host, port))
 		exit(0);
 
+	// optional, the client keeps running without it
+	metrics_init();
+
+	// lookups are done in the event loop if threads are not available
+	net_resolver_init();
+	timers_init();
+	tunnels_init();
+	socks5_init();
+	rdns_init();
+
 	channel_init();
 }
 
 int main(int argc, char **argv)
 {
 	int ret, fd, max_fd, last_state, state;
+	long long next;
+	unsigned long long slept, woken;
 	netsock_t *ns, *bak;
 	fd_set rfd, wfd, *pwfd;
-	struct timeval tv, *ptv;
+	struct timespec tv, *ptv;
+	sigset_t stopsigs, waitsigs;
+
+	// stop signals are only delivered while sleeping in pselect, threads
+	// started by setup inherit the mask
+	sigemptyset(&stopsigs);
+	sigaddset(&stopsigs, SIGUSR1);
+	sigaddset(&stopsigs, SIGINT);
+	sigaddset(&stopsigs, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &stopsigs, &waitsigs);
 
 	setup(argc, argv);
 
@@ -124,34 +152,59 @@ int main(int argc, char **argv)
 		state = channel_is_connected();
 		if (state != last_state) {
 
-			if (!state) // connected --> disconnected
-				tunnels_kill_clients();
-			else // disconnected --> connected
+			if (!state) { // connected --> disconnected
+				tunnels_suspend();
+				channel_compress_stop();
+				rdns_reset();
+			} else { // disconnected --> connected
+				channel_negotiate();
+				tunnels_resume();
 				tunnels_restart();
+			}
 			
 			last_state = state;
 		}
 
-		if (state) {
-			// channel is connected
-			if (channel_want_write()) {
-				FD_SET(RDP_FD_OUT, &wfd);
-				max_fd = RDP_FD_OUT;
-				pwfd = &wfd;
-			}
-			tv.tv_sec  = 1;
-			tv.tv_usec = 0;
+		if (state && channel_want_write()) {
+			FD_SET(RDP_FD_OUT, &wfd);
+			max_fd = RDP_FD_OUT;
+			pwfd = &wfd;
+		}
+
+		// sleep until the next timer (probe, channel timeout, deadlines)
+		next = timers_next();
+		if (next >= 0) {
+			tv.tv_sec  = (time_t)(next / 1000000);
+			tv.tv_nsec = (long)(next % 1000000) * 1000;
 			ptv = &tv;
 		}
 
+		fd = workers_fd();
+		if (fd >= 0) {
+			FD_SET(fd, &rfd);
+			if (fd > max_fd) max_fd = fd;
+		}
+
+		fd = net_resolver_fd();
+		if (fd >= 0) {
+			FD_SET(fd, &rfd);
+			if (fd > max_fd) max_fd = fd;
+		}
+
 		list_for_each(ns, &all_sockets) {
 
 			assert(valid_netsock(ns));
 
-			if (ns->state != NETSTATE_CANCELLED) {
+			if ((ns->state != NETSTATE_CANCELLED)
+					&& (ns->state != NETSTATE_RESOLVING)) {
 				fd = ns->fd;
 
-				if (netsock_want_read(ns)) {
+				// stop reading tunnels while compression workers lag behind
+				// or while the channel rate is exceeded
+				if (netsock_want_read(ns) && (netsock_is_server(ns)
+						|| (ns->type == NETSOCK_CTRLCLI)
+						|| (ns->type == NETSOCK_HTTPCLI)
+						|| (!workers_full() && !channel_paced()))) {
 					FD_SET(fd, &rfd);
 					if (fd > max_fd) max_fd = fd;
 				}
@@ -172,7 +225,11 @@ int main(int argc, char **argv)
 			break;
 		}
 		
-		ret = select(max_fd+1, &rfd, pwfd, NULL, ptv);
+		slept = timer_clock();
+		ret = pselect(max_fd+1, &rfd, pwfd, NULL, ptv, &waitsigs);
+		woken = timer_clock();
+		frec_record(FREC_WAKE, (unsigned char)(ret > 0xff ? 0xff : ret), 0xff,
+						(unsigned int)(woken - slept));
 		if (ret == -1) {
 			if (errno == EINTR) {
 				// Interrupted by signal, continue
@@ -182,11 +239,7 @@ int main(int argc, char **argv)
 			break;
 		}
 		
-		if (ret == 0) {
-			// channel ping timeout
-			//info(0, "channel timeout");
-			continue;
-		}
+		timers_run();
 
 		if (FD_ISSET(RDP_FD_OUT, &wfd))
 			channel_write_event();
@@ -196,6 +249,14 @@ int main(int argc, char **argv)
 				break;
 		}
 
+		fd = workers_fd();
+		if ((fd >= 0) && FD_ISSET(fd, &rfd))
+			channel_jobs_event();
+
+		fd = net_resolver_fd();
+		if ((fd >= 0) && FD_ISSET(fd, &rfd))
+			netsock_resolve_event();
+
 		list_for_each_safe(ns, bak, &all_sockets) {
 
 			assert(valid_netsock(ns));
@@ -206,7 +267,8 @@ int main(int argc, char **argv)
 				continue;
 			}
 
-			if (ns->type == NETSOCK_RTUNSRV)
+			if ((ns->type == NETSOCK_RTUNSRV)
+					|| (ns->state == NETSTATE_RESOLVING))
 				continue;
 
 			fd = ns->fd;
@@ -217,6 +279,8 @@ int main(int argc, char **argv)
 						tunnel_accept_event(ns);
 					else if (ns->type == NETSOCK_S5SRV)
 						socks5_accept_event(ns);
+					else if (ns->type == NETSOCK_HTTPSRV)
+						metrics_accept_event(ns);
 					else
 						controller_accept_event(ns);
 				}
@@ -234,6 +298,8 @@ int main(int argc, char **argv)
 						ret = socks5_read_event(ns);
 					else if (ns->type == NETSOCK_CTRLCLI)
 						ret = controller_read_event(ns);
+					else if (ns->type == NETSOCK_HTTPCLI)
+						ret = metrics_read_event(ns);
 					else
 						ret = channel_forward_recv(ns);
 				}
@@ -242,8 +308,12 @@ int main(int argc, char **argv)
 					netsock_close(ns);
 			}
 		}
+
+		frec_record(FREC_LOOP, 0, 0xff, (unsigned int)(timer_clock() - woken));
 	}
 
+	if (killme == SIGPIPE)
+		info(0, "rdesktop pipe is broken");
 	bye();
 	return 0;
 }
@@ -0,0 +1,404 @@
+/**
+ * @file metrics.c
+ * Prometheus metrics HTTP endpoint
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** largest HTTP request header accepted (bytes) */
+#define METRICS_MAX_REQUEST 4096
+/** seconds a scraper may take to send its request */
+#define METRICS_TIMEOUT     10
+
+extern struct list_head all_sockets;
+
+/** tunnel connections refused by the server, by R2TERR_xxx code */
+static unsigned int connect_failures[R2TERR_MAX+1];
+
+static const char *r2terr_labels[R2TERR_MAX+1] = {
+	"success", "generic", "badmsg", "connrefused", "forbidden",
+	"notavail", "resolve", "notfound", "compression", "unknown"
+};
+
+/**
+ * account a tunnel connection refused by the server
+ * @param[in] err R2TERR_xxx code of the answer
+ */
+void metrics_connect_failure(unsigned char err)
+{
+	++connect_failures[err < R2TERR_MAX ? err : R2TERR_MAX];
+}
+
+/**
+ * start the metrics HTTP listener
+ * @return 0 on success or if disabled
+ * @note R2T_METRICS environment variable holds the [HOST:]PORT to listen
+ *       on (HOST defaults to 127.0.0.1)
+ */
+int metrics_init(void)
+{
+	const char *val, *host;
+	char *addr, *port, *end;
+	long n;
+	netsock_t *ns;
+
+	val = getenv("R2T_METRICS");
+	if (!val || !*val)
+		return 0;
+
+	addr = strdup(val);
+	if (!addr)
+		return error("failed to allocate metrics address");
+
+	port = strrchr(addr, ':');
+	if (port) {
+		*port++ = 0;
+		host = addr;
+	} else {
+		port = addr;
+		host = "";
+	}
+
+	n = strtol(port, &end, 10);
+	if ((end == port) || *end || (n <= 0) || (n > 0xffff)) {
+		free(addr);
+		return error("invalid R2T_METRICS port");
+	}
+
+	// [::1]:PORT
+	if (*host == '[') {
+		++host;
+		end = strchr(host, ']');
+		if (end)
+			*end = 0;
+	}
+	if (!*host)
+		host = "127.0.0.1";
+
+	trace_ctrl("host=%s, port=%li", host, n);
+
+	ns = netsock_bind(NULL, host, (unsigned short) n, 0);
+	if (ns) {
+		ns->type = NETSOCK_HTTPSRV;
+		info(0, "metrics listening on %s:%li", host, n);
+	}
+
+	free(addr);
+	return (ns ? 0 : -1);
+}
+
+static void metrics_timeout(void *ctx)
+{
+	netsock_t *cli = (netsock_t *) ctx;
+	char host[NETADDRSTR_MAXSIZE];
+
+	info(1, "closing metrics client %s (timeout)",
+			netaddr_print(&cli->addr, host));
+	netsock_cancel(cli);
+}
+
+/**
+ * handle metrics listener accept-event
+ * @param[in] ns metrics listener socket
+ */
+void metrics_accept_event(netsock_t *ns)
+{
+	unsigned int i;
+	netsock_t *cli;
+
+	assert(valid_netsock(ns) && (ns->type == NETSOCK_HTTPSRV));
+	trace_ctrl("");
+
+	for (i=0; i<NET_ACCEPT_BURST; ++i) {
+		cli = netsock_accept(ns);
+		if (!cli)
+			break;
+		cli->type = NETSOCK_HTTPCLI;
+		cli->tid  = 0xff;
+		iobuf_init2(&cli->u.ctrlcli.ibuf, &cli->u.ctrlcli.obuf, "http");
+		timer_arm(&cli->timer, METRICS_TIMEOUT * 1000000ULL,
+					metrics_timeout, cli);
+	}
+}
+
+/**
+ * append formatted text to the answer of a metrics client
+ * @param[in] cli metrics client socket
+ * @param[in] fmt format string
+ * @return 0 on success
+ */
+static int metrics_printf(netsock_t *cli, const char *fmt, ...)
+{
+	int ret;
+	va_list va;
+	char buf[2048], *ptr;
+
+	va_start(va, fmt);
+	ret = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+
+	if ((ret <= 0) || (ret >= (int)sizeof(buf)))
+		return error("failed to format metric");
+
+	// sent at once by the caller
+	ptr = iobuf_reserve(&cli->u.ctrlcli.obuf, (unsigned int)ret, NULL);
+	if (!ptr)
+		return error("failed to allocate metrics memory");
+	memcpy(ptr, buf, ret);
+	iobuf_commit(&cli->u.ctrlcli.obuf, (unsigned int)ret);
+
+	return 0;
+}
+
+/**
+ * append the help and type lines of a metric
+ */
+#define METRIC_HEAD(name, type, help) \
+	"# HELP rdp2tcp_" name " " help "\n# TYPE rdp2tcp_" name " " type "\n"
+
+static const char *tunnel_kind(netsock_t *ns)
+{
+	switch (ns->type) {
+		case NETSOCK_TUNSRV:
+			return (ns->u.tunsrv.rport ? "forward" : "process");
+		case NETSOCK_TUNCLI:
+			return (ns->u.tuncli.is_process ? "process" : "forward");
+		case NETSOCK_RTUNSRV:
+		case NETSOCK_RTUNCLI:
+			return "reverse";
+		case NETSOCK_S5SRV:
+		case NETSOCK_S5CLI:
+			return "socks5";
+	}
+	return NULL;
+}
+
+/**
+ * append the metrics in Prometheus text format
+ * @param[in] cli metrics client socket
+ * @return 0 on success
+ * @note every value is read from counters kept by the event loop
+ */
+static int metrics_dump(netsock_t *cli)
+{
+	static const char *kinds[TUNIDLE_MAX] = {
+		"forward", "process", "reverse", "socks5"
+	};
+	int ret;
+	unsigned int i, buffered, srtt, rttvar, jitter, queued;
+	unsigned int tunnels[TUNIDLE_MAX], listeners[TUNIDLE_MAX];
+	unsigned long long now, last;
+	netstats_t st;
+	netsock_t *ns;
+	const char *kind;
+	char host[NETADDRSTR_MAXSIZE];
+
+	now = timer_clock();
+	buffered = channel_stats(&st, &last);
+	srtt = channel_rtt(&rttvar, &jitter);
+
+	ret = metrics_printf(cli,
+			METRIC_HEAD("channel_up", "gauge",
+						"1 if the virtual channel is connected")
+			"rdp2tcp_channel_up %u\n"
+			METRIC_HEAD("channel_uptime_seconds", "gauge",
+						"seconds since the virtual channel is connected")
+			"rdp2tcp_channel_uptime_seconds %llu\n"
+			METRIC_HEAD("channel_bytes_total", "counter",
+						"bytes transferred on the virtual channel")
+			"rdp2tcp_channel_bytes_total{direction=\"rx\"} %llu\n"
+			"rdp2tcp_channel_bytes_total{direction=\"tx\"} %llu\n"
+			METRIC_HEAD("channel_io_total", "counter",
+						"reads and writes on the virtual channel")
+			"rdp2tcp_channel_io_total{direction=\"rx\"} %u\n"
+			"rdp2tcp_channel_io_total{direction=\"tx\"} %u\n",
+			(st.up_ts ? 1 : 0),
+			(st.up_ts ? (now - st.up_ts) / 1000000 : 0),
+			st.rx_bytes, st.tx_bytes, st.rx_msgs, st.tx_msgs);
+	if (!ret)
+		ret = metrics_printf(cli,
+			METRIC_HEAD("channel_queue_bytes", "gauge",
+						"bytes waiting to be written to the virtual channel")
+			"rdp2tcp_channel_queue_bytes %u\n"
+			METRIC_HEAD("channel_queue_peak_bytes", "gauge",
+						"largest virtual channel output backlog")
+			"rdp2tcp_channel_queue_peak_bytes %u\n"
+			METRIC_HEAD("channel_rtt_seconds", "gauge",
+						"smoothed round-trip time of ping probes")
+			"rdp2tcp_channel_rtt_seconds %u.%06u\n"
+			METRIC_HEAD("channel_rtt_variation_seconds", "gauge",
+						"round-trip time variation of ping probes")
+			"rdp2tcp_channel_rtt_variation_seconds %u.%06u\n"
+			METRIC_HEAD("channel_jitter_seconds", "gauge",
+						"round-trip jitter of ping probes")
+			"rdp2tcp_channel_jitter_seconds %u.%06u\n",
+			buffered, st.peak_buf,
+			srtt / 1000000, srtt % 1000000,
+			rttvar / 1000000, rttvar % 1000000,
+			jitter / 1000000, jitter % 1000000);
+
+	memset(tunnels, 0, sizeof(tunnels));
+	memset(listeners, 0, sizeof(listeners));
+	queued = 0;
+	list_for_each(ns, &all_sockets) {
+		kind = tunnel_kind(ns);
+		if (!kind)
+			continue;
+		for (i=0; strcmp(kinds[i], kind); ++i) ;
+		if (netsock_is_tunnel(ns)) {
+			++tunnels[i];
+			queued += iobuf_datalen(netsock_obuf(ns));
+		} else {
+			++listeners[i];
+		}
+	}
+
+	if (!ret)
+		ret = metrics_printf(cli,
+			METRIC_HEAD("tunnels", "gauge", "open tunnels by kind")
+			"rdp2tcp_tunnels{kind=\"%s\"} %u\n"
+			"rdp2tcp_tunnels{kind=\"%s\"} %u\n"
+			"rdp2tcp_tunnels{kind=\"%s\"} %u\n"
+			"rdp2tcp_tunnels{kind=\"%s\"} %u\n"
+			METRIC_HEAD("listeners", "gauge", "tunnel listeners by kind")
+			"rdp2tcp_listeners{kind=\"%s\"} %u\n"
+			"rdp2tcp_listeners{kind=\"%s\"} %u\n"
+			"rdp2tcp_listeners{kind=\"%s\"} %u\n"
+			"rdp2tcp_listeners{kind=\"%s\"} %u\n"
+			METRIC_HEAD("tunnel_queue_bytes", "gauge",
+						"bytes waiting to be written to local tunnel peers")
+			"rdp2tcp_tunnel_queue_bytes %u\n"
+			METRIC_HEAD("connect_failures_total", "counter",
+						"tunnel connections refused by the server by error code"),
+			kinds[0], tunnels[0], kinds[1], tunnels[1],
+			kinds[2], tunnels[2], kinds[3], tunnels[3],
+			kinds[0], listeners[0], kinds[1], listeners[1],
+			kinds[2], listeners[2], kinds[3], listeners[3],
+			queued);
+
+	for (i=R2TERR_GENERIC; !ret && (i<=R2TERR_MAX); ++i)
+		ret = metrics_printf(cli,
+				"rdp2tcp_connect_failures_total{code=\"%s\"} %u\n",
+				r2terr_labels[i], connect_failures[i]);
+
+	if (!ret)
+		ret = metrics_printf(cli, METRIC_HEAD("listener_connections_total",
+				"counter", "connections opened by each tunnel listener"));
+
+	list_for_each(ns, &all_sockets) {
+		if (ret)
+			break;
+		kind = tunnel_kind(ns);
+		if (!kind || netsock_is_tunnel(ns))
+			continue;
+		if (ns->type == NETSOCK_RTUNSRV)
+			snprintf(host, sizeof(host), "%s:%hu",
+					ns->u.rtunsrv.lhost, ns->u.rtunsrv.lport);
+		else
+			netaddr_print(&ns->addr, host);
+		ret = metrics_printf(cli,
+				"rdp2tcp_listener_connections_total{kind=\"%s\",listener=\"%s\"}"
+				" %u\n", kind, host, ns->st.conns);
+	}
+
+	return ret;
+}
+
+/**
+ * find the end of the HTTP request header
+ * @return 1 if the header is complete
+ */
+static int metrics_request_complete(const char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i=1; i<len; ++i) {
+		if ((data[i] == '\n') && ((data[i-1] == '\n')
+				|| ((i > 1) && (data[i-1] == '\r') && (data[i-2] == '\n'))))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * handle metrics client network read-event
+ * @param[in] cli metrics client socket
+ * @return -1 on error
+ */
+int metrics_read_event(netsock_t *cli)
+{
+	int ret;
+	unsigned int len;
+	const char *data, *status;
+
+	assert(valid_netsock(cli) && (cli->type == NETSOCK_HTTPCLI));
+	trace_ctrl("");
+
+	ret = netsock_read(cli, &cli->u.ctrlcli.ibuf, 0, NULL);
+	if (ret)
+		return ret;
+
+	data = iobuf_dataptr(&cli->u.ctrlcli.ibuf);
+	len  = iobuf_datalen(&cli->u.ctrlcli.ibuf);
+
+	if (!metrics_request_complete(data, len)) {
+		if (len > METRICS_MAX_REQUEST)
+			return error("metrics request too large");
+		return 0;
+	}
+
+	if (strncmp(data, "GET ", 4))
+		status = "405 Method Not Allowed";
+	else if (strncmp(data+4, "/metrics ", 9) && strncmp(data+4, "/ ", 2))
+		status = "404 Not Found";
+	else
+		status = NULL;
+
+	if (status) {
+		ret = metrics_printf(cli, "HTTP/1.0 %s\r\n"
+				"Content-Type: text/plain\r\nConnection: close\r\n\r\n"
+				"%s\n", status, status);
+	} else {
+		ret = metrics_printf(cli, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Connection: close\r\n\r\n");
+		if (!ret)
+			ret = metrics_dump(cli);
+	}
+	if (ret)
+		return -1;
+
+	// closed by tunnel_write_event once the answer is flushed
+	iobuf_consume(&cli->u.ctrlcli.ibuf, len);
+	timer_cancel(&cli->timer);
+	cli->closing = 1;
+
+	ret = netsock_write(cli, NULL, 0);
+	if ((ret < 0) || (!ret && !iobuf_datalen(&cli->u.ctrlcli.obuf)))
+		return -1;
+
+	return 0;
+}
@@ -35,6 +35,47 @@
  */
 LIST_HEAD_INIT(all_sockets);
 
+/**
+ * check if main loop must wait for network-read event
+ * @param[in] ns netsock socket
+ * @note tunnel clients are read while the remote connection is pending,
+ *       their first bytes travel right behind the R2TCMD_CONN request
+ */
+int netsock_want_read(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+
+	// tunnels kept during a channel outage stop reading until resumed
+	if (ns->suspended || ns->rd_shut || ns->throttled)
+		return 0;
+
+	switch (ns->type) {
+
+		case NETSOCK_TUNSRV:
+		case NETSOCK_S5SRV:
+			// new connections wait in the backlog during channel outages
+			if (tunnel_resume_size && !channel_is_connected())
+				return 0;
+			break;
+
+		case NETSOCK_TUNCLI:
+			if (ns->state == NETSTATE_CONNECTING)
+				return ns->u.tuncli.early < tunnel_early_max;
+			break;
+
+		case NETSOCK_S5CLI:
+			if (ns->u.sockscli.pending)
+				return ns->u.sockscli.early < tunnel_early_max;
+			break;
+
+		case NETSOCK_HTTPCLI:
+			// request fully read once the answer is queued
+			return !ns->closing;
+	}
+
+	return ns->state >= NETSTATE_CONNECTED;
+}
+
 /**
  * check if main loop must wait for network-write event
  * @param[in] ns netsock socket
@@ -46,9 +87,13 @@ int netsock_want_write(netsock_t *ns)
 	switch (ns->type) {
 
 		case NETSOCK_CTRLCLI:
+		case NETSOCK_HTTPCLI:
 			return iobuf_datalen(&ns->u.ctrlcli.obuf) > 0;
 
 		case NETSOCK_TUNCLI:
+			// accepted clients wait for the server answer, not for POLLOUT
+			return iobuf_datalen(&ns->u.tuncli.obuf) > 0;
+
 		case NETSOCK_RTUNCLI:
 			return (ns->state != NETSTATE_CONNECTED)
 					|| (iobuf_datalen(&ns->u.tuncli.obuf) > 0);
@@ -62,6 +107,21 @@ int netsock_want_write(netsock_t *ns)
 	return 0;
 }
 
+/**
+ * get the output buffer of a tunnel client socket
+ * @param[in] ns tunnel client or SOCKS5 client socket
+ * @return the output buffer
+ */
+iobuf_t *netsock_obuf(netsock_t *ns)
+{
+	assert(valid_netsock(ns) && netsock_is_tunnel(ns));
+
+	if (ns->type == NETSOCK_S5CLI)
+		return &ns->u.sockscli.obuf;
+
+	return &ns->u.tuncli.obuf;
+}
+
 /**
  * cancel a network socket / delayed netsock_close
  * @param[in] ns netsock socket
@@ -80,14 +140,26 @@ void netsock_close(netsock_t *ns)
 {
 	assert(ns && (((ns->type == NETSOCK_UNDEF) || valid_netsock(ns))));
 
+	frec_record(FREC_CLOSE, (unsigned char) ns->type, ns->tid,
+					(unsigned int) ns->fd);
+	if (netsock_is_tunnel(ns) && (ns->tid != 0xff))
+		R2T_PROBE4(tunnel__close, ns->tid, ns->st.rx_bytes, ns->st.tx_bytes,
+					timer_clock() - ns->st.start_ts);
+
 	list_del(&ns->list);
+	timer_cancel(&ns->timer);
+	timer_cancel(&ns->rate_timer);
+	ratelimit_put(ns->group);
 
-	if (ns->type != NETSOCK_RTUNSRV)
+	if (ns->fd == -1)
+		net_resolver_cancel(ns);
+	else if (ns->type != NETSOCK_RTUNSRV)
 		close(ns->fd);
 
 	switch (ns->type) {
 
 		case NETSOCK_CTRLCLI:
+		case NETSOCK_HTTPCLI:
 			iobuf_kill2(&ns->u.ctrlcli.ibuf, &ns->u.ctrlcli.obuf);
 			break;
 
@@ -100,6 +172,7 @@ void netsock_close(netsock_t *ns)
 			break;
 	}
 
+	replay_kill(&ns->tx);
 	free(ns);
 }
 
@@ -134,6 +207,9 @@ netsock_t *netsock_alloc(
 		ns->state = NETSTATE_INIT;
 		ns->tid  = 0xff;
 		ns->fd = fd;
+		ns->io_ts = timer_clock();
+		ns->st.start_ts = ns->io_ts;
+		replay_init(&ns->tx, tunnel_resume_size);
 		if (addr)
 			memcpy(&ns->addr, addr, sizeof(*addr));
 			// Count existing sockets to prevent resource exhaustion
@@ -201,7 +277,7 @@ netsock_t *netsock_bind(
 /**
  * accept client socket
  * @param[in] srv server socket
- * @return allocated structure
+ * @return allocated structure or NULL if there is no pending connection
  */
 netsock_t *netsock_accept(netsock_t *srv)
 {
@@ -213,22 +289,71 @@ netsock_t *netsock_accept(netsock_t *srv)
 
 	ret = net_accept(&srv->fd, &fd, &addr);
 	if (ret) {
-		error("failed to accept connection (%s)", strerror(ret));
+		if ((ret != EAGAIN) && (ret != EWOULDBLOCK))
+			error("failed to accept connection (%s)", strerror(ret));
 		return NULL;
 	}
 
 	cli = netsock_alloc(NULL, fd, &addr, 0);
-	if (cli)
+	if (cli) {
 		cli->state = NETSTATE_CONNECTED;
+		++srv->st.conns;
+		frec_record(FREC_ACCEPT, (unsigned char) srv->type, srv->tid,
+						(unsigned int) fd);
+		netsock_inherit(cli, srv);
+	}
 
 	return cli;
 }
 
+/**
+ * set the options of a listener
+ * @param[in] srv listener socket (TUNSRV, S5SRV or RTUNSRV)
+ * @param[in] opts listener options
+ * @return 0 on success
+ */
+int netsock_set_options(netsock_t *srv, const tunopts_t *opts)
+{
+	assert(valid_netsock(srv) && opts && (netsock_is_server(srv)
+				|| (srv->type == NETSOCK_RTUNSRV)));
+
+	srv->profile = (unsigned char) opts->profile;
+	srv->idle_timeout = opts->idle;
+	ratelimit_init(&srv->rate, opts->conn_rate);
+	if (opts->rate) {
+		srv->group = ratelimit_new(opts->rate);
+		if (!srv->group)
+			return -1;
+	}
+
+	if (srv->fd != -1)
+		net_tune(&srv->fd, srv->profile);
+
+	return 0;
+}
+
+/**
+ * apply the options of a listener to one of its clients
+ * @param[in] cli client socket
+ * @param[in] srv listener socket
+ */
+void netsock_inherit(netsock_t *cli, netsock_t *srv)
+{
+	assert(valid_netsock(srv) && cli);
+
+	cli->profile = srv->profile;
+	cli->idle_timeout = srv->idle_timeout;
+	ratelimit_init(&cli->rate, srv->rate.rate);
+	cli->group = ratelimit_get(srv->group);
+}
+
 /**
  * start a client socket
  * @param[in] host client address 
  * @param[in] port client port
  * @return allocated structure
+ * @note the socket stays in NETSTATE_RESOLVING (without descriptor) until
+ *       netsock_resolve_event when host is not in the resolver cache
  */
 netsock_t *netsock_connect(const char *host, unsigned short port)
 {
@@ -238,20 +363,71 @@ netsock_t *netsock_connect(const char *host, unsigned short port)
 
 	assert(host && *host && port);
 
-	ret = net_client(AF_UNSPEC, host, port, &fd, &addr, &err);
+	cli = netsock_alloc(NULL, -1, NULL, 0);
+	if (!cli)
+		return NULL;
+
+	ret = net_client_async(AF_UNSPEC, host, port, cli, &fd, &addr, &err);
 	if (ret < 0) {
 		error("failed to connect to %s:%hu (%s)",
 				host, port, net_error(ret, err));
+		netsock_close(cli);
 		return NULL;
 	}
 
-	cli = netsock_alloc(NULL, fd, &addr, 0);
-	if (cli)
+	if (ret == NET_RESOLVING) {
+		cli->state = NETSTATE_RESOLVING;
+	} else {
+		cli->fd = fd;
+		memcpy(&cli->addr, &addr, sizeof(addr));
 		cli->state = (ret ? NETSTATE_CONNECTING : NETSTATE_CONNECTED);
+	}
 
 	return cli;
 }
 
+static void netsock_resolved(
+				void *ctx,
+				int ret,
+				int *fd,
+				netaddr_t *addr,
+				int err)
+{
+	netsock_t *cli = (netsock_t *)ctx;
+
+	assert(valid_netsock(cli) && netsock_resolving(cli));
+	trace_sock("tid=0x%02x, ret=%i", cli->tid, ret);
+
+	// tunnel closed by the server, netsock_close is pending
+	if (cli->state == NETSTATE_CANCELLED) {
+		if (ret >= 0)
+			close(*fd);
+		return;
+	}
+
+	if (ret < 0) {
+		error("failed to connect tunnel 0x%02x (%s)",
+				cli->tid, net_error(ret, err));
+		channel_close_tunnel(cli->tid);
+		netsock_cancel(cli);
+		return;
+	}
+
+	// data received in the meantime is already queued in the output buffer
+	cli->fd = *fd;
+	memcpy(&cli->addr, addr, sizeof(*addr));
+	net_tune(&cli->fd, cli->profile);
+	cli->state = (ret ? NETSTATE_CONNECTING : NETSTATE_CONNECTED);
+}
+
+/**
+ * connect client sockets whose hostname lookup has completed
+ */
+void netsock_resolve_event(void)
+{
+	net_resolver_collect(netsock_resolved);
+}
+
 /**
  * async read from socket
  * @param[in] ns network socket
@@ -283,6 +459,8 @@ int netsock_read(
 	} else if (r > 0) {
 		if (out_size)
 			*out_size = r;
+		ns->st.rx_bytes += r;
+		++ns->st.rx_msgs;
 		print_xfer("tcp", 'r', r);
 	}
 
@@ -313,9 +491,16 @@ int netsock_write(netsock_t *ns, const void *buf, unsigned int len)
 			error("failed to send data to %s (%s)", host, strerror(errno));
 
 	} else if (w > 0) {
+		ns->st.tx_bytes += w;
+		++ns->st.tx_msgs;
 		print_xfer("tcp", 'w', w);
 	}
 
+	// backlog left to the next write-event
+	w = iobuf_datalen(&ns->u.tuncli.obuf);
+	if (w > ns->st.peak_buf)
+		ns->st.peak_buf = w;
+
 	return ret;
 }
 
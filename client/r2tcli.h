@@ -31,10 +31,52 @@
 #include "iobuf.h"
 #include "rdp2tcp.h"
 #include "nethelper.h"
+#include "replay.h"
+#include "probes.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 
+// timer.c
+typedef void (*timer_cb_t)(void *);
+
+/** timer of the event loop */
+typedef struct _evtimer {
+	struct list_head list;      /**< timer wheel slot */
+	unsigned long long expire;  /**< expiration tick (ms) */
+	timer_cb_t cb;              /**< expiration callback */
+	void *ctx;                  /**< callback context */
+	unsigned char level;        /**< timer wheel level */
+	unsigned char armed;        /**< 1 while the timer is pending */
+} evtimer_t;
+
+#define timer_pending(t) ((t)->armed)
+
+unsigned long long timer_clock(void);
+void timers_init(void);
+void timer_arm(evtimer_t *, unsigned long long, timer_cb_t, void *);
+void timer_cancel(evtimer_t *);
+void timers_run(void);
+long long timers_next(void);
+
+// ratelimit.c
+/** token bucket */
+typedef struct _ratelimit {
+	unsigned int rate;      /**< bytes per second, 0 if unlimited */
+	unsigned int burst;     /**< bucket depth (bytes) */
+	long long tokens;       /**< available bytes, negative when in debt */
+	unsigned long long ts;  /**< last refill (us) */
+	unsigned int refs;      /**< references of a shared bucket */
+} ratelimit_t;
+
+void ratelimit_init(ratelimit_t *, unsigned int);
+ratelimit_t *ratelimit_new(unsigned int);
+ratelimit_t *ratelimit_get(ratelimit_t *);
+void ratelimit_put(ratelimit_t *);
+unsigned long long ratelimit_take(ratelimit_t *, unsigned int,
+												unsigned long long);
+int ratelimit_parse(const char *, unsigned int *);
+
 // netsock.c
 #define NETSOCK_CTRLSRV 0
 #define NETSOCK_TUNSRV  1
@@ -44,14 +86,30 @@
 #define NETSOCK_S5CLI   5
 #define NETSOCK_RTUNSRV 6
 #define NETSOCK_RTUNCLI 7
+#define NETSOCK_HTTPSRV 8
+#define NETSOCK_HTTPCLI 9
 #define NETSOCK_UNDEF   0xff
 
 #define NETSTATE_INIT           0
 #define NETSTATE_CANCELLED      1
-#define NETSTATE_CONNECTING     2
-#define NETSTATE_CONNECTED      3
-#define NETSTATE_AUTHENTICATING 4
-#define NETSTATE_AUTHENTICATED  5
+#define NETSTATE_RESOLVING      2
+#define NETSTATE_CONNECTING     3
+#define NETSTATE_CONNECTED      4
+#define NETSTATE_AUTHENTICATING 5
+#define NETSTATE_AUTHENTICATED  6
+
+/** traffic counters of a socket or of the channel */
+typedef struct _netstats {
+	unsigned long long rx_bytes; /**< bytes received */
+	unsigned long long tx_bytes; /**< bytes sent */
+	unsigned int rx_msgs;        /**< successful reads */
+	unsigned int tx_msgs;        /**< successful writes */
+	unsigned int peak_buf;       /**< largest output backlog (bytes) */
+	unsigned long long start_ts; /**< creation (us) */
+	unsigned long long req_ts;   /**< tunnel requested to the server (us) */
+	unsigned long long up_ts;    /**< connection establishment (us), 0 if none */
+	unsigned int conns;          /**< connections opened by a listener */
+} netstats_t;
 
 /** network socket (tunnel, client or server) */
 typedef struct _netsock {
@@ -62,6 +120,23 @@ typedef struct _netsock {
 	unsigned char tid;         /**< tunnel identifier */
 	unsigned int min_io_size;  /**< minimal input buffer size */
 	netaddr_t addr;            /**< socket address */
+	unsigned char suspended;   /**< 1 while kept during a channel outage */
+	unsigned char rd_shut;     /**< 1 once the local peer has sent FIN */
+	unsigned char wr_shut;     /**< TUNSHUT_xxx state of the write side */
+	unsigned char closing;     /**< 1 if closed by the server, output is flushed first */
+	unsigned char profile;     /**< NETPROF_xxx socket tuning profile */
+	evtimer_t timer;           /**< connect, handshake, idle or flush deadline */
+	unsigned int idle_timeout; /**< seconds without payload before close, 0 if none */
+	unsigned long long io_ts;  /**< last payload exchange (us) */
+	ratelimit_t rate;          /**< read rate of the socket (template of
+	                                the clients for a listener) */
+	ratelimit_t *group;        /**< read rate shared by the clients of a
+	                                listener, NULL if unlimited */
+	evtimer_t rate_timer;      /**< end of read throttling */
+	unsigned char throttled;   /**< 1 while reads exceed the rate limits */
+	netstats_t st;             /**< traffic counters */
+	unsigned int rx_seq;       /**< payload bytes received from the server */
+	replay_t tx;               /**< last payload bytes sent to the server */
 	union {
 		struct {
 			unsigned char  raf;   /**< remote address family */
@@ -72,6 +147,7 @@ typedef struct _netsock {
 			iobuf_t obuf;             /**< output buffer */
 			netaddr_t raddr;          /**< remote address */
 			unsigned char is_process; /**< 1 if tunnel is a process */
+			unsigned int early;       /**< bytes sent before R2TCMD_CONN answer */
 		} tuncli;
 		struct {
 			iobuf_t obuf; /**< output buffer */
@@ -80,6 +156,8 @@ typedef struct _netsock {
 		struct {
 			iobuf_t obuf; /**< output buffer */
 			iobuf_t ibuf; /**< input buffer */
+			unsigned char pending; /**< 1 if success answered before CONN */
+			unsigned int early;    /**< bytes sent before CONN answer */
 		} sockscli;
 		struct {
 			unsigned short lport;     /**< local port */
@@ -93,27 +171,76 @@ typedef struct _netsock {
 
 #define valid_netsock(ns) \
 				((ns) && (ns)->list.next && (ns)->list.prev \
-				 && (((ns)->fd != -1) || ((ns)->type == NETSOCK_RTUNSRV)) \
-				 && ((ns)->type <= NETSOCK_RTUNCLI) \
-				 && (((ns)->addr.ip4.sin_family == AF_INET) \
-					 || ((ns)->addr.ip4.sin_family == AF_INET6) \
-					 || ((ns)->type == NETSOCK_RTUNSRV)))
-
-#define netsock_is_server(ns) ((ns)->type <= NETSOCK_S5SRV)
+				 && ((ns)->type <= NETSOCK_HTTPCLI) \
+				 && (((ns)->type == NETSOCK_RTUNSRV) || netsock_resolving(ns) \
+					 || (((ns)->fd != -1) \
+						 && (((ns)->addr.ip4.sin_family == AF_INET) \
+							 || ((ns)->addr.ip4.sin_family == AF_INET6)))))
 
 /**
- * check if main loop must wait for network-read event
+ * check if a client socket is still waiting for its hostname lookup
  * @param[in] ns netsock socket
  */
-#define netsock_want_read(ns) ((ns)->state >= NETSTATE_CONNECTED)
+#define netsock_resolving(ns) \
+				(((ns)->fd == -1) && ((ns)->type == NETSOCK_RTUNCLI))
+
+#define netsock_is_server(ns) \
+				(((ns)->type <= NETSOCK_S5SRV) || ((ns)->type == NETSOCK_HTTPSRV))
+
+/** check if a socket is the local end of a tunnel */
+#define netsock_is_tunnel(ns) \
+				(((ns)->type > NETSOCK_CTRLCLI) && ((ns)->type <= NETSOCK_RTUNCLI) \
+				 && ((ns)->type != NETSOCK_RTUNSRV))
+
+/** options of a tunnel listener, inherited by its clients */
+typedef struct _tunopts {
+	int profile;            /**< NETPROF_xxx socket tuning profile */
+	unsigned int idle;      /**< seconds without traffic before close, 0 never */
+	unsigned int rate;      /**< read rate of all clients combined (bytes/s) */
+	unsigned int conn_rate; /**< read rate of each client (bytes/s) */
+} tunopts_t;
+
+// tunnel write side states
+#define TUNSHUT_NONE    0
+#define TUNSHUT_PENDING 1 /**< FIN received by the server, output not flushed */
+#define TUNSHUT_DONE    2 /**< FIN forwarded to the local peer */
+
+/** default maximum of bytes forwarded before a tunnel is connected */
+#define TUNNEL_EARLY_MAX (64*1024)
+extern unsigned int tunnel_early_max;
+
+/** seconds a channel outage may last before kept tunnels are closed */
+#define TUNNEL_RESUME_TIMEOUT 120
+extern unsigned int tunnel_resume_size;
+
+/** default seconds a tunnel may take to connect (SOCKS5 handshake included) */
+#define TUNNEL_CONNECT_TIMEOUT 30
+/** seconds a tunnel closed by the server may take to flush its output */
+#define TUNNEL_LINGER_TIMEOUT 30
+extern unsigned int tunnel_connect_timeout;
+
+// tunnel kinds with their own default idle timeout
+#define TUNIDLE_FORWARD 0
+#define TUNIDLE_PROCESS 1
+#define TUNIDLE_REVERSE 2
+#define TUNIDLE_SOCKS5  3
+#define TUNIDLE_MAX     4
+extern unsigned int tunnel_idle_timeout[TUNIDLE_MAX];
+extern unsigned int tunnel_conn_rate;
+
 
 netsock_t *netsock_alloc(netsock_t *, int, netaddr_t *, unsigned int);
 netsock_t *netsock_bind(netsock_t *, const char*,unsigned short,unsigned int);
 netsock_t *netsock_accept(netsock_t *);
+int  netsock_set_options(netsock_t *, const tunopts_t *);
+void netsock_inherit(netsock_t *, netsock_t *);
 netsock_t *netsock_connect(const char *, unsigned short);
+void netsock_resolve_event(void);
 int netsock_read(netsock_t *, iobuf_t *, unsigned int, unsigned int *);
 int  netsock_write(netsock_t *, const void *, unsigned int);
+int  netsock_want_read(netsock_t *);
 int  netsock_want_write(netsock_t *);
+iobuf_t *netsock_obuf(netsock_t *);
 void netsock_cancel(netsock_t *);
 void netsock_close(netsock_t *);
 
@@ -128,11 +255,31 @@ int  channel_read_event(void);
 int  channel_want_write(void);
 void channel_write_event(void);
 int  channel_ping(void);
-void channel_pong(void);
-unsigned char channel_request_tunnel(unsigned char, const char *, unsigned short, int);
+void channel_pong(const r2tmsg_ping_t *, unsigned int);
+unsigned int channel_ping_interval(void);
+unsigned int channel_timeout(void);
+unsigned int channel_rtt(unsigned int *, unsigned int *);
+int  channel_paced(void);
+unsigned int channel_stats(netstats_t *, unsigned long long *);
+unsigned char channel_request_tunnel(unsigned char, const char *, unsigned short, int, int);
 int channel_forward_recv(netsock_t *);
-int channel_forward_iobuf(iobuf_t *, unsigned char);
+int channel_forward_iobuf(iobuf_t *, netsock_t *);
+int channel_request_resume(unsigned char, unsigned int);
+int channel_replay(netsock_t *, unsigned int);
 void channel_close_tunnel(unsigned char);
+void channel_shutdown_tunnel(unsigned char);
+int  channel_request_resolve(unsigned char, const char *);
+int  channel_request_pool(const char *, unsigned short, unsigned char);
+void channel_negotiate(void);
+void channel_compress_stop(void);
+int  channel_compress_answer(const r2tmsg_compneg_t *, unsigned int);
+int  channel_recv_stream(const r2tmsg_compress_t *, unsigned int);
+const void *channel_decompress(const r2tmsg_compress_t *, unsigned int,
+											unsigned int *);
+int  channel_offload_decompress(const r2tmsg_compress_t *, unsigned int);
+void channel_jobs_event(void);
+int  channel_dedup_answer(const r2tmsg_dedupneg_t *, unsigned int);
+const void *channel_dedup_decode(const r2tmsg_t *, unsigned int, unsigned int *);
 
 // controller.c
 int  controller_start(const char *, unsigned short);
@@ -141,9 +288,12 @@ int  controller_read_event(netsock_t *);
 int  controller_answer(netsock_t *, const char *, ...);
 
 // tunnel.c
-int tunnel_add(netsock_t *, char *, unsigned short, int, char *, unsigned short);
-int tunnel_add_reverse(netsock_t *, char *, unsigned short, int, char *, unsigned short);
+int tunnel_add(netsock_t *, char *, unsigned short, int, char *, unsigned short,
+					const tunopts_t *);
+int tunnel_add_reverse(netsock_t *, char *, unsigned short, int, char *,
+					unsigned short, const tunopts_t *);
 int tunnel_del(netsock_t *, char *, unsigned short);
+int tunnel_pool(netsock_t *, char *, unsigned short, unsigned int);
 void tunnel_accept_event(netsock_t *);
 void tunnel_connect_event(netsock_t *, int, const void *, unsigned short);
 void tunnel_revconnect_event(netsock_t *, unsigned char, int,
@@ -152,17 +302,69 @@ void tunnel_bind_event(netsock_t *, int, const void *, unsigned short);
 int  tunnel_write_event(netsock_t *);
 int  tunnel_write(netsock_t *, const void *, unsigned int);
 void tunnel_close(netsock_t *, int);
+void tunnel_shutdown(netsock_t *);
+int  tunnel_remote_shutdown(netsock_t *);
+void tunnel_remote_close(netsock_t *);
 unsigned char tunnel_generate_id(void);
 netsock_t *tunnel_lookup(unsigned char);
 void tunnels_kill_clients(void);
 void tunnels_restart(void);
+void tunnels_init(void);
+void tunnels_suspend(void);
+void tunnels_resume(void);
+void tunnel_set_timeout(netsock_t *, unsigned int);
+int  tunnel_resumed(netsock_t *, unsigned int);
+
+// rdns.c
+void rdns_init(void);
+void rdns_reset(void);
+int  rdns_lookup(const char *, unsigned char *, char *);
+int  rdns_answer(const r2tmsg_resolveans_t *, unsigned int);
 
 // socks5.c
-int socks5_bind(netsock_t *, const char *, unsigned short);
+void socks5_init(void);
+int socks5_bind(netsock_t *, const char *, unsigned short, const tunopts_t *);
 void socks5_connect_event(netsock_t *, int, const void *, unsigned short);
 void socks5_accept_event(netsock_t *);
+void socks5_timeout(netsock_t *);
 int  socks5_read_event(netsock_t *);
 
+// histogram.c
+#define HIST_CONNECT 0 /**< tunnel request to server answer */
+#define HIST_SOCKS5  1 /**< SOCKS5 accept to success answer */
+#define HIST_QUEUE   2 /**< frame wait in the channel output buffer */
+#define HIST_RTT     3 /**< ping probe round trip */
+#define HIST_MAX     4
+
+void hist_record(unsigned int, unsigned long long);
+void hist_reset(void);
+unsigned long long hist_percentile(unsigned int, unsigned int);
+int  hist_dump(netsock_t *);
+
+// metrics.c
+int  metrics_init(void);
+void metrics_accept_event(netsock_t *);
+int  metrics_read_event(netsock_t *);
+void metrics_connect_failure(unsigned char);
+
+// flightrec.c
+#define FREC_FRAME_IN   1 /**< frame parsed (cmd, tid, length) */
+#define FREC_FRAME_OUT  2 /**< frame queued (cmd, tid, length) */
+#define FREC_CHAN_READ  3 /**< channel pipe read (length) */
+#define FREC_CHAN_WRITE 4 /**< channel pipe write (bytes written) */
+#define FREC_CHAN_STATE 5 /**< channel up or down (state) */
+#define FREC_ACCEPT     6 /**< connection accepted (listener type, fd) */
+#define FREC_CLOSE      7 /**< socket closed (type, tid, fd) */
+#define FREC_THROTTLE   8 /**< rate exceeded (0 tunnel/1 channel, tid, us) */
+#define FREC_WAKE       9 /**< select returned (ready fds, slept us) */
+#define FREC_LOOP      10 /**< events handled (duration us) */
+#define FREC_QUEUE     11 /**< output backlog (0xff or socket type, tid, bytes) */
+
+void frec_init(void);
+void frec_record(unsigned char, unsigned char, unsigned char, unsigned int);
+int  frec_dump(void);
+int  frec_controller_dump(netsock_t *);
+
 // main.c
 void bye(void);
 
@@ -0,0 +1,160 @@
+/**
+ * @file ratelimit.c
+ * token buckets limiting the rate tunnels are read at
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <stdlib.h>
+
+/** bucket depth expressed in time at the configured rate (ms) */
+#define RATELIMIT_BURST_MS  100
+/** minimal bucket depth (bytes) */
+#define RATELIMIT_BURST_MIN (16*1024)
+
+/**
+ * initialize a token bucket
+ * @param[in] rl token bucket
+ * @param[in] rate bytes per second, 0 if unlimited
+ */
+void ratelimit_init(ratelimit_t *rl, unsigned int rate)
+{
+	assert(rl);
+
+	rl->rate  = rate;
+	rl->burst = (unsigned int)((unsigned long long)rate
+											* RATELIMIT_BURST_MS / 1000);
+	if (rl->burst < RATELIMIT_BURST_MIN)
+		rl->burst = RATELIMIT_BURST_MIN;
+	rl->tokens = rl->burst;
+	rl->ts     = timer_clock();
+	rl->refs   = 1;
+}
+
+/**
+ * allocate a token bucket shared by several sockets
+ * @param[in] rate bytes per second
+ * @return allocated bucket holding one reference or NULL
+ */
+ratelimit_t *ratelimit_new(unsigned int rate)
+{
+	ratelimit_t *rl;
+
+	rl = malloc(sizeof(*rl));
+	if (rl)
+		ratelimit_init(rl, rate);
+	else
+		error("failed to allocate rate limiter");
+
+	return rl;
+}
+
+/**
+ * take a reference on a shared token bucket
+ * @param[in] rl token bucket (may be NULL)
+ * @return the token bucket
+ */
+ratelimit_t *ratelimit_get(ratelimit_t *rl)
+{
+	if (rl)
+		++rl->refs;
+	return rl;
+}
+
+/**
+ * release a reference on a shared token bucket
+ * @param[in] rl token bucket (may be NULL)
+ */
+void ratelimit_put(ratelimit_t *rl)
+{
+	if (rl && !--rl->refs)
+		free(rl);
+}
+
+/**
+ * consume tokens of a bucket
+ * @param[in] rl token bucket
+ * @param[in] len bytes transferred
+ * @param[in] now current time (us)
+ * @return microseconds to wait before the bucket holds tokens again,
+ *         0 if the transfer may go on
+ * @note bytes already read are always accounted, the bucket goes into debt
+ *       instead of splitting reads
+ */
+unsigned long long ratelimit_take(ratelimit_t *rl, unsigned int len,
+											unsigned long long now)
+{
+	long long fill;
+
+	assert(rl);
+
+	if (!rl->rate)
+		return 0;
+
+	if (now > rl->ts) {
+		fill = (long long)((now - rl->ts) * rl->rate / 1000000);
+		if (fill > 0) {
+			rl->tokens += fill;
+			if (rl->tokens > (long long)rl->burst)
+				rl->tokens = rl->burst;
+			// keep the remainder of the elapsed time for the next refill
+			rl->ts += (unsigned long long)fill * 1000000 / rl->rate;
+		}
+	}
+
+	rl->tokens -= len;
+	if (rl->tokens > 0)
+		return 0;
+
+	return (unsigned long long)(1 - rl->tokens) * 1000000 / rl->rate + 1;
+}
+
+/**
+ * parse a rate
+ * @param[in] str decimal number of bytes per second with an optional K, M
+ *            or G suffix (powers of 1024)
+ * @param[out] rate bytes per second
+ * @return 0 on success
+ */
+int ratelimit_parse(const char *str, unsigned int *rate)
+{
+	unsigned long long val;
+	char *end;
+
+	assert(str && rate);
+
+	val = strtoull(str, &end, 10);
+	if (end == str)
+		return -1;
+
+	switch (*end) {
+		case 'g': case 'G': val <<= 10; // fall through
+		case 'm': case 'M': val <<= 10; // fall through
+		case 'k': case 'K': val <<= 10;
+			++end;
+			break;
+	}
+
+	if (*end || (val > 0xffffffffULL))
+		return -1;
+
+	*rate = (unsigned int) val;
+	return 0;
+}
@@ -0,0 +1,262 @@
+/**
+ * @file rdns.c
+ * rdp2tcp remote hostname resolution cache
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** number of cached hostnames */
+#define RDNS_CACHE_SIZE   64
+/** default lifetime of a resolved hostname (seconds) */
+#define RDNS_DEFAULT_TTL  60
+/** lifetime of a "host not found" answer (seconds) */
+#define RDNS_NEGATIVE_TTL 10
+
+/** hostname resolved by the rdp2tcp server */
+typedef struct _rdns_entry {
+	char host[MAX_HOSTNAME_LEN+1]; /**< hostname, empty if slot is free */
+	time_t expire;                 /**< expiration date, 0 if no answer yet */
+	time_t used;                   /**< last lookup date */
+	unsigned char pending;         /**< 1 if a R2TCMD_RESOLVE is in flight */
+	unsigned char err;             /**< R2TERR_xxx of the answer */
+	unsigned char naddrs;          /**< number of addresses */
+	unsigned char af[R2TRESOLVE_MAX_ADDRS];       /**< TUNAF_xxx */
+	unsigned char addrs[R2TRESOLVE_MAX_ADDRS][16]; /**< raw addresses */
+} rdns_entry_t;
+
+static rdns_entry_t rdns_cache[RDNS_CACHE_SIZE];
+static unsigned int rdns_ttl = RDNS_DEFAULT_TTL;
+
+/**
+ * initialize remote resolution cache
+ * @note R2T_REMOTE_DNS environment variable sets the cache TTL in seconds
+ *       (0 disables the cache)
+ */
+void rdns_init(void)
+{
+	const char *env;
+
+	env = getenv("R2T_REMOTE_DNS");
+	if (env)
+		rdns_ttl = (unsigned int) atoi(env);
+
+	trace_chan("ttl=%u", rdns_ttl);
+}
+
+/**
+ * forget all cached hostnames and in-flight requests
+ * @note called when the virtual channel is disconnected
+ */
+void rdns_reset(void)
+{
+	trace_chan("");
+	memset(rdns_cache, 0, sizeof(rdns_cache));
+}
+
+static rdns_entry_t *rdns_find(const char *host)
+{
+	unsigned int i;
+
+	for (i=0; i<RDNS_CACHE_SIZE; ++i) {
+		if (rdns_cache[i].host[0] && !strcasecmp(rdns_cache[i].host, host))
+			return &rdns_cache[i];
+	}
+
+	return NULL;
+}
+
+static rdns_entry_t *rdns_alloc(const char *host)
+{
+	unsigned int i;
+	rdns_entry_t *e, *old;
+
+	// free slot or least recently used one without request in flight
+	old = NULL;
+	for (i=0; i<RDNS_CACHE_SIZE; ++i) {
+		e = &rdns_cache[i];
+		if (!e->host[0])
+			break;
+		if (!e->pending && (!old || (e->used < old->used)))
+			old = e;
+	}
+
+	if (i == RDNS_CACHE_SIZE) {
+		if (!old)
+			return NULL;
+		e = old;
+	}
+
+	memset(e, 0, sizeof(*e));
+	strcpy(e->host, host);
+	return e;
+}
+
+static void rdns_request(rdns_entry_t *e)
+{
+	if (!channel_request_resolve(TUNAF_ANY, e->host))
+		e->pending = 1;
+}
+
+/**
+ * lookup a hostname in remote resolution cache
+ * @param[in] host hostname to resolve
+ * @param[out] tunaf address family of ip (TUNAF_IPV4 or TUNAF_IPV6)
+ * @param[out] ip IP address string (INET6_ADDRSTRLEN bytes at least)
+ * @return 1 if host has been resolved to a single address, 0 if unknown
+ *         or resolved to several addresses, -1 if host does not exist
+ * @note a R2TCMD_RESOLVE request is sent when the host is unknown or when
+ *       its entry is about to expire, the answer fills the cache for the
+ *       next lookups
+ */
+int rdns_lookup(const char *host, unsigned char *tunaf, char *ip)
+{
+	rdns_entry_t *e;
+	time_t now;
+
+	assert(host && *host && tunaf && ip);
+
+	if (!rdns_ttl || (strlen(host) > MAX_HOSTNAME_LEN))
+		return 0;
+
+	time(&now);
+	e = rdns_find(host);
+	if (!e) {
+		e = rdns_alloc(host);
+		if (e)
+			rdns_request(e);
+		trace_chan("%s miss", host);
+		return 0;
+	}
+
+	e->used = now;
+
+	if (!e->expire || (now >= e->expire)) {
+		e->expire = 0;
+		if (!e->pending)
+			rdns_request(e);
+		trace_chan("%s %s", host, (e->pending ? "pending" : "expired"));
+		return 0;
+	}
+
+	if (e->err) {
+		trace_chan("%s not found", host);
+		return -1;
+	}
+
+	// refresh hot entries before they expire
+	if (!e->pending && ((unsigned int)(e->expire - now) < rdns_ttl / 4))
+		rdns_request(e);
+
+	// the server races all addresses of a hostname when connecting to it
+	if (e->naddrs > 1) {
+		trace_chan("%s hit (%u addrs)", host, e->naddrs);
+		return 0;
+	}
+
+	*tunaf = e->af[0];
+	if (!inet_ntop((e->af[0] == TUNAF_IPV4 ? AF_INET : AF_INET6),
+				e->addrs[0], ip, INET6_ADDRSTRLEN))
+		return 0;
+
+	trace_chan("%s hit %s", host, ip);
+	return 1;
+}
+
+/**
+ * handle R2TCMD_RESOLVE answer
+ * @param[in] msg rdp2tcp message
+ * @param[in] len message length
+ * @return 0 on success
+ */
+int rdns_answer(const r2tmsg_resolveans_t *msg, unsigned int len)
+{
+	unsigned int i, off, size, alen;
+	unsigned char af[R2TRESOLVE_MAX_ADDRS];
+	const char *host;
+	rdns_entry_t *e;
+
+	assert(msg && (len >= 3));
+
+	size = len - sizeof(*msg);
+	if ((len < sizeof(*msg)+2) || (msg->count > R2TRESOLVE_MAX_ADDRS)
+			|| ((const char *)msg)[len-1])
+		return error("invalid resolve answer");
+
+	for (i=0, off=0; i<msg->count; ++i) {
+		if (off >= size)
+			return error("truncated resolve answer");
+		af[i] = msg->data[off];
+		if (af[i] == TUNAF_IPV4)
+			alen = 4;
+		else if (af[i] == TUNAF_IPV6)
+			alen = 16;
+		else
+			return error("invalid resolve answer address family 0x%02x", af[i]);
+		off += 1 + alen;
+	}
+
+	if (off >= size)
+		return error("truncated resolve answer");
+
+	host = (const char *)msg->data + off;
+	trace_chan("host=%s, err=0x%02x, count=%u", host, msg->err, msg->count);
+
+	e = rdns_find(host);
+	if (!e || !e->pending) {
+		trace_chan("unexpected resolve answer for %s", host);
+		return 0;
+	}
+
+	e->pending = 0;
+
+	if (msg->err == R2TERR_RESOLVE) {
+		// transient failure, next lookup asks again
+		e->expire = 0;
+		return 0;
+	}
+
+	if (msg->err || !msg->count) {
+		e->err    = R2TERR_NOTFOUND;
+		e->naddrs = 0;
+		time(&e->expire);
+		e->expire += (rdns_ttl < RDNS_NEGATIVE_TTL ? rdns_ttl : RDNS_NEGATIVE_TTL);
+		return 0;
+	}
+
+	e->err    = R2TERR_SUCCESS;
+	e->naddrs = msg->count;
+	for (i=0, off=0; i<msg->count; ++i) {
+		alen = (af[i] == TUNAF_IPV4 ? 4 : 16);
+		e->af[i] = af[i];
+		memcpy(e->addrs[i], msg->data + off + 1, alen);
+		off += 1 + alen;
+	}
+	time(&e->expire);
+	e->expire += rdns_ttl;
+
+	return 0;
+}
@@ -34,6 +34,23 @@
 extern int debug_level;
 #endif
 
+/** 1 to answer CONNECT requests before the tunnel is connected */
+static int socks5_fast = 0;
+
+/**
+ * initialize SOCKS5 proxies settings
+ * @note R2T_SOCKS_FAST=1 answers requests without waiting for the tunnel
+ */
+void socks5_init(void)
+{
+	const char *env;
+
+	env = getenv("R2T_SOCKS_FAST");
+	socks5_fast = (env && (atoi(env) > 0));
+
+	trace_socks("fast=%i", socks5_fast);
+}
+
 static int socks_error(netsock_t *cli, unsigned char ret)
 {
 	unsigned char out[2];
@@ -45,6 +62,39 @@ static int socks_error(netsock_t *cli, unsigned char ret)
 	return -1;
 }
 
+/**
+ * answer success before the tunnel is connected
+ * @param[in] cli client socket
+ * @return 0 on success
+ * @note the client first payload is forwarded right behind R2TCMD_CONN,
+ *       a connection failure then shows up as a closed connection
+ */
+static int socks5_fast_reply(netsock_t *cli)
+{
+	static const unsigned char ans[10] = { SOCKS5_VERSION, SOCKS5_SUCCESS, 0,
+											SOCKS5_ATYPE_IPV4, 0, 0, 0, 0, 0, 0 };
+
+	trace_socks("id=0x%02x", cli->tid);
+
+	cli->state = NETSTATE_CONNECTED;
+	cli->u.sockscli.pending = 1;
+	cli->u.sockscli.early = 0;
+	cli->st.up_ts = timer_clock();
+	hist_record(HIST_SOCKS5, cli->st.up_ts - cli->st.start_ts);
+
+	if (netsock_write(cli, ans, sizeof(ans)) < 0)
+		return -1;
+
+	// payload pipelined behind the request
+	if (iobuf_datalen(&cli->u.sockscli.ibuf) > 0) {
+		cli->u.sockscli.early = iobuf_datalen(&cli->u.sockscli.ibuf);
+		if (channel_forward_iobuf(&cli->u.sockscli.ibuf, cli) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 /**
  * handle SOCKS5 server network accept-event
  * @param[in] cli client socket
@@ -65,6 +115,16 @@ void socks5_connect_event(
 			&& addr && ((af == AF_INET) || (af == AF_INET6)));
 	trace_socks("");
 
+	if (cli->u.sockscli.pending) {
+		// success was already answered
+		cli->u.sockscli.pending = 0;
+		hist_record(HIST_CONNECT, timer_clock() - cli->st.req_ts);
+		R2T_PROBE2(tunnel__up, cli->tid, timer_clock() - cli->st.req_ts);
+		info(0, "SOCKS5 tunnel 0x%02x connected", cli->tid);
+		tunnel_set_timeout(cli, cli->idle_timeout);
+		return;
+	}
+
 	if (cli->state != NETSTATE_CONNECTING) {
 		// server went wrong ...
 		error("invalid SOCKS5 protocol state");
@@ -88,12 +148,16 @@ void socks5_connect_event(
 	ans[5+addr_len] = (unsigned char) (port & 0xff);
 
 	cli->state = NETSTATE_CONNECTED;
+	cli->st.up_ts = timer_clock();
+	hist_record(HIST_CONNECT, cli->st.up_ts - cli->st.req_ts);
+	R2T_PROBE2(tunnel__up, cli->tid, cli->st.up_ts - cli->st.req_ts);
+	hist_record(HIST_SOCKS5, cli->st.up_ts - cli->st.start_ts);
+	tunnel_set_timeout(cli, cli->idle_timeout);
 
 	if (netsock_write(cli, ans, addr_len+6) >= 0) {
 
 		if (iobuf_datalen(&cli->u.sockscli.ibuf) > 0) {
-			if (channel_forward_iobuf(&cli->u.sockscli.ibuf,
-												cli->tid) < 0) {
+			if (channel_forward_iobuf(&cli->u.sockscli.ibuf, cli) < 0) {
 				tunnel_close(cli, 1);
 			}
 		}
@@ -103,63 +167,62 @@ void socks5_connect_event(
 	}
 }
 
-static int socks5_setup(netsock_t *cli)
+/**
+ * handle SOCKS5 authentication greeting
+ * @param[in] cli client socket
+ * @return 0 on success, 1 if more data is needed, -1 on error
+ */
+static int socks5_auth(netsock_t *cli)
 {
-	unsigned int len, methods_count, port_off;
-	unsigned short port;
-	unsigned char tunaf, tid, *buf, out[2];
+	unsigned int len, methods_count;
+	unsigned char *buf, out[2];
 	iobuf_t *ibuf;
-	char *host, ip[INET6_ADDRSTRLEN+1];
 
 	ibuf = &cli->u.sockscli.ibuf;
-
-	if (netsock_read(cli, ibuf, 0, NULL) < 0)
-		return -1;
-
-#ifdef DEBUG
-	if (debug_level > 2) iobuf_dump(ibuf);
-#endif
-
 	len = iobuf_datalen(ibuf);
-	if (!len) // need more data
-		return 1;
-
 	buf = iobuf_dataptr(ibuf);
-	// Validate SOCKS5 version
-	if (buf[0] != SOCKS5_VERSION) {
-		error("SOCKS5 protocol version not supported (0x%02x)", buf[0]);
-		tunnel_close(cli, 1);
-		return -1;
-	}
 
-	if (cli->state == NETSTATE_AUTHENTICATING) {
+	if (len < 2) 
+		return 1;
 
-		if (len < 2) 
-			return 1;
+	methods_count = (unsigned int) buf[1];
+	if (!methods_count)
+		return error("no SOCKS authentication method proposed");
 
-		methods_count = (unsigned int) buf[1];
-		if (!methods_count)
-			return error("no SOCKS authentication method proposed");
+	if (methods_count + 2 > len) // need more data
+		return 1;
 
-		if (methods_count + 2 > len) // need more data
-			return 1;
+	if (!memchr(buf+2, SOCKS5_NOAUTH, methods_count)) {
+		// no valid auth
+		return error("SOCKS5 authentication not supported");
+	}
 
-		if (!memchr(buf+2, SOCKS5_NOAUTH, methods_count)) {
-			// no valid auth
-			return error("SOCKS5 authentication not supported");
-		}
+	iobuf_consume(ibuf, methods_count+2);
+	out[0] = 5;
+	out[1] = SOCKS5_NOAUTH;
+	netsock_write(cli, &out, 2);
+	cli->state = NETSTATE_AUTHENTICATED;
+	debug(0, "SOCKS5 client authenticated");
+	return 0;
+}
 
-		iobuf_consume(ibuf, methods_count+2);
-		out[0] = 5;
-		out[1] = SOCKS5_NOAUTH;
-		netsock_write(cli, &out, 2);
-		cli->state = NETSTATE_AUTHENTICATED;
-		debug(0, "SOCKS5 client authenticated");
-		return 0;
-	}
+/**
+ * handle SOCKS5 connect request
+ * @param[in] cli client socket
+ * @return 0 on success, 1 if more data is needed, -1 on error
+ */
+static int socks5_request(netsock_t *cli)
+{
+	unsigned int len, port_off;
+	unsigned short port;
+	int ret;
+	unsigned char tunaf, tid, *buf;
+	iobuf_t *ibuf;
+	char *host, ip[INET6_ADDRSTRLEN+1];
 
-	if (cli->state != NETSTATE_AUTHENTICATED)
-		return error("invalid SOCKS5 protocol state 0x%02x", cli->state);
+	ibuf = &cli->u.sockscli.ibuf;
+	len = iobuf_datalen(ibuf);
+	buf = iobuf_dataptr(ibuf);
 
 	// +----+-----+-------+------+----------+----------+
 	// |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
@@ -195,18 +258,11 @@ static int socks5_setup(netsock_t *cli)
 		case SOCKS5_ATYPE_FQDN:
 			if (len < 7+(unsigned int)buf[4])
 				return 1;
-			
-			tunaf = TUNAF_ANY;
-			len = (unsigned int) buf[4];
-			host = malloc(len+1);
-			if (!host)
-				return error("failed to allocate SOCKS5 hostname");
-			memcpy(host, buf+5, len);
-			host[len] = 0;
-			if (host && !*host) {
-				if (host) free(host);
+			if (!buf[4])
 				return error("empty SOCKS5 domain");
-			}
+			tunaf = TUNAF_ANY;
+			// hostname is terminated in place, over the port once it is read
+			host = (char *)buf+5;
 			port_off = 5 + (unsigned int) buf[4];
 			break;
 
@@ -223,16 +279,22 @@ static int socks5_setup(netsock_t *cli)
 			return socks_error(cli, SOCKS5_UNKADDRTYPE);
 	}
 
-	port = ntohs((((unsigned short)buf[port_off+1]) << 8) | buf[port_off]);
-	if (!port) {
-		if (host && (host != ip))
-			free(host);
+	port = (((unsigned short)buf[port_off]) << 8) | buf[port_off+1];
+	if (!port)
 		return error("invalid SOCKS5 port");
-	}
-	iobuf_consume(ibuf, port_off+2);
+	buf[port_off] = 0;
 
 	info(0, "SOCKS5 forward request to %s:%hu", host, port);
 
+	if (tunaf == TUNAF_ANY) {
+		// hostnames already resolved by the server are sent as addresses
+		ret = rdns_lookup(host, &tunaf, ip);
+		if (ret < 0)
+			return socks_error(cli, SOCKS5_PORTUNREACH);
+		if (ret > 0)
+			host = ip;
+	}
+
 	// Check if channel is connected before requesting tunnel
 	// Be more lenient - try to establish tunnel even if channel appears disconnected
 	if (!channel_is_connected()) {
@@ -240,9 +302,8 @@ static int socks5_setup(netsock_t *cli)
 		// Don't fail immediately, try to establish the tunnel
 	}
 	
-	tid = channel_request_tunnel(tunaf, host, port, 0);
-	if (host && (host != ip))
-		free(host);
+	tid = channel_request_tunnel(tunaf, host, port, 0, cli->profile);
+	iobuf_consume(ibuf, port_off+2);
 
 	if (tid == 0xff) {
 		error("Failed to request tunnel through RDP2TCP channel");
@@ -251,10 +312,53 @@ static int socks5_setup(netsock_t *cli)
 
 	cli->tid   = tid;
 	cli->state = NETSTATE_CONNECTING;
+	cli->st.req_ts = timer_clock();
+
+	if (socks5_fast)
+		return socks5_fast_reply(cli);
 
 	return 0;
 }
 
+static int socks5_setup(netsock_t *cli)
+{
+	int ret;
+	iobuf_t *ibuf;
+
+	ibuf = &cli->u.sockscli.ibuf;
+
+	if (netsock_read(cli, ibuf, 0, NULL) < 0)
+		return -1;
+
+#ifdef DEBUG
+	if (debug_level > 2) iobuf_dump(ibuf);
+#endif
+
+	// greeting and request are usually received in a single read
+	do {
+		if (!iobuf_datalen(ibuf)) // need more data
+			return 1;
+
+		// Validate SOCKS5 version
+		if (*(unsigned char *)iobuf_dataptr(ibuf) != SOCKS5_VERSION) {
+			error("SOCKS5 protocol version not supported (0x%02x)",
+					*(unsigned char *)iobuf_dataptr(ibuf));
+			tunnel_close(cli, 1);
+			return -1;
+		}
+
+		if (cli->state == NETSTATE_AUTHENTICATING)
+			ret = socks5_auth(cli);
+		else if (cli->state == NETSTATE_AUTHENTICATED)
+			ret = socks5_request(cli);
+		else
+			return error("invalid SOCKS5 protocol state 0x%02x", cli->state);
+
+	} while (!ret && (cli->state == NETSTATE_AUTHENTICATED));
+
+	return ret;
+}
+
 /**
  * handle SOCKS5 client network read-event
  * @param[in] cli client socket
@@ -271,6 +375,19 @@ int socks5_read_event(netsock_t *cli)
 	return channel_forward_recv(cli);
 }
 
+/**
+ * answer a SOCKS5 request whose tunnel did not connect in time
+ * @param[in] cli client socket
+ */
+void socks5_timeout(netsock_t *cli)
+{
+	assert(valid_netsock(cli) && (cli->type == NETSOCK_S5CLI));
+	trace_socks("id=0x%02x, state=%u", cli->tid, cli->state);
+
+	if (cli->state == NETSTATE_CONNECTING)
+		socks_error(cli, SOCKS5_TTLEXPIRED);
+}
+
 /**
  * handle SOCKS5 server network accept-event
  * @param[in] srv server socket
@@ -278,14 +395,19 @@ int socks5_read_event(netsock_t *cli)
  */
 void socks5_accept_event(netsock_t *srv)
 {
+	unsigned int i;
 	netsock_t *cli;
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(srv) && (srv->type == NETSOCK_S5SRV));
 	trace_socks("");
 
-	cli = netsock_accept(srv);
-	if (cli) {
+	// browsers open many connections at once, take them all
+	for (i=0; i<NET_ACCEPT_BURST; ++i) {
+		cli = netsock_accept(srv);
+		if (!cli)
+			break;
+
 		info(0, "accepted socks5 client %s", netaddr_print(&cli->addr, host));
 		
 		// Initialize SOCKS5 client regardless of channel state
@@ -294,11 +416,13 @@ void socks5_accept_event(netsock_t *srv)
 		cli->tid   = 0xff;
 		cli->state = NETSTATE_AUTHENTICATING;
 		iobuf_init2(&cli->u.sockscli.ibuf, &cli->u.sockscli.obuf, "socks5");
-		
-		// Log channel status for debugging
-		if (!channel_is_connected()) {
-			warn("SOCKS5 client accepted but RDP2TCP channel appears disconnected");
-		}
+		// handshake and connection must complete in time
+		tunnel_set_timeout(cli, tunnel_connect_timeout);
+	}
+
+	// Log channel status for debugging
+	if (i && !channel_is_connected()) {
+		warn("SOCKS5 client accepted but RDP2TCP channel appears disconnected");
 	}
 }
 
@@ -307,8 +431,13 @@ void socks5_accept_event(netsock_t *srv)
  * @param[in] cli socket of client who requested server start
  * @param[in] host local server hostname or IP address
  * @param[in] port local TCP port
+ * @param[in] opts listener options
  */
-int socks5_bind(netsock_t *cli, const char *host, unsigned short port)
+int socks5_bind(
+			netsock_t *cli,
+			const char *host,
+			unsigned short port,
+			const tunopts_t *opts)
 {
 	netsock_t *srv;
 
@@ -320,6 +449,10 @@ int socks5_bind(netsock_t *cli, const char *host, unsigned short port)
 	if (!srv)
 		return 0; // soft-error
 	srv->type = NETSOCK_S5SRV;
+	if (netsock_set_options(srv, opts)) {
+		netsock_close(srv);
+		return controller_answer(cli, "error: failed to set proxy options");
+	}
 
 	return controller_answer(cli, "SOCKS5 server listening on %s:%hu", host, port);
 }
@@ -0,0 +1,260 @@
+/**
+ * @file timer.c
+ * hierarchical timer wheel driving the client event loop
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <time.h>
+
+/** bits of tick covered by each wheel level */
+#define WHEEL_BITS   6
+/** number of slots of each wheel level */
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+/** number of wheel levels (2^24 ms, about 4.6 hours) */
+#define WHEEL_LEVELS 4
+/** timer resolution (microseconds) */
+#define TIMER_TICK   1000
+
+/** timer wheel singleton */
+typedef struct _timer_wheel {
+	unsigned long long now; /**< last processed tick */
+	unsigned int count[WHEEL_LEVELS]; /**< pending timers of each level */
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE]; /**< pending timers */
+} timer_wheel_t;
+
+static timer_wheel_t wheel;
+
+/**
+ * get a monotonic clock in microseconds
+ */
+unsigned long long timer_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * initialize the timer wheel
+ */
+void timers_init(void)
+{
+	unsigned int i, j;
+
+	for (i=0; i<WHEEL_LEVELS; ++i) {
+		wheel.count[i] = 0;
+		for (j=0; j<WHEEL_SIZE; ++j)
+			list_init(&wheel.slots[i][j]);
+	}
+
+	wheel.now = timer_clock() / TIMER_TICK;
+}
+
+/**
+ * link a timer in the wheel slot matching its expiration tick
+ * @param[in] t timer
+ * @param[in] base first tick that is not processed yet
+ */
+static void wheel_insert(evtimer_t *t, unsigned long long base)
+{
+	unsigned long long delta;
+	unsigned int level, shift;
+
+	if (t->expire < base)
+		t->expire = base;
+
+	delta = t->expire - base;
+	for (level=0; level<WHEEL_LEVELS-1; ++level) {
+		if (delta < (1ULL << ((level + 1) * WHEEL_BITS)))
+			break;
+	}
+
+	shift = level * WHEEL_BITS;
+	if (delta >= (1ULL << ((level + 1) * WHEEL_BITS))) {
+		// beyond the wheel range, moved down at the last top level slot
+		delta = (1ULL << ((level + 1) * WHEEL_BITS)) - 1;
+		shift = ((unsigned int)((base + delta) >> shift)) & WHEEL_MASK;
+	} else {
+		shift = ((unsigned int)(t->expire >> shift)) & WHEEL_MASK;
+	}
+
+	t->level = level;
+	++wheel.count[level];
+	list_add_tail(&t->list, &wheel.slots[level][shift]);
+}
+
+/**
+ * start or restart a timer
+ * @param[in] t timer
+ * @param[in] delay delay before expiration in microseconds
+ * @param[in] cb callback run when the timer expires
+ * @param[in] ctx callback context
+ * @note the callback may arm or cancel any timer, itself included
+ */
+void timer_arm(evtimer_t *t, unsigned long long delay, timer_cb_t cb,
+																void *ctx)
+{
+	assert(t && cb);
+
+	timer_cancel(t);
+
+	t->cb  = cb;
+	t->ctx = ctx;
+	// never expire early, the wheel is driven by elapsed ticks
+	t->expire = (timer_clock() + delay + TIMER_TICK - 1) / TIMER_TICK;
+	t->armed  = 1;
+	wheel_insert(t, wheel.now + 1);
+}
+
+/**
+ * stop a timer
+ * @param[in] t timer (may be idle)
+ */
+void timer_cancel(evtimer_t *t)
+{
+	assert(t);
+
+	if (!t->armed)
+		return;
+
+	list_del(&t->list);
+	--wheel.count[t->level];
+	t->armed = 0;
+}
+
+/**
+ * move the timers of an upper level slot down the wheel
+ * @param[in] level wheel level
+ * @param[in] tick tick being processed
+ * @return slot index at this level
+ */
+static unsigned int wheel_cascade(unsigned int level, unsigned long long tick)
+{
+	unsigned int idx;
+	struct list_head *slot;
+	evtimer_t *t;
+
+	idx  = ((unsigned int)(tick >> (level * WHEEL_BITS))) & WHEEL_MASK;
+	slot = &wheel.slots[level][idx];
+
+	while (!list_empty(slot)) {
+		t = (evtimer_t *) slot->next;
+		list_del(&t->list);
+		--wheel.count[level];
+		wheel_insert(t, tick);
+	}
+
+	return idx;
+}
+
+/**
+ * run the callbacks of expired timers
+ */
+void timers_run(void)
+{
+	unsigned long long now, tick, mask;
+	unsigned int i, level;
+	struct list_head *slot, expired;
+	evtimer_t *t;
+
+	now = timer_clock() / TIMER_TICK;
+
+	while (wheel.now < now) {
+
+		// skip ticks without any work until the next cascade
+		for (level=0; (level<WHEEL_LEVELS) && !wheel.count[level]; ++level) ;
+		if (level == WHEEL_LEVELS) {
+			wheel.now = now;
+			break;
+		}
+		if (level > 0) {
+			mask = (1ULL << (level * WHEEL_BITS)) - 1;
+			if ((wheel.now | mask) >= now) {
+				wheel.now = now;
+				break;
+			}
+			wheel.now |= mask;
+		}
+
+		tick = ++wheel.now;
+		i = ((unsigned int) tick) & WHEEL_MASK;
+		for (level=1; !i && (level<WHEEL_LEVELS); ++level)
+			i = wheel_cascade(level, tick);
+
+		// timers armed by callbacks may land in this slot again
+		slot = &wheel.slots[0][((unsigned int) tick) & WHEEL_MASK];
+		list_init(&expired);
+		while (!list_empty(slot)) {
+			t = (evtimer_t *) slot->next;
+			list_del(&t->list);
+			list_add_tail(&t->list, &expired);
+		}
+
+		while (!list_empty(&expired)) {
+			t = (evtimer_t *) expired.next;
+			timer_cancel(t);
+			trace_evt("timer=%p, tick=%llu", t, tick);
+			t->cb(t->ctx);
+		}
+	}
+}
+
+/**
+ * get the delay until the next timer expiration
+ * @return delay in microseconds or -1 if no timer is pending
+ */
+long long timers_next(void)
+{
+	unsigned long long base, first, now;
+	unsigned int level, i, idx;
+	struct list_head *slot;
+	evtimer_t *t;
+
+	first = 0;
+	for (level=0; level<WHEEL_LEVELS; ++level) {
+
+		if (!wheel.count[level])
+			continue;
+
+		// slots are ordered in time from the one following the cursor
+		base = wheel.now >> (level * WHEEL_BITS);
+		for (i=1; i<=WHEEL_SIZE; ++i) {
+			idx  = ((unsigned int)(base + i)) & WHEEL_MASK;
+			slot = &wheel.slots[level][idx];
+			if (list_empty(slot))
+				continue;
+			list_for_each(t, slot) {
+				if (!first || (t->expire < first))
+					first = t->expire;
+			}
+			break;
+		}
+	}
+
+	if (!first)
+		return -1;
+
+	now = timer_clock();
+	first *= TIMER_TICK;
+	return (first > now ? (long long)(first - now) : 0);
+}
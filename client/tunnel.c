@@ -22,10 +22,15 @@
  */
 #include "r2tcli.h"
 #include "nethelper.h"
+#include "workers.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
 
 extern struct list_head all_sockets;
 
@@ -51,6 +56,97 @@ netsock_t *tunnel_lookup(unsigned char tid)
 
 static unsigned char last_tid = 0xff;
 
+unsigned int tunnel_early_max = TUNNEL_EARLY_MAX;
+unsigned int tunnel_resume_size = REPLAY_DEFAULT_SIZE;
+unsigned int tunnel_connect_timeout = TUNNEL_CONNECT_TIMEOUT;
+unsigned int tunnel_idle_timeout[TUNIDLE_MAX];
+unsigned int tunnel_conn_rate = 0;
+
+/** end of the channel outage tunnels are kept through */
+static evtimer_t resume_timer;
+
+static void tunnels_expire(void *);
+
+/**
+ * parse R2T_IDLE_TIMEOUT environment variable
+ * @param[in] val comma-separated list of SECONDS (all tunnels) or
+ *            KIND=SECONDS with KIND among forward, process, reverse, socks5
+ */
+static void tunnels_parse_idle(const char *val)
+{
+	static const char *kinds[TUNIDLE_MAX] = {
+		"forward", "process", "reverse", "socks5"
+	};
+	unsigned int i, len, secs;
+	const char *eq;
+	char *end;
+
+	while (*val) {
+		eq = strchr(val, '=');
+		len = (unsigned int) strcspn(val, ",");
+		if (eq && (eq < val + len)) {
+			secs = (unsigned int) strtoul(eq+1, &end, 10);
+			for (i=0; i<TUNIDLE_MAX; ++i) {
+				if ((strlen(kinds[i]) == (size_t)(eq - val))
+						&& !strncmp(kinds[i], val, eq - val))
+					break;
+			}
+			if (i < TUNIDLE_MAX)
+				tunnel_idle_timeout[i] = secs;
+			else
+				warn("unknown tunnel kind in R2T_IDLE_TIMEOUT");
+		} else {
+			secs = (unsigned int) strtoul(val, &end, 10);
+			for (i=0; i<TUNIDLE_MAX; ++i)
+				tunnel_idle_timeout[i] = secs;
+		}
+		val += len;
+		if (*val == ',')
+			++val;
+	}
+}
+
+/**
+ * initialize tunnels settings
+ * @note R2T_EARLY environment variable sets how many bytes a tunnel client
+ *       may send before the remote connection is established (0 disables)
+ * @note R2T_RESUME environment variable sets the replay window of each
+ *       tunnel in KB (0 closes tunnels when the channel goes down)
+ * @note R2T_CONNECT_TIMEOUT environment variable sets how many seconds a
+ *       tunnel may take to connect (0 disables)
+ * @note R2T_IDLE_TIMEOUT environment variable sets how many seconds a
+ *       tunnel may stay without traffic (0 disables, default)
+ * @note R2T_CONN_RATE environment variable sets how many bytes per second
+ *       each tunnel is read at (0 is unlimited, default)
+ */
+void tunnels_init(void)
+{
+	const char *val;
+
+	val = getenv("R2T_EARLY");
+	if (val)
+		tunnel_early_max = (unsigned int)atoi(val);
+
+	val = getenv("R2T_RESUME");
+	if (val)
+		tunnel_resume_size = (unsigned int)atoi(val) * 1024;
+
+	val = getenv("R2T_CONNECT_TIMEOUT");
+	if (val)
+		tunnel_connect_timeout = (unsigned int)atoi(val);
+
+	val = getenv("R2T_IDLE_TIMEOUT");
+	if (val)
+		tunnels_parse_idle(val);
+
+	val = getenv("R2T_CONN_RATE");
+	if (val && ratelimit_parse(val, &tunnel_conn_rate))
+		warn("invalid R2T_CONN_RATE");
+
+	trace_tun("early=%u, resume=%u, timeout=%u", tunnel_early_max,
+				tunnel_resume_size, tunnel_connect_timeout);
+}
+
 /**
  * generate a unused tunnel ID
  * @return 0xff on error (all tunnel ID are used)
@@ -60,7 +156,10 @@ unsigned char tunnel_generate_id(void)
 	unsigned char tid;
 
 	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
+		// IDs with queued compression jobs cannot be reused yet
+		if ((tid <= R2T_TID_MAX)
+				&& !tunnel_lookup(tid) && !workers_busy(WORKER_OUT, tid)
+				&& !workers_busy(WORKER_IN, tid)) {
 			last_tid = tid;
 			return tid;
 		}
@@ -87,6 +186,7 @@ static unsigned char sysaf_to_rdpaf(int af)
  * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
  * @param[in] rhost remote hostname
  * @param[in] rport remote TCP port
+ * @param[in] opts listener options
  * @return 0 or 1 if the controller is still connected
  */
 int tunnel_add(
@@ -95,7 +195,8 @@ int tunnel_add(
 			unsigned short lport,
 			int raf,
 			char *rhost,
-			unsigned short rport)
+			unsigned short rport,
+			const tunopts_t *opts)
 {
 	size_t rhost_len;
 	netsock_t *ns;
@@ -137,6 +238,10 @@ int tunnel_add(
 
 
 	ns->type = NETSOCK_TUNSRV;
+	if (netsock_set_options(ns, opts)) {
+		netsock_close(ns);
+		return controller_answer(cli, "error: failed to set tunnel options");
+	}
 	ns->u.tunsrv.raf   = sysaf_to_rdpaf(raf);
 	ns->u.tunsrv.rport = rport;
 	memcpy(ns->u.tunsrv.rhost, rhost, rhost_len);
@@ -161,6 +266,7 @@ int tunnel_add(
  * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
  * @param[in] rhost remote hostname
  * @param[in] rport remote TCP port
+ * @param[in] opts listener options
  * @return 0 or 1 if the controller is still connected
  */
 int tunnel_add_reverse(
@@ -169,7 +275,8 @@ int tunnel_add_reverse(
 			unsigned short lport,
 			int raf,
 			char *rhost,
-			unsigned short rport)
+			unsigned short rport,
+			const tunopts_t *opts)
 {
 	size_t lhost_len, rhost_len;
 	netsock_t *ns;
@@ -185,6 +292,10 @@ int tunnel_add_reverse(
 		return 0; // soft-error .. maybe hard but dont kill client
 
 	ns->type = NETSOCK_RTUNSRV;
+	if (netsock_set_options(ns, opts)) {
+		netsock_close(ns);
+		return controller_answer(cli, "error: failed to set tunnel options");
+	}
 	ns->u.rtunsrv.lport = lport;
 	ns->u.rtunsrv.rport = rport;
 	ns->u.rtunsrv.lhost_len = (unsigned short) lhost_len;
@@ -193,7 +304,8 @@ int tunnel_add_reverse(
 
 	if (channel_is_connected()) {
 		// request tunnel binding right now if channel is connected
-		ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+		ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1,
+												ns->profile);
 		if (ns->tid == 0xff) {
 			netsock_close(ns);
 			return controller_answer(cli, "error: failed to request port binding");
@@ -206,6 +318,85 @@ int tunnel_add_reverse(
 	return controller_answer(cli, str);
 }
 
+/** maximum number of connection pools */
+#define MAX_POOLS 8
+
+/** connection pool configured on the server */
+typedef struct _tunpool {
+	unsigned short port;           /**< remote port, 0 if slot is free */
+	unsigned char size;            /**< number of spare connections */
+	char host[MAX_HOSTNAME_LEN+1]; /**< remote hostname */
+} tunpool_t;
+
+static tunpool_t tunpools[MAX_POOLS];
+
+/**
+ * configure a server-side pool of connections to a tunnel destination
+ * @param[in] cli socket of the client who requested the pool
+ * @param[in] rhost remote hostname
+ * @param[in] rport remote TCP port
+ * @param[in] size number of spare connections, 0 to remove the pool
+ * @return 0 or 1 if the controller is still connected
+ * @note the pool is sent again to the server when the channel reconnects
+ */
+int tunnel_pool(
+			netsock_t *cli,
+			char *rhost,
+			unsigned short rport,
+			unsigned int size)
+{
+	unsigned int i;
+	tunpool_t *pool, *slot;
+
+	assert(valid_netsock(cli) && rhost && *rhost && rport);
+	trace_tun("%s:%hu size=%u", rhost, rport, size);
+
+	if (strlen(rhost) > MAX_HOSTNAME_LEN)
+		return controller_answer(cli, "error: hostname too long");
+
+	if (size > R2T_POOL_MAX)
+		return controller_answer(cli, "error: pool size above %u",
+										R2T_POOL_MAX);
+
+	pool = slot = NULL;
+	for (i=0; i<MAX_POOLS; ++i) {
+		if (!tunpools[i].port) {
+			if (!slot)
+				slot = &tunpools[i];
+		} else if ((tunpools[i].port == rport)
+				&& !strcasecmp(tunpools[i].host, rhost)) {
+			pool = &tunpools[i];
+		}
+	}
+
+	if (!pool) {
+		if (!size)
+			return controller_answer(cli, "error: pool [%s]:%hu not found",
+												rhost, rport);
+		if (!slot)
+			return controller_answer(cli, "error: too many pools");
+		pool = slot;
+		pool->port = rport;
+		strcpy(pool->host, rhost);
+	}
+
+	pool->size = (unsigned char) size;
+
+	if (channel_is_connected()
+			&& channel_request_pool(pool->host, pool->port, pool->size))
+		return controller_answer(cli, "error: failed to request pool");
+
+	if (!size) {
+		pool->port = 0;
+		info(0, "pool [%s]:%hu removed", rhost, rport);
+		return controller_answer(cli, "pool [%s]:%hu removed", rhost, rport);
+	}
+
+	info(0, "pool [%s]:%hu holds %u connections", rhost, rport, size);
+	return controller_answer(cli, "pool [%s]:%hu holds %u connections",
+										rhost, rport, size);
+}
+
 /**
  * try to remove tunnel removal
  * @param[in] cli socket of client who requested tunnel removal
@@ -269,6 +460,7 @@ void tunnel_close(netsock_t *ns, int notify_server)
 	trace_tun("tid=0x%02x, notify=%i", tid, notify_server);
 
 	if (tid != 0xff) {
+		workers_cancel(WORKER_IN, tid);
 		if (notify_server)
 			channel_close_tunnel(tid);
 
@@ -279,12 +471,165 @@ void tunnel_close(netsock_t *ns, int notify_server)
 	netsock_cancel(ns);
 }
 
+static int tunnel_established(netsock_t *ns)
+{
+	if (ns->state != NETSTATE_CONNECTED)
+		return 0;
+
+	if (ns->type == NETSOCK_S5CLI)
+		return !ns->u.sockscli.pending;
+
+	return (ns->type == NETSOCK_TUNCLI) || (ns->type == NETSOCK_RTUNCLI);
+}
+
+/**
+ * handle FIN sent by the local peer of a tunnel
+ * @param[in] ns tunnel socket
+ * @note the tunnel stops reading and keeps writing until the server has
+ *       shut the other direction and closes it
+ */
+void tunnel_shutdown(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+	trace_tun("tid=0x%02x, wr_shut=%u", ns->tid, ns->wr_shut);
+
+	if (ns->tid == 0xff) {
+		tunnel_close(ns, 0);
+		return;
+	}
+
+	ns->rd_shut = 1;
+	channel_shutdown_tunnel(ns->tid);
+}
+
+static void tunnel_shut_write(netsock_t *ns)
+{
+	char host[NETADDRSTR_MAXSIZE];
+
+	trace_tun("tid=0x%02x", ns->tid);
+
+	ns->wr_shut = TUNSHUT_DONE;
+	if (shutdown(ns->fd, SHUT_WR))
+		error("failed to shutdown %s (%s)", netaddr_print(&ns->addr, host),
+				strerror(errno));
+}
+
+/**
+ * handle R2TCMD_SHUTDOWN, FIN sent by the remote peer of a tunnel
+ * @param[in] ns tunnel socket
+ * @return 0 on success
+ * @note the local write side is shut once queued data is written
+ */
+int tunnel_remote_shutdown(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+	trace_tun("tid=0x%02x, rd_shut=%u", ns->tid, ns->rd_shut);
+
+	// sent again after a channel outage
+	if (ns->wr_shut != TUNSHUT_NONE)
+		return 0;
+
+	ns->wr_shut = TUNSHUT_PENDING;
+	if ((ns->state == NETSTATE_CONNECTED)
+			&& !iobuf_datalen(&ns->u.tuncli.obuf))
+		tunnel_shut_write(ns);
+
+	return 0;
+}
+
+/**
+ * handle R2TCMD_CLOSE sent by the server
+ * @param[in] ns tunnel socket
+ * @note queued data is written before the socket is closed, the tunnel
+ *       identifier is released right away
+ */
+void tunnel_remote_close(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+	trace_tun("tid=0x%02x", ns->tid);
+
+	if (!tunnel_established(ns) || !iobuf_datalen(&ns->u.tuncli.obuf)) {
+		netsock_cancel(ns);
+		return;
+	}
+
+	ns->closing = 1;
+	ns->rd_shut = 1;
+	ns->tid     = 0xff;
+	tunnel_set_timeout(ns, TUNNEL_LINGER_TIMEOUT);
+}
+
+static void tunnel_timeout_event(void *ctx)
+{
+	netsock_t *ns = (netsock_t *) ctx;
+	unsigned long long idle, timeout;
+	char host[NETADDRSTR_MAXSIZE];
+
+	assert(valid_netsock(ns));
+
+	if (ns->state == NETSTATE_CANCELLED)
+		return;
+
+	if (ns->closing) {
+		info(0, "dropping output of closed tunnel client %s",
+				netaddr_print(&ns->addr, host));
+		netsock_cancel(ns);
+		return;
+	}
+
+	if (tunnel_established(ns)) {
+		if (!ns->idle_timeout)
+			return;
+
+		// traffic does not re-arm the timer, it only moves the deadline
+		idle = timer_clock() - ns->io_ts;
+		timeout = ns->idle_timeout * 1000000ULL;
+		// kept tunnels are not idle, the outage has its own deadline
+		if (ns->suspended)
+			idle = 0;
+		if (idle < timeout) {
+			timer_arm(&ns->timer, timeout - idle, tunnel_timeout_event, ns);
+			return;
+		}
+
+		info(0, "closing idle tunnel 0x%02x (%s)", ns->tid,
+				netaddr_print(&ns->addr, host));
+		tunnel_close(ns, 1);
+		return;
+	}
+
+	info(0, "tunnel client %s timed out (state %u)",
+			netaddr_print(&ns->addr, host), ns->state);
+	if (ns->type == NETSOCK_S5CLI)
+		socks5_timeout(ns);
+	tunnel_close(ns, 1);
+}
+
+/**
+ * set the deadline of a tunnel connection, handshake, idle period or
+ * output flush
+ * @param[in] ns tunnel socket
+ * @param[in] timeout delay in seconds (0 cancels the deadline)
+ * @note the tunnel is closed if it is not established, active or flushed
+ *       in time
+ */
+void tunnel_set_timeout(netsock_t *ns, unsigned int timeout)
+{
+	assert(valid_netsock(ns));
+
+	if (timeout)
+		timer_arm(&ns->timer, timeout * 1000000ULL, tunnel_timeout_event, ns);
+	else
+		timer_cancel(&ns->timer);
+}
+
 /**
  * handle tcp-connect tunnel network accept-event
  * @param[in] srv tunnel socket
  */
 void tunnel_accept_event(netsock_t *srv)
 {
+	unsigned int i;
 	unsigned char tid;
 	netsock_t *cli;
 	char host1[NETADDRSTR_MAXSIZE], host2[NETADDRSTR_MAXSIZE];
@@ -292,8 +637,19 @@ void tunnel_accept_event(netsock_t *srv)
 	assert(valid_netsock(srv) && (srv->type == NETSOCK_TUNSRV));
 	trace_tun("");
 
-	cli = netsock_accept(srv);
-	if (cli) {
+	// Check if channel is connected before requesting tunnel
+	// Be more lenient - try to establish tunnel even if channel appears disconnected
+	if (!channel_is_connected()) {
+		warn("RDP2TCP channel appears disconnected - attempting tunnel anyway");
+	}
+
+	// the connection requests of a burst are queued together and
+	// sent in a single channel write
+	for (i=0; i<NET_ACCEPT_BURST; ++i) {
+		cli = netsock_accept(srv);
+		if (!cli)
+			break;
+
 		cli->type = NETSOCK_TUNCLI;
 		iobuf_init(&cli->u.tuncli.obuf, 'w', "tun");
 
@@ -301,24 +657,22 @@ void tunnel_accept_event(netsock_t *srv)
 				netaddr_print(&cli->addr, host1),
 				netaddr_print(&srv->addr, host2));
 
-		// Check if channel is connected before requesting tunnel
-		// Be more lenient - try to establish tunnel even if channel appears disconnected
-		if (!channel_is_connected()) {
-			warn("RDP2TCP channel appears disconnected - attempting tunnel anyway");
-		}
-		
 		tid = channel_request_tunnel(srv->u.tunsrv.raf,
 												srv->u.tunsrv.rhost,
-												srv->u.tunsrv.rport, 0);
+												srv->u.tunsrv.rport, 0,
+												srv->profile);
 
 		if (tid != 0xff) {
 			info(0, "reserved tunnel 0x%02x for %s",
 					tid, netaddr_print(&cli->addr, host1));
 			cli->tid = tid;
 			cli->state = NETSTATE_CONNECTING;
+			cli->st.req_ts = timer_clock();
+			tunnel_set_timeout(cli, tunnel_connect_timeout);
 		} else {
 			error("Failed to request tunnel through RDP2TCP channel");
 			netsock_close(cli);
+			break;
 		}
 	}
 }
@@ -346,6 +700,10 @@ void tunnel_connect_event(
 		af == AF_INET ? "ipv4" : (af == AF_UNSPEC ? "proc" : "ipv6"), port);
 
 	ns->state = NETSTATE_CONNECTED;
+	ns->st.up_ts = timer_clock();
+	hist_record(HIST_CONNECT, ns->st.up_ts - ns->st.req_ts);
+	R2T_PROBE2(tunnel__up, ns->tid, ns->st.up_ts - ns->st.req_ts);
+	tunnel_set_timeout(ns, ns->idle_timeout);
 
 	if (af != AF_UNSPEC) {
 		// tcp forwarding
@@ -408,8 +766,15 @@ void tunnel_revconnect_event(
 	if (cli) {
 		cli->type = NETSOCK_RTUNCLI;
 		cli->tid = new_id;
+		R2T_PROBE4(tunnel__create, new_id, 2, srv->u.rtunsrv.lhost,
+						srv->u.rtunsrv.lport);
+		++srv->st.conns;
+		netsock_inherit(cli, srv);
+		if (cli->fd != -1)
+			net_tune(&cli->fd, cli->profile);
 		netaddr_set(af, addr, port, &cli->u.tuncli.raddr);
 		iobuf_init(&cli->u.tuncli.obuf, 'w', "rtuncli");
+		tunnel_set_timeout(cli, tunnel_connect_timeout);
 	} else {
 		channel_close_tunnel(new_id);
 	}
@@ -429,6 +794,14 @@ int tunnel_write(netsock_t *ns, const void *buf, unsigned int len)
 				|| (ns->type == NETSOCK_S5CLI)));
 	trace_tun("len=%u, state=%u", len, ns->state);
 
+	ns->rx_seq += len;
+	ns->io_ts = timer_clock();
+	R2T_PROBE3(tunnel__write, ns->tid, len, iobuf_datalen(&ns->u.tuncli.obuf));
+
+	// remote data may arrive before the local host is resolved
+	if (ns->state == NETSTATE_RESOLVING)
+		return (iobuf_append(&ns->u.tuncli.obuf, buf, len) ? 0 : -1);
+
 	return netsock_write(ns, buf, len);
 }
 
@@ -439,10 +812,35 @@ int tunnel_write(netsock_t *ns, const void *buf, unsigned int len)
  */
 int tunnel_write_event(netsock_t *ns)
 {
-	if ((ns->type == NETSOCK_RTUNCLI) && (ns->state != NETSTATE_CONNECTED))
+	int ret;
+
+	if ((ns->type == NETSOCK_RTUNCLI) && (ns->state != NETSTATE_CONNECTED)) {
 		ns->state = NETSTATE_CONNECTED;
+		ns->st.up_ts = timer_clock();
+		tunnel_set_timeout(ns, ns->idle_timeout);
+		R2T_PROBE2(tunnel__up, ns->tid, ns->st.up_ts - ns->st.start_ts);
+	}
+
+	frec_record(FREC_QUEUE, (unsigned char) ns->type, ns->tid,
+					iobuf_datalen(&ns->u.tuncli.obuf));
+	ret = netsock_write(ns, NULL, 0);
+	if (ret < 0) {
+		// the server must forget the tunnel too
+		tunnel_close(ns, 1);
+		return ret;
+	}
+
+	if (ret || iobuf_datalen(&ns->u.tuncli.obuf))
+		return ret;
+
+	// output is flushed, pending shutdown or close can proceed
+	if (ns->closing)
+		return -1;
+
+	if (ns->wr_shut == TUNSHUT_PENDING)
+		tunnel_shut_write(ns);
 
-	return netsock_write(ns, NULL, 0);
+	return 0;
 }
 
 /**
@@ -460,7 +858,7 @@ void tunnels_kill_clients(void)
 			ns->u.rtunsrv.bound = 0;
 			memset(&ns->addr, 0, sizeof(ns->addr));
 
-		} else if (ns->type > NETSOCK_CTRLCLI) {
+		} else if (netsock_is_tunnel(ns)) {
 			info(0, "closing tunnel client %s",
 					netaddr_print(&ns->addr, host));
 			netsock_close(ns);
@@ -468,14 +866,137 @@ void tunnels_kill_clients(void)
 	}
 }
 
+/**
+ * keep established tunnels through a channel outage
+ * @note other tunnel clients are closed, reverse-connect tunnels are bound
+ *       again once the channel is back
+ */
+void tunnels_suspend(void)
+{
+	netsock_t *ns, *bak;
+	char host[NETADDRSTR_MAXSIZE];
+
+	if (!tunnel_resume_size) {
+		tunnels_kill_clients();
+		return;
+	}
+
+	list_for_each_safe(ns, bak, &all_sockets) {
+
+		if (ns->type == NETSOCK_RTUNSRV) {
+			ns->tid   = 0xff;
+			ns->u.rtunsrv.bound = 0;
+			memset(&ns->addr, 0, sizeof(ns->addr));
+
+		} else if (netsock_is_tunnel(ns) && !ns->closing) {
+			if (tunnel_established(ns)) {
+				if (!ns->suspended) {
+					// the server sends again what is not written yet
+					workers_cancel(WORKER_IN, ns->tid);
+					ns->suspended = 1;
+				}
+			} else {
+				info(0, "closing tunnel client %s",
+						netaddr_print(&ns->addr, host));
+				netsock_close(ns);
+			}
+		}
+	}
+
+	timer_arm(&resume_timer, TUNNEL_RESUME_TIMEOUT * 1000000ULL,
+				tunnels_expire, NULL);
+}
+
+/**
+ * ask the server to resume tunnels kept during a channel outage
+ */
+void tunnels_resume(void)
+{
+	netsock_t *ns;
+
+	timer_cancel(&resume_timer);
+
+	list_for_each(ns, &all_sockets) {
+		if (!ns->suspended)
+			continue;
+
+		// queued payloads are part of the replayed bytes
+		workers_cancel(WORKER_OUT, ns->tid);
+		if (channel_request_resume(ns->tid, ns->rx_seq))
+			tunnel_close(ns, 0);
+	}
+}
+
+/**
+ * close tunnels kept during a channel outage that lasts too long
+ * @param[in] ctx unused
+ */
+static void tunnels_expire(void *ctx)
+{
+	netsock_t *ns;
+
+	info(0, "channel outage lasts too long, closing kept tunnels");
+
+	list_for_each(ns, &all_sockets) {
+		if (ns->suspended) {
+			ns->suspended = 0;
+			tunnel_close(ns, 1);
+		}
+	}
+}
+
+/**
+ * handle R2TCMD_RESUME answer
+ * @param[in] ns tunnel socket
+ * @param[in] seq payload bytes received by the server
+ * @return 0 on success
+ */
+int tunnel_resumed(netsock_t *ns, unsigned int seq)
+{
+	int held;
+
+	assert(valid_netsock(ns));
+	trace_tun("tid=0x%02x, seq=%u, tx=%u, rx=%u", ns->tid, seq, ns->tx.seq,
+				ns->rx_seq);
+
+	if (!ns->suspended) {
+		warn("unexpected resume answer for tunnel 0x%02x", ns->tid);
+		return 0;
+	}
+
+	ns->suspended = 0;
+
+	held = replay_held(&ns->tx, seq);
+	if ((held < 0) || channel_replay(ns, seq)) {
+		info(0, "tunnel 0x%02x cannot be resumed", ns->tid);
+		tunnel_close(ns, 1);
+		return 0;
+	}
+
+	// FIN may have been lost with the channel
+	if (ns->rd_shut)
+		channel_shutdown_tunnel(ns->tid);
+
+	info(0, "tunnel 0x%02x resumed (%i bytes sent again)", ns->tid, held);
+	return 0;
+}
+
 /**
  * re-bind reverse-connect tunnels
  */
 void tunnels_restart(void)
 {
+	unsigned int i;
 	netsock_t *ns, *bak;
 	const char *rhost;
 	unsigned short rport;
+
+	// pools first, tunnels opened right after may use them
+	for (i=0; i<MAX_POOLS; ++i) {
+		if (tunpools[i].port)
+			channel_request_pool(tunpools[i].host, tunpools[i].port,
+										tunpools[i].size);
+	}
 	
 	list_for_each_safe(ns, bak, &all_sockets) {
 
@@ -484,7 +1005,8 @@ void tunnels_restart(void)
 			rhost = &ns->u.rtunsrv.lhost[ns->u.rtunsrv.lhost_len];
 			rport = ns->u.rtunsrv.rport;
 
-			ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+			ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1,
+												ns->profile);
 			if (ns->tid != 0xff) {
 				info(0, "restarted %s:%hu <-- %s:%hu",
 						ns->u.rtunsrv.lhost, ns->u.rtunsrv.lport, rhost, rport);
@@ -0,0 +1,502 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2025, jnqpblc
+ *
+ */
+/**
+ * @file compbench.c
+ * compression benchmark replaying synthetic traffic corpora
+ *
+ * Every corpus is cut into chunks of the benchmarked size and each chunk is
+ * (de)compressed like a DATA message (one-shot API) or fed through a
+ * sync-flushed stream (channel-wide API). Results are printed as CSV.
+ */
+#include "compress.h"
+#include "iobuf.h"
+#include "print.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** default amount of data replayed per benchmark */
+#define BENCH_DEFAULT_TOTAL (4 * 1024 * 1024)
+/** size of each generated corpus */
+#define BENCH_CORPUS_SIZE   (1024 * 1024)
+/** calls of the untimed run warming caches and allocations up */
+#define BENCH_WARMUP_CALLS  16
+
+typedef struct {
+	const char *name;
+	void (*generate)(unsigned char *, unsigned int);
+} corpus_t;
+
+typedef struct {
+	unsigned char algorithm;
+	unsigned char level;
+} method_t;
+
+typedef struct {
+	unsigned int calls;
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	double comp_time;
+	double decomp_time;
+	double *lat;      /**< per-call compression latency (seconds) */
+} result_t;
+
+static unsigned int rnd_state = 0x2545f491;
+
+static unsigned int rnd(void)
+{
+	// xorshift32, deterministic corpora across runs
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int fill(unsigned char *buf, unsigned int off,
+									unsigned int size, const char *s)
+{
+	unsigned int len;
+
+	len = strlen(s);
+	if (off + len > size)
+		len = size - off;
+	memcpy(buf + off, s, len);
+	return off + len;
+}
+
+static const char *words[] = {
+	"the", "session", "remote", "server", "tunnel", "content", "value",
+	"request", "display", "window", "network", "update", "user", "account",
+	"service", "status", "message", "client", "connection", "default"
+};
+#define NWORDS (sizeof(words)/sizeof(words[0]))
+
+/** HTTP/1.1 requests and responses with HTML bodies */
+static void gen_http(unsigned char *buf, unsigned int size)
+{
+	unsigned int off, i, n;
+	char tmp[512];
+
+	off = 0;
+	while (off < size) {
+		n = rnd();
+		snprintf(tmp, sizeof(tmp),
+				"GET /api/v1/%s/%u HTTP/1.1\r\nHost: intranet.example.com\r\n"
+				"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64)\r\n"
+				"Accept: text/html,application/xhtml+xml\r\n"
+				"Cookie: sid=%08x%08x\r\n\r\n",
+				words[n % NWORDS], n % 10000, rnd(), rnd());
+		off = fill(buf, off, size, tmp);
+
+		snprintf(tmp, sizeof(tmp),
+				"HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n"
+				"Cache-Control: no-cache\r\nContent-Length: %u\r\n\r\n"
+				"<html><head><title>%s</title></head><body><div class=\"%s\">",
+				n % 4096, words[(n >> 8) % NWORDS], words[(n >> 16) % NWORDS]);
+		off = fill(buf, off, size, tmp);
+
+		for (i=0; (i < 40) && (off < size); ++i) {
+			snprintf(tmp, sizeof(tmp), "<p>%s %s %s</p>\n",
+					words[rnd() % NWORDS], words[rnd() % NWORDS],
+					words[rnd() % NWORDS]);
+			off = fill(buf, off, size, tmp);
+		}
+		off = fill(buf, off, size, "</div></body></html>\n");
+	}
+}
+
+/** JSON API responses */
+static void gen_json(unsigned char *buf, unsigned int size)
+{
+	unsigned int off;
+	char tmp[512];
+
+	off = fill(buf, 0, size, "[");
+	while (off < size) {
+		snprintf(tmp, sizeof(tmp),
+				"{\"id\":%u,\"name\":\"%s_%s\",\"enabled\":%s,"
+				"\"score\":%u.%02u,\"tags\":[\"%s\",\"%s\"],"
+				"\"owner\":{\"uid\":%u,\"login\":\"%s\"}},\n",
+				rnd() % 1000000, words[rnd() % NWORDS], words[rnd() % NWORDS],
+				(rnd() & 1 ? "true" : "false"), rnd() % 100, rnd() % 100,
+				words[rnd() % NWORDS], words[rnd() % NWORDS],
+				rnd() % 65536, words[rnd() % NWORDS]);
+		off = fill(buf, off, size, tmp);
+	}
+}
+
+/** executable-like data: opcodes, small integers, pointers and padding */
+static void gen_binary(unsigned char *buf, unsigned int size)
+{
+	static const unsigned char ops[] = {
+		0x55, 0x48, 0x89, 0xe5, 0x8b, 0x45, 0xfc, 0xe8, 0xc3, 0x90, 0x0f,
+		0x1f, 0x44, 0x00, 0x31, 0xc0, 0x83, 0xec, 0x10, 0x74, 0x75, 0xeb
+	};
+	unsigned int off, i, n, base;
+
+	base = 0x401000;
+	for (off=0; off < size; ) {
+		n = rnd();
+		switch (n % 4) {
+			case 0: // code
+				for (i=0; (i < 32) && (off < size); ++i)
+					buf[off++] = ops[rnd() % sizeof(ops)];
+				break;
+			case 1: // relocations / pointers
+				for (i=0; (i < 8) && (off + 4 <= size); ++i, off += 4) {
+					base += rnd() % 64;
+					memcpy(buf + off, &base, 4);
+				}
+				break;
+			case 2: // padding
+				for (i=0; (i < (n >> 8) % 64) && (off < size); ++i)
+					buf[off++] = 0;
+				break;
+			default: // high entropy constants
+				for (i=0; (i < 16) && (off < size); ++i)
+					buf[off++] = (unsigned char) rnd();
+		}
+	}
+}
+
+/** TLS application records (incompressible payload) */
+static void gen_tls(unsigned char *buf, unsigned int size)
+{
+	unsigned int off, len, i;
+
+	for (off=0; off < size; ) {
+		len = 256 + rnd() % 16128;
+		if (off + 5 > size)
+			break;
+		buf[off++] = 0x17;
+		buf[off++] = 0x03;
+		buf[off++] = 0x03;
+		buf[off++] = (unsigned char)(len >> 8);
+		buf[off++] = (unsigned char) len;
+		for (i=0; (i < len) && (off < size); ++i)
+			buf[off++] = (unsigned char) rnd();
+	}
+	while (off < size)
+		buf[off++] = (unsigned char) rnd();
+}
+
+static const corpus_t corpora[] = {
+	{ "http",   gen_http   },
+	{ "json",   gen_json   },
+	{ "binary", gen_binary },
+	{ "tls",    gen_tls    }
+};
+#define NCORPORA (sizeof(corpora)/sizeof(corpora[0]))
+
+static const method_t methods[] = {
+	{ COMPRESS_GZIP, 1 },
+	{ COMPRESS_GZIP, 6 },
+	{ COMPRESS_GZIP, 9 },
+	{ COMPRESS_LZ4,  1 },
+	{ COMPRESS_LZ4,  9 }
+};
+#define NMETHODS (sizeof(methods)/sizeof(methods[0]))
+
+static const unsigned int default_chunks[] = {
+	64, 512, 1460, 4096, 16384, 65536
+};
+#define NCHUNKS (sizeof(default_chunks)/sizeof(default_chunks[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * replay a corpus through the one-shot API
+ * @return 0 on success
+ */
+static int bench_oneshot(const unsigned char *corpus, unsigned int chunk,
+						unsigned int total, const method_t *m, result_t *res)
+{
+	unsigned char *cbuf, *pbuf;
+	unsigned int off, done, csize, psize, max;
+	double t0, t1, t2;
+
+	max = get_max_compressed_size(m->algorithm, chunk);
+	cbuf = malloc(max);
+	pbuf = malloc(chunk);
+	if (!cbuf || !pbuf) {
+		free(cbuf);
+		free(pbuf);
+		return error("out of memory");
+	}
+
+	for (off=0, done=0; done < total; done += chunk, off += chunk) {
+		if (off + chunk > BENCH_CORPUS_SIZE)
+			off = 0;
+
+		csize = max;
+		t0 = now();
+		if (compress_data(m->algorithm, m->level, corpus + off, chunk,
+					cbuf, &csize))
+			break;
+		t1 = now();
+		psize = chunk;
+		if (decompress_data(m->algorithm, cbuf, csize, pbuf, &psize))
+			break;
+		t2 = now();
+
+		if ((psize != chunk) || memcmp(pbuf, corpus + off, chunk))
+			break;
+
+		res->lat[res->calls++] = t1 - t0;
+		res->in_bytes    += chunk;
+		res->out_bytes   += csize;
+		res->comp_time   += t1 - t0;
+		res->decomp_time += t2 - t1;
+	}
+
+	free(cbuf);
+	free(pbuf);
+
+	if (done < total)
+		return error("%s level %u one-shot round-trip failed",
+				get_compression_name(m->algorithm), m->level);
+	return 0;
+}
+
+/**
+ * replay a corpus through a sync-flushed compression stream
+ * @return 0 on success
+ */
+static int bench_stream(const unsigned char *corpus, unsigned int chunk,
+						unsigned int total, const method_t *m, result_t *res)
+{
+	int ret, csize;
+	unsigned int off, done;
+	compress_stream_t zout, zin;
+	iobuf_t cbuf, pbuf;
+	double t0, t1, t2;
+
+	memset(&zout, 0, sizeof(zout));
+	memset(&zin, 0, sizeof(zin));
+	if (compress_stream_init(&zout, m->algorithm, m->level, 0))
+		return -1;
+	if (compress_stream_init(&zin, m->algorithm, m->level, 1)) {
+		compress_stream_kill(&zout);
+		return -1;
+	}
+	iobuf_init2(&pbuf, &cbuf, "bench");
+
+	ret = 0;
+	for (off=0, done=0; done < total; done += chunk, off += chunk) {
+		if (off + chunk > BENCH_CORPUS_SIZE)
+			off = 0;
+
+		t0 = now();
+		csize = compress_stream_write(&zout, corpus + off, chunk, 0, &cbuf);
+		t1 = now();
+		if (csize < 0)
+			break;
+		ret = compress_stream_write(&zin, iobuf_dataptr(&cbuf), csize, chunk,
+									&pbuf);
+		t2 = now();
+
+		if ((ret != (int)chunk)
+				|| memcmp(iobuf_dataptr(&pbuf), corpus + off, chunk))
+			break;
+		iobuf_consume(&cbuf, csize);
+		iobuf_consume(&pbuf, chunk);
+
+		res->lat[res->calls++] = t1 - t0;
+		res->in_bytes    += chunk;
+		res->out_bytes   += csize;
+		res->comp_time   += t1 - t0;
+		res->decomp_time += t2 - t1;
+	}
+
+	compress_stream_kill(&zout);
+	compress_stream_kill(&zin);
+	iobuf_kill2(&pbuf, &cbuf);
+
+	if (done < total)
+		return error("%s level %u stream round-trip failed",
+				get_compression_name(m->algorithm), m->level);
+	return 0;
+}
+
+static void report(const char *corpus, unsigned int chunk, const method_t *m,
+							const char *api, result_t *res)
+{
+	double lat_avg, p50, p99;
+
+	qsort(res->lat, res->calls, sizeof(double), cmp_double);
+	lat_avg = res->comp_time / res->calls;
+	p50 = res->lat[res->calls / 2];
+	p99 = res->lat[(res->calls * 99) / 100];
+
+	printf("%s,%u,%s,%u,%s,%u,%llu,%llu,%.4f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+			corpus, chunk, get_compression_name(m->algorithm), m->level, api,
+			res->calls, res->in_bytes, res->out_bytes,
+			(double)res->out_bytes / res->in_bytes,
+			res->in_bytes / res->comp_time / 1e6,
+			res->in_bytes / res->decomp_time / 1e6,
+			lat_avg * 1e6, p50 * 1e6, p99 * 1e6,
+			res->decomp_time / res->calls * 1e6);
+	fflush(stdout);
+}
+
+/**
+ * parse a strictly positive size argument
+ * @return size or 0 if invalid
+ */
+static unsigned int parse_size(const char *arg)
+{
+	char *end;
+	unsigned long val;
+
+	if ((*arg < '0') || (*arg > '9'))
+		return 0;
+	val = strtoul(arg, &end, 10);
+	if (*end || (val > 0x7fffffff))
+		return 0;
+	return (unsigned int) val;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c corpus] [-a algo] [-s chunk] [-t total]\n"
+		"  -c corpus  http, json, binary or tls (default is all)\n"
+		"  -a algo    gzip or lz4 (default is all available)\n"
+		"  -s chunk   chunk size in bytes (repeatable, default is "
+		"64 to 65536)\n"
+		"  -t total   bytes replayed per run (default is %u)\n"
+		"\noutput columns: corpus,chunk,algorithm,level,api,calls,in_bytes,"
+		"out_bytes,ratio,comp_mbps,decomp_mbps,comp_lat_avg_us,"
+		"comp_lat_p50_us,comp_lat_p99_us,decomp_lat_avg_us\n",
+		name, BENCH_DEFAULT_TOTAL);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed;
+	unsigned int i, j, k, api, nchunks, total, calls, warmup;
+	unsigned int chunks[16];
+	const char *only_corpus, *only_algo;
+	unsigned char *corpus;
+	result_t res;
+
+	print_init();
+
+	only_corpus = NULL;
+	only_algo = NULL;
+	nchunks = 0;
+	total = BENCH_DEFAULT_TOTAL;
+
+	while ((opt = getopt(argc, argv, "c:a:s:t:h")) != -1) {
+		switch (opt) {
+			case 'c': only_corpus = optarg; break;
+			case 'a': only_algo = optarg; break;
+			case 's':
+				if (nchunks < sizeof(chunks)/sizeof(chunks[0]))
+					chunks[nchunks++] = parse_size(optarg);
+				break;
+			case 't':
+				total = parse_size(optarg);
+				if (!total)
+					usage(argv[0]);
+				break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (!nchunks) {
+		memcpy(chunks, default_chunks, sizeof(default_chunks));
+		nchunks = NCHUNKS;
+	}
+	for (i=0; i<nchunks; ++i) {
+		if (!chunks[i] || (chunks[i] > BENCH_CORPUS_SIZE)
+				|| (chunks[i] > RDP2TCP_MAX_MSGLEN))
+			usage(argv[0]);
+	}
+
+	corpus = malloc(BENCH_CORPUS_SIZE);
+	if (!corpus)
+		return 1;
+
+	memset(&res, 0, sizeof(res));
+	failed = 0;
+
+	printf("corpus,chunk,algorithm,level,api,calls,in_bytes,out_bytes,ratio,"
+			"comp_mbps,decomp_mbps,comp_lat_avg_us,comp_lat_p50_us,"
+			"comp_lat_p99_us,decomp_lat_avg_us\n");
+
+	for (i=0; i<NCORPORA; ++i) {
+		if (only_corpus && strcmp(only_corpus, corpora[i].name))
+			continue;
+
+		rnd_state = 0x2545f491;
+		corpora[i].generate(corpus, BENCH_CORPUS_SIZE);
+
+		for (j=0; j<nchunks; ++j) {
+			calls = (total + chunks[j] - 1) / chunks[j];
+			res.lat = malloc(calls * sizeof(double));
+			if (!res.lat)
+				return 1;
+			warmup = chunks[j] * (calls < BENCH_WARMUP_CALLS ?
+										calls : BENCH_WARMUP_CALLS);
+
+			for (k=0; k<NMETHODS; ++k) {
+				const method_t *m = &methods[k];
+
+				if (only_algo
+						&& strcmp(only_algo, get_compression_name(m->algorithm)))
+					continue;
+
+				for (api=0; api<2; ++api) {
+					if (!compress_supported(m->algorithm, api))
+						continue;
+
+					// untimed first pass, the first rows are not skewed by
+					// cold caches and allocations
+					res.calls = 0;
+					if ((api ? bench_stream : bench_oneshot)(corpus, chunks[j],
+								warmup, m, &res) < 0) {
+						failed = 1;
+						continue;
+					}
+
+					res.calls = 0;
+					res.in_bytes = res.out_bytes = 0;
+					res.comp_time = res.decomp_time = 0;
+
+					if ((api ? bench_stream : bench_oneshot)(corpus, chunks[j],
+								total, m, &res) < 0) {
+						failed = 1;
+						continue;
+					}
+					report(corpora[i].name, chunks[j], m,
+							(api ? "stream" : "oneshot"), &res);
+				}
+			}
+			free(res.lat);
+		}
+	}
+
+	free(corpus);
+	return failed;
+}
@@ -11,6 +11,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#else
+#include <windows.h>
+#endif
 
 #ifdef HAVE_LZ4
 #include <lz4.h>
@@ -300,3 +305,289 @@ const char *get_compression_name(unsigned char algorithm)
             return "unknown";
     }
 }
+
+int get_compression_algorithm(const char *name)
+{
+    if (!name)
+        return -1;
+    if (!strcmp(name, "none"))
+        return COMPRESS_NONE;
+    if (!strcmp(name, "gzip"))
+        return COMPRESS_GZIP;
+    if (!strcmp(name, "lz4"))
+        return COMPRESS_LZ4;
+    return -1;
+}
+
+int compress_supported(unsigned char algorithm, int streaming)
+{
+    switch (algorithm) {
+        case COMPRESS_NONE:
+        case COMPRESS_GZIP:
+            return 1;
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            // only one-shot LZ4 blocks are implemented
+            return !streaming;
+#endif
+        default:
+            return 0;
+    }
+}
+
+int compress_stream_init(compress_stream_t *s, unsigned char algorithm,
+                         unsigned char level, int inflating)
+{
+    z_stream *strm;
+    int ret;
+
+    assert(s);
+    memset(s, 0, sizeof(*s));
+
+    if (algorithm != COMPRESS_GZIP)
+        return error("unsupported stream compression algorithm: %d", algorithm);
+
+    strm = calloc(1, sizeof(*strm));
+    if (!strm)
+        return error("failed to allocate compression stream");
+
+    if (level < 1) level = 1;
+    if (level > 9) level = 9;
+
+    if (inflating)
+        ret = inflateInit(strm);
+    else
+        ret = deflateInit(strm, level);
+
+    if (ret != Z_OK) {
+        free(strm);
+        return error("%sInit failed: %d", (inflating ? "inflate" : "deflate"), ret);
+    }
+
+    s->algorithm = algorithm;
+    s->level = level;
+    s->inflating = (unsigned char) !!inflating;
+    s->fresh = 1;
+    s->state = strm;
+
+    trace_comp("%s stream initialized (level %d)",
+               (inflating ? "inflate" : "deflate"), level);
+    return 0;
+}
+
+void compress_stream_kill(compress_stream_t *s)
+{
+    z_stream *strm;
+
+    assert(s);
+
+    strm = (z_stream *) s->state;
+    if (strm) {
+        if (s->inflating)
+            inflateEnd(strm);
+        else
+            deflateEnd(strm);
+        free(strm);
+    }
+
+    memset(s, 0, sizeof(*s));
+}
+
+int compress_stream_write(compress_stream_t *s, const void *input,
+                          unsigned int input_size, unsigned int max_output,
+                          iobuf_t *out)
+{
+    z_stream *strm;
+    unsigned int avail, produced, want, mark;
+    void *ptr;
+    int ret;
+
+    assert(s && (input || !input_size) && valid_iobuf(out));
+
+    strm = (z_stream *) s->state;
+    if (!strm)
+        return error("inactive compression stream");
+
+    strm->next_in = (Bytef *)input;
+    strm->avail_in = input_size;
+    produced = 0;
+    mark = iobuf_datalen(out);
+
+    do {
+        if (s->inflating)
+            want = (input_size < 1024 ? 4096 : input_size * 4);
+        else
+            want = get_max_compressed_size(COMPRESS_GZIP, strm->avail_in) + 16;
+
+        // one spare byte tells an oversized output from an exact fit
+        if (max_output && (want > max_output - produced + 1))
+            want = max_output - produced + 1;
+
+        ptr = iobuf_reserve(out, want, &avail);
+        if (!ptr)
+            return error("failed to allocate compression buffer");
+        if (max_output && (avail > want))
+            avail = want;
+
+        strm->next_out = (Bytef *)ptr;
+        strm->avail_out = avail;
+
+        if (s->inflating)
+            ret = inflate(strm, Z_SYNC_FLUSH);
+        else
+            ret = deflate(strm, Z_SYNC_FLUSH);
+
+        if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+            return error("%s failed: %d",
+                         (s->inflating ? "inflate" : "deflate"), ret);
+
+        avail -= strm->avail_out;
+        if (avail > 0) {
+            iobuf_commit(out, avail);
+            produced += avail;
+        }
+
+        if (max_output && (produced > max_output)) {
+            iobuf_truncate(out, mark);
+            return error("%s output exceeds %u bytes",
+                         (s->inflating ? "inflate" : "deflate"), max_output);
+        }
+
+        // no progress possible with room left in output buffer
+        if ((ret == Z_STREAM_END) || ((ret == Z_BUF_ERROR) && strm->avail_out))
+            break;
+
+        // a full output buffer may hide pending flush data
+    } while (strm->avail_in || !strm->avail_out);
+
+    if (strm->avail_in)
+        return error("%s stalled with %u bytes left",
+                     (s->inflating ? "inflate" : "deflate"), strm->avail_in);
+
+    s->fresh = 0;
+
+    trace_comp("%s stream %u bytes to %u bytes",
+               (s->inflating ? "inflate" : "deflate"), input_size, produced);
+
+    return (int) produced;
+}
+
+int compress_stream_chunk(compress_stream_t *s, iobuf_t *in, iobuf_t *out)
+{
+    int ret;
+    unsigned int off, plain;
+    unsigned char level;
+    char *frame;
+    r2tmsg_compress_t *msg;
+
+    assert(s && valid_iobuf(in) && valid_iobuf(out));
+
+    plain = iobuf_datalen(in);
+    if (!plain)
+        return 0;
+
+    if (plain > RDP2TCP_MAX_MSGLEN / 2)
+        plain = RDP2TCP_MAX_MSGLEN / 2;
+
+    // chunk header is filled once compressed size is known
+    off = iobuf_datalen(out);
+    if (!iobuf_reserve(out, 4 + sizeof(*msg), NULL))
+        return error("failed to allocate channel memory");
+    iobuf_commit(out, 4 + sizeof(*msg));
+
+    level = s->level | (s->fresh ? R2TCOMP_LEVEL_RESET : 0);
+    ret = compress_stream_write(s, iobuf_dataptr(in), plain, 0, out);
+    if (ret < 0) {
+        iobuf_truncate(out, off);
+        return -1;
+    }
+
+    frame = ((char *)iobuf_dataptr(out)) + off;
+    *(unsigned int *)frame = htonl(sizeof(*msg) + (unsigned int)ret);
+    msg = (r2tmsg_compress_t *)(frame + 4);
+    msg->cmd = R2TCMD_COMPRESS;
+    msg->id  = R2TCOMP_STREAM;
+    msg->algorithm = s->algorithm;
+    msg->level = level;
+    msg->original_size = htonl(plain);
+
+    iobuf_consume(in, plain);
+    return (int) plain;
+}
+
+int compress_stream_recv(compress_stream_t *s, const r2tmsg_compress_t *msg,
+                         unsigned int len, iobuf_t *out)
+{
+    int ret;
+    unsigned int used, orig;
+
+    assert(s && msg && valid_iobuf(out));
+
+    if (len < sizeof(*msg))
+        return error("compressed stream chunk too short");
+
+    orig = ntohl(msg->original_size);
+    if (orig > RDP2TCP_MAX_MSGLEN)
+        return error("invalid compressed stream chunk size %u", orig);
+
+    if (msg->level & R2TCOMP_LEVEL_RESET) {
+        // peer (re)started its stream
+        compress_stream_kill(s);
+        used = iobuf_datalen(out);
+        if (used > 0)
+            iobuf_consume(out, used);
+        if (compress_stream_init(s, msg->algorithm,
+                                 msg->level & ~R2TCOMP_LEVEL_RESET, 1))
+            return -1;
+
+    } else if (!compress_stream_active(s) || (s->algorithm != msg->algorithm)) {
+        return error("compressed stream chunk out of sequence");
+    }
+
+    // inflated data is bounded by the announced size (0 means no bound)
+    ret = compress_stream_write(s, msg->data, len - sizeof(*msg),
+                                (orig ? orig : 1), out);
+    if (ret < 0)
+        return -1;
+
+    if ((unsigned int)ret != orig)
+        return error("compressed stream chunk size mismatch");
+
+    return 0;
+}
+
+const void *decompress_message(const r2tmsg_compress_t *msg, unsigned int len,
+                               iobuf_t *scratch, unsigned int *out_len)
+{
+    void *ptr;
+    unsigned int size, orig;
+
+    assert(msg && valid_iobuf(scratch) && out_len);
+
+    if (len <= sizeof(*msg)) {
+        error("compressed message too short");
+        return NULL;
+    }
+
+    orig = ntohl(msg->original_size);
+    if (!orig || (orig > RDP2TCP_MAX_MSGLEN)) {
+        error("invalid compressed message size %u", orig);
+        return NULL;
+    }
+
+    ptr = iobuf_reserve(scratch, orig, NULL);
+    if (!ptr) {
+        error("failed to allocate decompression buffer");
+        return NULL;
+    }
+
+    size = orig;
+    if (decompress_data(msg->algorithm, msg->data, len - sizeof(*msg),
+                        ptr, &size) || (size != orig)) {
+        error("failed to decompress tunnel 0x%02x data", msg->id);
+        return NULL;
+    }
+
+    *out_len = size;
+    return ptr;
+}
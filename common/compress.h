@@ -8,6 +8,18 @@
 #define __RDP2TCP_COMPRESS_H__
 
 #include "rdp2tcp.h"
+#include "iobuf.h"
+
+/** streaming compression context shared by a whole frame stream */
+typedef struct compress_stream {
+    unsigned char algorithm;  /**< COMPRESS_xxx or COMPRESS_NONE if inactive */
+    unsigned char level;      /**< compression level */
+    unsigned char inflating;  /**< 1 for a decompression stream */
+    unsigned char fresh;      /**< 1 until the first chunk was produced */
+    void *state;              /**< algorithm private state */
+} compress_stream_t;
+
+#define compress_stream_active(s) ((s)->algorithm != COMPRESS_NONE)
 
 /**
  * Compress data using the specified algorithm
@@ -59,4 +71,83 @@ int should_compress(const void *data, unsigned int size);
  */
 const char *get_compression_name(unsigned char algorithm);
 
+/**
+ * Get compression algorithm from its name
+ * @param[in] name Algorithm name ("gzip", "lz4" or "none")
+ * @return COMPRESS_xxx value or -1 if the name is unknown
+ */
+int get_compression_algorithm(const char *name);
+
+/**
+ * Check whether an algorithm is available in this build
+ * @param[in] algorithm Compression algorithm
+ * @param[in] streaming 1 if a streaming context is required
+ * @return 1 if supported, 0 otherwise
+ */
+int compress_supported(unsigned char algorithm, int streaming);
+
+/**
+ * Initialize a streaming (de)compression context
+ * @param[out] s Stream context
+ * @param[in] algorithm Compression algorithm (only COMPRESS_GZIP streams)
+ * @param[in] level Compression level
+ * @param[in] inflating 1 for decompression, 0 for compression
+ * @return 0 on success, negative value on error
+ */
+int compress_stream_init(compress_stream_t *s, unsigned char algorithm,
+                         unsigned char level, int inflating);
+
+/**
+ * Destroy a streaming context, leaving it inactive
+ * @param[in,out] s Stream context
+ */
+void compress_stream_kill(compress_stream_t *s);
+
+/**
+ * Feed data through a streaming context
+ * @param[in,out] s Stream context
+ * @param[in] input Input data
+ * @param[in] input_size Size of input data
+ * @param[in] max_output Largest output size, 0 for no limit
+ * @param[in,out] out I/O buffer receiving (de)compressed data
+ * @return number of bytes appended to out, negative value on error
+ * @note compression streams are sync-flushed so the peer can decode
+ *       everything produced so far
+ */
+int compress_stream_write(compress_stream_t *s, const void *input,
+                          unsigned int input_size, unsigned int max_output,
+                          iobuf_t *out);
+
+/**
+ * Compress the head of a frame buffer into a channel-wide stream chunk
+ * @param[in,out] s Deflate stream context
+ * @param[in,out] in Plain frames, the compressed ones are consumed
+ * @param[in,out] out I/O buffer receiving the R2TCMD_COMPRESS frame
+ * @return number of plain bytes consumed, 0 if in is empty, negative
+ *         value on error
+ */
+int compress_stream_chunk(compress_stream_t *s, iobuf_t *in, iobuf_t *out);
+
+/**
+ * Inflate a channel-wide stream chunk received from the peer
+ * @param[in,out] s Inflate stream context, (re)started by the chunk flags
+ * @param[in] msg R2TCMD_COMPRESS message with id R2TCOMP_STREAM
+ * @param[in] len Message size
+ * @param[in,out] out I/O buffer receiving the plain frames
+ * @return 0 on success, negative value on error
+ */
+int compress_stream_recv(compress_stream_t *s, const r2tmsg_compress_t *msg,
+                         unsigned int len, iobuf_t *out);
+
+/**
+ * Decompress a per-tunnel R2TCMD_COMPRESS message
+ * @param[in] msg Compressed message
+ * @param[in] len Message size
+ * @param[in,out] scratch I/O buffer holding the decompressed data
+ * @param[out] out_len Decompressed size
+ * @return decompressed data or NULL on error
+ */
+const void *decompress_message(const r2tmsg_compress_t *msg, unsigned int len,
+                               iobuf_t *scratch, unsigned int *out_len);
+
 #endif // __RDP2TCP_COMPRESS_H__
@@ -0,0 +1,344 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2025, jnqpblc
+ *
+ */
+/**
+ * @file dedup.c
+ * content-defined chunking and synchronized chunk caches
+ *
+ * DATA payloads are cut with a gear rolling hash so chunk boundaries follow
+ * the content and survive shifts. The sender keeps a hash index of the
+ * chunks the peer holds and replaces known chunks by their sequence number.
+ */
+#include "dedup.h"
+#include "debug.h"
+#include "print.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** boundary when the 12 upper bits of the gear hash are zero */
+#define DEDUP_CUT_MASK 0xfff00000
+
+static unsigned int gear[256];
+static int gear_ready = 0;
+
+static void gear_init(void)
+{
+	unsigned int i, x;
+
+	x = 0x9e3779b9;
+	for (i=0; i<256; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		gear[i] = x;
+	}
+	gear_ready = 1;
+}
+
+/**
+ * find the next content-defined chunk boundary
+ * @param[in] data input data
+ * @param[in] len input size
+ * @return chunk size
+ */
+static unsigned int dedup_cut(const unsigned char *data, unsigned int len)
+{
+	unsigned int i, h, max;
+
+	if (len <= DEDUP_MIN_CHUNK)
+		return len;
+
+	max = (len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK);
+	h = 0;
+	for (i=0; i<max; ++i) {
+		h = (h << 1) + gear[data[i]];
+		if ((i >= DEDUP_MIN_CHUNK) && !(h & DEDUP_CUT_MASK))
+			return i + 1;
+	}
+
+	return max;
+}
+
+static unsigned int dedup_hash(const unsigned char *data, unsigned int len)
+{
+	unsigned int i, h;
+
+	// FNV-1a, collisions are resolved by comparing chunks
+	h = 0x811c9dc5;
+	for (i=0; i<len; ++i) {
+		h ^= data[i];
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+/**
+ * initialize a chunk cache
+ * @param[out] c chunk cache
+ * @param[in] budget maximum cached bytes (0 leaves the cache inactive)
+ * @param[in] encoder 1 for the sending side (indexes chunks by content)
+ * @return 0 on success
+ */
+int dedup_init(dedup_cache_t *c, unsigned int budget, int encoder)
+{
+	unsigned int i;
+
+	assert(c);
+	trace_comp("budget=%u, encoder=%i", budget, encoder);
+
+	memset(c, 0, sizeof(*c));
+	if (!budget)
+		return 0;
+
+	if (!gear_ready)
+		gear_init();
+
+	if (budget > DEDUP_MAX_CACHE)
+		budget = DEDUP_MAX_CACHE;
+	else if (budget < DEDUP_MAX_CHUNK)
+		budget = DEDUP_MAX_CHUNK;
+
+	// payload tails give chunks smaller than DEDUP_MIN_CHUNK
+	c->nslots = budget / (DEDUP_MIN_CHUNK / 4);
+	c->slots = calloc(c->nslots, sizeof(dedup_slot_t));
+	if (!c->slots)
+		return error("failed to allocate dedup cache");
+
+	if (encoder) {
+		for (c->nbuckets=1; c->nbuckets < c->nslots; c->nbuckets <<= 1)
+			;
+		c->buckets = malloc(c->nbuckets * sizeof(int));
+		if (!c->buckets) {
+			free(c->slots);
+			c->slots = NULL;
+			return error("failed to allocate dedup cache");
+		}
+		for (i=0; i<c->nbuckets; ++i)
+			c->buckets[i] = -1;
+	}
+
+	c->budget = budget;
+	return 0;
+}
+
+/**
+ * destroy a chunk cache, leaving it inactive
+ * @param[in,out] c chunk cache
+ */
+void dedup_kill(dedup_cache_t *c)
+{
+	unsigned int i;
+
+	assert(c);
+
+	if (c->slots) {
+		for (i=0; i<c->nslots; ++i)
+			free(c->slots[i].data);
+		free(c->slots);
+	}
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+}
+
+/**
+ * drop the oldest cached chunk
+ */
+static void dedup_evict(dedup_cache_t *c)
+{
+	int *link;
+	unsigned int idx;
+	dedup_slot_t *slot;
+
+	idx = c->oldest % c->nslots;
+	slot = &c->slots[idx];
+
+	if (c->buckets) {
+		link = &c->buckets[slot->hash & (c->nbuckets - 1)];
+		while (*link != -1) {
+			if (*link == (int)idx) {
+				*link = slot->next;
+				break;
+			}
+			link = &c->slots[*link].next;
+		}
+	}
+
+	c->bytes -= slot->len;
+	free(slot->data);
+	slot->data = NULL;
+	slot->len = 0;
+	++c->oldest;
+}
+
+/**
+ * append a chunk to the cache
+ * @return 0 on success
+ */
+static int dedup_insert(dedup_cache_t *c, const unsigned char *data,
+								unsigned int len, unsigned int hash)
+{
+	unsigned int idx;
+	dedup_slot_t *slot;
+
+	while ((c->next - c->oldest == c->nslots) || (c->bytes + len > c->budget))
+		dedup_evict(c);
+
+	idx = c->next % c->nslots;
+	slot = &c->slots[idx];
+	slot->data = malloc(len);
+	if (!slot->data)
+		return error("failed to allocate dedup chunk");
+
+	memcpy(slot->data, data, len);
+	slot->seq  = c->next;
+	slot->len  = len;
+	slot->hash = hash;
+
+	if (c->buckets) {
+		slot->next = c->buckets[hash & (c->nbuckets - 1)];
+		c->buckets[hash & (c->nbuckets - 1)] = (int)idx;
+	}
+
+	c->bytes += len;
+	++c->next;
+	return 0;
+}
+
+static dedup_slot_t *dedup_lookup(dedup_cache_t *c, const unsigned char *data,
+										unsigned int len, unsigned int hash)
+{
+	int idx;
+	dedup_slot_t *slot;
+
+	for (idx=c->buckets[hash & (c->nbuckets - 1)]; idx != -1; idx=slot->next) {
+		slot = &c->slots[idx];
+		if ((slot->hash == hash) && (slot->len == len)
+				&& !memcmp(slot->data, data, len))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/**
+ * encode a DATA payload as R2TCMD_DEDUP records
+ * @param[in] c outgoing chunk cache
+ * @param[in] data payload
+ * @param[in] len payload size
+ * @param[out] out buffer receiving records
+ * @return number of bytes appended to out, -1 on error
+ */
+int dedup_encode(dedup_cache_t *c, const void *data, unsigned int len,
+																iobuf_t *out)
+{
+	const unsigned char *ptr;
+	unsigned char *rec;
+	unsigned int off, clen, hash, used;
+	dedup_slot_t *slot;
+
+	assert(c && c->buckets && data && out);
+
+	ptr = (const unsigned char *)data;
+	used = iobuf_datalen(out);
+
+	for (off=0; off < len; off += clen) {
+
+		clen = dedup_cut(ptr + off, len - off);
+		hash = dedup_hash(ptr + off, clen);
+
+		slot = dedup_lookup(c, ptr + off, clen, hash);
+		if (slot) {
+			rec = iobuf_reserve(out, 5, NULL);
+			if (!rec)
+				return error("failed to allocate dedup records");
+			rec[0] = DEDUP_REC_REF;
+			rec[1] = (unsigned char)(slot->seq >> 24);
+			rec[2] = (unsigned char)(slot->seq >> 16);
+			rec[3] = (unsigned char)(slot->seq >> 8);
+			rec[4] = (unsigned char) slot->seq;
+			iobuf_commit(out, 5);
+			c->saved += clen;
+
+		} else {
+			rec = iobuf_reserve(out, 3 + clen, NULL);
+			if (!rec)
+				return error("failed to allocate dedup records");
+			rec[0] = DEDUP_REC_NEW;
+			rec[1] = (unsigned char)(clen >> 8);
+			rec[2] = (unsigned char) clen;
+			memcpy(rec + 3, ptr + off, clen);
+			iobuf_commit(out, 3 + clen);
+
+			if (dedup_insert(c, ptr + off, clen, hash))
+				return -1;
+		}
+	}
+
+	trace_comp("len=%u --> %u", len, iobuf_datalen(out) - used);
+	return (int)(iobuf_datalen(out) - used);
+}
+
+/**
+ * decode R2TCMD_DEDUP records
+ * @param[in] c incoming chunk cache
+ * @param[in] data records
+ * @param[in] len records size
+ * @param[out] out buffer receiving the original payload
+ * @return number of bytes appended to out, -1 on error
+ */
+int dedup_decode(dedup_cache_t *c, const void *data, unsigned int len,
+																iobuf_t *out)
+{
+	const unsigned char *ptr;
+	unsigned int off, clen, seq, used;
+	dedup_slot_t *slot;
+
+	assert(c && data && out);
+
+	ptr = (const unsigned char *)data;
+	used = iobuf_datalen(out);
+
+	for (off=0; off < len; ) {
+
+		switch (ptr[off]) {
+
+			case DEDUP_REC_NEW:
+				if (off + 3 > len)
+					return error("truncated dedup record");
+				clen = (ptr[off+1] << 8) | ptr[off+2];
+				off += 3;
+				if (!clen || (clen > DEDUP_MAX_CHUNK) || (off + clen > len))
+					return error("invalid dedup chunk size %u", clen);
+
+				if (!iobuf_append(out, ptr + off, clen)
+						|| dedup_insert(c, ptr + off, clen, 0))
+					return error("failed to decode dedup chunk");
+				off += clen;
+				break;
+
+			case DEDUP_REC_REF:
+				if (off + 5 > len)
+					return error("truncated dedup record");
+				seq = ((unsigned int)ptr[off+1] << 24) | (ptr[off+2] << 16)
+						| (ptr[off+3] << 8) | ptr[off+4];
+				off += 5;
+				if (seq - c->oldest >= c->next - c->oldest)
+					return error("unknown dedup chunk %u", seq);
+
+				slot = &c->slots[seq % c->nslots];
+				if (!iobuf_append(out, slot->data, slot->len))
+					return error("failed to decode dedup chunk");
+				c->saved += slot->len;
+				break;
+
+			default:
+				return error("invalid dedup record 0x%02x", ptr[off]);
+		}
+	}
+
+	return (int)(iobuf_datalen(out) - used);
+}
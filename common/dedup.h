@@ -0,0 +1,58 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2025, jnqpblc
+ *
+ */
+#ifndef __RDP2TCP_DEDUP_H__
+#define __RDP2TCP_DEDUP_H__
+
+#include "iobuf.h"
+
+/** DATA payloads smaller than this are never deduplicated */
+#define DEDUP_MIN_SIZE  2048
+/** content-defined chunk size bounds */
+#define DEDUP_MIN_CHUNK 1024
+#define DEDUP_AVG_CHUNK 4096
+#define DEDUP_MAX_CHUNK 16384
+/** default and maximum chunk cache sizes (bytes) */
+#define DEDUP_DEFAULT_CACHE (16*1024*1024)
+#define DEDUP_MAX_CACHE     (256*1024*1024)
+
+/** R2TCMD_DEDUP record types */
+#define DEDUP_REC_NEW 0x01 /**< [len16][data] chunk appended to the cache */
+#define DEDUP_REC_REF 0x02 /**< [seq32] chunk already held by the peer */
+
+/** cached chunk */
+typedef struct _dedup_slot {
+	unsigned int seq;      /**< insertion sequence number */
+	unsigned int len;      /**< chunk size */
+	unsigned int hash;     /**< chunk hash (encoder only) */
+	int next;              /**< next slot in hash bucket (encoder only) */
+	unsigned char *data;   /**< chunk data */
+} dedup_slot_t;
+
+/** one direction of the synchronized chunk cache
+ * @note both peers insert the same chunks in the same order and evict the
+ *       oldest ones with the same byte budget, so sequence numbers refer to
+ *       the same chunk on both ends */
+typedef struct _dedup_cache {
+	unsigned int budget;   /**< maximum cached bytes, 0 if inactive */
+	unsigned int bytes;    /**< cached bytes */
+	unsigned int nslots;   /**< slots ring size */
+	unsigned int oldest;   /**< sequence number of the oldest chunk */
+	unsigned int next;     /**< sequence number of the next chunk */
+	unsigned int nbuckets; /**< hash buckets count (encoder only) */
+	dedup_slot_t *slots;   /**< slots ring */
+	int *buckets;          /**< hash buckets (encoder only) */
+	unsigned long long saved; /**< payload bytes replaced by references */
+} dedup_cache_t;
+
+#define dedup_active(c) ((c)->budget > 0)
+
+int  dedup_init(dedup_cache_t *, unsigned int, int);
+void dedup_kill(dedup_cache_t *);
+int  dedup_encode(dedup_cache_t *, const void *, unsigned int, iobuf_t *);
+int  dedup_decode(dedup_cache_t *, const void *, unsigned int, iobuf_t *);
+
+#endif // __RDP2TCP_DEDUP_H__
@@ -212,6 +212,20 @@ void *iobuf_append(iobuf_t *buf, const void *data, unsigned int size)
 	return ptr;
 }
 
+/**
+ * drop data at the end of an I/O buffer
+ * @param[in] buf I/O buffer to shrink
+ * @param[in] size new size of used data
+ */
+void iobuf_truncate(iobuf_t *buf, unsigned int size)
+{
+	assert(valid_iobuf(buf) && (size <= buf->size));
+	trace_iobuf("[%c] %s, size=%u, old=%u",
+					buf->type, buf->name, size, buf->size);
+
+	buf->size = size;
+}
+
 #ifdef DEBUG
 void iobuf_dump(iobuf_t *buf)
 {
@@ -111,6 +111,13 @@ void iobuf_commit(iobuf_t *, unsigned int);
  * @return Pointer to appended data, or NULL on failure
  */
 void *iobuf_append(iobuf_t *, const void *, unsigned int);
+
+/**
+ * @brief Drop data from the end of an I/O buffer
+ * @param[in,out] buf The I/O buffer to shrink
+ * @param[in] size New used size (must not exceed current used size)
+ */
+void iobuf_truncate(iobuf_t *, unsigned int);
 //void iobuf_xfer(iobuf_t *, iobuf_t *);
 
 #endif // __RDP2TCP_IOBUF_H__
@@ -24,10 +24,14 @@
 static struct {
     logger_config_t config;
     FILE *log_file;
-    pthread_mutex_t mutex;
+    long file_size;         // bytes in the current log file
+    pthread_mutex_t mutex;  // serializes file output and rotation
     int initialized;
 } logger_state = {0};
 
+// Lowest level logged, LOG_LEVEL_MAX until the logger is initialized
+log_level_t logger_level = LOG_LEVEL_MAX;
+
 // Color codes for terminal output
 static const char *color_codes[] = {
     "\033[36m",  // DEBUG - cyan
@@ -86,16 +90,20 @@ static void get_thread_id(char *buffer, size_t size)
 
 /**
  * Rotate log file if needed
+ * @note the size is tracked while writing, the file is only checked once
+ *       it seems large enough
  */
 static void rotate_log_file(void)
 {
     if (!logger_state.config.filename || 
-        logger_state.config.max_file_size <= 0) {
+        logger_state.config.max_file_size <= 0 ||
+        logger_state.file_size < logger_state.config.max_file_size) {
         return;
     }
     
     struct stat st;
     if (stat(logger_state.config.filename, &st) == 0) {
+        logger_state.file_size = (long)st.st_size;
         if (st.st_size >= logger_state.config.max_file_size) {
             // Close current file
             if (logger_state.log_file) {
@@ -127,6 +135,7 @@ static void rotate_log_file(void)
             
             // Reopen log file
             logger_state.log_file = fopen(logger_state.config.filename, "a");
+            logger_state.file_size = 0;
         }
     }
 }
@@ -210,30 +219,38 @@ static void format_json(const log_entry_t *entry, char *buffer, size_t size)
 
 /**
  * Write log message to destination
+ * @note stderr messages are batched by the print.c writer thread, stdio
+ *       streams are only flushed for warnings and errors
  */
-static void write_log(const char *formatted_message)
+static void write_log(log_level_t level, const char *formatted_message)
 {
-    pthread_mutex_lock(&logger_state.mutex);
-    
+    int ret;
+
     switch (logger_state.config.destination) {
         case LOG_DEST_STDOUT:
             printf("%s\n", formatted_message);
-            fflush(stdout);
+            if (level >= LOG_LEVEL_WARN) {
+                fflush(stdout);
+            }
             break;
             
         case LOG_DEST_STDERR:
-            fprintf(stderr, "%s\n", formatted_message);
-            fflush(stderr);
+            print_raw(formatted_message);
             break;
             
         case LOG_DEST_FILE:
+            pthread_mutex_lock(&logger_state.mutex);
+            rotate_log_file();
             if (logger_state.log_file) {
-                rotate_log_file();
-                if (logger_state.log_file) {
-                    fprintf(logger_state.log_file, "%s\n", formatted_message);
+                ret = fprintf(logger_state.log_file, "%s\n", formatted_message);
+                if (ret > 0) {
+                    logger_state.file_size += ret;
+                }
+                if (level >= LOG_LEVEL_WARN) {
                     fflush(logger_state.log_file);
                 }
             }
+            pthread_mutex_unlock(&logger_state.mutex);
             break;
             
 #ifdef HAVE_SYSLOG
@@ -245,8 +262,6 @@ static void write_log(const char *formatted_message)
         default:
             break;
     }
-    
-    pthread_mutex_unlock(&logger_state.mutex);
 }
 
 int logger_init(const logger_config_t *config)
@@ -274,6 +289,8 @@ int logger_init(const logger_config_t *config)
             pthread_mutex_destroy(&logger_state.mutex);
             return -1;
         }
+        fseek(logger_state.log_file, 0, SEEK_END);
+        logger_state.file_size = ftell(logger_state.log_file);
     }
     
 #ifdef HAVE_SYSLOG
@@ -284,6 +301,7 @@ int logger_init(const logger_config_t *config)
 #endif
     
     logger_state.initialized = 1;
+    logger_level = config->level;
     
     LOG_INFO(LOG_CAT_GENERAL, "Logger initialized with level %s", 
              level_names[config->level]);
@@ -297,6 +315,7 @@ void logger_cleanup(void)
         return;
     }
     
+    logger_level = LOG_LEVEL_MAX;
     pthread_mutex_lock(&logger_state.mutex);
     
     if (logger_state.log_file) {
@@ -320,6 +339,9 @@ void logger_set_level(log_level_t level)
 {
     if (level < LOG_LEVEL_MAX) {
         logger_state.config.level = level;
+        if (logger_state.initialized) {
+            logger_level = level;
+        }
     }
 }
 
@@ -373,7 +395,7 @@ void log_structured(log_level_t level, log_category_t category,
             return;
     }
     
-    write_log(formatted);
+    write_log(level, formatted);
 }
 
 void log_tunnel(log_level_t level, const char *tunnel_id, const char *fmt, ...)
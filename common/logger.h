@@ -171,33 +171,47 @@ const char *get_log_level_name(log_level_t level);
  */
 const char *get_log_category_name(log_category_t category);
 
+// Lowest level logged, LOG_LEVEL_MAX while the logger is not initialized
+extern log_level_t logger_level;
+
+// Check the level before any argument is evaluated
+#define LOG_ENABLED(level) ((level) >= logger_level)
+
 // Convenience macros for logging
 #define LOG_DEBUG(cat, fmt, ...) \
-    log_structured(LOG_LEVEL_DEBUG, cat, __FILE__, __func__, __LINE__, \
-                   NULL, NULL, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) \
+        log_structured(LOG_LEVEL_DEBUG, cat, __FILE__, __func__, __LINE__, \
+                       NULL, NULL, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_INFO(cat, fmt, ...) \
-    log_structured(LOG_LEVEL_INFO, cat, __FILE__, __func__, __LINE__, \
-                   NULL, NULL, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_INFO)) \
+        log_structured(LOG_LEVEL_INFO, cat, __FILE__, __func__, __LINE__, \
+                       NULL, NULL, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_WARN(cat, fmt, ...) \
-    log_structured(LOG_LEVEL_WARN, cat, __FILE__, __func__, __LINE__, \
-                   NULL, NULL, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_WARN)) \
+        log_structured(LOG_LEVEL_WARN, cat, __FILE__, __func__, __LINE__, \
+                       NULL, NULL, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_ERROR(cat, fmt, ...) \
-    log_structured(LOG_LEVEL_ERROR, cat, __FILE__, __func__, __LINE__, \
-                   NULL, NULL, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) \
+        log_structured(LOG_LEVEL_ERROR, cat, __FILE__, __func__, __LINE__, \
+                       NULL, NULL, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_TUNNEL_DEBUG(tid, fmt, ...) \
-    log_tunnel(LOG_LEVEL_DEBUG, tid, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) \
+        log_tunnel(LOG_LEVEL_DEBUG, tid, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_TUNNEL_INFO(tid, fmt, ...) \
-    log_tunnel(LOG_LEVEL_INFO, tid, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_INFO)) \
+        log_tunnel(LOG_LEVEL_INFO, tid, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_TUNNEL_WARN(tid, fmt, ...) \
-    log_tunnel(LOG_LEVEL_WARN, tid, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_WARN)) \
+        log_tunnel(LOG_LEVEL_WARN, tid, fmt, ##__VA_ARGS__); } while (0)
 
 #define LOG_TUNNEL_ERROR(tid, fmt, ...) \
-    log_tunnel(LOG_LEVEL_ERROR, tid, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) \
+        log_tunnel(LOG_LEVEL_ERROR, tid, fmt, ##__VA_ARGS__); } while (0)
 
 #endif // __RDP2TCP_LOGGER_H__
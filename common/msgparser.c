@@ -23,6 +23,7 @@
 #include "print.h"
 #include "iobuf.h"
 #include "msgparser.h"
+#include "probes.h"
 
 #include <stdio.h>
 #ifndef _WIN32
@@ -34,6 +35,9 @@
 extern int debug_level;
 extern const cmdhandler_t cmd_handlers[];
 
+/** optional callback seeing each valid command before its handler */
+cmdobserver_t commands_observer = NULL;
+
 /**
  * parse rdp2tcp commands and call specific handlers
  * @param[in] ibuf input buffer
@@ -50,7 +54,12 @@ int commands_parse(iobuf_t *ibuf)
 		1, // R2TCMD_PING
 		3, // R2TCMD_BIND
 		2, // R2TCMD_RCONN
-		8  // R2TCMD_COMPRESS
+		5, // R2TCMD_COMPRESS
+		3, // R2TCMD_DEDUP
+		3, // R2TCMD_RESOLVE
+		3, // R2TCMD_POOL
+		6, // R2TCMD_RESUME
+		2  // R2TCMD_SHUTDOWN
 	};
 
 	assert(valid_iobuf(ibuf) && (iobuf_datalen(ibuf)>0));
@@ -87,6 +96,11 @@ int commands_parse(iobuf_t *ibuf)
 		if (!cmd_handlers[cmd])
 			return error("command 0x%02x not supported", cmd);
 
+		R2T_PROBE3(frame__in, cmd, (msg_len > 1 ? data[off+1] : 0), msg_len);
+
+		if (commands_observer)
+			commands_observer((const r2tmsg_t*)(data+off), msg_len);
+
 		// call specific command handler
 		if (cmd_handlers[cmd]((const r2tmsg_t*)(data+off), msg_len))
 			return -1;
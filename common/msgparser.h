@@ -22,6 +22,9 @@
 #include "rdp2tcp.h"
 
 typedef int (*cmdhandler_t)(const r2tmsg_t *, unsigned int);
+typedef void (*cmdobserver_t)(const r2tmsg_t *, unsigned int);
+
+extern cmdobserver_t commands_observer;
 
 int commands_parse(iobuf_t *);
 
@@ -20,10 +20,17 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // accept4
+#endif
 #include "nethelper.h"
 #include "debug.h"
+#include "print.h"
+#include "probes.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #ifndef _WIN32
 #include <string.h>
 #include <fcntl.h>
@@ -31,8 +38,26 @@
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#else
+#include <mstcpip.h>
+#endif
+
+#if defined(__linux__) && !defined(HAVE_ACCEPT4)
+#define HAVE_ACCEPT4
 #endif
 
+/** default length of the listen queue */
+#define NET_DEFAULT_BACKLOG 128
+/** default idle time before keepalive probes (seconds) */
+#define NET_DEFAULT_KEEPALIVE 60
+/** interval between keepalive probes (seconds) */
+#define NET_KEEPALIVE_INTERVAL 10
+/** unanswered keepalive probes before a connection is dropped */
+#define NET_KEEPALIVE_COUNT 6
+
 #ifndef _WIN32
 #define nethelper_error errno
 #define nethelper_badsock -1
@@ -124,10 +149,247 @@ const char *net_error(int ret, int err)
 	return (const char *) buffer;
 }
 
-static int netres(
-					int mode,
+/** resolver cache size */
+#define NETRES_CACHE_SIZE   64
+/** maximum addresses kept for a single hostname */
+#define NETRES_MAX_ADDRS    8
+/** default lifetime of successful resolutions (seconds) */
+#define NETRES_DEFAULT_TTL  60
+/** maximum lifetime of failed resolutions (seconds) */
+#define NETRES_NEGATIVE_TTL 10
+#define NETRES_HOST_MAXLEN  256
+
+/** resolved address, without port */
+typedef struct _netres_addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t len;
+	netaddr_t addr;
+} netres_addr_t;
+
+/** resolver cache entry */
+typedef struct _netres_entry {
+	char host[NETRES_HOST_MAXLEN]; /**< hostname, empty if unused */
+	int pref_af;                   /**< requested address family */
+	int err;                       /**< getaddrinfo error (negative entry) */
+	time_t expire;                 /**< expiration time */
+	unsigned int used;             /**< last use (LRU replacement) */
+	unsigned int naddrs;           /**< number of addresses */
+	netres_addr_t addrs[NETRES_MAX_ADDRS];
+} netres_entry_t;
+
+static netres_entry_t netres_cache[NETRES_CACHE_SIZE];
+static unsigned int netres_clock = 0;
+static int netres_ttl = -1;
+static int net_backlog = -1;
+static int net_keepalive_idle = -1;
+
+/**
+ * run getaddrinfo and keep the results
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname to resolve
+ * @param[in] flags getaddrinfo hints flags
+ * @param[out] e resolved addresses
+ * @return getaddrinfo error
+ * @note called from resolver threads, must not touch the cache
+ */
+static int netres_getaddrinfo(
+					int pref_af,
+					const char *host,
+					int flags,
+					netres_entry_t *e)
+{
+	int ret;
+	struct addrinfo hints, *res, *ptr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = pref_af;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = flags;
+
+	res = NULL;
+	ret = getaddrinfo(host, NULL, &hints, &res);
+
+	e->naddrs = 0;
+	e->err    = ret;
+	for (ptr=res; ptr && (e->naddrs < NETRES_MAX_ADDRS); ptr=ptr->ai_next) {
+		if (ptr->ai_addrlen > sizeof(netaddr_t))
+			continue;
+		e->addrs[e->naddrs].family   = ptr->ai_family;
+		e->addrs[e->naddrs].socktype = ptr->ai_socktype;
+		e->addrs[e->naddrs].protocol = ptr->ai_protocol;
+		e->addrs[e->naddrs].len      = ptr->ai_addrlen;
+		memcpy(&e->addrs[e->naddrs].addr, ptr->ai_addr, ptr->ai_addrlen);
+		++e->naddrs;
+	}
+	if (res)
+		freeaddrinfo(res);
+
+	return ret;
+}
+
+/**
+ * look up a hostname in the resolver cache
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname
+ * @return cache entry (maybe negative) or NULL if not cached
+ * @note R2T_DNS_TTL environment variable sets the cache lifetime in seconds
+ *       (0 disables the cache)
+ */
+static netres_entry_t *netres_lookup(int pref_af, const char *host)
+{
+	unsigned int i;
+	time_t now;
+	const char *val;
+	netres_entry_t *e;
+
+	if (netres_ttl < 0) {
+		val = getenv("R2T_DNS_TTL");
+		netres_ttl = (val ? atoi(val) : NETRES_DEFAULT_TTL);
+		if (netres_ttl < 0)
+			netres_ttl = 0;
+	}
+
+	if (!netres_ttl)
+		return NULL;
+
+	now = time(NULL);
+	for (i=0; i<NETRES_CACHE_SIZE; ++i) {
+		e = &netres_cache[i];
+		if (e->host[0] && (e->expire > now) && (e->pref_af == pref_af)
+				&& !strcmp(e->host, host)) {
+			e->used = ++netres_clock;
+			trace_sock("%s cached (%u addrs, err=%i)", host, e->naddrs, e->err);
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * store a resolution result in the resolver cache
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname
+ * @param[in] res resolution result
+ * @note failures are cached for 10 seconds at most
+ */
+static void netres_store(int pref_af, const char *host,
+								const netres_entry_t *res)
+{
+	unsigned int i;
+	time_t now;
+	netres_entry_t *e, *slot;
+
+	// only definitive failures are worth a negative entry
+	if (!netres_ttl || (strlen(host) >= NETRES_HOST_MAXLEN)
+			|| (res->err && (res->err != EAI_NONAME)))
+		return;
+
+	now  = time(NULL);
+	slot = NULL;
+	for (i=0; i<NETRES_CACHE_SIZE; ++i) {
+		e = &netres_cache[i];
+		if (e->host[0] && (e->expire > now) && (e->pref_af == pref_af)
+				&& !strcmp(e->host, host)) {
+			slot = e;
+			break;
+		}
+		if (!e->host[0] || (e->expire <= now)) {
+			e->host[0] = 0;
+			if (!slot || slot->host[0])
+				slot = e;
+		} else if (!slot || (slot->host[0] && (e->used < slot->used))) {
+			slot = e;
+		}
+	}
+
+	if (slot != res)
+		memcpy(slot, res, sizeof(*slot));
+	strcpy(slot->host, host);
+	slot->pref_af = pref_af;
+	slot->used    = ++netres_clock;
+	slot->expire  = now + (res->err && (netres_ttl > NETRES_NEGATIVE_TTL)
+								? NETRES_NEGATIVE_TTL : netres_ttl);
+}
+
+/**
+ * drop a hostname from the resolver cache
+ */
+static void netres_forget(int pref_af, const char *host)
+{
+	netres_entry_t *e;
+
+	e = netres_lookup(pref_af, host);
+	if (e)
+		e->host[0] = 0;
+}
+
+/**
+ * look up a hostname in the resolver cache or resolve it
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname to resolve
+ * @param[in] tmp entry used when the result is not cached
+ * @param[out] err getaddrinfo error
+ * @return resolved entry or NULL on error
+ */
+static netres_entry_t *netres_query(
 					int pref_af,
 					const char *host,
+					netres_entry_t *tmp,
+					int *err)
+{
+	netres_entry_t *e;
+
+	e = netres_lookup(pref_af, host);
+	if (!e) {
+		netres_getaddrinfo(pref_af, host, 0, tmp);
+		netres_store(pref_af, host, tmp);
+		e = tmp;
+	}
+
+	if (e->err) {
+		*err = e->err;
+		return NULL;
+	}
+
+	return e;
+}
+
+/**
+ * get the length of the listen queue of tcp servers
+ * @return backlog size
+ * @note R2T_BACKLOG environment variable overrides the default value
+ */
+static int net_listen_backlog(void)
+{
+	const char *val;
+
+	if (net_backlog < 0) {
+		val = getenv("R2T_BACKLOG");
+		net_backlog = (val ? atoi(val) : NET_DEFAULT_BACKLOG);
+		if (net_backlog <= 0)
+			net_backlog = NET_DEFAULT_BACKLOG;
+		trace_sock("backlog=%i", net_backlog);
+	}
+
+	return net_backlog;
+}
+
+/**
+ * bind or connect a socket to the first usable resolved address
+ * @param[in] mode 0 to only fill addr, 1 for tcp server, 2 for tcp client
+ * @param[in] entry resolved addresses
+ * @param[in] port tcp port
+ * @param[out] out_sock socket
+ * @param[out] addr socket address
+ * @param[out] err system error code
+ * @return -1 on error, 0 on success, 1 if connection is pending
+ */
+static int netres_open(
+					int mode,
+					const netres_entry_t *entry,
 					unsigned short port,
 					sock_t *out_sock,
 					netaddr_t *addr,
@@ -140,27 +402,9 @@ static int netres(
 	WSAEVENT evt;
 #endif
 	int ret, n;
-	struct addrinfo hints, *res, *ptr;
-	char service[8];
-
-	assert(((pref_af==AF_UNSPEC) || (pref_af==AF_INET) || (pref_af==AF_INET6))
-			&& host && *host && port && addr && err && (out_sock || !mode));
-	*err = 0;
-
-	if (addr)
-		memset(addr, 0, sizeof(*addr));
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = pref_af;
-	hints.ai_socktype = SOCK_STREAM;
-	snprintf(service, sizeof(service)-1, "%hu", port);
-
-	res = NULL;
-	ret = getaddrinfo(host, service, &hints, &res);
-	if (ret) {
-		*err = ret;
-		return NETERR_RESOLVE;
-	}
+	unsigned int i;
+	const netres_addr_t *ptr;
+	netaddr_t sa;
 
 	ret = NETERR_NOADDR;
 	fd  = nethelper_badsock;
@@ -169,10 +413,17 @@ static int netres(
 #endif
 
 	// for each hostname resolution result
-	for (ptr=res; ptr; ptr=ptr->ai_next) {
+	for (i=0; i<entry->naddrs; ++i) {
+
+		ptr = &entry->addrs[i];
+		memcpy(&sa, &ptr->addr, ptr->len);
+		if (ptr->family == AF_INET6)
+			sa.ip6.sin6_port = htons(port);
+		else
+			sa.ip4.sin_port = htons(port);
 
 		if (addr)
-			memcpy(addr, ptr->ai_addr, ptr->ai_addrlen);
+			memcpy(addr, &sa, ptr->len);
 
 		if (!mode) { // resolve-only
 			ret = 0;
@@ -180,7 +431,7 @@ static int netres(
 		}
 
 		// create new async socket
-		fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+		fd = socket(ptr->family, ptr->socktype, ptr->protocol);
 		if (fd == nethelper_badsock) {
 			*err = nethelper_error;
 			ret = NETERR_SOCKET;
@@ -203,9 +454,9 @@ static int netres(
 			n = 1;
 			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,(const void*)&n, sizeof(n));
 
-			if (!bind(fd, ptr->ai_addr, ptr->ai_addrlen)) {
+			if (!bind(fd, (struct sockaddr *)&sa, ptr->len)) {
 
-				if (!listen(fd, 5)) {
+				if (!listen(fd, net_listen_backlog())) {
 #ifdef _WIN32
 					if (WSAEventSelect(fd, evt, FD_ACCEPT)) {
 						*err = nethelper_error;
@@ -231,7 +482,7 @@ static int netres(
 				break;
 			}
 #endif
-			if (!connect(fd, ptr->ai_addr, ptr->ai_addrlen)) {
+			if (!connect(fd, (struct sockaddr *)&sa, ptr->len)) {
 #ifdef _WIN32
 				if (WSAEventSelect(fd, evt, FD_READ|FD_CLOSE)) {
 					*err = nethelper_error;
@@ -258,8 +509,6 @@ static int netres(
 		continue;
 	}
 
-	freeaddrinfo(res);
-
 	if ((ret >= 0) && mode) {
 #ifndef _WIN32
 		*out_sock = fd;
@@ -278,6 +527,38 @@ static int netres(
 	return ret;
 }
 
+static int netres(
+					int mode,
+					int pref_af,
+					const char *host,
+					unsigned short port,
+					sock_t *out_sock,
+					netaddr_t *addr,
+					int *err)
+{
+	int ret;
+	netres_entry_t tmp, *entry;
+
+	assert(((pref_af==AF_UNSPEC) || (pref_af==AF_INET) || (pref_af==AF_INET6))
+			&& host && *host && port && addr && err && (out_sock || !mode));
+	*err = 0;
+
+	if (addr)
+		memset(addr, 0, sizeof(*addr));
+
+	entry = netres_query(pref_af, host, &tmp, err);
+	if (!entry)
+		return NETERR_RESOLVE;
+
+	ret = netres_open(mode, entry, port, out_sock, addr, err);
+
+	// addresses may be stale, resolve again next time
+	if (ret == NETERR_CONNECT)
+		netres_forget(pref_af, host);
+
+	return ret;
+}
+
 /**
  * resolve a hostname
  * @return -1 on error, 0 on success
@@ -324,6 +605,711 @@ int net_client(
 	return netres(2, pref_af, host, port, out_sock, addr, err);
 }
 
+/** number of resolver threads */
+#define NETRES_THREADS 4
+/** delay before the next connection attempt starts (RFC 8305) */
+#define NETRES_ATTEMPT_DELAY   250
+/** connection race timeout (ms) */
+#define NETRES_CONNECT_TIMEOUT 20000
+
+#define NETRES_QUEUED  0
+#define NETRES_RUNNING 1
+#define NETRES_DONE    2
+
+/** pending asynchronous resolution */
+typedef struct _netres_req {
+	struct _netres_req *next;      /**< next request in submission order */
+	void *ctx;                     /**< caller context */
+	int pref_af;                   /**< preferred address family */
+	unsigned short port;           /**< tcp port */
+	unsigned char state;           /**< NETRES_xxx */
+	unsigned char resolved;        /**< 1 if res comes from the cache */
+	volatile unsigned char cancelled; /**< 1 if result must be dropped */
+	char host[NETRES_HOST_MAXLEN]; /**< hostname */
+	netres_entry_t res;            /**< resolution result */
+	int ret;                       /**< connection race result */
+	int err;                       /**< connection race error */
+	sock_t sock;                   /**< connected socket (ret == 0) */
+	netaddr_t addr;                /**< connected address */
+	net_lookup_t lookup;           /**< lookup callback (no connection) */
+} netres_req_t;
+
+#ifndef _WIN32
+typedef pthread_t netres_thread_t;
+#define resolver_lock()   pthread_mutex_lock(&resolver.lock)
+#define resolver_unlock() pthread_mutex_unlock(&resolver.lock)
+#else
+typedef HANDLE netres_thread_t;
+#define resolver_lock()   EnterCriticalSection(&resolver.lock)
+#define resolver_unlock() LeaveCriticalSection(&resolver.lock)
+#endif
+
+/** resolver thread pool singleton */
+static struct {
+	int count;                  /**< number of resolver threads */
+	int stop;                   /**< 1 when threads must exit */
+	netres_req_t *head;         /**< requests in submission order */
+	netres_req_t *tail;
+	netres_thread_t threads[NETRES_THREADS];
+#ifndef _WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int notify[2];              /**< completion pipe */
+#else
+	CRITICAL_SECTION lock;
+	HANDLE sem;                 /**< queued requests count */
+	HANDLE evt;                 /**< completion event */
+#endif
+} resolver;
+
+/**
+ * get a monotonic clock in milliseconds
+ */
+static unsigned int netres_ms(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#else
+	return (unsigned int)GetTickCount();
+#endif
+}
+
+/**
+ * connect to all resolved addresses in parallel, keep the first to succeed
+ * @param[in] req request holding the resolved addresses
+ * @return 0 on success, -1 on error (req->ret and req->err are set)
+ * @note attempts start NETRES_ATTEMPT_DELAY apart, or as soon as the
+ *       previous one fails, alternating address families (RFC 8305)
+ */
+static int netres_race(netres_req_t *req)
+{
+#ifndef _WIN32
+	int fds[NETRES_MAX_ADDRS], fd, maxfd;
+	socklen_t optlen;
+#else
+	SOCKET fds[NETRES_MAX_ADDRS], fd;
+	int maxfd, optlen;
+	unsigned long nb;
+#endif
+	const netres_addr_t *order[NETRES_MAX_ADDRS], *ptr;
+	netaddr_t sa[NETRES_MAX_ADDRS];
+	unsigned int i, j, n, next, alive, start, now, last, wait;
+	int family, soerr, winner;
+	fd_set wfds, efds;
+	struct timeval tv;
+
+	// interleave families, starting with the first one returned
+	n = 0;
+	family = (req->res.naddrs ? req->res.addrs[0].family : AF_UNSPEC);
+	for (i=0, j=0; (i < req->res.naddrs) || (j < req->res.naddrs); ) {
+		while ((i < req->res.naddrs) && (req->res.addrs[i].family != family))
+			++i;
+		if (i < req->res.naddrs)
+			order[n++] = &req->res.addrs[i++];
+		while ((j < req->res.naddrs) && (req->res.addrs[j].family == family))
+			++j;
+		if (j < req->res.naddrs)
+			order[n++] = &req->res.addrs[j++];
+	}
+
+	req->ret = NETERR_NOADDR;
+	req->err = 0;
+	winner = -1;
+	next = alive = 0;
+	start = last = netres_ms();
+
+	for (;;) {
+
+		now = netres_ms();
+		if (req->cancelled || (now - start >= NETRES_CONNECT_TIMEOUT))
+			break;
+
+		// start the next attempt
+		if ((next < n) && (!alive || (now - last >= NETRES_ATTEMPT_DELAY))) {
+
+			ptr = order[next];
+			memcpy(&sa[next], &ptr->addr, ptr->len);
+			if (ptr->family == AF_INET6)
+				sa[next].ip6.sin6_port = htons(req->port);
+			else
+				sa[next].ip4.sin_port = htons(req->port);
+
+			fd = socket(ptr->family, ptr->socktype, ptr->protocol);
+			fds[next] = fd;
+			last = now;
+			++next;
+
+			if (fd == nethelper_badsock) {
+				req->err = nethelper_error;
+				req->ret = NETERR_SOCKET;
+				continue;
+			}
+#ifndef _WIN32
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+#else
+			nb = 1;
+			ioctlsocket(fd, FIONBIO, &nb);
+#endif
+			trace_sock("%s attempt %u", req->host, next);
+			if (!connect(fd, (struct sockaddr *)&sa[next-1], ptr->len)) {
+				winner = next - 1;
+				break;
+			}
+			if (!net_pending()
+#ifdef _WIN32
+					&& (WSAGetLastError() != WSAEWOULDBLOCK)
+#endif
+					) {
+				req->err = nethelper_error;
+				req->ret = NETERR_CONNECT;
+				close_sock(fd);
+				fds[next-1] = nethelper_badsock;
+				continue;
+			}
+			++alive;
+		}
+
+		if (!alive) {
+			if (next < n)
+				continue;
+			break;
+		}
+
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		maxfd = 0;
+		for (i=0; i<next; ++i) {
+			if (fds[i] != nethelper_badsock) {
+				FD_SET(fds[i], &wfds);
+				FD_SET(fds[i], &efds);
+				if ((int)fds[i] > maxfd)
+					maxfd = (int)fds[i];
+			}
+		}
+
+		wait = NETRES_CONNECT_TIMEOUT - (now - start);
+		if ((next < n) && (wait > NETRES_ATTEMPT_DELAY - (now - last)))
+			wait = NETRES_ATTEMPT_DELAY - (now - last);
+		tv.tv_sec  = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+
+		if (select(maxfd+1, NULL, &wfds, &efds, &tv) < 0) {
+			req->err = nethelper_error;
+			req->ret = NETERR_CONNECT;
+			break;
+		}
+
+		for (i=0; i<next; ++i) {
+			fd = fds[i];
+			if ((fd == nethelper_badsock)
+					|| (!FD_ISSET(fd, &wfds) && !FD_ISSET(fd, &efds)))
+				continue;
+
+			soerr  = 0;
+			optlen = sizeof(soerr);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&soerr, &optlen))
+				soerr = nethelper_error;
+			if (!soerr && FD_ISSET(fd, &wfds)) {
+				winner = i;
+				break;
+			}
+
+			// failed attempt, the next one starts right away
+			req->err = (soerr ? soerr : nethelper_error);
+			req->ret = NETERR_CONNECT;
+			close_sock(fd);
+			fds[i] = nethelper_badsock;
+			--alive;
+			last = now - NETRES_ATTEMPT_DELAY;
+		}
+		if (winner >= 0)
+			break;
+	}
+
+	if ((winner < 0) && !req->cancelled && (alive > 0)) {
+		req->ret = NETERR_CONNECT;
+#ifndef _WIN32
+		req->err = ETIMEDOUT;
+#else
+		req->err = WSAETIMEDOUT;
+#endif
+	}
+
+	for (i=0; i<next; ++i) {
+		if ((fds[i] != nethelper_badsock) && ((int)i != winner))
+			close_sock(fds[i]);
+	}
+
+	if (winner < 0)
+		return -1;
+
+	memcpy(&req->addr, &sa[winner], order[winner]->len);
+#ifndef _WIN32
+	req->sock = fds[winner];
+#else
+	req->sock.fd  = fds[winner];
+	req->sock.evt = WSACreateEvent();
+	if ((req->sock.evt == WSA_INVALID_EVENT)
+			|| WSAEventSelect(req->sock.fd, req->sock.evt, FD_READ|FD_CLOSE)) {
+		req->err = nethelper_error;
+		req->ret = NETERR_SOCKET;
+		if (req->sock.evt != WSA_INVALID_EVENT)
+			WSACloseEvent(req->sock.evt);
+		close_sock(req->sock.fd);
+		return -1;
+	}
+#endif
+	trace_sock("%s connected at attempt %i/%u", req->host, winner+1, n);
+	req->ret = 0;
+	req->err = 0;
+	return 0;
+}
+
+/**
+ * resolver thread main loop
+ */
+#ifndef _WIN32
+static void *resolver_main(void *arg)
+#else
+static DWORD WINAPI resolver_main(LPVOID arg)
+#endif
+{
+	netres_req_t *req;
+#ifndef _WIN32
+	char c = 0;
+#endif
+
+	for (;;) {
+#ifdef _WIN32
+		WaitForSingleObject(resolver.sem, INFINITE);
+#endif
+		resolver_lock();
+		for (;;) {
+			for (req=resolver.head; req; req=req->next) {
+				if (req->state == NETRES_QUEUED)
+					break;
+			}
+#ifndef _WIN32
+			if (!req && !resolver.stop) {
+				pthread_cond_wait(&resolver.cond, &resolver.lock);
+				continue;
+			}
+#endif
+			break;
+		}
+		if (resolver.stop) {
+			resolver_unlock();
+			break;
+		}
+		if (req)
+			req->state = NETRES_RUNNING;
+		resolver_unlock();
+
+		if (!req)
+			continue;
+
+		// cancelled requests are not worth a lookup
+		if (!req->cancelled && !req->resolved)
+			netres_getaddrinfo(req->pref_af, req->host, 0, &req->res);
+		// a single address is connected without blocking by the event loop
+		if (!req->cancelled && !req->res.err && !req->lookup
+				&& (req->res.naddrs > 1))
+			netres_race(req);
+
+		resolver_lock();
+		req->state = NETRES_DONE;
+		resolver_unlock();
+
+#ifndef _WIN32
+		if (write(resolver.notify[1], &c, 1) < 0) {
+			// pipe already full, the event loop is going to collect anyway
+		}
+#else
+		SetEvent(resolver.evt);
+#endif
+	}
+
+	return 0;
+}
+
+/**
+ * start the resolver threads
+ * @return 0 on success
+ * @note asynchronous lookups are resolved in the caller thread if the
+ *       resolver is not started
+ */
+int net_resolver_init(void)
+{
+	int i;
+
+	if (resolver.count > 0)
+		return 0;
+
+	memset(&resolver, 0, sizeof(resolver));
+#ifndef _WIN32
+	if (pipe(resolver.notify))
+		return error("failed to create resolver pipe");
+	fcntl(resolver.notify[0], F_SETFL,
+			fcntl(resolver.notify[0], F_GETFL)|O_NONBLOCK);
+	fcntl(resolver.notify[1], F_SETFL,
+			fcntl(resolver.notify[1], F_GETFL)|O_NONBLOCK);
+	pthread_mutex_init(&resolver.lock, NULL);
+	pthread_cond_init(&resolver.cond, NULL);
+#else
+	InitializeCriticalSection(&resolver.lock);
+	resolver.sem = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+	resolver.evt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!resolver.sem || !resolver.evt)
+		return error("failed to create resolver events");
+#endif
+
+	for (i=0; i<NETRES_THREADS; ++i) {
+#ifndef _WIN32
+		if (pthread_create(&resolver.threads[i], NULL, resolver_main, NULL))
+			break;
+#else
+		resolver.threads[i] = CreateThread(NULL, 0, resolver_main, NULL, 0, NULL);
+		if (!resolver.threads[i])
+			break;
+#endif
+		++resolver.count;
+	}
+
+	if (!resolver.count)
+		return error("failed to start resolver threads");
+
+	trace_sock("%i resolver threads", resolver.count);
+	return 0;
+}
+
+/**
+ * stop the resolver threads and drop pending lookups
+ */
+void net_resolver_kill(void)
+{
+	int i;
+	netres_req_t *req;
+
+	if (resolver.count <= 0)
+		return;
+
+	resolver_lock();
+	resolver.stop = 1;
+#ifndef _WIN32
+	pthread_cond_broadcast(&resolver.cond);
+#else
+	if (resolver.sem)
+		ReleaseSemaphore(resolver.sem, resolver.count, NULL);
+#endif
+	resolver_unlock();
+
+	// threads blocked in getaddrinfo are left behind
+	for (i=0; i<resolver.count; ++i) {
+#ifndef _WIN32
+		pthread_detach(resolver.threads[i]);
+#else
+		CloseHandle(resolver.threads[i]);
+#endif
+	}
+
+	resolver_lock();
+	while (resolver.head) {
+		req = resolver.head;
+		resolver.head = req->next;
+		if (req->state == NETRES_RUNNING) {
+			// leaked on purpose, its thread still writes into it
+			req->cancelled = 1;
+			continue;
+		}
+		free(req);
+	}
+	resolver.tail  = NULL;
+	resolver.count = 0;
+	resolver_unlock();
+}
+
+#ifndef _WIN32
+/**
+ * get the resolver completion file descriptor
+ * @return readable descriptor or -1 if the resolver is not started
+ */
+int net_resolver_fd(void)
+{
+	return (resolver.count > 0 ? resolver.notify[0] : -1);
+}
+#else
+/**
+ * get the resolver completion event
+ * @return auto-reset event or NULL if the resolver is not started
+ */
+HANDLE net_resolver_event(void)
+{
+	return (resolver.count > 0 ? resolver.evt : NULL);
+}
+#endif
+
+/**
+ * resolve a hostname without blocking and connect a socket client
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname to resolve
+ * @param[in] port tcp port
+ * @param[in] ctx context given back to net_resolver_collect callback
+ * @param[out] out_sock socket
+ * @param[out] addr socket address
+ * @param[out] err error code
+ * @return -1 on error, 0 on success, 1 if connection is pending,
+ *         NET_RESOLVING if the connection completes in net_resolver_collect
+ * @note hostnames with several addresses are connected by the resolver
+ *       threads, racing all addresses (happy eyeballs), a single address
+ *       gets a regular non-blocking connect once resolved
+ */
+int net_client_async(
+		int pref_af,
+		const char *host,
+		unsigned short port,
+		void *ctx,
+		sock_t *out_sock,
+		netaddr_t *addr,
+		int *err)
+{
+	netres_req_t *req;
+	netres_entry_t *e;
+
+	assert(host && *host && port && ctx && out_sock && addr && err);
+
+	if ((resolver.count <= 0) || (strlen(host) >= NETRES_HOST_MAXLEN))
+		return net_client(pref_af, host, port, out_sock, addr, err);
+
+	// a single cached address does not need a connection race
+	e = netres_lookup(pref_af, host);
+	if (e && (e->err || (e->naddrs <= 1)))
+		return net_client(pref_af, host, port, out_sock, addr, err);
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		*err = EAI_MEMORY;
+		return NETERR_RESOLVE;
+	}
+
+	if (e) {
+		memcpy(&req->res, e, sizeof(*e));
+		req->resolved = 1;
+
+	} else if (!netres_getaddrinfo(pref_af, host, AI_NUMERICHOST, &req->res)) {
+		// IP addresses do not need a lookup
+		free(req);
+		return net_client(pref_af, host, port, out_sock, addr, err);
+	}
+
+	req->ret     = NETERR_CONNECT;
+	req->ctx     = ctx;
+	req->pref_af = pref_af;
+	req->port    = port;
+	req->state   = NETRES_QUEUED;
+	strcpy(req->host, host);
+	trace_sock("%s queued", host);
+
+	resolver_lock();
+	if (resolver.tail)
+		resolver.tail->next = req;
+	else
+		resolver.head = req;
+	resolver.tail = req;
+#ifndef _WIN32
+	pthread_cond_signal(&resolver.cond);
+#else
+	ReleaseSemaphore(resolver.sem, 1, NULL);
+#endif
+	resolver_unlock();
+
+	return NET_RESOLVING;
+}
+
+/**
+ * call a lookup callback with resolved addresses
+ */
+static void netres_lookup_done(
+					const netres_entry_t *e,
+					net_lookup_t cb,
+					void *ctx)
+{
+	unsigned int i;
+	netaddr_t addrs[NETRES_MAX_ADDRS];
+
+	for (i=0; i<e->naddrs; ++i)
+		memcpy(&addrs[i], &e->addrs[i].addr, e->addrs[i].len);
+
+	cb(ctx, e->err, addrs, (e->err ? 0 : e->naddrs));
+}
+
+/**
+ * resolve a hostname without blocking
+ * @param[in] pref_af preferred address family
+ * @param[in] host hostname to resolve
+ * @param[in] cb callback receiving the addresses
+ * @param[in] ctx context given back to cb
+ * @return 0 if cb has already been called, NET_RESOLVING if the lookup
+ *         completes in net_resolver_collect, -1 on error
+ */
+int net_lookup_async(
+		int pref_af,
+		const char *host,
+		net_lookup_t cb,
+		void *ctx)
+{
+	netres_req_t *req;
+	netres_entry_t tmp, *e;
+
+	assert(host && *host && cb);
+
+	e = netres_lookup(pref_af, host);
+	if (!e && !netres_getaddrinfo(pref_af, host, AI_NUMERICHOST, &tmp))
+		e = &tmp; // IP address
+
+	if (!e && ((resolver.count <= 0) || (strlen(host) >= NETRES_HOST_MAXLEN))) {
+		netres_getaddrinfo(pref_af, host, 0, &tmp);
+		netres_store(pref_af, host, &tmp);
+		e = &tmp;
+	}
+
+	if (e) {
+		netres_lookup_done(e, cb, ctx);
+		return 0;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return error("failed to allocate lookup request");
+
+	req->ret     = NETERR_RESOLVE;
+	req->ctx     = ctx;
+	req->lookup  = cb;
+	req->pref_af = pref_af;
+	req->state   = NETRES_QUEUED;
+	strcpy(req->host, host);
+	trace_sock("%s queued", host);
+
+	resolver_lock();
+	if (resolver.tail)
+		resolver.tail->next = req;
+	else
+		resolver.head = req;
+	resolver.tail = req;
+#ifndef _WIN32
+	pthread_cond_signal(&resolver.cond);
+#else
+	ReleaseSemaphore(resolver.sem, 1, NULL);
+#endif
+	resolver_unlock();
+
+	return NET_RESOLVING;
+}
+
+/**
+ * drop the pending lookups of a context
+ * @param[in] ctx context given to net_client_async
+ */
+void net_resolver_cancel(void *ctx)
+{
+	netres_req_t *req;
+
+	resolver_lock();
+	for (req=resolver.head; req; req=req->next) {
+		if (req->ctx == ctx)
+			req->cancelled = 1;
+	}
+	resolver_unlock();
+}
+
+/**
+ * connect sockets for completed lookups
+ * @param[in] cb callback called for each completed lookup, with the same
+ *               arguments and return value as net_client_async
+ * @note must be called from the event loop when the resolver fd/event fires
+ */
+void net_resolver_collect(net_resolved_t cb)
+{
+	int ret, err;
+	netres_req_t *req, *prev, *done, **last;
+#ifndef _WIN32
+	char c[32];
+
+	while (read(resolver.notify[0], c, sizeof(c)) > 0)
+		;
+#endif
+
+	// completed requests are unlinked at once, callbacks may queue new ones
+	done = NULL;
+	last = &done;
+	resolver_lock();
+	for (prev=NULL, req=resolver.head; req; ) {
+		if (req->state == NETRES_DONE) {
+			if (prev)
+				prev->next = req->next;
+			else
+				resolver.head = req->next;
+			if (resolver.tail == req)
+				resolver.tail = prev;
+			*last = req;
+			last  = &req->next;
+			req   = req->next;
+			*last = NULL;
+		} else {
+			prev = req;
+			req  = req->next;
+		}
+	}
+	resolver_unlock();
+
+	while (done) {
+		req  = done;
+		done = req->next;
+
+		if (req->cancelled) {
+			if (!req->res.err && !req->ret) {
+#ifndef _WIN32
+				close(req->sock);
+#else
+				net_close(&req->sock);
+#endif
+			}
+			free(req);
+			continue;
+		}
+
+		if (!req->resolved)
+			netres_store(req->pref_af, req->host, &req->res);
+
+		if (req->lookup) {
+			trace_sock("%s --> %i", req->host, req->res.err);
+			netres_lookup_done(&req->res, req->lookup, req->ctx);
+			free(req);
+			continue;
+		}
+
+		if (req->res.err) {
+			ret = NETERR_RESOLVE;
+			err = req->res.err;
+		} else if (req->res.naddrs <= 1) {
+			err = 0;
+			ret = netres_open(2, &req->res, req->port, &req->sock,
+									&req->addr, &err);
+		} else {
+			ret = req->ret;
+			err = req->err;
+			if (ret == NETERR_CONNECT)
+				netres_forget(req->pref_af, req->host);
+		}
+
+		trace_sock("%s:%hu --> %i/%i", req->host, req->port, ret, err);
+		cb(req->ctx, ret, &req->sock, &req->addr, err);
+		free(req);
+	}
+}
+
 /**
  * accept a client connection
  * @param[in] srv the server socket
@@ -339,7 +1325,8 @@ int net_accept(sock_t *srv, sock_t *cli, netaddr_t *addr)
 	addrlen = sizeof(*addr);
 
 #if defined(HAVE_ACCEPT4)
-	*cli = accept4(*srv, (struct sockaddr *)addr, &addrlen, SOCK_NONBLOCK);
+	*cli = accept4(*srv, (struct sockaddr *)addr, &addrlen,
+						SOCK_NONBLOCK|SOCK_CLOEXEC);
 	if (*cli == nethelper_badsock)
 		return nethelper_error;
 
@@ -348,6 +1335,7 @@ int net_accept(sock_t *srv, sock_t *cli, netaddr_t *addr)
 	if (*cli == nethelper_badsock)
 		return nethelper_error;
 	fcntl(*cli, F_SETFL, fcntl(*cli, F_GETFL)|O_NONBLOCK);
+	fcntl(*cli, F_SETFD, FD_CLOEXEC);
 
 #else
 	cli->fd = accept(srv->fd, (struct sockaddr *)addr, &addrlen);
@@ -367,6 +1355,173 @@ int net_accept(sock_t *srv, sock_t *cli, netaddr_t *addr)
 	return 0;
 }
 
+/** socket options of a tuning profile */
+typedef struct _netprof {
+	const char *name;  /**< profile name */
+	int nodelay;       /**< TCP_NODELAY */
+	int sndbuf;        /**< SO_SNDBUF, 0 keeps the system default */
+	int rcvbuf;        /**< SO_RCVBUF, 0 keeps the system default */
+	int notsent_lowat; /**< TCP_NOTSENT_LOWAT, 0 keeps the system default */
+} netprof_t;
+
+static const netprof_t net_profiles[NETPROF_MAX] = {
+	{ "default",     0, 0,           0,           0 },
+	{ "interactive", 1, 32*1024,     32*1024,     0 },
+	{ "bulk",        0, 1024*1024,   1024*1024,   128*1024 }
+};
+
+/**
+ * lookup a socket tuning profile by name
+ * @param[in] name profile name
+ * @return NETPROF_xxx or -1 if unknown
+ */
+int net_profile_lookup(const char *name)
+{
+	int i;
+
+	assert(name);
+
+	for (i=0; i<NETPROF_MAX; ++i) {
+		if (!strcmp(net_profiles[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * get the name of a socket tuning profile
+ * @param[in] profile NETPROF_xxx
+ */
+const char *net_profile_name(int profile)
+{
+	return net_profiles[(profile >= 0) && (profile < NETPROF_MAX)
+										? profile : NETPROF_DEFAULT].name;
+}
+
+/**
+ * enable TCP keepalive probes on a socket
+ * @param[in] s TCP socket
+ * @return 0 on success
+ * @note R2T_KEEPALIVE environment variable sets the idle time in seconds
+ *       before the first probe (0 disables keepalive), a peer that went
+ *       away silently is detected after 6 more probes sent every 10 seconds
+ */
+int net_keepalive(sock_t *s)
+{
+	const char *val;
+	int ret;
+#ifndef _WIN32
+	int n;
+#else
+	struct tcp_keepalive ka;
+	DWORD len;
+#endif
+
+	assert(valid_sock(s));
+
+	if (net_keepalive_idle < 0) {
+		val = getenv("R2T_KEEPALIVE");
+		net_keepalive_idle = (val ? atoi(val) : NET_DEFAULT_KEEPALIVE);
+		if (net_keepalive_idle < 0)
+			net_keepalive_idle = 0;
+		trace_sock("keepalive=%i", net_keepalive_idle);
+	}
+
+	if (!net_keepalive_idle)
+		return 0;
+
+#ifndef _WIN32
+	n = 1;
+	ret = setsockopt(net_fd(s), SOL_SOCKET, SO_KEEPALIVE,
+										(const void *)&n, sizeof(n));
+#ifdef TCP_KEEPIDLE
+	n = net_keepalive_idle;
+	if (!ret)
+		ret = setsockopt(net_fd(s), IPPROTO_TCP, TCP_KEEPIDLE,
+										(const void *)&n, sizeof(n));
+#endif
+#ifdef TCP_KEEPINTVL
+	n = NET_KEEPALIVE_INTERVAL;
+	if (!ret)
+		ret = setsockopt(net_fd(s), IPPROTO_TCP, TCP_KEEPINTVL,
+										(const void *)&n, sizeof(n));
+#endif
+#ifdef TCP_KEEPCNT
+	n = NET_KEEPALIVE_COUNT;
+	if (!ret)
+		ret = setsockopt(net_fd(s), IPPROTO_TCP, TCP_KEEPCNT,
+										(const void *)&n, sizeof(n));
+#endif
+#else
+	// the probe count is fixed by the system (10 since Windows Vista)
+	ka.onoff = 1;
+	ka.keepalivetime = (ULONG) net_keepalive_idle * 1000;
+	ka.keepaliveinterval = NET_KEEPALIVE_INTERVAL * 1000;
+	ret = WSAIoctl(net_fd(s), SIO_KEEPALIVE_VALS, &ka, sizeof(ka),
+								NULL, 0, &len, NULL, NULL);
+#endif
+
+	if (ret)
+		trace_sock("failed to enable keepalive (%i)", nethelper_error);
+
+	return ret;
+}
+
+/**
+ * apply a socket tuning profile
+ * @param[in] s TCP socket
+ * @param[in] profile NETPROF_xxx
+ * @return 0 on success
+ * @note options are inherited by sockets accepted on a tuned listener,
+ *       failures are reported but the socket stays usable
+ * @note keepalive probes are enabled whatever the profile
+ */
+int net_tune(sock_t *s, int profile)
+{
+	const netprof_t *prof;
+	int ret, n;
+
+	assert(valid_sock(s));
+
+	ret = net_keepalive(s);
+
+	if ((profile <= NETPROF_DEFAULT) || (profile >= NETPROF_MAX))
+		return ret;
+
+	prof = &net_profiles[profile];
+
+	n = 1;
+	if (prof->nodelay && setsockopt(net_fd(s), IPPROTO_TCP, TCP_NODELAY,
+												(const void *)&n, sizeof(n)))
+		ret = -1;
+
+	n = prof->sndbuf;
+	if (n && setsockopt(net_fd(s), SOL_SOCKET, SO_SNDBUF,
+										(const void *)&n, sizeof(n)))
+		ret = -1;
+
+	n = prof->rcvbuf;
+	if (n && setsockopt(net_fd(s), SOL_SOCKET, SO_RCVBUF,
+										(const void *)&n, sizeof(n)))
+		ret = -1;
+
+#ifdef TCP_NOTSENT_LOWAT
+	// a receive low-water mark would hold back short tails, the send side
+	// one keeps the socket buffer from hiding the channel backpressure
+	n = prof->notsent_lowat;
+	if (n && setsockopt(net_fd(s), IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+										(const void *)&n, sizeof(n)))
+		ret = -1;
+#endif
+
+	if (ret)
+		trace_sock("failed to apply profile %s (%i)", prof->name,
+				nethelper_error);
+
+	return ret;
+}
+
 /**
  * async read from file descriptor to I/O buffer
  * @param[in] s socket
@@ -406,6 +1561,7 @@ int net_read(
 #else
 	ret = recv(net_fd(s), buf+prefix_size, avail-prefix_size, 0);
 #endif
+	R2T_PROBE3(net__read, net_fd(s), ret, avail-prefix_size);
 	if (ret > 0) {
 		iobuf_commit(ibuf, prefix_size + (unsigned int) ret);
 		*out_size = (unsigned int) ret;
@@ -461,6 +1617,7 @@ int net_write(
 #else
 			ret = send(net_fd(s), data, size, 0);
 #endif
+			R2T_PROBE3(net__write, net_fd(s), ret, size);
 			if (ret < 0)
 				return net_pending() ? 1 : -(int)nethelper_error;
 
@@ -494,6 +1651,7 @@ int net_write(
 #else
 	ret = send(net_fd(s), iobuf_dataptr(obuf), used, 0);
 #endif
+	R2T_PROBE3(net__write, net_fd(s), ret, used);
 	if (ret < 0)
 		return net_pending() ? 1 : -(int)nethelper_error;
 
@@ -103,7 +103,57 @@ const char *net_error(int, int);
 int net_resolve(int, const char *, unsigned short, netaddr_t *, int *);
 int net_server(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
 int net_client(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
+
+/** net_client_async return value when the lookup is queued */
+#define NET_RESOLVING 2
+
+/**
+ * @brief Completion callback of asynchronous lookups
+ * @param[in] ctx context given to net_client_async
+ * @param[in] ret net_client return value
+ * @param[in] sock connected socket (ret >= 0)
+ * @param[in] addr socket address
+ * @param[in] err error code
+ */
+typedef void (*net_resolved_t)(void *, int, sock_t *, netaddr_t *, int);
+
+/**
+ * @brief Completion callback of asynchronous lookups without connection
+ * @param[in] ctx context given to net_lookup_async
+ * @param[in] err getaddrinfo error code
+ * @param[in] addrs resolved addresses (port is 0)
+ * @param[in] count number of addresses
+ */
+typedef void (*net_lookup_t)(void *, int, const netaddr_t *, unsigned int);
+
+int  net_resolver_init(void);
+void net_resolver_kill(void);
+int  net_client_async(int, const char *, unsigned short, void *, sock_t *,
+								netaddr_t *, int *);
+int  net_lookup_async(int, const char *, net_lookup_t, void *);
+void net_resolver_cancel(void *);
+void net_resolver_collect(net_resolved_t);
+#ifndef _WIN32
+int  net_resolver_fd(void);
+#else
+HANDLE net_resolver_event(void);
+#endif
+
+/** maximum number of connections accepted per listener event */
+#define NET_ACCEPT_BURST 64
+
 int net_accept(sock_t *, sock_t *, netaddr_t *);
+
+// socket tuning profiles
+#define NETPROF_DEFAULT     0 /**< system defaults */
+#define NETPROF_INTERACTIVE 1 /**< TCP_NODELAY, small buffers */
+#define NETPROF_BULK        2 /**< large buffers, send low-water mark */
+#define NETPROF_MAX         3
+
+int net_profile_lookup(const char *);
+const char *net_profile_name(int);
+int net_tune(sock_t *, int);
+int net_keepalive(sock_t *);
 int net_read(sock_t*, iobuf_t*, unsigned int, unsigned int*, unsigned int*);
 int net_write(sock_t *, iobuf_t *, const void *, unsigned int, unsigned int *);
 
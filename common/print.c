@@ -25,6 +25,14 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 #include "debug.h"
 #include "print.h"
@@ -35,25 +43,291 @@
 #define PRINT_DBG  3
 #define PRINT_MAX  4
 
+/** longest message, longer ones are truncated */
+#define PRINT_LINE_MAX 2048
+
 int info_level = 3;
 static FILE *print_fps[PRINT_MAX];
 
+/* asynchronous output {{{ */
+#ifndef _WIN32
+/** bytes of messages each thread may have pending */
+#define LOGRING_SIZE  (32*1024)
+/** bytes written to stderr at once by the writer thread */
+#define LOGBATCH_SIZE (64*1024)
+/** time given to the other threads to fill the rings after a wakeup (us) */
+#define LOGBATCH_US   10000
+
+/** pending messages of a thread, single producer and single consumer */
+typedef struct _logring {
+	struct _logring *next; /**< next ring of the list */
+	unsigned int head;     /**< read position (writer thread) */
+	unsigned int tail;     /**< write position (owner thread) */
+	char buf[LOGRING_SIZE];
+} logring_t;
+
+/** asynchronous output singleton */
+static struct {
+	int active;            /**< 1 once the writer thread runs */
+	int idle;              /**< 1 while the writer thread waits for a wakeup */
+	int wakeup[2];         /**< pipe waking the writer thread up */
+	logring_t *rings;      /**< rings of all threads, never freed */
+	pthread_mutex_t lock;  /**< held by the ring consumer */
+	pthread_t thread;
+	char batch[LOGBATCH_SIZE];
+} alog;
+
+static __thread logring_t *alog_ring = NULL;
+
+/**
+ * write a whole buffer to stderr
+ */
+static void alog_write(const char *buf, unsigned int len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(2, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += w;
+		len -= (unsigned int) w;
+	}
+}
+
+/**
+ * queue a message into the ring of the calling thread
+ * @param[in] line message including its final line feed
+ * @param[in] len message length
+ * @return 0 on success, -1 if the ring is full
+ * @note lock-free, the writer thread is only woken up when it sleeps
+ */
+static int alog_push(const char *line, unsigned int len)
+{
+	logring_t *r;
+	unsigned int head, tail, off, part;
+	ssize_t w;
+
+	r = alog_ring;
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return -1;
+		r->next = __atomic_load_n(&alog.rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&alog.rings, &r->next, r, 0,
+								__ATOMIC_RELEASE, __ATOMIC_RELAXED)) ;
+		alog_ring = r;
+	}
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	tail = r->tail;
+	if (len > LOGRING_SIZE - (tail - head))
+		return -1;
+
+	off  = tail & (LOGRING_SIZE - 1);
+	part = LOGRING_SIZE - off;
+	if (part > len)
+		part = len;
+	memcpy(r->buf + off, line, part);
+	memcpy(r->buf, line + part, len - part);
+	__atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&alog.idle, 0, __ATOMIC_SEQ_CST)) {
+		w = write(alog.wakeup[1], "", 1);
+		(void) w;
+	}
+
+	return 0;
+}
+
+/**
+ * write the messages of all rings to stderr
+ * @return number of bytes written
+ * @note must be called with alog.lock held
+ */
+static unsigned int alog_drain(void)
+{
+	logring_t *r;
+	unsigned int head, tail, off, len, used, total;
+
+	used  = 0;
+	total = 0;
+	for (r = __atomic_load_n(&alog.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			off = head & (LOGRING_SIZE - 1);
+			len = tail - head;
+			if (len > LOGRING_SIZE - off)
+				len = LOGRING_SIZE - off;
+			if (len > LOGBATCH_SIZE - used) {
+				alog_write(alog.batch, used);
+				used = 0;
+			}
+			memcpy(alog.batch + used, r->buf + off, len);
+			used  += len;
+			head  += len;
+			total += len;
+		}
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	}
+
+	if (used > 0)
+		alog_write(alog.batch, used);
+
+	return total;
+}
+
+/**
+ * writer thread main loop
+ */
+static void *alog_main(void *arg)
+{
+	char buf[64];
+	unsigned int n;
+	sigset_t set;
+	struct timespec ts;
+
+	// signals are handled by the event loop thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	ts.tv_sec  = 0;
+	ts.tv_nsec = LOGBATCH_US * 1000;
+
+	for (;;) {
+		pthread_mutex_lock(&alog.lock);
+		n = alog_drain();
+		pthread_mutex_unlock(&alog.lock);
+		if (!n) {
+			// messages queued before the flag is seen are drained here
+			__atomic_store_n(&alog.idle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_lock(&alog.lock);
+			n = alog_drain();
+			pthread_mutex_unlock(&alog.lock);
+			if (!n && (read(alog.wakeup[0], buf, sizeof(buf)) < 0)
+					&& (errno != EINTR))
+				break;
+		}
+		// no pause while the threads log faster than it writes
+		if (n < LOGRING_SIZE / 4)
+			nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * write the pending messages before the process exits
+ */
+static void alog_flush(void)
+{
+	pthread_mutex_lock(&alog.lock);
+	alog_drain();
+	pthread_mutex_unlock(&alog.lock);
+}
+
+/**
+ * start the writer thread
+ * @note messages are written synchronously if it cannot be started
+ */
+static void alog_start(void)
+{
+	if (pipe(alog.wakeup))
+		return;
+
+	fcntl(alog.wakeup[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&alog.lock, NULL);
+	if (pthread_create(&alog.thread, NULL, alog_main, NULL)) {
+		close(alog.wakeup[0]);
+		close(alog.wakeup[1]);
+		return;
+	}
+
+	atexit(alog_flush);
+	alog.active = 1;
+}
+#endif
+/* }}} */
 /* common code {{{  */
+
+/**
+ * output a complete message
+ * @param[in] fp output stream
+ * @param[in] line message including its final line feed
+ * @param[in] len message length
+ */
+static void print_line(FILE *fp, const char *line, unsigned int len)
+{
+#ifndef _WIN32
+	if (alog.active && (fp == stderr)) {
+		if (!alog_push(line, len))
+			return;
+		// full ring, drain it here to keep the messages in order
+		pthread_mutex_lock(&alog.lock);
+		alog_drain();
+		if (alog_push(line, len))
+			alog_write(line, len);
+		pthread_mutex_unlock(&alog.lock);
+		return;
+	}
+#endif
+	fwrite(line, 1, len, fp);
+}
+
+/**
+ * output a preformatted message on stderr
+ * @param[in] msg message without final line feed
+ * @note goes through the writer thread like the other messages
+ */
+void print_raw(const char *msg)
+{
+	char line[PRINT_LINE_MAX];
+	unsigned int len;
+
+	assert(msg);
+
+	len = (unsigned int) strlen(msg);
+	if (len > sizeof(line) - 1)
+		len = sizeof(line) - 1;
+	memcpy(line, msg, len);
+	line[len++] = '\n';
+
+	print_line(stderr, line, len);
+}
+
 static void do_print(
 					unsigned int fid,
 					const char *prefix,
 					const char *fmt,
 					va_list va)
 {
-	FILE *fp;
+	char line[PRINT_LINE_MAX];
+	unsigned int off;
+	int len;
 
 	assert(print_fps[fid] && fmt);
 
-	fp = print_fps[fid];
-	if (prefix)
-		fputs(prefix, fp);
-	vfprintf(fp, fmt, va);
-	fputc('\n', fp);
+	off = 0;
+	if (prefix) {
+		off = (unsigned int) strlen(prefix);
+		memcpy(line, prefix, off);
+	}
+
+	// formatted once, written with a single call
+	len = vsnprintf(line + off, sizeof(line) - off - 1, fmt, va);
+	if (len < 0)
+		return;
+	if ((unsigned int) len > sizeof(line) - off - 2)
+		len = (int)(sizeof(line) - off - 2);
+	off += (unsigned int) len;
+	line[off++] = '\n';
+
+	print_line(print_fps[fid], line, off);
 }
 /* }}} */
 /* debug {{{ */
@@ -91,9 +365,11 @@ void __trace(
 /* info/warn/error API {{{ */
 void print_init(void)
 {
-#ifdef DEBUG
+#if defined(DEBUG) || !defined(_WIN32)
 	char *val;
+#endif
 
+#ifdef DEBUG
 	val = getenv("DEBUG");
 	if (val)
 		debug_level = atoi(val);
@@ -105,6 +381,17 @@ void print_init(void)
 	print_fps[0] = stderr;
 	print_fps[1] = stderr;
 	print_fps[2] = stderr;
+
+#ifndef _WIN32
+	val = getenv("R2T_LOG_SYNC");
+#ifdef DEBUG
+	// debug builds keep messages ordered with traces and hex dumps
+	if (val && (*val == '0'))
+#else
+	if (!val || !*val || (*val == '0'))
+#endif
+		alog_start();
+#endif
 }
 
 /**
@@ -112,8 +399,9 @@ void print_init(void)
  * @param[in] level information verbosity level
  * @param[in] fmt format string
  * @see warn error
+ * @note called through the info() macro once the level is checked
  */
-void info(int level, const char *fmt, ...)
+void __info(int level, const char *fmt, ...)
 {
 	va_list va;
 
@@ -166,8 +454,9 @@ int error(const char *fmt, ...)
 
 /**
  * print I/O transfer length
+ * @note called through the print_xfer() macro once the level is checked
  */
-void print_xfer(const char *name, char rw, unsigned int size)
+void __print_xfer(const char *name, char rw, unsigned int size)
 {
 	info(1, (rw=='r'?"%-6s          < %-8u":"%-6s %8u >"), name, size);
 }
@@ -24,11 +24,22 @@
 
 void print_init(void);
 
-void info(int, const char *, ...);
+extern int info_level;
+
+void __info(int, const char *, ...);
 int warn(const char *, ...);
 int error(const char *, ...);
 
-void print_xfer(const char *, char, unsigned int);
+void __print_xfer(const char *, char, unsigned int);
+void print_raw(const char *);
+
+/** print information, arguments are only evaluated if the level is enabled */
+#define info(level, ...) \
+	do { if ((level) <= info_level) __info(level, __VA_ARGS__); } while (0)
+
+/** print I/O transfer length if info level 1 is enabled */
+#define print_xfer(name, rw, size) \
+	do { if (info_level >= 1) __print_xfer(name, rw, size); } while (0)
 
 #ifdef DEBUG
 void fprint_hex(void *, unsigned int, FILE *);
@@ -0,0 +1,65 @@
+/**
+ * @file probes.h
+ * USDT static tracepoints (provider "rdp2tcp")
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RDP2TCP_PROBES_H__
+#define __RDP2TCP_PROBES_H__
+
+/*
+ * Probes compile to a single nop and an ELF note when <sys/sdt.h> is
+ * available (systemtap-sdt-dev / systemtap-sdt-devel), and to nothing
+ * otherwise or with -DR2T_NO_SDT. They are listed by
+ * "bpftrace -l 'usdt:./rdp2tcp:*'", the tools/bpftrace scripts use them.
+ *
+ * frame__in      (cmd, tid, len)         channel frame parsed
+ * tunnel__recv   (tid, len, chan_queue)  tunnel data queued for the channel
+ * tunnel__write  (tid, len, queue)       channel data written to a tunnel
+ * net__read      (fd, ret, avail)        read() result
+ * net__write     (fd, ret, len)          write() result
+ * tunnel__create (tid, kind, host, port) tunnel requested (0 forward,
+ *                                        1 reverse listener, 2 reverse client)
+ * tunnel__up     (tid, connect_us)       tunnel connected
+ * tunnel__close  (tid, rx_bytes, tx_bytes, age_us)
+ * ping__send     (seq)
+ * ping__recv     (seq, rtt_us)
+ */
+
+#if !defined(_WIN32) && !defined(R2T_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define R2T_HAVE_SDT
+#endif
+#endif
+
+#ifdef R2T_HAVE_SDT
+#include <sys/sdt.h>
+
+#define R2T_PROBE1(name, a)          DTRACE_PROBE1(rdp2tcp, name, a)
+#define R2T_PROBE2(name, a, b)       DTRACE_PROBE2(rdp2tcp, name, a, b)
+#define R2T_PROBE3(name, a, b, c)    DTRACE_PROBE3(rdp2tcp, name, a, b, c)
+#define R2T_PROBE4(name, a, b, c, d) DTRACE_PROBE4(rdp2tcp, name, a, b, c, d)
+#else
+#define R2T_PROBE1(name, a)          ((void)0)
+#define R2T_PROBE2(name, a, b)       ((void)0)
+#define R2T_PROBE3(name, a, b, c)    ((void)0)
+#define R2T_PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+#endif // __RDP2TCP_PROBES_H__
@@ -40,12 +40,24 @@
 #define R2TCMD_BIND  0x04
 #define R2TCMD_RCONN 0x05
 #define R2TCMD_COMPRESS 0x06
-#define R2TCMD_MAX   0x07
+#define R2TCMD_DEDUP 0x07
+#define R2TCMD_RESOLVE 0x08
+#define R2TCMD_POOL  0x09
+#define R2TCMD_RESUME 0x0a
+#define R2TCMD_SHUTDOWN 0x0b
+#define R2TCMD_MAX   0x0c
 
 // address family on wire
 #define TUNAF_ANY  0x00
 #define TUNAF_IPV4 0x01
 #define TUNAF_IPV6 0x02
+#define TUNAF_MASK 0x0f
+/** socket tuning profile (NETPROF_xxx) of R2TCMD_CONN/BIND, stored in the
+ *  high nibble of the address family
+ * @note servers without profile support reject a non-zero profile as an
+ *       invalid address family, only NETPROF_DEFAULT is compatible */
+#define TUNAF_PROFILE(af)    (((af) >> 4) & 0x0f)
+#define TUNAF_SET_PROFILE(p) ((unsigned char)((p) << 4))
 
 // rdp2tcp error codes
 #define R2TERR_SUCCESS     0x00
@@ -66,9 +78,17 @@ PACK(struct _r2tmsg {
 });
 typedef struct _r2tmsg r2tmsg_t;
 
-/** R2TCMD_CONN or R2TCMD_BIND message (client --> server) */
+/** highest tunnel identifier, 0xfe and 0xff are reserved for channel-wide
+ *  COMPRESS/DEDUP frames (R2TCOMP_STREAM, R2TCOMP_NEGOTIATE) */
+#define R2T_TID_MAX 0xfd
+
+/** largest number of spare connections of a R2TCMD_POOL pool */
+#define R2T_POOL_MAX 8
+
+/** R2TCMD_CONN, R2TCMD_BIND or R2TCMD_POOL message (client --> server)
+ * @note R2TCMD_POOL holds the number of spare connections in id */
 PACK(struct _r2tmsg_connreq {
-	unsigned char cmd;   /**< R2TCMD_CONN or R2TCMD_BIND */
+	unsigned char cmd;   /**< R2TCMD_CONN, R2TCMD_BIND or R2TCMD_POOL */
 	unsigned char id;    /**< tunnel identifier */
 	unsigned short port; /**< TCP port or 0 for process tunnel */
 	unsigned char af;    /**< address family */
@@ -103,15 +123,109 @@ typedef struct _r2tmsg_rconnreq r2tmsg_rconnreq_t;
 #define COMPRESS_GZIP 0x01
 #define COMPRESS_LZ4  0x02
 
-/** R2TCMD_COMPRESS message (client <--> server) */
+// Compression modes
+#define R2TCOMP_MODE_NONE    0x00 /**< no compression */
+#define R2TCOMP_MODE_TUNNEL  0x01 /**< DATA payloads compressed one by one */
+#define R2TCOMP_MODE_CHANNEL 0x02 /**< whole frame stream compressed */
+
+// R2TCMD_COMPRESS special tunnel identifiers
+#define R2TCOMP_NEGOTIATE 0xff /**< compression negotiation */
+#define R2TCOMP_STREAM    0xfe /**< channel-wide compressed stream chunk */
+
+/** set in stream chunk level field when a new stream starts */
+#define R2TCOMP_LEVEL_RESET 0x80
+
+/** R2TCMD_COMPRESS message (client <--> server)
+ * @note with id R2TCOMP_STREAM, data holds a chunk of the compressed
+ *       frame stream, flushed at each channel write */
 PACK(struct _r2tmsg_compress {
 	unsigned char cmd;      /**< R2TCMD_COMPRESS */
-	unsigned char id;       /**< tunnel identifier */
+	unsigned char id;       /**< tunnel identifier or R2TCOMP_STREAM */
 	unsigned char algorithm; /**< compression algorithm */
 	unsigned char level;    /**< compression level (1-9 for gzip, 1-16 for lz4) */
-	unsigned int original_size; /**< original data size */
+	unsigned int original_size; /**< original data size (network order) */
 	char data[0];          /**< compressed data */
 });
 typedef struct _r2tmsg_compress r2tmsg_compress_t;
 
+/** R2TCMD_COMPRESS negotiation (client --> server request, server answer)
+ * @note the server answers with the accepted parameters or R2TCOMP_MODE_NONE */
+PACK(struct _r2tmsg_compneg {
+	unsigned char cmd;       /**< R2TCMD_COMPRESS */
+	unsigned char id;        /**< R2TCOMP_NEGOTIATE */
+	unsigned char algorithm; /**< compression algorithm */
+	unsigned char level;     /**< compression level */
+	unsigned char mode;      /**< R2TCOMP_MODE_xxx */
+});
+typedef struct _r2tmsg_compneg r2tmsg_compneg_t;
+
+// R2TCMD_DEDUP special tunnel identifier
+#define R2TDEDUP_NEGOTIATE 0xff /**< chunk cache negotiation */
+
+/** R2TCMD_DEDUP negotiation (client --> server request, server answer)
+ * @note the server answers with the accepted cache size, 0 to refuse.
+ *       Both ends then reset their chunk caches.
+ *       Other R2TCMD_DEDUP messages carry a DATA payload encoded as
+ *       DEDUP_REC_xxx records (see dedup.h) */
+PACK(struct _r2tmsg_dedupneg {
+	unsigned char cmd;   /**< R2TCMD_DEDUP */
+	unsigned char id;    /**< R2TDEDUP_NEGOTIATE */
+	unsigned int budget; /**< chunk cache size in bytes (network order) */
+});
+typedef struct _r2tmsg_dedupneg r2tmsg_dedupneg_t;
+
+/** maximum number of addresses in a R2TCMD_RESOLVE answer */
+#define R2TRESOLVE_MAX_ADDRS 8
+
+PACK(struct _r2tmsg_resolvereq {
+	unsigned char cmd;   /**< R2TCMD_RESOLVE */
+	unsigned char af;    /**< requested address family (TUNAF_xxx) */
+	char hostname[0];    /**< NUL-terminated hostname */
+});
+typedef struct _r2tmsg_resolvereq r2tmsg_resolvereq_t;
+
+/** hostname resolution answer
+ * @note data holds count records ([TUNAF_xxx][4 or 16 bytes address])
+ *       followed by the NUL-terminated requested hostname */
+PACK(struct _r2tmsg_resolveans {
+	unsigned char cmd;   /**< R2TCMD_RESOLVE */
+	unsigned char af;    /**< requested address family (TUNAF_xxx) */
+	unsigned char err;   /**< error code */
+	unsigned char count; /**< number of addresses */
+	unsigned char data[0];
+});
+typedef struct _r2tmsg_resolveans r2tmsg_resolveans_t;
+
+/** R2TCMD_RESUME message (client <--> server)
+ * @note sent by the client for each tunnel kept during a channel outage,
+ *       the server answers with its own counter then both ends send again
+ *       the bytes the other one missed */
+PACK(struct _r2tmsg_resume {
+	unsigned char cmd; /**< R2TCMD_RESUME */
+	unsigned char id;  /**< tunnel identifier */
+	unsigned int seq;  /**< payload bytes received on the tunnel (network order) */
+});
+typedef struct _r2tmsg_resume r2tmsg_resume_t;
+
+/* R2TCMD_SHUTDOWN (client <--> server) is a bare r2tmsg_t sent once the
+ * local peer of a tunnel has sent FIN, after its last R2TCMD_DATA. The
+ * receiver shuts down the write side of its own socket once pending output
+ * is flushed. The server closes the tunnel when both directions are shut. */
+
+// R2TCMD_PING kinds (stored in id)
+#define R2TPING_KEEPALIVE 0x00 /**< empty ping, not answered */
+#define R2TPING_PROBE     0x01 /**< timestamped ping, echoed by the peer */
+#define R2TPING_ECHO      0x02 /**< answer to R2TPING_PROBE */
+
+/** R2TCMD_PING probe or echo message
+ * @note the peer sends back seq and ts untouched, the sender computes the
+ *       channel round-trip time from its own clock */
+PACK(struct _r2tmsg_ping {
+	unsigned char cmd; /**< R2TCMD_PING */
+	unsigned char id;  /**< R2TPING_xxx */
+	unsigned int seq;  /**< probe sequence number (network order) */
+	unsigned int ts;   /**< sender timestamp in microseconds (network order) */
+});
+typedef struct _r2tmsg_ping r2tmsg_ping_t;
+
 #endif
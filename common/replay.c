@@ -0,0 +1,152 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2025, jnqpblc
+ *
+ */
+/**
+ * @file replay.c
+ * bounded retransmit buffers of tunnel payloads
+ *
+ * Each end keeps the last bytes it sent on a tunnel in a ring. After a
+ * channel outage, the peer tells how many bytes it received and the
+ * missing ones are sent again from the ring.
+ */
+#include "replay.h"
+#include "debug.h"
+#include "print.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * initialize a replay buffer
+ * @param[in] r replay buffer
+ * @param[in] size window size in bytes, 0 to only count bytes
+ * @note size is rounded down to a power of 2, memory is allocated on the
+ *       first append
+ */
+void replay_init(replay_t *r, unsigned int size)
+{
+	unsigned int pow2;
+
+	assert(r);
+
+	if (size > REPLAY_MAX_SIZE)
+		size = REPLAY_MAX_SIZE;
+
+	pow2 = 0;
+	if (size) {
+		for (pow2=1; pow2 <= size / 2; pow2 <<= 1)
+			;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->size = pow2;
+}
+
+/**
+ * destroy a replay buffer
+ * @param[in] r replay buffer
+ */
+void replay_kill(replay_t *r)
+{
+	assert(r);
+
+	if (r->data)
+		free(r->data);
+	r->data = NULL;
+	r->used = 0;
+}
+
+/**
+ * record bytes sent to the peer
+ * @param[in] r replay buffer
+ * @param[in] data sent bytes
+ * @param[in] len number of bytes
+ * @note on allocation failure the bytes are only counted and the window
+ *       is disabled
+ */
+void replay_append(replay_t *r, const void *data, unsigned int len)
+{
+	unsigned int pos, n;
+	const unsigned char *ptr;
+
+	assert(r && (data || !len));
+
+	if (r->size && !r->data) {
+		r->data = malloc(r->size);
+		if (!r->data) {
+			error("failed to allocate %u bytes replay buffer", r->size);
+			r->size = 0;
+		}
+	}
+
+	r->seq += len;
+	if (!r->size)
+		return;
+
+	// only the last window bytes are kept
+	ptr = (const unsigned char *)data;
+	if (len > r->size) {
+		ptr += len - r->size;
+		len = r->size;
+	}
+
+	pos = (r->seq - len) & (r->size - 1);
+	n = r->size - pos;
+	if (n > len)
+		n = len;
+	memcpy(r->data + pos, ptr, n);
+	memcpy(r->data, ptr + n, len - n);
+
+	r->used += len;
+	if (r->used > r->size)
+		r->used = r->size;
+}
+
+/**
+ * count bytes to send again
+ * @param[in] r replay buffer
+ * @param[in] from sequence number of the first byte the peer misses
+ * @return number of bytes to replay or -1 if they are not held anymore
+ */
+int replay_held(const replay_t *r, unsigned int from)
+{
+	unsigned int missing;
+
+	assert(r);
+
+	missing = r->seq - from;
+	if (missing > r->used)
+		return -1;
+
+	return (int) missing;
+}
+
+/**
+ * get contiguous bytes to send again
+ * @param[in] r replay buffer
+ * @param[in] from sequence number of the first byte
+ * @param[out] data pointer to the bytes
+ * @return number of contiguous bytes available at data
+ * @note replay_held() must have accepted from
+ */
+unsigned int replay_peek(const replay_t *r, unsigned int from,
+									const void **data)
+{
+	unsigned int pos, len;
+
+	assert(r && data && (replay_held(r, from) >= 0));
+
+	len = r->seq - from;
+	if (!len)
+		return 0;
+
+	pos = from & (r->size - 1);
+	if (len > r->size - pos)
+		len = r->size - pos;
+
+	*data = r->data + pos;
+	return len;
+}
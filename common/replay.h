@@ -0,0 +1,30 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2025, jnqpblc
+ *
+ */
+#ifndef __RDP2TCP_REPLAY_H__
+#define __RDP2TCP_REPLAY_H__
+
+/** default replay window of each tunnel direction (bytes) */
+#define REPLAY_DEFAULT_SIZE (256*1024)
+/** maximum replay window (bytes) */
+#define REPLAY_MAX_SIZE     (16*1024*1024)
+
+/** last bytes sent on a tunnel, kept until a channel outage is over
+ * @note sequence numbers count the tunnel payload bytes and wrap at 2^32 */
+typedef struct _replay {
+	unsigned char *data; /**< ring buffer, allocated on first use */
+	unsigned int size;   /**< ring buffer size (power of 2), 0 if disabled */
+	unsigned int seq;    /**< sequence number of the next byte */
+	unsigned int used;   /**< bytes held in the ring (at most size) */
+} replay_t;
+
+void replay_init(replay_t *, unsigned int);
+void replay_kill(replay_t *);
+void replay_append(replay_t *, const void *, unsigned int);
+int  replay_held(const replay_t *, unsigned int);
+unsigned int replay_peek(const replay_t *, unsigned int, const void **);
+
+#endif // __RDP2TCP_REPLAY_H__
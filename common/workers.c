@@ -0,0 +1,527 @@
+/**
+ * @file workers.c
+ * worker threads compressing and inflating tunnel payloads
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "workers.h"
+#include "compress.h"
+#include "rdp2tcp.h"
+#include "debug.h"
+#include "print.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+typedef pthread_t worker_thread_t;
+#define pool_lock()   pthread_mutex_lock(&pool.lock)
+#define pool_unlock() pthread_mutex_unlock(&pool.lock)
+#else
+typedef HANDLE worker_thread_t;
+#define pool_lock()   EnterCriticalSection(&pool.lock)
+#define pool_unlock() LeaveCriticalSection(&pool.lock)
+#endif
+
+/** compression worker pool singleton */
+static struct {
+	int count;                  /**< number of worker threads */
+	int stop;                   /**< 1 when threads must exit */
+	unsigned int pending;       /**< number of submitted jobs */
+	unsigned short busy[2][256]; /**< pending jobs per direction and tunnel */
+	struct list_head jobs;      /**< pending jobs in submission order */
+	r2t_job_t *head;            /**< first job waiting for a worker */
+	r2t_job_t *tail;            /**< last job waiting for a worker */
+	worker_thread_t threads[WORKERS_MAX];
+#ifndef _WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int notify[2];              /**< completion pipe */
+#else
+	CRITICAL_SECTION lock;
+	HANDLE sem;                 /**< queued jobs count */
+	HANDLE evt;                 /**< completion event */
+#endif
+} pool;
+
+/**
+ * wake up the event loop
+ */
+static void workers_notify(void)
+{
+#ifndef _WIN32
+	char c = 0;
+
+	if (write(pool.notify[1], &c, 1) < 0) {
+		// pipe already full, the event loop is going to collect anyway
+	}
+#else
+	SetEvent(pool.evt);
+#endif
+}
+
+/**
+ * process a single job in a worker thread
+ * @param[in] job job to process
+ */
+static void workers_run(r2t_job_t *job)
+{
+	unsigned char *out;
+	unsigned int size;
+
+	switch (job->op) {
+
+		case WORKER_OP_COMPRESS:
+			// data is sent uncompressed when compression does not pay
+			size = get_max_compressed_size(job->algorithm, job->len);
+			out = malloc(size + 6);
+			if (!out)
+				break;
+
+			if (compress_data(job->algorithm, job->level, job->data, job->len,
+						out + 6, &size) || (size + 6 >= job->len)) {
+				free(out);
+				break;
+			}
+
+			out[0] = job->algorithm;
+			out[1] = job->level;
+			*((unsigned int *)(out + 2)) = htonl(job->len);
+			free(job->data);
+			job->data = out;
+			job->len  = size + 6;
+			job->cmd  = R2TCMD_COMPRESS;
+			break;
+
+		case WORKER_OP_DECOMPRESS:
+			size = job->orig;
+			out = malloc(size);
+			if (!out || decompress_data(job->algorithm, job->data, job->len,
+													out, &size)
+					|| (size != job->orig)) {
+				free(out);
+				job->status = -1;
+				break;
+			}
+
+			free(job->data);
+			job->data = out;
+			job->len  = size;
+			break;
+	}
+}
+
+/**
+ * wait for a queued job
+ * @return next job or NULL if the pool is stopping
+ */
+static r2t_job_t *workers_wait(void)
+{
+	r2t_job_t *job;
+
+#ifdef _WIN32
+	WaitForSingleObject(pool.sem, INFINITE);
+#endif
+	pool_lock();
+#ifndef _WIN32
+	while (!pool.head && !pool.stop)
+		pthread_cond_wait(&pool.cond, &pool.lock);
+#endif
+
+	job = NULL;
+	if (!pool.stop && pool.head) {
+		job = pool.head;
+		pool.head = job->next;
+		if (!pool.head)
+			pool.tail = NULL;
+	}
+	pool_unlock();
+
+	return job;
+}
+
+#ifndef _WIN32
+static void *workers_main(void *arg)
+#else
+static DWORD WINAPI workers_main(LPVOID arg)
+#endif
+{
+	r2t_job_t *job;
+
+	while ((job = workers_wait())) {
+		workers_run(job);
+
+		pool_lock();
+		job->done = 1;
+		pool_unlock();
+
+		workers_notify();
+	}
+
+	return 0;
+}
+
+/**
+ * guess worker threads count (R2T_WORKERS or CPU count - 1)
+ */
+static int workers_default_count(void)
+{
+	const char *val;
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO si;
+#endif
+
+	val = getenv("R2T_WORKERS");
+	if (val && *val)
+		return atoi(val);
+
+#ifndef _WIN32
+	n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	GetSystemInfo(&si);
+	n = (int) si.dwNumberOfProcessors;
+#endif
+	// keep a core for the event loop
+	--n;
+	if (n > 4)
+		n = 4;
+
+	return n;
+}
+
+/**
+ * start the compression worker pool
+ * @return number of worker threads (0 if jobs must run inline)
+ * @note R2T_WORKERS environment variable overrides the threads count
+ */
+int workers_init(void)
+{
+	int i, n;
+
+	if (pool.count > 0)
+		return pool.count;
+
+	memset(&pool, 0, sizeof(pool));
+	list_init(&pool.jobs);
+
+	n = workers_default_count();
+	if (n <= 0)
+		return 0;
+	if (n > WORKERS_MAX)
+		n = WORKERS_MAX;
+
+#ifndef _WIN32
+	if (pipe(pool.notify))
+		return error("failed to create workers pipe");
+	fcntl(pool.notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(pool.notify[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+#else
+	InitializeCriticalSection(&pool.lock);
+	pool.sem = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+	pool.evt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!pool.sem || !pool.evt)
+		return error("failed to create workers events");
+#endif
+
+	for (i=0; i<n; ++i) {
+#ifndef _WIN32
+		if (pthread_create(&pool.threads[i], NULL, workers_main, NULL))
+			break;
+#else
+		pool.threads[i] = CreateThread(NULL, 0, workers_main, NULL, 0, NULL);
+		if (!pool.threads[i])
+			break;
+#endif
+	}
+
+	pool.count = i;
+	if (!i) {
+		workers_kill();
+		return error("failed to start compression workers");
+	}
+
+	info(1, "started %i compression workers", i);
+	return i;
+}
+
+/**
+ * stop worker threads and destroy pending jobs
+ */
+void workers_kill(void)
+{
+	int i;
+	r2t_job_t *job, *bak;
+
+	trace_comp("count=%i, pending=%u", pool.count, pool.pending);
+
+	if (!valid_list_head(&pool.jobs))
+		return;
+
+	if (pool.count > 0) {
+		pool_lock();
+		pool.stop = 1;
+#ifndef _WIN32
+		pthread_cond_broadcast(&pool.cond);
+#else
+		ReleaseSemaphore(pool.sem, pool.count, NULL);
+#endif
+		pool_unlock();
+
+		for (i=0; i<pool.count; ++i) {
+#ifndef _WIN32
+			pthread_join(pool.threads[i], NULL);
+#else
+			WaitForSingleObject(pool.threads[i], INFINITE);
+			CloseHandle(pool.threads[i]);
+#endif
+		}
+	}
+
+	list_for_each_safe(job, bak, &pool.jobs) {
+		list_del(&job->list);
+		free(job->data);
+		free(job);
+	}
+
+#ifndef _WIN32
+	if (pool.notify[0] > 0) {
+		close(pool.notify[0]);
+		close(pool.notify[1]);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+#else
+	if (pool.sem)
+		CloseHandle(pool.sem);
+	if (pool.evt)
+		CloseHandle(pool.evt);
+	DeleteCriticalSection(&pool.lock);
+#endif
+
+	memset(&pool, 0, sizeof(pool));
+}
+
+/**
+ * get the number of worker threads
+ */
+int workers_count(void)
+{
+	return pool.count;
+}
+
+/**
+ * get the number of jobs not yet collected
+ */
+int workers_pending(void)
+{
+	return (int) pool.pending;
+}
+
+/**
+ * check whether a tunnel has jobs not yet collected
+ * @param[in] dir WORKER_OUT or WORKER_IN
+ * @param[in] tid rdp2tcp tunnel ID
+ * @return number of pending jobs
+ * @note later messages of a busy tunnel must be submitted as WORKER_OP_NONE
+ *       jobs to stay in order
+ */
+int workers_busy(unsigned char dir, unsigned char tid)
+{
+	return pool.busy[dir][tid];
+}
+
+/**
+ * submit a job to the worker pool
+ * @param[in] dir WORKER_OUT or WORKER_IN
+ * @param[in] tid rdp2tcp tunnel ID
+ * @param[in] cmd rdp2tcp command (R2TCMD_xxx) of the resulting message
+ * @param[in] op WORKER_OP_xxx
+ * @param[in] algorithm compression algorithm
+ * @param[in] level compression level
+ * @param[in] orig original size of compressed data
+ * @param[in] data payload (copied)
+ * @param[in] len size of payload
+ * @return 0 on success
+ */
+int workers_submit(
+		unsigned char dir,
+		unsigned char tid,
+		unsigned char cmd,
+		unsigned char op,
+		unsigned char algorithm,
+		unsigned char level,
+		unsigned int orig,
+		const void *data,
+		unsigned int len)
+{
+	r2t_job_t *job;
+
+	assert(pool.count > 0);
+	trace_comp("dir=%u, tid=0x%02x, cmd=%u, op=%u, len=%u",
+			dir, tid, cmd, op, len);
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return error("failed to allocate compression job");
+
+	if (len > 0) {
+		job->data = malloc(len);
+		if (!job->data) {
+			free(job);
+			return error("failed to allocate compression job");
+		}
+		memcpy(job->data, data, len);
+	}
+
+	job->dir       = dir;
+	job->tid       = tid;
+	job->cmd       = cmd;
+	job->op        = op;
+	job->algorithm = algorithm;
+	job->level     = level;
+	job->orig      = orig;
+	job->len       = len;
+
+	list_add_tail(&job->list, &pool.jobs);
+	++pool.busy[dir][tid];
+	++pool.pending;
+
+	pool_lock();
+	if (op == WORKER_OP_NONE) {
+		job->done = 1;
+	} else {
+		if (pool.tail)
+			pool.tail->next = job;
+		else
+			pool.head = job;
+		pool.tail = job;
+#ifndef _WIN32
+		pthread_cond_signal(&pool.cond);
+#else
+		ReleaseSemaphore(pool.sem, 1, NULL);
+#endif
+	}
+	pool_unlock();
+
+	if (op == WORKER_OP_NONE)
+		workers_notify();
+
+	return 0;
+}
+
+/**
+ * drop results of pending jobs of a closed tunnel
+ * @param[in] dir WORKER_OUT or WORKER_IN
+ * @param[in] tid rdp2tcp tunnel ID
+ */
+void workers_cancel(unsigned char dir, unsigned char tid)
+{
+	r2t_job_t *job;
+
+	if (!pool.busy[dir][tid])
+		return;
+
+	trace_comp("dir=%u, tid=0x%02x", dir, tid);
+
+	list_for_each(job, &pool.jobs) {
+		if ((job->dir == dir) && (job->tid == tid))
+			job->cancelled = 1;
+	}
+}
+
+/**
+ * emit completed jobs, preserving submission order for each tunnel
+ * @param[in] emit callback invoked for each completed job
+ * @return 0 on success, -1 if a callback failed
+ */
+int workers_collect(workers_emit_t emit)
+{
+	int ret;
+	unsigned char tid;
+	unsigned char blocked[2][32];
+	r2t_job_t *job, *bak;
+	struct list_head ready;
+#ifndef _WIN32
+	char tmp[64];
+
+	while (read(pool.notify[0], tmp, sizeof(tmp)) > 0)
+		;
+#endif
+
+	list_init(&ready);
+	memset(blocked, 0, sizeof(blocked));
+
+	pool_lock();
+	list_for_each_safe(job, bak, &pool.jobs) {
+		tid = job->tid;
+		if (blocked[job->dir][tid >> 3] & (1 << (tid & 7)))
+			continue;
+
+		if (!job->done) {
+			// later jobs of this tunnel wait for this one
+			blocked[job->dir][tid >> 3] |= 1 << (tid & 7);
+			continue;
+		}
+
+		list_del(&job->list);
+		list_add_tail(&job->list, &ready);
+	}
+	pool_unlock();
+
+	ret = 0;
+	list_for_each_safe(job, bak, &ready) {
+		list_del(&job->list);
+		--pool.busy[job->dir][job->tid];
+		--pool.pending;
+
+		if (!job->cancelled && (emit(job) < 0))
+			ret = -1;
+
+		free(job->data);
+		free(job);
+	}
+
+	return ret;
+}
+
+#ifndef _WIN32
+/**
+ * get the file descriptor readable when jobs complete
+ */
+int workers_fd(void)
+{
+	return (pool.count > 0 ? pool.notify[0] : -1);
+}
+#else
+/**
+ * get the event signaled when jobs complete
+ */
+HANDLE workers_event(void)
+{
+	return (pool.count > 0 ? pool.evt : NULL);
+}
+#endif
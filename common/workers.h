@@ -0,0 +1,90 @@
+/**
+ * @file workers.h
+ * compression worker pool
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RDP2TCP_WORKERS_H__
+#define __RDP2TCP_WORKERS_H__
+
+#include "compiler.h"
+#include "list.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/** job output goes to the virtual channel */
+#define WORKER_OUT 0
+/** job output goes to a tunnel */
+#define WORKER_IN  1
+
+/** job is only re-sequenced (already in its final form) */
+#define WORKER_OP_NONE       0
+/** DATA payload to compress into a R2TCMD_COMPRESS payload */
+#define WORKER_OP_COMPRESS   1
+/** compressed payload to inflate back into tunnel data */
+#define WORKER_OP_DECOMPRESS 2
+
+/** maximum number of worker threads */
+#define WORKERS_MAX 16
+/** queued jobs above which tunnels should stop being read */
+#define WORKERS_MAX_PENDING 64
+
+/** (de)compression job */
+typedef struct _r2t_job {
+	struct list_head list;    /**< pending jobs in submission order */
+	struct _r2t_job *next;    /**< worker queue link */
+	unsigned char dir;        /**< WORKER_OUT or WORKER_IN */
+	unsigned char tid;        /**< rdp2tcp tunnel ID */
+	unsigned char cmd;        /**< R2TCMD_xxx of the resulting message */
+	unsigned char op;         /**< WORKER_OP_xxx */
+	unsigned char algorithm;  /**< compression algorithm */
+	unsigned char level;      /**< compression level */
+	unsigned char cancelled;  /**< 1 if result must be dropped */
+	unsigned char done;       /**< 1 once processed (protected by pool lock) */
+	int status;               /**< 0 on success */
+	unsigned int orig;        /**< original size (WORKER_OP_DECOMPRESS) */
+	unsigned int len;         /**< payload size */
+	unsigned char *data;      /**< payload */
+} r2t_job_t;
+
+/** callback receiving completed jobs, in order for each tunnel */
+typedef int (*workers_emit_t)(r2t_job_t *);
+
+int  workers_init(void);
+void workers_kill(void);
+int  workers_count(void);
+int  workers_pending(void);
+int  workers_busy(unsigned char, unsigned char);
+int  workers_submit(unsigned char, unsigned char, unsigned char, unsigned char,
+						unsigned char, unsigned char, unsigned int,
+						const void *, unsigned int);
+void workers_cancel(unsigned char, unsigned char);
+int  workers_collect(workers_emit_t);
+#ifndef _WIN32
+int  workers_fd(void);
+#else
+HANDLE workers_event(void);
+#endif
+
+/** check whether the pool should throttle tunnel reads */
+#define workers_full() (workers_pending() >= WORKERS_MAX_PENDING)
+
+#endif // __RDP2TCP_WORKERS_H__
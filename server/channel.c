@@ -24,8 +24,13 @@
 #include "r2twin.h"
 #include "rdp2tcp.h"
 #include "msgparser.h"
+#include "compress.h"
+#include "workers.h"
+#include "dedup.h"
 #include "wtsapi32.h"
 
+#include <stdlib.h>
+
 #ifndef CHANNEL_CHUNK_LENGTH
 /** minimal chunk size supported by TS virtual channel */
 #define CHANNEL_CHUNK_LENGTH 1600
@@ -83,6 +88,8 @@ int channel_init(const char *name)
 		WTSVirtualChannelClose(vc.ts);
 		return -1;
 	}
+	iobuf_init2(&vc.zibuf, &vc.pbuf, "zchan");
+	iobuf_init(&vc.scratch, 'w', "zscratch");
 
 	events_init(vc.wio.io.hEvent, vc.rio.io.hEvent);
 
@@ -102,6 +109,13 @@ void channel_kill(void)
 	}
 	
 	aio_kill_forward(&vc.rio, &vc.wio);
+	compress_stream_kill(&vc.zout);
+	compress_stream_kill(&vc.zin);
+	iobuf_kill2(&vc.zibuf, &vc.pbuf);
+	iobuf_kill(&vc.scratch);
+	dedup_kill(&vc.dd_out);
+	dedup_kill(&vc.dd_in);
+	vc.comp_mode = R2TCOMP_MODE_NONE;
 	
 	// Close handles safely
 	if (vc.chan && vc.chan != INVALID_HANDLE_VALUE) {
@@ -141,6 +155,20 @@ int channel_write_pending(void)
 	return vc.wio.pending;
 }
 
+/**
+ * compress pending plain frames into channel-wide stream chunks
+ * @return 0 on success
+ */
+static int channel_flush_stream(void)
+{
+	int ret;
+
+	while ((ret = compress_stream_chunk(&vc.zout, &vc.pbuf, &vc.wio.buf)) > 0)
+		;
+
+	return ret;
+}
+
 /**
  * process TS virtual channel write-event
  * @return 0 on success
@@ -150,6 +178,14 @@ int channel_write_event(void)
 	int ret;
 
 	ret = aio_write(&vc.wio, vc.chan, "chan");
+
+	// previous write completed, flush the compression stream
+	if ((ret >= 0) && !vc.wio.pending && (iobuf_datalen(&vc.pbuf) > 0)) {
+		if (channel_flush_stream() < 0)
+			ret = -1;
+		else
+			ret = aio_write(&vc.wio, vc.chan, "chan");
+	}
 	trace_chan("pending=%i, outavail=%u, connected=%i, ret=%i",
 			vc.wio.pending, iobuf_datalen(&vc.wio.buf), vc.connected, ret);
 
@@ -178,11 +214,15 @@ int channel_write(
 {
 	unsigned char *ptr;
 	unsigned int used;
+	iobuf_t *obuf;
 
 	trace_chan("cmd=%02x id=%02x len=%u", cmd, tun_id, data_len);
-	used = iobuf_datalen(&vc.wio.buf);
 
-	ptr = iobuf_reserve(&vc.wio.buf, data_len+6, NULL);
+	// channel-wide compression stages plain frames until the pipe is free
+	obuf = (vc.comp_mode == R2TCOMP_MODE_CHANNEL ? &vc.pbuf : &vc.wio.buf);
+	used = iobuf_datalen(obuf);
+
+	ptr = iobuf_reserve(obuf, data_len+6, NULL);
 	if (!ptr)
 		return error("failed to append %u bytes to channel buffer", data_len+6);
 	*((unsigned int *)ptr) = htonl(data_len+2);
@@ -190,14 +230,418 @@ int channel_write(
 	ptr[4] = cmd;
 	ptr[5] = tun_id;
 	memcpy(ptr+6, data, data_len);
-	iobuf_commit(&vc.wio.buf, data_len+6);
+	iobuf_commit(obuf, data_len+6);
 
-	if (used > 0)
+	if ((used > 0) || vc.wio.pending)
 		return 0;
 
 	return channel_write_event();
 }
 
+/**
+ * send tunnel data as a R2TCMD_COMPRESS message if it is worth it
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @param[in] data data to write
+ * @param[in] data_len size of buffer
+ * @return 0 on success, 1 if data was not compressed, -1 on error
+ */
+static int channel_write_compressed(
+	unsigned char tun_id,
+	const void *data,
+	unsigned int data_len)
+{
+	unsigned char *ptr;
+	unsigned int clen;
+
+	if (!should_compress(data, data_len))
+		return 1;
+
+	// algorithm, level and original size precede compressed data
+	clen = get_max_compressed_size(vc.comp_algo, data_len);
+	ptr = iobuf_reserve(&vc.scratch, clen + 6, NULL);
+	if (!ptr)
+		return 1;
+
+	if (compress_data(vc.comp_algo, vc.comp_level, data, data_len, ptr+6, &clen)
+			|| (clen + 6 >= data_len))
+		return 1;
+
+	ptr[0] = vc.comp_algo;
+	ptr[1] = vc.comp_level;
+	*((unsigned int *)(ptr+2)) = htonl(data_len);
+
+	return channel_write(R2TCMD_COMPRESS, tun_id, ptr, clen + 6);
+}
+
+/**
+ * send tunnel data as a R2TCMD_DEDUP message
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @param[in] data data to write
+ * @param[in] data_len size of buffer
+ * @return 0 on success, 1 if data must be sent as is, -1 on error
+ */
+static int channel_write_dedup(
+	unsigned char tun_id,
+	const void *data,
+	unsigned int data_len)
+{
+	int ret;
+
+	if (data_len < DEDUP_MIN_SIZE)
+		return 1;
+
+	ret = dedup_encode(&vc.dd_out, data, data_len, &vc.scratch);
+	if (ret < 0) {
+		// the client never sees the partial update, stop deduplicating
+		dedup_kill(&vc.dd_out);
+		if (iobuf_datalen(&vc.scratch) > 0)
+			iobuf_truncate(&vc.scratch, 0);
+		return 1;
+	}
+
+	ret = channel_write(R2TCMD_DEDUP, tun_id, iobuf_dataptr(&vc.scratch), ret);
+	iobuf_truncate(&vc.scratch, 0);
+
+	return ret;
+}
+
+/**
+ * decode a R2TCMD_DEDUP message
+ * @param[in] msg R2TCMD_DEDUP message
+ * @param[in] len message size
+ * @param[out] out_len decoded payload size
+ * @return decoded payload or NULL on error
+ * @note the chunk cache is updated even if the tunnel is already closed
+ */
+const void *channel_dedup_decode(const r2tmsg_t *msg, unsigned int len,
+												unsigned int *out_len)
+{
+	int ret;
+	const void *data;
+
+	if (!dedup_active(&vc.dd_in)) {
+		error("unexpected dedup message");
+		return NULL;
+	}
+
+	ret = dedup_decode(&vc.dd_in, ((const char *)msg)+2, len-2, &vc.scratch);
+	data = iobuf_dataptr(&vc.scratch);
+
+	// scratch is left empty, data stays valid until its next use
+	if (iobuf_datalen(&vc.scratch) > 0)
+		iobuf_truncate(&vc.scratch, 0);
+
+	if (ret <= 0)
+		return NULL;
+
+	*out_len = (unsigned int)ret;
+	return data;
+}
+
+/**
+ * handle client chunk cache request and send back the accepted size
+ * @param[in] msg negotiation request
+ * @param[in] len message size
+ * @return 0 on success
+ * @note R2T_DEDUP environment variable caps the cache size (MB)
+ */
+int channel_dedup_negotiate(const r2tmsg_dedupneg_t *msg, unsigned int len)
+{
+	r2tmsg_dedupneg_t ans;
+	unsigned int budget, max;
+	const char *val;
+
+	if (len < sizeof(*msg))
+		return error("invalid dedup request size");
+
+	val = getenv("R2T_DEDUP");
+	max = (val ? (unsigned int)atoi(val) * 1024 * 1024 : 64 * 1024 * 1024);
+	if (max > DEDUP_MAX_CACHE)
+		max = DEDUP_MAX_CACHE;
+
+	budget = ntohl(msg->budget);
+	if (budget > max)
+		budget = max;
+	trace_chan("budget=%u", budget);
+
+	dedup_kill(&vc.dd_out);
+	dedup_kill(&vc.dd_in);
+
+	if (budget && (dedup_init(&vc.dd_in, budget, 0)
+				|| dedup_init(&vc.dd_out, budget, 1))) {
+		dedup_kill(&vc.dd_in);
+		budget = 0;
+	}
+
+	// both ends use the budget as adjusted by dedup_init()
+	if (budget)
+		budget = vc.dd_out.budget;
+
+	ans.budget = htonl(budget);
+	if (channel_write(R2TCMD_DEDUP, R2TDEDUP_NEGOTIATE, &ans.budget,
+									sizeof(ans.budget)) < 0)
+		return -1;
+
+	if (budget)
+		info(0, "deduplication enabled (%u KB chunk cache)", budget / 1024);
+	else
+		info(0, "deduplication request refused");
+
+	return 0;
+}
+
+/**
+ * hand tunnel data over to the compression workers
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @param[in] data data to write
+ * @param[in] data_len size of buffer
+ * @return 0 on success, 1 if data must be sent inline, -1 on error
+ */
+static int channel_offload(
+	unsigned char tun_id,
+	const void *data,
+	unsigned int data_len)
+{
+	unsigned char op;
+
+	// deduplication needs payloads in clear when they reach the channel
+	if ((vc.comp_mode == R2TCOMP_MODE_TUNNEL) && !dedup_active(&vc.dd_out)
+			&& should_compress(data, data_len))
+		op = WORKER_OP_COMPRESS;
+	else if (workers_busy(WORKER_OUT, tun_id))
+		op = WORKER_OP_NONE; // queued behind previous data
+	else
+		return 1;
+
+	return workers_submit(WORKER_OUT, tun_id, R2TCMD_DATA, op, vc.comp_algo,
+							vc.comp_level, 0, data, data_len);
+}
+
+/**
+ * hand a per-tunnel compressed message over to the decompression workers
+ * @param[in] msg compressed message
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_offload_decompress(const r2tmsg_compress_t *msg, unsigned int len)
+{
+	unsigned int orig;
+
+	if (len <= sizeof(*msg))
+		return error("compressed message too short");
+
+	orig = ntohl(msg->original_size);
+	if (!orig || (orig > RDP2TCP_MAX_MSGLEN))
+		return error("invalid compressed message size %u", orig);
+
+	return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA,
+						WORKER_OP_DECOMPRESS, msg->algorithm, 0, orig,
+						msg->data, len - sizeof(*msg));
+}
+
+/**
+ * deliver a completed worker job
+ * @param[in] job completed job
+ * @return 0 on success
+ */
+static int channel_job_done(r2t_job_t *job)
+{
+	tunnel_t *tun;
+
+	if (job->dir == WORKER_OUT) {
+		if ((job->cmd == R2TCMD_DATA) && dedup_active(&vc.dd_out)
+				&& !channel_write_dedup(job->tid, job->data, job->len))
+			return 0;
+		return channel_write(job->cmd, job->tid, job->data, job->len);
+	}
+
+	tun = tunnel_lookup(job->tid);
+	if (!tun)
+		return 0;
+
+	if (job->status < 0) {
+		error("failed to decompress tunnel 0x%02x data", job->tid);
+		channel_close_tunnel(job->tid);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	if (job->cmd == R2TCMD_SHUTDOWN)
+		return tunnel_remote_shutdown(tun);
+
+	if (job->cmd == R2TCMD_RESUME)
+		return tunnel_resume(tun, ntohl(*(unsigned int *)job->data));
+
+	return tunnel_write(tun, job->data, job->len);
+}
+
+/**
+ * handle compression workers completion event
+ * @return 0 on success
+ */
+int channel_jobs_event(void)
+{
+	trace_chan("pending=%i", workers_pending());
+	return workers_collect(channel_job_done);
+}
+
+/**
+ * notify the client a tunnel has been closed
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @return 0 on success
+ */
+int channel_close_tunnel(unsigned char tun_id)
+{
+	// tunnel data still being compressed must reach the client first
+	if (workers_busy(WORKER_OUT, tun_id))
+		return workers_submit(WORKER_OUT, tun_id, R2TCMD_CLOSE,
+								WORKER_OP_NONE, 0, 0, 0, NULL, 0);
+
+	return channel_write(R2TCMD_CLOSE, tun_id, NULL, 0);
+}
+
+/**
+ * notify the client the peer of a tunnel has sent FIN
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @return 0 on success
+ */
+int channel_shutdown_tunnel(unsigned char tun_id)
+{
+	// sent right after the last tunnel data
+	if (workers_busy(WORKER_OUT, tun_id))
+		return workers_submit(WORKER_OUT, tun_id, R2TCMD_SHUTDOWN,
+								WORKER_OP_NONE, 0, 0, 0, NULL, 0);
+
+	return channel_write(R2TCMD_SHUTDOWN, tun_id, NULL, 0);
+}
+
+/**
+ * handle client compression request and send back the accepted settings
+ * @param[in] msg negotiation request
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_compress_negotiate(const r2tmsg_compneg_t *msg, unsigned int len)
+{
+	r2tmsg_compneg_t ans;
+	int ret;
+
+	if (len < sizeof(*msg))
+		return error("invalid compression request size");
+
+	trace_chan("mode=%u, algo=%u, level=%u",
+			msg->mode, msg->algorithm, msg->level);
+
+	ans = *msg;
+	if (((ans.mode != R2TCOMP_MODE_TUNNEL) && (ans.mode != R2TCOMP_MODE_CHANNEL))
+			|| (ans.algorithm == COMPRESS_NONE)
+			|| !compress_supported(ans.algorithm,
+							ans.mode == R2TCOMP_MODE_CHANNEL)) {
+		ans.mode = R2TCOMP_MODE_NONE;
+		ans.algorithm = COMPRESS_NONE;
+	}
+	ans.level &= ~R2TCOMP_LEVEL_RESET;
+
+	// flush and stop the previous stream before answering in clear
+	if ((vc.comp_mode == R2TCOMP_MODE_CHANNEL) && (channel_flush_stream() < 0))
+		return -1;
+	compress_stream_kill(&vc.zout);
+	vc.comp_mode = R2TCOMP_MODE_NONE;
+
+	ret = channel_write(R2TCMD_COMPRESS, R2TCOMP_NEGOTIATE,
+							&ans.algorithm, sizeof(ans) - 2);
+	if (ret < 0)
+		return ret;
+
+	if (ans.mode == R2TCOMP_MODE_NONE) {
+		info(0, "compression request refused");
+		return 0;
+	}
+
+	if ((ans.mode == R2TCOMP_MODE_CHANNEL)
+			&& compress_stream_init(&vc.zout, ans.algorithm, ans.level, 0))
+		return -1;
+
+	// per-tunnel compression can be spread over several cores
+	if ((ans.mode == R2TCOMP_MODE_TUNNEL) && !workers_count()
+			&& (workers_init() > 0))
+		event_add_workers();
+
+	vc.comp_mode  = ans.mode;
+	vc.comp_algo  = ans.algorithm;
+	vc.comp_level = ans.level;
+
+	info(0, "%s compression enabled (%s level %u)",
+			(ans.mode == R2TCOMP_MODE_CHANNEL ? "channel" : "tunnel"),
+			get_compression_name(ans.algorithm), ans.level);
+
+	return 0;
+}
+
+/**
+ * handle a chunk of the client channel-wide compressed stream
+ * @param[in] msg compressed chunk
+ * @param[in] len message size
+ * @return 0 on success
+ */
+int channel_recv_stream(const r2tmsg_compress_t *msg, unsigned int len)
+{
+	int ret;
+	static int nested = 0;
+	r2tmsg_compneg_t req;
+
+	if (nested)
+		return error("nested compressed stream chunk");
+
+	// chunks of the lost stream are dropped until the client restarts it
+	if (vc.zin_lost) {
+		if ((len < sizeof(*msg)) || !(msg->level & R2TCOMP_LEVEL_RESET))
+			return 0;
+		vc.zin_lost = 0;
+	}
+
+	ret = compress_stream_recv(&vc.zin, msg, len, &vc.zibuf);
+	if (!ret && (iobuf_datalen(&vc.zibuf) > 0)) {
+		nested = 1;
+		ret = commands_parse(&vc.zibuf);
+		nested = 0;
+	}
+
+	if (ret < 0) {
+		// frames already handled must not run again with the next chunk
+		warn("channel stream lost, asking the client to restart it");
+		compress_stream_kill(&vc.zin);
+		if (iobuf_datalen(&vc.zibuf) > 0)
+			iobuf_consume(&vc.zibuf, iobuf_datalen(&vc.zibuf));
+		vc.zin_lost = 1;
+
+		// the client restarts its stream on any negotiation answer
+		req.cmd       = R2TCMD_COMPRESS;
+		req.id        = R2TCOMP_NEGOTIATE;
+		req.algorithm = vc.comp_algo;
+		req.level     = vc.comp_level;
+		req.mode      = vc.comp_mode;
+		return channel_compress_negotiate(&req, sizeof(req));
+	}
+
+	return 0;
+}
+
+/**
+ * decompress a per-tunnel compressed payload
+ * @param[in] msg compressed message
+ * @param[in] len message size
+ * @param[out] out_len decompressed size
+ * @return decompressed data or NULL on error
+ */
+const void *channel_decompress(
+						const r2tmsg_compress_t *msg,
+						unsigned int len,
+						unsigned int *out_len)
+{
+	return decompress_message(msg, len, &vc.scratch, out_len);
+}
+
 /**
  * forward tunnel input buffer to virtual channel
  * @param[in] tun tunnel
@@ -214,9 +658,20 @@ int channel_forward(tunnel_t *tun)
 	ret = 0;
 
 	if (len > 0) {
-		ret = channel_write(R2TCMD_DATA, tun->id, iobuf_dataptr(ibuf), len);
-		if (ret >= 0)
+		ret = 1;
+		if (workers_count() > 0)
+			ret = channel_offload(tun->id, iobuf_dataptr(ibuf), len);
+		if ((ret > 0) && dedup_active(&vc.dd_out))
+			ret = channel_write_dedup(tun->id, iobuf_dataptr(ibuf), len);
+		if ((ret > 0) && (vc.comp_mode == R2TCOMP_MODE_TUNNEL))
+			ret = channel_write_compressed(tun->id, iobuf_dataptr(ibuf), len);
+		if (ret > 0)
+			ret = channel_write(R2TCMD_DATA, tun->id, iobuf_dataptr(ibuf), len);
+		if (ret >= 0) {
+			// kept to be sent again after a channel outage
+			replay_append(&tun->tx, iobuf_dataptr(ibuf), len);
 			iobuf_consume(ibuf, len);
+		}
 	}
 
 	return ret;
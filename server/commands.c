@@ -23,10 +23,14 @@
 #include "rdp2tcp.h"
 #include "r2twin.h"
 #include "msgparser.h"
+#include <stdlib.h>
 #include <string.h>
 
 extern struct list_head all_tunnels;
 
+/** system address family of each TUNAF_xxx */
+static const int r2taf_to_sysaf[TUNAF_IPV6+1] = { AF_UNSPEC, AF_INET, AF_INET6 };
+
 static int protoerror(unsigned char tid, unsigned char err, const char *errstr)
 {
 	channel_write(R2TCMD_CONN, tid, &err, 1);
@@ -38,7 +42,7 @@ static int start_tcp_tunnel(
 					unsigned int len,
 					int bind_tunnel)
 {
-	static const int r2taf_to_sysaf[3] = { AF_UNSPEC, AF_INET, AF_INET6 };
+	unsigned char af, profile;
 
 	// Validate message pointer
 	if (!msg) {
@@ -48,6 +52,10 @@ static int start_tcp_tunnel(
 	if (len < 7)
 		return protoerror(msg->id, R2TERR_BADMSG, "command too small");
 
+	// reserved IDs would be mistaken for channel-wide frames
+	if (msg->id > R2T_TID_MAX)
+		return error("invalid tunnel id 0x%02x", msg->id);
+
 	// Check if tunnel ID is already in use
 	if (tunnel_lookup(msg->id))
 		return error("tunnel 0x%02x is already used", msg->id);
@@ -63,9 +71,14 @@ static int start_tcp_tunnel(
 		return protoerror(msg->id, R2TERR_GENERIC, "too many tunnels");
 	}
 
-	if (msg->af > TUNAF_IPV6)
+	af      = msg->af & TUNAF_MASK;
+	profile = TUNAF_PROFILE(msg->af);
+	if (af > TUNAF_IPV6)
 		return protoerror(msg->id, R2TERR_BADMSG, "invalid address family");
 
+	if (profile >= NETPROF_MAX)
+		return protoerror(msg->id, R2TERR_BADMSG, "invalid socket profile");
+
 	// Validate hostname length and content
 	if (len < 7 || msg->hostname[len-6] != '\0') {
 		return protoerror(msg->id, R2TERR_BADMSG, "invalid hostname");
@@ -76,8 +89,8 @@ static int start_tcp_tunnel(
 		return protoerror(msg->id, R2TERR_BADMSG, "hostname length invalid");
 	}
 
-	tunnel_create(msg->id, r2taf_to_sysaf[msg->af],
-						msg->hostname, ntohs(msg->port), bind_tunnel);
+	tunnel_create(msg->id, r2taf_to_sysaf[af],
+						msg->hostname, ntohs(msg->port), bind_tunnel, profile);
 
 	return 0;
 }
@@ -98,6 +111,44 @@ static int cmd_bind(const r2tmsg_connreq_t *msg, unsigned int len)
 	return start_tcp_tunnel(msg, len, 1);
 }
 
+static int cmd_pool(const r2tmsg_connreq_t *msg, unsigned int len)
+{
+	trace_chan("len=%u, size=%u, af=0x%02x, port=0x%04x",
+		len, msg->id, msg->af, msg->port);
+
+	if ((len < 7) || (msg->hostname[len-6] != '\0') || !msg->port
+			|| (msg->af > TUNAF_IPV6))
+		return error("invalid pool request");
+
+	if (!*msg->hostname || (strlen(msg->hostname) > MAX_HOSTNAME_LEN))
+		return error("invalid pool request hostname");
+
+	tunnel_pool(r2taf_to_sysaf[msg->af], msg->hostname, ntohs(msg->port),
+					msg->id);
+
+	return 0;
+}
+
+static int cmd_resume(const r2tmsg_resume_t *msg, unsigned int len)
+{
+	tunnel_t *tun;
+
+	trace_chan("len=%u, tid=0x%02x, seq=%u", len, msg->id, ntohl(msg->seq));
+
+	tun = tunnel_lookup(msg->id);
+	if (!tun) {
+		info(0, "tunnel 0x%02x cannot be resumed (unknown)", msg->id);
+		return channel_write(R2TCMD_CLOSE, msg->id, NULL, 0);
+	}
+
+	// client data still being decompressed is counted first
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_RESUME, WORKER_OP_NONE,
+										0, 0, 0, &msg->seq, sizeof(msg->seq));
+
+	return tunnel_resume(tun, ntohl(msg->seq));
+}
+
 static int cmd_close(const r2tmsg_t *msg, unsigned int len)
 {
 	tunnel_t *tun;
@@ -109,10 +160,33 @@ static int cmd_close(const r2tmsg_t *msg, unsigned int len)
 		return 0;
 	}
 
+	// the client may reuse the ID right after CLOSE, pending jobs of the
+	// closed tunnel must not reach the next one
+	workers_cancel(WORKER_OUT, msg->id);
+	workers_cancel(WORKER_IN, msg->id);
 	tunnel_close(tun);
 	return 0;
 }
 
+static int cmd_shutdown(const r2tmsg_t *msg, unsigned int len)
+{
+	tunnel_t *tun;
+
+	trace_chan("len=%u, tid=0x%02x", len, msg->id);
+	tun = tunnel_lookup(msg->id);
+	if (!tun) {
+		error("invalid tunnel id 0x%02x", msg->id);
+		return 0;
+	}
+
+	// previous compressed data of this tunnel is still being inflated
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_SHUTDOWN,
+								WORKER_OP_NONE, 0, 0, 0, NULL, 0);
+
+	return tunnel_remote_shutdown(tun);
+}
+
 static int cmd_data(const r2tmsg_t *msg, unsigned int len)
 {
 	tunnel_t *tun;
@@ -124,14 +198,174 @@ static int cmd_data(const r2tmsg_t *msg, unsigned int len)
 		return 0;
 	}
 
+	// previous compressed data of this tunnel is still being inflated
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA, WORKER_OP_NONE,
+									0, 0, 0, ((const char *)msg)+2, len-2);
+
 	return tunnel_write(tun, ((const char *)msg)+2, len-2);
 }
 
+static int cmd_ping(const r2tmsg_ping_t *msg, unsigned int len)
+{
+	// keepalive pings (possibly without id) only refresh the channel
+	if ((len < 2) || (msg->id != R2TPING_PROBE))
+		return 0;
+
+	if (len != sizeof(*msg))
+		return error("invalid ping probe");
+
+	// seq and ts are echoed untouched, the client measures the round-trip
+	return channel_write(R2TCMD_PING, R2TPING_ECHO, &msg->seq,
+								sizeof(*msg) - 2);
+}
+
 static int cmd_compress(const r2tmsg_t *msg, unsigned int len)
 {
-	// For now, just ignore compression commands to maintain compatibility
-	// TODO: Implement compression handling
-	trace_chan("compression command ignored (len=%u)", len);
+	tunnel_t *tun;
+	const void *data;
+	unsigned int size;
+
+	trace_chan("len=%u, id=0x%02x", len, msg->id);
+
+	if (msg->id == R2TCOMP_NEGOTIATE)
+		return channel_compress_negotiate((const r2tmsg_compneg_t *)msg, len);
+
+	if (msg->id == R2TCOMP_STREAM)
+		return channel_recv_stream((const r2tmsg_compress_t *)msg, len);
+
+	tun = tunnel_lookup(msg->id);
+	if (!tun) {
+		error("invalid tunnel id 0x%02x", msg->id);
+		return 0;
+	}
+
+	if (workers_count() > 0) {
+		if (channel_offload_decompress((const r2tmsg_compress_t *)msg, len)) {
+			channel_close_tunnel(tun->id);
+			tunnel_close(tun);
+		}
+		return 0;
+	}
+
+	data = channel_decompress((const r2tmsg_compress_t *)msg, len, &size);
+	if (!data) {
+		tunnel_close(tun);
+		return 0;
+	}
+
+	return tunnel_write(tun, data, size);
+}
+
+static int cmd_dedup(const r2tmsg_t *msg, unsigned int len)
+{
+	tunnel_t *tun;
+	const void *data;
+	unsigned int size;
+
+	trace_chan("len=%u, id=0x%02x", len, msg->id);
+
+	if (msg->id == R2TDEDUP_NEGOTIATE)
+		return channel_dedup_negotiate((const r2tmsg_dedupneg_t *)msg, len);
+
+	// decoded first to keep the chunk cache in sync
+	data = channel_dedup_decode(msg, len, &size);
+
+	tun = tunnel_lookup(msg->id);
+	if (!tun) {
+		error("invalid tunnel id 0x%02x", msg->id);
+		return 0;
+	}
+
+	if (!data) {
+		channel_close_tunnel(tun->id);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	if (workers_busy(WORKER_IN, msg->id))
+		return workers_submit(WORKER_IN, msg->id, R2TCMD_DATA, WORKER_OP_NONE,
+									0, 0, 0, data, size);
+
+	return tunnel_write(tun, data, size);
+}
+
+/** pending R2TCMD_RESOLVE request */
+typedef struct _resolve_ctx {
+	unsigned char af;                   /**< requested TUNAF_xxx */
+	char hostname[MAX_HOSTNAME_LEN+1];  /**< requested hostname */
+} resolve_ctx_t;
+
+static void resolve_answer(
+				void *ctx,
+				int err,
+				const netaddr_t *addrs,
+				unsigned int count)
+{
+	resolve_ctx_t *req = (resolve_ctx_t *)ctx;
+	unsigned char ans[2 + R2TRESOLVE_MAX_ADDRS*17 + MAX_HOSTNAME_LEN+1];
+	unsigned int i, n, off, hlen;
+
+	trace_chan("host=%s, err=%i, count=%u", req->hostname, err, count);
+
+	off = 2;
+	for (i=0, n=0; (i < count) && (n < R2TRESOLVE_MAX_ADDRS); ++i) {
+		if (netaddr_af(&addrs[i]) == AF_INET) {
+			ans[off] = TUNAF_IPV4;
+			memcpy(&ans[off+1], &addrs[i].ip4.sin_addr, 4);
+			off += 5;
+		} else if (netaddr_af(&addrs[i]) == AF_INET6) {
+			ans[off] = TUNAF_IPV6;
+			memcpy(&ans[off+1], &addrs[i].ip6.sin6_addr, 16);
+			off += 17;
+		} else {
+			continue;
+		}
+		++n;
+	}
+
+	if (err)
+		ans[0] = (err == EAI_NONAME ? R2TERR_NOTFOUND : R2TERR_RESOLVE);
+	else
+		ans[0] = (n ? R2TERR_SUCCESS : R2TERR_NOTFOUND);
+	ans[1] = (unsigned char) n;
+
+	hlen = strlen(req->hostname) + 1;
+	memcpy(&ans[off], req->hostname, hlen);
+	off += hlen;
+
+	channel_write(R2TCMD_RESOLVE, req->af, ans, off);
+	free(req);
+}
+
+static int cmd_resolve(const r2tmsg_resolvereq_t *msg, unsigned int len)
+{
+	resolve_ctx_t *req;
+	unsigned int hlen;
+
+	trace_chan("len=%u, af=0x%02x", len, msg->af);
+
+	if ((len < 4) || (((const char *)msg)[len-1] != '\0')
+			|| (msg->af > TUNAF_IPV6))
+		return error("invalid resolve request");
+
+	hlen = strlen(msg->hostname);
+	if (!hlen || (hlen > MAX_HOSTNAME_LEN))
+		return error("invalid resolve request hostname");
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return error("failed to allocate resolve request");
+
+	req->af = msg->af;
+	memcpy(req->hostname, msg->hostname, hlen+1);
+
+	// the answer is sent from the resolver completion event, failures are
+	// answered right away so that the client does not wait forever
+	if (net_lookup_async(r2taf_to_sysaf[msg->af], req->hostname,
+									resolve_answer, req) < 0)
+		resolve_answer(req, EAI_FAIL, NULL, 0);
+
 	return 0;
 }
 
@@ -139,9 +373,14 @@ const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	(cmdhandler_t) cmd_conn,     /* R2TCMD_CONN */
 	(cmdhandler_t) cmd_close,    /* R2TCMD_CLOSE */
 	(cmdhandler_t) cmd_data,     /* R2TCMD_DATA */
-	NULL,
+	(cmdhandler_t) cmd_ping,     /* R2TCMD_PING */
 	(cmdhandler_t) cmd_bind,     /* R2TCMD_BIND */
 	NULL,
-	(cmdhandler_t) cmd_compress  /* R2TCMD_COMPRESS */
+	(cmdhandler_t) cmd_compress, /* R2TCMD_COMPRESS */
+	(cmdhandler_t) cmd_dedup,    /* R2TCMD_DEDUP */
+	(cmdhandler_t) cmd_resolve,  /* R2TCMD_RESOLVE */
+	(cmdhandler_t) cmd_pool,     /* R2TCMD_POOL */
+	(cmdhandler_t) cmd_resume,   /* R2TCMD_RESUME */
+	(cmdhandler_t) cmd_shutdown  /* R2TCMD_SHUTDOWN */
 };
 
@@ -27,7 +27,16 @@ extern struct list_head all_tunnels;
 
 static unsigned int events_count = 0;
 static HANDLE all_events[0x102] = {0, };
-static unsigned char evtid_to_tunid[0x102] = {0, };
+static unsigned short evtid_to_tunid[0x102] = {0, };
+
+/** pseudo tunnel ID of pooled connections events */
+#define EVTID_SPARE    0x100
+/** pseudo tunnel ID of the compression workers completion event */
+#define EVTID_WORKERS  0x101
+/** pseudo tunnel ID of the hostname resolver completion event */
+#define EVTID_RESOLVER 0x102
+
+static int event_add(HANDLE, unsigned short);
 
 /** initialize the TS events loop
  * @param[in] wevt TS virtual channel write-event
@@ -38,13 +47,28 @@ void events_init(HANDLE wevt, HANDLE revt)
 	all_events[0] = wevt;
 	all_events[1] = revt;
 	events_count = 2;
+
+	if (workers_event())
+		event_add_workers();
+	if (net_resolver_event())
+		event_add_resolver();
 }
 
-/** register a network tunnel event
- * @param[in] evt TS virtual channel socket event
- * @param[in] id rdp2tcp tunnel ID
+/** register the compression workers completion event
  * @return 0 on success */
-int event_add_tunnel(HANDLE evt, unsigned char id)
+int event_add_workers(void)
+{
+	return event_add(workers_event(), EVTID_WORKERS);
+}
+
+/** register the hostname resolver completion event
+ * @return 0 on success */
+int event_add_resolver(void)
+{
+	return event_add(net_resolver_event(), EVTID_RESOLVER);
+}
+
+static int event_add(HANDLE evt, unsigned short id)
 {
 	unsigned int i;
 
@@ -70,6 +94,45 @@ int event_add_tunnel(HANDLE evt, unsigned char id)
 	return 0;
 }
 
+/** register a network tunnel event
+ * @param[in] evt TS virtual channel socket event
+ * @param[in] id rdp2tcp tunnel ID
+ * @return 0 on success */
+int event_add_tunnel(HANDLE evt, unsigned char id)
+{
+	return event_add(evt, id);
+}
+
+/** register a pooled connection socket event
+ * @param[in] evt socket event
+ * @return 0 on success */
+int event_add_spare(HANDLE evt)
+{
+	return event_add(evt, EVTID_SPARE);
+}
+
+/** remove a single event
+ * @param[in] evt event handle */
+void event_del_handle(HANDLE evt)
+{
+	unsigned int i;
+
+	trace_evt("evt=%x", evt);
+
+	for (i=2; i<events_count; ++i) {
+		if (all_events[i] == evt) {
+			if (i+1 < events_count) {
+				memmove(&evtid_to_tunid[i], &evtid_to_tunid[i+1],
+							sizeof(evtid_to_tunid[0]) * (events_count-i-1));
+				memmove(&all_events[i], &all_events[i+1],
+							sizeof(all_events[0]) * (events_count-i-1));
+			}
+			--events_count;
+			break;
+		}
+	}
+}
+
 /** register a process tunnel event
  * @param[in] proc child process handle
  * @param[in] re child process read event
@@ -157,7 +220,18 @@ int event_wait(tunnel_t **out_tun, HANDLE *out_h)
 		return EVT_CHAN_READ;
 	}
 
-	tun = tunnel_lookup(evtid_to_tunid[off+ret]);
+	if (evtid_to_tunid[off+ret] == EVTID_SPARE) {
+		*out_h = all_events[off+ret];
+		return EVT_SPARE;
+	}
+
+	if (evtid_to_tunid[off+ret] == EVTID_WORKERS)
+		return EVT_WORKERS;
+
+	if (evtid_to_tunid[off+ret] == EVTID_RESOLVER)
+		return EVT_RESOLVER;
+
+	tun = tunnel_lookup((unsigned char)evtid_to_tunid[off+ret]);
 	if (!tun)
 		return error("invalid tunnel event 0x%02x", evtid_to_tunid[off+ret]);
 
@@ -40,6 +40,8 @@ void bye(void)
 {
 	channel_kill();
 	tunnels_kill();
+	workers_kill();
+	net_resolver_kill();
 	net_exit();
 	exit(0);
 }
@@ -61,6 +63,8 @@ static void setup(void)
 {
 	print_init();
 	net_init();
+	// lookups are done in the event loop if threads are not available
+	net_resolver_init();
 	SetConsoleCtrlHandler(on_signal, TRUE);
 }
 
@@ -78,6 +82,7 @@ static int ping(time_t *now)
 	time(now);
 	if (!last_ping || (last_ping + RDP2TCP_PING_DELAY - 1 < *now)) {
 		last_ping = *now;
+		tunnels_timer();
 		return channel_write(R2TCMD_PING, 0, NULL, 0);
 	}
 
@@ -103,6 +108,9 @@ int main(int argc, char **argv)
 		if (channel_init(chan_name))
 			break;
 
+		// tunnels survive channel reconnections
+		tunnels_restore_events();
+
 		ret = ping(&now);
 
 		// I/O loop
@@ -136,6 +144,23 @@ int main(int argc, char **argv)
 					ret = tunnel_event(tun, h);
 					break;
 
+				case EVT_WORKERS: // compression jobs completed
+					debug(0, "EVT_WORKERS");
+					ret = channel_jobs_event();
+					break;
+
+				case EVT_RESOLVER: // hostname lookups completed
+					debug(0, "EVT_RESOLVER");
+					tunnels_resolve_event();
+					ret = 0;
+					break;
+
+				case EVT_SPARE: // pooled connection event
+					debug(0, "EVT_SPARE");
+					tunnels_spare_event(h);
+					ret = 0;
+					break;
+
 				case EVT_PING: // ping delay
 					if (channel_is_connected()) {
 						debug(0, "EVT_PING");
@@ -31,6 +31,10 @@
 #include "list.h"
 #include "iobuf.h"
 #include "nethelper.h"
+#include "compress.h"
+#include "workers.h"
+#include "dedup.h"
+#include "replay.h"
 
 /** async I/O instance */
 typedef struct _aio {
@@ -47,8 +51,24 @@ typedef struct _vchannel {
 	int connected:1; /**< 1 if channel is conneced */
 	aio_t rio;       /**< input aio_t */
 	aio_t wio;       /**< output aio_t */
+	iobuf_t pbuf;    /**< plain frames waiting for stream compression */
+	iobuf_t zibuf;   /**< decompressed channel-wide stream input */
+	iobuf_t scratch; /**< per-tunnel (de)compression buffer */
+	unsigned char comp_mode;  /**< negotiated R2TCOMP_MODE_xxx */
+	unsigned char comp_algo;  /**< negotiated compression algorithm */
+	unsigned char comp_level; /**< negotiated compression level */
+	compress_stream_t zout;   /**< channel-wide output stream */
+	compress_stream_t zin;    /**< channel-wide input stream */
+	unsigned char zin_lost;   /**< 1 until the client restarts its stream */
+	dedup_cache_t dd_out;     /**< chunks held by the client */
+	dedup_cache_t dd_in;      /**< chunks received from the client */
 } vchannel_t;
 
+// tunnel write side states
+#define TUNSHUT_NONE    0
+#define TUNSHUT_PENDING 1 /**< FIN received by the client, output not flushed */
+#define TUNSHUT_DONE    2 /**< FIN forwarded to the tunnel peer */
+
 /** rdp2tcp tunnel */
 typedef struct _tunnel {
 	struct list_head list;   /**< double-linked list */
@@ -56,6 +76,13 @@ typedef struct _tunnel {
 	unsigned char connected; /**< 1 if tunnel is connected */
 	unsigned char server;    /**< 1 for reverse-connect tunnel */
 	unsigned char id;        /**< tunnel identifier */
+	unsigned char resolving; /**< 1 while hostname lookup is pending */
+	unsigned char rd_shut;   /**< 1 once the tunnel peer has sent FIN */
+	unsigned char wr_shut;   /**< TUNSHUT_xxx state of the write side */
+	unsigned char profile;   /**< NETPROF_xxx socket tuning profile */
+	struct _tunpool *pool;   /**< owner pool of a spare connection */
+	unsigned int rx_seq;     /**< payload bytes received from the client */
+	replay_t tx;             /**< last payload bytes sent to the client */
 	HANDLE proc;     /**< child process HANDLE */
 	HANDLE rfd;      /**< child process stdout/stderr HANDLE */
 	HANDLE wfd;      /**< child process stdin HANDLE */
@@ -85,10 +112,17 @@ int aio_write(aio_t *, HANDLE, const char *);
 #define EVT_CHAN_READ  1
 #define EVT_TUNNEL     2
 #define EVT_PING       3
+#define EVT_WORKERS    4
+#define EVT_RESOLVER   5
+#define EVT_SPARE      6
 
 void events_init(HANDLE, HANDLE);
 int event_add_tunnel(HANDLE, unsigned char);
+int event_add_workers(void);
+int event_add_resolver(void);
+int event_add_spare(HANDLE);
 void event_del_tunnel(unsigned char);
+void event_del_handle(HANDLE);
 int event_add_process(HANDLE, HANDLE, HANDLE, unsigned char);
 int event_wait(tunnel_t **, HANDLE *);
 
@@ -101,15 +135,32 @@ int channel_write_event(void);
 int channel_write_pending(void);
 int channel_write(unsigned char, unsigned char, const void *, unsigned int);
 int channel_forward(tunnel_t *);
+int channel_compress_negotiate(const r2tmsg_compneg_t *, unsigned int);
+int channel_recv_stream(const r2tmsg_compress_t *, unsigned int);
+const void *channel_decompress(const r2tmsg_compress_t *, unsigned int,
+											unsigned int *);
+int channel_offload_decompress(const r2tmsg_compress_t *, unsigned int);
+int channel_close_tunnel(unsigned char);
+int channel_shutdown_tunnel(unsigned char);
+int channel_jobs_event(void);
+int channel_dedup_negotiate(const r2tmsg_dedupneg_t *, unsigned int);
+const void *channel_dedup_decode(const r2tmsg_t *, unsigned int, unsigned int *);
 
 /* tunnel.c ***/
 #define valid_tunnel(tun) ((tun) && (tun)->list.next && (tun)->list.prev)
-void tunnel_create(unsigned char, int, const char *, unsigned short, int);
+void tunnel_create(unsigned char, int, const char *, unsigned short, int, int);
 tunnel_t *tunnel_lookup(unsigned char);
 int tunnel_event(tunnel_t *, HANDLE);
 int tunnel_write(tunnel_t *tun, const void *, unsigned int);
 void tunnel_close(tunnel_t *);
+int  tunnel_remote_shutdown(tunnel_t *);
 void tunnels_kill(void);
+void tunnels_resolve_event(void);
+void tunnel_pool(int, const char *, unsigned short, unsigned int);
+void tunnels_spare_event(HANDLE);
+void tunnels_timer(void);
+int  tunnel_resume(tunnel_t *, unsigned int);
+void tunnels_restore_events(void);
 
 /* errors.c ***/
 int wsaerror(const char *);
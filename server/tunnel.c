@@ -25,6 +25,7 @@
 #include "print.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 extern const char *r2t_errors[R2TERR_MAX];
@@ -32,6 +33,24 @@ extern const char *r2t_errors[R2TERR_MAX];
 /** global tunnels double-linked list */
 LIST_HEAD_INIT(all_tunnels);
 
+/** maximum number of connection pools */
+#define MAX_POOLS     8
+
+/** pre-established connections to a tunnel destination */
+typedef struct _tunpool {
+	struct list_head list;   /**< double-linked list */
+	struct list_head spares; /**< spare connections (tunnel_t) */
+	unsigned int size;       /**< requested number of spare connections */
+	unsigned int count;      /**< current number of spare connections */
+	unsigned int failures;   /**< connection failures since last timer */
+	int pref_af;             /**< preferred address family */
+	unsigned short port;     /**< TCP port */
+	char host[MAX_HOSTNAME_LEN+1]; /**< hostname */
+} tunpool_t;
+
+/** connection pools double-linked list */
+static LIST_HEAD_INIT(all_pools);
+
 /** lookup rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID
  * @return NULL if tunnel is not found */
@@ -74,7 +93,10 @@ static unsigned char tunnel_generate_id(void)
 
 	//ok = 1; //not used
 	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
+		// IDs with queued compression jobs cannot be reused yet
+		if ((tid <= R2T_TID_MAX)
+				&& !tunnel_lookup(tid) && !workers_busy(WORKER_OUT, tid)
+				&& !workers_busy(WORKER_IN, tid)) {
 			last_tid = tid;
 			return tid;
 		}
@@ -122,9 +144,32 @@ static int tunnel_socksend_event(tunnel_t *tun)
 	if (w > 0)
 		print_xfer("tcp", 'w', w);
 
+	// FIN forwarded once queued data is written
+	if ((tun->wr_shut == TUNSHUT_PENDING) && !iobuf_datalen(&tun->wio.buf)) {
+		trace_tun("id=0x%02x shutdown", tun->id);
+		tun->wr_shut = TUNSHUT_DONE;
+		if (shutdown(tun->sock.fd, SD_SEND))
+			return wsaerror("shutdown");
+	}
+
 	return 0;
 }
 
+/**
+ * close a tunnel whose both directions are shut
+ * @return 1 if the tunnel has been closed
+ */
+static int tunnel_done(tunnel_t *tun)
+{
+	if (!tun->rd_shut || (tun->wr_shut != TUNSHUT_DONE))
+		return 0;
+
+	trace_tun("id=0x%02x", tun->id);
+	channel_close_tunnel(tun->id);
+	tunnel_close(tun);
+	return 1;
+}
+
 static int tunnel_connect_event(tunnel_t *tun, int err)
 {
 	unsigned int ans_len;
@@ -167,24 +212,17 @@ static int tunnel_connect_event(tunnel_t *tun, int err)
 }
 
 
-static int host_connect(
-					tunnel_t *tun,
-					int pref_af,
-					const char *host,
-					unsigned short port)
+static int host_connect_done(tunnel_t *tun, int ret, int err)
 {
-	int ret, err;
 	unsigned char msg;
-
-	ret = net_client(pref_af, host, port, &tun->sock, &tun->addr, &err);
-	debug(0, "net_client(%s, %hu) -> %i / %i", host, port, ret, err);
+	char host[NETADDRSTR_MAXSIZE];
 
 	if (ret >= 0) {
-		info(0, "connect%s to %s:%hu", (ret > 0 ? "ing" : "ed"),
-			host, port);
+		info(0, "connect%s to %s", (ret > 0 ? "ing" : "ed"),
+			netaddr_print(&tun->addr, host));
+		net_tune(&tun->sock, tun->profile);
 
 		if (!event_add_tunnel(tun->sock.evt, tun->id)) {
-			iobuf_init2(&tun->rio.buf, &tun->wio.buf, "tcp");
 			if (!ret) {
 				ret = tunnel_connect_event(tun, 0);
 			} else {
@@ -198,10 +236,211 @@ static int host_connect(
 	channel_write(R2TCMD_CONN, tun->id, &msg, 1);
 	if (ret >= 0)
 		net_close(&tun->sock);
+	iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
 
 	return -1;
 }
 
+static void pool_fill(tunpool_t *);
+
+/**
+ * check whether a spare connection leads to host:port
+ * @note tunnels requested by IP address match the spare peer address
+ */
+static int spare_match(
+				tunnel_t *spare,
+				const char *host,
+				unsigned short port)
+{
+	char addr[NETADDRSTR_MAXSIZE], key[MAX_HOSTNAME_LEN+16];
+
+	if (!_stricmp(spare->pool->host, host))
+		return 1;
+
+	if (spare->resolving)
+		return 0;
+
+	snprintf(key, sizeof(key), (strchr(host, ':') ? "[%s]:%hu" : "%s:%hu"),
+				host, port);
+	return !strcmp(netaddr_print(&spare->addr, addr), key);
+}
+
+/**
+ * take a spare connection out of its pool
+ * @return NULL if no pool has a spare connection to host:port
+ */
+static tunnel_t *pool_claim(
+				int pref_af,
+				const char *host,
+				unsigned short port)
+{
+	tunpool_t *pool;
+	tunnel_t *spare, *found;
+
+	found = NULL;
+
+	list_for_each(pool, &all_pools) {
+		// pools of any family serve all requests
+		if ((pool->port != port)
+				|| ((pref_af != AF_UNSPEC) && (pool->pref_af != AF_UNSPEC)
+					&& (pool->pref_af != pref_af)))
+			continue;
+
+		// established connections first, then pending ones
+		list_for_each(spare, &pool->spares) {
+			if (spare->resolving || !spare_match(spare, host, port))
+				continue;
+			if (!found || (spare->connected && !found->connected))
+				found = spare;
+			if (found->connected)
+				break;
+		}
+
+		if (found)
+			break;
+	}
+
+	if (!found)
+		return NULL;
+
+	trace_tun("%s:%hu connected=%i", host, port, found->connected);
+	list_del(&found->list);
+	event_del_handle(found->sock.evt);
+	pool = found->pool;
+	--pool->count;
+	pool_fill(pool);
+
+	return found;
+}
+
+/**
+ * hand a spare connection over to a new tunnel
+ * @return 0 on success
+ */
+static int spare_attach(tunnel_t *tun, tunnel_t *spare)
+{
+	unsigned char msg;
+	int connected;
+
+	tun->sock = spare->sock;
+	memcpy(&tun->addr, &spare->addr, sizeof(tun->addr));
+	connected = spare->connected;
+	free(spare);
+
+	info(0, "tunnel 0x%02x uses a pooled connection", tun->id);
+	net_tune(&tun->sock, tun->profile);
+
+	if (event_add_tunnel(tun->sock.evt, tun->id)) {
+		msg = R2TERR_GENERIC;
+		channel_write(R2TCMD_CONN, tun->id, &msg, 1);
+		net_close(&tun->sock);
+		iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+		return -1;
+	}
+
+	// data already received by the spare socket is reported again
+	// by the event selection of tunnel_connect_event
+	if (connected)
+		return tunnel_connect_event(tun, 0);
+
+	return 0;
+}
+
+static int host_connect(
+					tunnel_t *tun,
+					int pref_af,
+					const char *host,
+					unsigned short port)
+{
+	int ret, err;
+	tunnel_t *spare;
+
+	// data received before the connection is queued in wio
+	iobuf_init2(&tun->rio.buf, &tun->wio.buf, "tcp");
+
+	spare = pool_claim(pref_af, host, port);
+	if (spare)
+		return spare_attach(tun, spare);
+
+	ret = net_client_async(pref_af, host, port, tun, &tun->sock, &tun->addr,
+									&err);
+	debug(0, "net_client(%s, %hu) -> %i / %i", host, port, ret, err);
+
+	if (ret == NET_RESOLVING) {
+		info(0, "resolving %s", host);
+		tun->resolving = 1;
+		return 0;
+	}
+
+	return host_connect_done(tun, ret, err);
+}
+
+static void spare_resolved(
+				tunnel_t *spare,
+				int ret,
+				sock_t *sock,
+				netaddr_t *addr)
+{
+	tunpool_t *pool;
+
+	pool = spare->pool;
+	spare->resolving = 0;
+
+	if (ret >= 0) {
+		spare->sock = *sock;
+		memcpy(&spare->addr, addr, sizeof(*addr));
+		if (!event_add_spare(spare->sock.evt)) {
+			spare->connected = !ret;
+			return;
+		}
+		net_close(&spare->sock);
+	}
+
+	list_del(&spare->list);
+	--pool->count;
+	++pool->failures;
+	free(spare);
+}
+
+static void tunnel_resolved(
+				void *ctx,
+				int ret,
+				sock_t *sock,
+				netaddr_t *addr,
+				int err)
+{
+	tunnel_t *tun = (tunnel_t *)ctx;
+
+	assert(valid_tunnel(tun) && tun->resolving);
+	trace_tun("id=0x%02x, ret=%i", tun->id, ret);
+
+	if (tun->pool) {
+		spare_resolved(tun, ret, sock, addr);
+		return;
+	}
+
+	tun->resolving = 0;
+	if (ret >= 0) {
+		tun->sock = *sock;
+		memcpy(&tun->addr, addr, sizeof(*addr));
+	}
+
+	if (host_connect_done(tun, ret, err) < 0) {
+		debug(0, "failed to create tunnel 0x%02x", tun->id);
+		event_del_tunnel(tun->id);
+		list_del(&tun->list);
+		free(tun);
+	}
+}
+
+/**
+ * connect tunnels whose hostname lookup has completed
+ */
+void tunnels_resolve_event(void)
+{
+	net_resolver_collect(tunnel_resolved);
+}
+
 static int host_bind(
 		tunnel_t *tun,
 		int pref_af,
@@ -219,6 +458,8 @@ static int host_bind(
 	debug(0, "bind %s:%hu ... %i/%i", host, port, ret, err);
 	if (!ret) {
 		info(0, "listening on %s:%hu", host, port);
+		// inherited by accepted connections
+		net_tune(&tun->sock, tun->profile);
 		ans_len = netaddr_to_connans(&tun->addr, &ans);
 		ans.err = 0;
 		if (event_add_tunnel(tun->sock.evt, tun->id)) {
@@ -249,6 +490,26 @@ static int host_bind(
 }
 
 
+/**
+ * get the replay window of tunnels
+ * @note R2T_RESUME environment variable sets the window in KB (0 disables
+ *       tunnels resumption)
+ */
+static unsigned int resume_window(void)
+{
+	static int window = -1;
+	const char *val;
+
+	if (window < 0) {
+		val = getenv("R2T_RESUME");
+		window = (val ? atoi(val) * 1024 : REPLAY_DEFAULT_SIZE);
+		if (window < 0)
+			window = 0;
+	}
+
+	return (unsigned int) window;
+}
+
 static tunnel_t *tunnel_alloc(unsigned char id)
 {
 	tunnel_t *tun;
@@ -256,6 +517,7 @@ static tunnel_t *tunnel_alloc(unsigned char id)
 	tun = calloc(1, sizeof(*tun));
 	if (tun) {
 		tun->id = id;
+		replay_init(&tun->tx, resume_window());
 	} else {
 		error("failed to allocate tunnel for id 0x%02x", id);
 	}
@@ -270,13 +532,15 @@ static tunnel_t *tunnel_alloc(unsigned char id)
  * @param[in] host tunnel hostname or command line
  * @param[in] port tcp tunnel port or 0 for process tunnel
  * @param[in] bind_socket 1 for reverse connect tunnel
+ * @param[in] profile NETPROF_xxx socket tuning profile
  */
 void tunnel_create(
 			unsigned char id,
 			int pref_af,
 			const char *host,
 			unsigned short port,
-			int bind_socket)
+			int bind_socket,
+			int profile)
 {
 	tunnel_t *tun;
 	int ret;
@@ -302,6 +566,7 @@ void tunnel_create(
 	tun = tunnel_alloc(id);
 	if (!tun)
 		return;
+	tun->profile = (unsigned char) profile;
 
 	if (port > 0) {
 		// tcp tunnel
@@ -334,8 +599,13 @@ void tunnel_close(tunnel_t *tun)
 	list_del(&tun->list);
 	
 	event_del_tunnel(tun->id);
+	workers_cancel(WORKER_IN, tun->id);
 
-	if (!tun->proc) {
+	if (tun->resolving) {
+		net_resolver_cancel(tun);
+		iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+
+	} else if (!tun->proc) {
 		if (!tun->server)
 			iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
 		net_close(&tun->sock);
@@ -346,6 +616,7 @@ void tunnel_close(tunnel_t *tun)
 		process_stop(tun);
 	}
 
+	replay_kill(&tun->tx);
 	free(tun);
 }
 
@@ -373,6 +644,34 @@ static int tunnel_sockrecv_event(tunnel_t *tun)
 	return 0;
 }
 
+/**
+ * forward FIN sent by the tunnel peer
+ * @note data received along with FIN is forwarded first
+ */
+static int tunnel_sockeof_event(tunnel_t *tun)
+{
+	int ret;
+	unsigned int r;
+
+	assert(valid_tunnel(tun));
+
+	do {
+		ret = net_read(&tun->sock, &tun->rio.buf, 0, &tun->rio.min_io_size, &r);
+		trace_tun("id=0x%02x --> ret=%i, r=%u", tun->id, ret, r);
+		if (!ret && (r > 0)) {
+			print_xfer("tcp", 'r', r);
+			if (channel_forward(tun) < 0)
+				return error("failed to forward");
+		}
+	} while (!ret && (r > 0));
+
+	if ((ret < 0) && (ret != NETERR_CLOSED))
+		return error("%s", net_error(NETERR_RECV, ret));
+
+	tun->rd_shut = 1;
+	return channel_shutdown_tunnel(tun->id);
+}
+
 static int on_read_completed(iobuf_t *ibuf, tunnel_t *tun)
 {
 	assert(valid_iobuf(ibuf) && valid_tunnel(tun));
@@ -392,7 +691,13 @@ static int tunnel_fdwrite_event(tunnel_t *tun)
 	return aio_write(&tun->wio, tun->wfd, "tun");
 }
 
-static int tunnel_accept_event(tunnel_t *tun)
+/**
+ * accept one pending connection of a listening tunnel
+ * @param[in] tun listening tunnel
+ * @return 0 if a connection has been handled, 1 if there is nothing more
+ *         to accept on this tunnel or -1 on error
+ */
+static int tunnel_accept_client(tunnel_t *tun)
 {
 	tunnel_t *cli;
 	sock_t cli_sock;
@@ -407,6 +712,8 @@ static int tunnel_accept_event(tunnel_t *tun)
 	trace_tun("id=0x%02x", tun->id);
 
 	ret = net_accept(&tun->sock, &cli_sock, &addr);
+	if (ret == WSAEWOULDBLOCK)
+		return 1;
 	if (ret)
 		return wsaerror("accept");
 
@@ -414,7 +721,7 @@ static int tunnel_accept_event(tunnel_t *tun)
 	if (tid == 0xff) {
 		error("failed to generate tunnel identifier");
 		net_close(&cli_sock);
-		return 0;
+		return 1;
 	}
 	trace_tun("srvid=0x%02x cliid=0x%02x", tun->id, tid);
 
@@ -436,14 +743,36 @@ static int tunnel_accept_event(tunnel_t *tun)
 	cli->sock.evt  = cli_sock.evt;
 	cli->connected = 1;
 	cli->id        = tid;
+	cli->profile   = tun->profile; // options inherited from the listener
+	// keepalive timings may not be inherited from the listener
+	net_keepalive(&cli->sock);
 	iobuf_init2(&cli->rio.buf, &cli->wio.buf, "tcp");
 	list_add_tail(&cli->list, &all_tunnels);
 	
 	msg_len = netaddr_to_connans(&addr, (r2tmsg_connans_t *)&msg);
 	msg.rid = tid;
 
-	if (channel_write(R2TCMD_RCONN, tun->id, &msg.rid, msg_len) < 0)
+	if (channel_write(R2TCMD_RCONN, tun->id, &msg.rid, msg_len) < 0) {
 		tunnel_close(tun);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int tunnel_accept_event(tunnel_t *tun)
+{
+	unsigned int i;
+	int ret;
+
+	assert(valid_tunnel(tun));
+
+	// handle the whole burst of connections instead of one per event
+	for (i=0; i<NET_ACCEPT_BURST; ++i) {
+		ret = tunnel_accept_client(tun);
+		if (ret)
+			return (ret > 0 ? 0 : ret);
+	}
 
 	return 0;
 }
@@ -452,7 +781,7 @@ static int tunnel_close_event(tunnel_t *tun)
 {
 	assert(valid_tunnel(tun));
 
-	channel_write(R2TCMD_CLOSE, tun->id, NULL, 0);
+	channel_close_tunnel(tun->id);
 	tunnel_close(tun);
 
 	return 0;
@@ -524,9 +853,17 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
 
 			if (evt & FD_CLOSE) {
 				debug(0, "FD_CLOSE");
-				return tunnel_close_event(tun);
+				// graceful FIN only shuts one direction
+				if ((ret < 0) || events.iErrorCode[FD_CLOSE_BIT]
+						|| !tun->connected)
+					return tunnel_close_event(tun);
+				ret = tunnel_sockeof_event(tun);
 			}
 
+			// both directions may be shut by now
+			if ((ret >= 0) && !(evt & FD_ACCEPT) && tunnel_done(tun))
+				return 0;
+
 		} else {
 			if (WSAGetLastError() != ERROR_IO_PENDING)
 				return wsaerror("WSAEnumNetworkEvents");
@@ -557,6 +894,8 @@ int tunnel_write(tunnel_t *tun, const void *data, unsigned int len)
 	trace_tun("====> %c %u %u", obuf->type, obuf->size, obuf->total);
 	assert(valid_iobuf(obuf));
 
+	tun->rx_seq += len;
+
 	used = iobuf_datalen(obuf);
 	if (len > 0) {
 		if (!iobuf_append(obuf, data, len))
@@ -576,14 +915,351 @@ int tunnel_write(tunnel_t *tun, const void *data, unsigned int len)
 	return tunnel_socksend_event(tun);
 }
 
+/** handle R2TCMD_SHUTDOWN, FIN sent by the tunnel client
+ * @param[in] tun established tunnel
+ * @return 0 on success
+ * @note the socket write side is shut once queued data is written, process
+ *       tunnels keep their stdin open */
+int tunnel_remote_shutdown(tunnel_t *tun)
+{
+	assert(valid_tunnel(tun));
+	trace_tun("id=0x%02x, rd_shut=%u", tun->id, tun->rd_shut);
+
+	// sent again after a channel outage
+	if ((tun->wr_shut != TUNSHUT_NONE) || tun->proc)
+		return 0;
+
+	tun->wr_shut = TUNSHUT_PENDING;
+	if (!tun->connected || iobuf_datalen(&tun->wio.buf))
+		return 0;
+
+	if (tunnel_socksend_event(tun) < 0) {
+		channel_close_tunnel(tun->id);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	tunnel_done(tun);
+	return 0;
+}
+
+static void spare_close(tunnel_t *spare)
+{
+	assert(valid_tunnel(spare) && spare->pool);
+
+	list_del(&spare->list);
+	--spare->pool->count;
+
+	if (spare->resolving) {
+		net_resolver_cancel(spare);
+	} else {
+		event_del_handle(spare->sock.evt);
+		net_close(&spare->sock);
+	}
+
+	free(spare);
+}
+
+/**
+ * open a new spare connection
+ * @return 0 on success
+ */
+static int pool_open(tunpool_t *pool)
+{
+	int ret, err;
+	tunnel_t *spare;
+
+	spare = tunnel_alloc(0xff);
+	if (!spare)
+		return -1;
+
+	spare->pool = pool;
+	ret = net_client_async(pool->pref_af, pool->host, pool->port, spare,
+									&spare->sock, &spare->addr, &err);
+
+	if (ret == NET_RESOLVING) {
+		spare->resolving = 1;
+
+	} else if (ret < 0) {
+		debug(0, "pool %s:%hu: %s", pool->host, pool->port,
+				net_error(ret, err));
+		free(spare);
+		return -1;
+
+	} else if (event_add_spare(spare->sock.evt)) {
+		net_close(&spare->sock);
+		free(spare);
+		return -1;
+
+	} else {
+		spare->connected = !ret;
+	}
+
+	list_add_tail(&spare->list, &pool->spares);
+	++pool->count;
+
+	return 0;
+}
+
+/**
+ * open spare connections until the pool is full
+ * @note after a failure, the pool is refilled by tunnels_timer only
+ */
+static void pool_fill(tunpool_t *pool)
+{
+	while (!pool->failures && (pool->count < pool->size)) {
+		if (pool_open(pool)) {
+			++pool->failures;
+			break;
+		}
+	}
+}
+
+static void pool_free(tunpool_t *pool)
+{
+	tunnel_t *spare, *bak;
+
+	list_for_each_safe(spare, bak, &pool->spares) {
+		spare_close(spare);
+	}
+
+	list_del(&pool->list);
+	free(pool);
+}
+
+/**
+ * create, resize or remove a connection pool
+ * @param[in] pref_af preferred address family
+ * @param[in] host pooled connections hostname
+ * @param[in] port pooled connections TCP port
+ * @param[in] size number of spare connections, 0 to remove the pool
+ */
+void tunnel_pool(
+			int pref_af,
+			const char *host,
+			unsigned short port,
+			unsigned int size)
+{
+	unsigned int count;
+	tunpool_t *pool, *found;
+	tunnel_t *spare;
+
+	assert(host && *host && port);
+	trace_tun("pref_af=%i, host=%s, port=%hu, size=%u",
+				pref_af, host, port, size);
+
+	count = 0;
+	found = NULL;
+	list_for_each(pool, &all_pools) {
+		if ((pool->port == port) && (pool->pref_af == pref_af)
+				&& !_stricmp(pool->host, host))
+			found = pool;
+		++count;
+	}
+
+	if (!size) {
+		if (found) {
+			info(0, "removed pool %s:%hu", host, port);
+			pool_free(found);
+		}
+		return;
+	}
+
+	if (size > R2T_POOL_MAX)
+		size = R2T_POOL_MAX;
+
+	pool = found;
+	if (!pool) {
+		if (count >= MAX_POOLS) {
+			error("too many connection pools");
+			return;
+		}
+
+		pool = calloc(1, sizeof(*pool));
+		if (!pool) {
+			error("failed to allocate connection pool");
+			return;
+		}
+
+		list_init(&pool->spares);
+		pool->pref_af = pref_af;
+		pool->port    = port;
+		strcpy(pool->host, host);
+		list_add_tail(&pool->list, &all_pools);
+	}
+
+	info(0, "pool %s:%hu holds %u connections", host, port, size);
+	pool->size     = size;
+	pool->failures = 0;
+
+	while (pool->count > size) {
+		spare = (tunnel_t *) pool->spares.prev;
+		spare_close(spare);
+	}
+
+	pool_fill(pool);
+}
+
+/**
+ * handle pooled connection socket event
+ * @param[in] h event handle
+ */
+void tunnels_spare_event(HANDLE h)
+{
+	int evt, err;
+	tunpool_t *pool;
+	tunnel_t *spare;
+	WSANETWORKEVENTS events;
+
+	list_for_each(pool, &all_pools) {
+		list_for_each(spare, &pool->spares) {
+			if (!spare->resolving && (spare->sock.evt == h))
+				goto found;
+		}
+	}
+
+	error("invalid pooled connection event");
+	return;
+
+found:
+	events.lNetworkEvents = 0;
+	if (WSAEnumNetworkEvents(spare->sock.fd, h, &events)) {
+		if (WSAGetLastError() != ERROR_IO_PENDING)
+			wsaerror("WSAEnumNetworkEvents");
+		return;
+	}
+
+	evt = (int) events.lNetworkEvents;
+	trace_tun("pool %s:%hu, evt=0x%x", pool->host, pool->port, evt);
+
+	if (evt & FD_CONNECT) {
+		err = events.iErrorCode[FD_CONNECT_BIT];
+		if (err) {
+			debug(0, "pool %s:%hu: connect error %i", pool->host, pool->port, err);
+			++pool->failures;
+			spare_close(spare);
+			return;
+		}
+		spare->connected = 1;
+	}
+
+	// data sent first by the peer stays in the socket until it is claimed
+	if (evt & FD_CLOSE) {
+		debug(0, "pool %s:%hu: connection closed by peer", pool->host,
+				pool->port);
+		++pool->failures;
+		spare_close(spare);
+	}
+}
+
+/**
+ * refill connection pools
+ * @note called on each ping delay
+ */
+void tunnels_timer(void)
+{
+	tunpool_t *pool;
+
+	list_for_each(pool, &all_pools) {
+		pool->failures = 0;
+		pool_fill(pool);
+	}
+}
+
+/**
+ * resume a tunnel after a channel outage
+ * @param[in] tun tunnel kept by the client
+ * @param[in] seq payload bytes received by the client
+ * @return 0 on success
+ * @note the tunnel is closed if the bytes the client missed are not held
+ *       anymore
+ */
+int tunnel_resume(tunnel_t *tun, unsigned int seq)
+{
+	int held;
+	unsigned int len, rx;
+	const void *data;
+
+	assert(valid_tunnel(tun));
+	trace_tun("id=0x%02x, seq=%u, tx=%u, rx=%u", tun->id, seq, tun->tx.seq,
+				tun->rx_seq);
+
+	held = replay_held(&tun->tx, seq);
+	if (!tun->connected || tun->server || (held < 0)) {
+		info(0, "tunnel 0x%02x cannot be resumed", tun->id);
+		channel_close_tunnel(tun->id);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	// queued payloads are part of the replayed bytes
+	workers_cancel(WORKER_OUT, tun->id);
+
+	rx = htonl(tun->rx_seq);
+	if (channel_write(R2TCMD_RESUME, tun->id, &rx, sizeof(rx)) < 0)
+		return -1;
+
+	while (seq != tun->tx.seq) {
+		len = replay_peek(&tun->tx, seq, &data);
+		if (len > RDP2TCP_MAX_MSGLEN / 2)
+			len = RDP2TCP_MAX_MSGLEN / 2;
+		if (channel_write(R2TCMD_DATA, tun->id, data, len) < 0)
+			return -1;
+		seq += len;
+	}
+
+	// FIN may have been lost with the channel
+	if (tun->rd_shut && (channel_shutdown_tunnel(tun->id) < 0))
+		return -1;
+
+	info(0, "tunnel 0x%02x resumed (%i bytes sent again)", tun->id, held);
+	return 0;
+}
+
+/**
+ * register again the events of all tunnels
+ * @note the events table is reset when the virtual channel is reopened
+ */
+void tunnels_restore_events(void)
+{
+	tunnel_t *tun;
+	tunpool_t *pool;
+
+	trace_tun("");
+
+	list_for_each(tun, &all_tunnels) {
+		if (tun->resolving)
+			continue;
+		if (tun->proc) {
+			if (event_add_process(tun->proc, tun->rio.io.hEvent,
+									tun->wio.io.hEvent, tun->id))
+				error("failed to restore tunnel 0x%02x events", tun->id);
+		} else if (event_add_tunnel(tun->sock.evt, tun->id)) {
+			error("failed to restore tunnel 0x%02x events", tun->id);
+		}
+	}
+
+	list_for_each(pool, &all_pools) {
+		list_for_each(tun, &pool->spares) {
+			if (!tun->resolving)
+				event_add_spare(tun->sock.evt);
+		}
+	}
+}
+
 /** destroy all tunnels */
 void tunnels_kill(void)
 {
 	tunnel_t *tun, *bak;
+	tunpool_t *pool, *pbak;
 
 	trace_tun("");
 
 	list_for_each_safe(tun, bak, &all_tunnels) {
 		tunnel_close(tun);
 	}
+
+	list_for_each_safe(pool, pbak, &all_pools) {
+		pool_free(pool);
+	}
 }
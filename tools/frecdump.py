@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+rdp2tcp flight recorder decoder
+
+Renders a dump written by the rdp2tcp client (SIGUSR2 or controller "f"
+command) as a timeline, one event per line.
+
+usage: frecdump.py [-a] FILE
+  -a  show wall clock times instead of times relative to the dump
+"""
+
+import sys
+import signal
+import struct
+import time
+
+HDR_SIZE = 32
+REC_SIZE = 16
+
+commands = ['conn', 'close', 'data', 'ping', 'bind', 'rconn', 'compress',
+			'dedup', 'resolve', 'pool', 'resume', 'shutdown']
+
+socket_types = ['ctrlsrv', 'tunsrv', 's5srv', 'ctrlcli', 'tuncli', 's5cli',
+				'rtunsrv', 'rtuncli', 'httpsrv', 'httpcli']
+
+def name(table, idx):
+	if idx < len(table):
+		return table[idx]
+	return '0x%02x' % idx
+
+def tid(idx):
+	if idx == 0xff:
+		return '--'
+	return '%02x' % idx
+
+def frame(arg, id, val):
+	return '%-8s tid=%s len=%u' % (name(commands, arg), tid(id), val)
+
+def sock(arg, id, val):
+	return '%-8s tid=%s fd=%u' % (name(socket_types, arg), tid(id), val)
+
+def queue(arg, id, val):
+	if arg == 0xff:
+		return 'channel  bytes=%u' % val
+	return '%-8s tid=%s bytes=%u' % (name(socket_types, arg), tid(id), val)
+
+def throttle(arg, id, val):
+	if arg:
+		return 'channel  delay_us=%u' % val
+	return 'tunnel   tid=%s delay_us=%u' % (tid(id), val)
+
+events = {
+	1:  ('frame-in',  frame),
+	2:  ('frame-out', frame),
+	3:  ('chan-read', lambda a, i, v: 'bytes=%u' % v),
+	4:  ('chan-write', lambda a, i, v: 'bytes=%u' % v),
+	5:  ('chan-state', lambda a, i, v: a and 'up' or 'down'),
+	6:  ('accept',    sock),
+	7:  ('close',     sock),
+	8:  ('throttle',  throttle),
+	9:  ('wake',      lambda a, i, v: 'ready=%u slept_us=%u' % (a, v)),
+	10: ('loop',      lambda a, i, v: 'busy_us=%u' % v),
+	11: ('queue',     queue)
+}
+
+def decode(path, absolute):
+	f = open(path, 'rb')
+	data = f.read()
+	f.close()
+
+	if len(data) < HDR_SIZE or data[:8] != b'R2TFREC\0':
+		raise ValueError('%s is not a flight recorder dump' % path)
+
+	# records are written in the byte order of the client host
+	order = '<'
+	if struct.unpack('<I', data[8:12])[0] != 1:
+		order = '>'
+	version, count, mono, wall = struct.unpack(order + 'IIQQ', data[8:HDR_SIZE])
+	if version != 1:
+		raise ValueError('unsupported dump version %u' % version)
+
+	count = min(count, (len(data) - HDR_SIZE) // REC_SIZE)
+	print('%u records, dumped at %s' % (count,
+		time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(wall / 1e6))))
+
+	prev = None
+	for i in range(count):
+		off = HDR_SIZE + i * REC_SIZE
+		ts, type, arg, id, pad, val = struct.unpack(order + 'QBBBBI',
+											data[off:off + REC_SIZE])
+		if absolute:
+			when = wall - (mono - ts)
+			stamp = time.strftime('%H:%M:%S', time.localtime(when // 1000000))
+			stamp += '.%06u' % (when % 1000000)
+		else:
+			stamp = '%+.6f' % ((ts - mono) / 1e6)
+
+		# long gaps stand out when the loop stopped
+		delta = ''
+		if prev is not None:
+			delta = '+%u' % (ts - prev)
+		prev = ts
+
+		label, fmt = events.get(type, ('0x%02x' % type,
+								lambda a, i, v: 'arg=%u id=%u val=%u' % (a, i, v)))
+		print('%s %10s  %-10s %s' % (stamp, delta, label, fmt(arg, id, val)))
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	absolute = '-a' in args
+	args = [a for a in args if a != '-a']
+	if len(args) != 1:
+		print(__doc__.strip())
+		sys.exit(1)
+	# quiet when piped to head
+	signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+	try:
+		decode(args[0], absolute)
+	except (IOError, ValueError) as e:
+		print('error: %s' % e)
+		sys.exit(1)
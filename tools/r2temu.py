@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+"""
+rdp2tcp server emulator used by the tools/test-*.py scripts
+
+client/rdp2tcp is started with its stdin/stdout standing for the virtual
+channel, this module plays the rdp2tcp.exe side. Frames are
+[len32 BE][cmd][id][payload], the client reads them wrapped in blocks
+prefixed by a little-endian 32-bit size.
+"""
+
+import os
+import select
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+import zlib
+
+R2TCMD_CONN     = 0x00
+R2TCMD_CLOSE    = 0x01
+R2TCMD_DATA     = 0x02
+R2TCMD_PING     = 0x03
+R2TCMD_COMPRESS = 0x06
+R2TCMD_DEDUP    = 0x07
+R2TCMD_RESUME   = 0x0a
+R2TCMD_SHUTDOWN = 0x0b
+
+R2TPING_PROBE = 0x01
+R2TPING_ECHO  = 0x02
+
+R2TCOMP_NEGOTIATE   = 0xff
+R2TCOMP_STREAM      = 0xfe
+R2TCOMP_MODE_NONE   = 0x00
+R2TCOMP_MODE_TUNNEL = 0x01
+R2TCOMP_MODE_CHANNEL = 0x02
+R2TCOMP_LEVEL_RESET = 0x80
+COMPRESS_GZIP = 0x01
+
+R2TDEDUP_NEGOTIATE = 0xff
+DEDUP_REC_NEW = 0x01
+DEDUP_REC_REF = 0x02
+
+CLIENT = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      '..', 'client', 'rdp2tcp')
+
+
+def frame(cmd, tid, payload=b''):
+    """build a channel frame (without its length)"""
+    return bytes([cmd, tid]) + payload
+
+
+class Channel:
+    """client/rdp2tcp process and the server end of its virtual channel"""
+
+    def __init__(self, port, env=None):
+        if not os.access(CLIENT, os.X_OK):
+            raise RuntimeError('%s not found, run make -C client' % CLIENT)
+
+        e = dict(os.environ)
+        e.update(env or {})
+        self.log = tempfile.TemporaryFile()
+        self.proc = subprocess.Popen([CLIENT, '127.0.0.1', str(port)], env=e,
+                                     stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE, stderr=self.log)
+        self.port = port
+        self.raw = b''       # client output not parsed yet
+        self.queue = []      # frames received and not consumed by the test
+        self.chunks = []     # (level, original size) of the client stream chunks
+        self.zin = None      # inflate stream of the client chunks
+        self.zout = None     # deflate stream of our chunks
+        self.zfresh = False
+        self.level = 6
+        self.probes = True   # echo the client ping probes
+        self.rx = {}         # payload bytes received per tunnel
+
+    def close(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+        self.proc.wait()
+        self.log.close()
+
+    def stderr(self):
+        """client log output so far"""
+        self.log.seek(0)
+        return self.log.read().decode(errors='replace')
+
+    def wait_log(self, text, since=0, timeout=5.0):
+        """wait for a client log message logged after the first since
+        characters of the log, serving the channel meanwhile"""
+        end = time.time() + timeout
+        while text not in self.stderr()[since:]:
+            if time.time() > end:
+                raise AssertionError('client did not log "%s"' % text)
+            self.poll(0.1)
+
+    # channel output
+
+    def write(self, data):
+        """write raw frames (with their length) to the client"""
+        self.proc.stdin.write(struct.pack('<I', len(data)) + data)
+        self.proc.stdin.flush()
+
+    def send(self, *frames):
+        """send frames, compressed if channel mode is on"""
+        data = b''.join(struct.pack('>I', len(f)) + f for f in frames)
+        if self.zout:
+            data = self.chunk(data)
+        self.write(data)
+
+    def chunk(self, plain):
+        """wrap frames into a channel-wide stream chunk"""
+        level = self.level | (R2TCOMP_LEVEL_RESET if self.zfresh else 0)
+        self.zfresh = False
+        data = self.zout.compress(plain) + self.zout.flush(zlib.Z_SYNC_FLUSH)
+        msg = bytes([R2TCMD_COMPRESS, R2TCOMP_STREAM, COMPRESS_GZIP, level])
+        msg += struct.pack('>I', len(plain)) + data
+        return struct.pack('>I', len(msg)) + msg
+
+    def answer_compress(self, req):
+        """accept a compression request in clear, then restart our stream"""
+        self.zout = None
+        self.send(req)
+        if req[4] == R2TCOMP_MODE_CHANNEL:
+            self.start_stream(req[3])
+
+    def start_stream(self, level=6):
+        """(re)start our deflate stream, the next chunk carries the reset"""
+        self.level = level
+        self.zout = zlib.compressobj(level)
+        self.zfresh = True
+
+    # channel input
+
+    def parse(self, data, nested=False):
+        while len(data) >= 4:
+            n = struct.unpack('>I', data[:4])[0]
+            if len(data) < 4 + n:
+                break
+            f, data = data[4:4+n], data[4+n:]
+
+            if f[0] == R2TCMD_PING:
+                if (len(f) > 1) and (f[1] == R2TPING_PROBE) and self.probes:
+                    self.send(bytes([R2TCMD_PING, R2TPING_ECHO]) + f[2:])
+                continue
+
+            if (f[0] == R2TCMD_COMPRESS) and (f[1] == R2TCOMP_STREAM):
+                if nested:
+                    raise AssertionError('nested stream chunk')
+                orig = struct.unpack('>I', f[4:8])[0]
+                self.chunks.append((f[3], orig))
+                if f[3] & R2TCOMP_LEVEL_RESET:
+                    self.zin = zlib.decompressobj()
+                if not self.zin:
+                    raise AssertionError('stream chunk without reset')
+                plain = self.zin.decompress(f[8:])
+                if len(plain) != orig:
+                    raise AssertionError('chunk size %u != %u'
+                                         % (len(plain), orig))
+                rest = self.parse(plain, True)
+                if rest:
+                    raise AssertionError('chunk with a partial frame')
+                continue
+
+            if f[0] == R2TCMD_DATA:
+                self.rx[f[1]] = self.rx.get(f[1], 0) + len(f) - 2
+            self.queue.append(f)
+
+        if nested:
+            return data
+        self.raw = data
+        return b''
+
+    def poll(self, timeout, socks=()):
+        """wait for client output, returns the readable sockets of socks"""
+        r, _, _ = select.select([self.proc.stdout] + list(socks), [], [],
+                                timeout)
+        if self.proc.stdout in r:
+            data = os.read(self.proc.stdout.fileno(), 1 << 20)
+            if not data:
+                raise AssertionError('client exited:\n' + self.stderr())
+            self.parse(self.raw + data)
+            r.remove(self.proc.stdout)
+        return r
+
+    def wait(self, pred, timeout=2.0):
+        """consume the first received frame matching pred"""
+        end = time.time() + timeout
+        while True:
+            for f in self.queue:
+                if pred(f):
+                    self.queue.remove(f)
+                    return f
+            left = end - time.time()
+            if left <= 0:
+                raise AssertionError('expected frame not received')
+            self.poll(min(left, 0.1))
+
+    def expect(self, cmd, tid=None, timeout=2.0):
+        return self.wait(lambda f: (f[0] == cmd)
+                         and ((tid is None) or (f[1] == tid)), timeout)
+
+    def collect(self, tid, size, timeout=5.0):
+        """consume DATA payloads of a tunnel until size bytes are received"""
+        data = b''
+        end = time.time() + timeout
+        while len(data) < size:
+            for f in [f for f in self.queue if f[:2] == bytes([R2TCMD_DATA, tid])]:
+                self.queue.remove(f)
+                data += f[2:]
+            if len(data) >= size:
+                break
+            if time.time() > end:
+                raise AssertionError('tunnel 0x%02x: %u/%u bytes received'
+                                     % (tid, len(data), size))
+            self.poll(0.1)
+        return data
+
+    def idle(self, secs):
+        """keep answering the client for a while"""
+        end = time.time() + secs
+        while time.time() < end:
+            self.poll(min(end - time.time(), 0.1))
+
+    # local side
+
+    def connect(self):
+        """mark the virtual channel as connected"""
+        self.send(bytes([R2TCMD_PING, 0]))
+        self.idle(0.3)
+
+    def controller(self, line):
+        """send a controller command, returns its answer"""
+        c = socket.create_connection(('127.0.0.1', self.port))
+        c.sendall(line.encode() + b'\n')
+        c.settimeout(2)
+        ans = c.recv(4096).decode()
+        c.close()
+        return ans
+
+    def open_tunnel(self, lport):
+        """connect to a tunnel listener and answer its CONN request"""
+        s = socket.create_connection(('127.0.0.1', lport))
+        f = self.expect(R2TCMD_CONN)
+        tid = f[1]
+        self.send(frame(R2TCMD_CONN, tid, b'\x00\x01' + struct.pack('>H', 80)
+                        + bytes([10, 0, 0, 1])))
+        return s, tid
+
+    def read_local(self, sock, size, timeout=5.0):
+        """read size bytes from a local socket, serving the channel meanwhile"""
+        data = b''
+        end = time.time() + timeout
+        while len(data) < size:
+            left = end - time.time()
+            if left <= 0:
+                raise AssertionError('local socket: %u/%u bytes received'
+                                     % (len(data), size))
+            if self.poll(min(left, 0.1), [sock]):
+                d = sock.recv(1 << 20)
+                if not d:
+                    break
+                data += d
+        return data
+
+    def read_eof(self, sock, timeout=2.0):
+        """check a local socket reaches EOF, serving the channel meanwhile"""
+        end = time.time() + timeout
+        while time.time() < end:
+            if self.poll(0.1, [sock]):
+                if not sock.recv(1 << 20):
+                    return True
+        return False
+
+
+def send_local(sock, data):
+    """send data from a thread, the client may not read it at once"""
+    def run():
+        try:
+            sock.sendall(data)
+        except OSError:
+            pass # client killed by the end of the test
+    t = threading.Thread(target=run, daemon=True)
+    t.start()
+    return t
@@ -131,6 +131,11 @@ class RDP2TCPEnhancedCLI:
                 return False
                 
             cmd_type = type_map[tunnel_type]
+
+            # listener-wide rate shared by all clients of the tunnel
+            options = None
+            if bandwidth_limit and tunnel_type != 'process':
+                options = 'rate=%d' % bandwidth_limit
             
             if tunnel_type == 'process':
                 if not command:
@@ -138,12 +143,12 @@ class RDP2TCPEnhancedCLI:
                     return False
                 result = self.client.add_tunnel(cmd_type, (local_host, local_port), (command, 0))
             elif tunnel_type == 'socks5':
-                result = self.client.add_tunnel(cmd_type, (local_host, local_port), ('', 0))
+                result = self.client.add_tunnel(cmd_type, (local_host, local_port), ('', 0), options)
             else:
                 if not remote_host or not remote_port:
                     self.logger.error("Remote host and port required for TCP/reverse tunnels")
                     return False
-                result = self.client.add_tunnel(cmd_type, (local_host, local_port), (remote_host, remote_port))
+                result = self.client.add_tunnel(cmd_type, (local_host, local_port), (remote_host, remote_port), options)
                 
             self.logger.info(f"Tunnel '{name}' created: {result}")
             
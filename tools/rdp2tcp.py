@@ -70,9 +70,30 @@ class rdp2tcp:
 		self.sock.sendall('l\n'.encode())
 		return self.__read_answer('\n\n')
 
-	def add_tunnel(self, type, src, dst):
-		msg = '%s %s %i %s' % (type, src[0], src[1], dst[0])
-		if type != 'x': msg += ' %i' % dst[1]
+	def stats(self):
+		self.sock.sendall('c\n'.encode())
+		stats = []
+		for line in self.__read_answer('\n\n').splitlines():
+			words = line.split(' ')
+			fields = [w for w in words if '=' not in w]
+			counters = dict(w.split('=', 1) for w in words if '=' in w)
+			for k in counters:
+				counters[k] = int(counters[k])
+			stats.append((fields, counters))
+		return stats
+
+	def histograms(self, reset=False):
+		if reset:
+			self.sock.sendall('h reset\n'.encode())
+			return self.__read_answer()
+		self.sock.sendall('h\n'.encode())
+		return self.__read_answer('\n\n')
+
+	def add_tunnel(self, type, src, dst, options=None):
+		msg = '%s %s %i' % (type, src[0], src[1])
+		if type != 's': msg += ' %s' % dst[0]
+		if type in ('t', 'r'): msg += ' %i' % dst[1]
+		if options and type != 'x': msg += ' %s' % options
 		self.sock.sendall((msg + '\n').encode())
 		return self.__read_answer()
 
@@ -80,6 +101,10 @@ class rdp2tcp:
 		self.sock.sendall(('- %s %i\n' % src).encode())
 		return self.__read_answer()
 
+	def set_pool(self, dst, count):
+		self.sock.sendall(('p %s %i %i\n' % (dst[0], dst[1], count)).encode())
+		return self.__read_answer()
+
 
 if __name__ == '__main__':
 	from sys import argv, exit, stdin, stdout
@@ -90,12 +115,18 @@ usage: %s [-h host] [-p port] <cmd> [args..]
 
 commands:
    info
-   add forward <lhost> <lport> <rhost> <rport>
-   add reverse <lhost> <lport> <rhost> <rport>
+   stats
+   hist [reset]
+   add forward <lhost> <lport> <rhost> <rport> [options..]
+   add reverse <lhost> <lport> <rhost> <rport> [options..]
    add process <lhost> <lport> <command>
-   add socks5  <lhost> <lport>
+   add socks5  <lhost> <lport> [options..]
    del <lhost> <lport>
-   sh [args]""" % argv[0])
+   pool <rhost> <rport> <count>
+   sh [args]
+
+tunnel options:
+   [profile] [idle=<secs>] [rate=<bytes/s>] [connrate=<bytes/s>]""" % argv[0])
 		exit(0)
 
 	
@@ -135,7 +166,7 @@ commands:
 		i += 2
 
 	cmd = argv[i]
-	if cmd not in ('info','add','del','sh','telnet'):
+	if cmd not in ('info','stats','hist','add','del','pool','sh','telnet'):
 		usage()
 
 	try:
@@ -148,23 +179,27 @@ commands:
 	if cmd == 'add':
 		argc -= 1
 		arg = argv[i+1]
-		if arg == 'forward' and argc == 4:
+		options = None
+		if arg == 'forward' and 4 <= argc <= 8:
 			type = 't'
 			src,dst = (argv[i+2], int(argv[i+3])),(argv[i+4], int(argv[i+5]))
-		elif arg == 'reverse' and argc == 4:
+			options = ' '.join(argv[i+6:])
+		elif arg == 'reverse' and 4 <= argc <= 8:
 			type = 'r'
 			src,dst = (argv[i+2], int(argv[i+3])),(argv[i+4], int(argv[i+5]))
+			options = ' '.join(argv[i+6:])
 		elif arg == 'process' and argc == 3:
 			type = 'x'
 			src,dst = (argv[i+2], int(argv[i+3])),(argv[i+4], 0)
-		elif arg == 'socks5' and argc == 2:
+		elif arg == 'socks5' and 2 <= argc <= 6:
 			type = 's'
 			src,dst = (argv[i+2], int(argv[i+3])),('', 0)
+			options = ' '.join(argv[i+4:])
 		else:
 			usage()
 
 		try:
-			print(r2t.add_tunnel(type, src, dst))
+			print(r2t.add_tunnel(type, src, dst, options))
 		except R2TException as e:
 			print('error: %s' % str(e))
 
@@ -176,9 +211,26 @@ commands:
 		except R2TException as e:
 			print('error: %s' % str(e))
 
+	elif cmd == 'pool':
+		if argc != 3: usage()
+
+		try:
+			print(r2t.set_pool((argv[i+1], int(argv[i+2])), int(argv[i+3])))
+		except R2TException as e:
+			print('error: %s' % str(e))
+
 	elif cmd == 'info':
 		print(r2t.info())
 
+	elif cmd == 'stats':
+		for fields, counters in r2t.stats():
+			print('%-40s %s' % (' '.join(fields), ' '.join('%s=%i' % kv
+										for kv in counters.items())))
+
+	elif cmd == 'hist':
+		if argc > 1 or (argc == 1 and argv[i+1] != 'reset'): usage()
+		print(r2t.histograms(argc == 1))
+
 	elif cmd == 'sh':
 		proc = 'cmd.exe'
 		if argc >= 1:
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""
+Test channel-wide stream compression (R2T_COMPRESS=channel)
+
+Runs client/rdp2tcp against the emulated server of r2temu.py, no RDP
+session is needed.
+"""
+
+import os
+import sys
+
+from r2temu import *
+
+PORT = 18610
+
+
+def start():
+    chan = Channel(PORT, {'R2T_COMPRESS': 'channel:gzip:6'})
+    chan.connect()
+    neg = chan.expect(R2TCMD_COMPRESS, R2TCOMP_NEGOTIATE)
+    if neg[2:5] != bytes([COMPRESS_GZIP, 6, R2TCOMP_MODE_CHANNEL]):
+        raise AssertionError('unexpected request %r' % neg)
+    chan.answer_compress(neg)
+    chan.controller('t 127.0.0.1 %u target 80' % (PORT + 1))
+    return chan
+
+
+def test_round_trip():
+    """Test tunnel data both ways through the compressed streams"""
+    chan = None
+    try:
+        print("Testing channel compression round trip...")
+        chan = start()
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        small = b'hello'
+        big = (b'rdp2tcp channel compression ' * 8192) + os.urandom(65536)
+
+        sock.sendall(small)
+        send_local(sock, big)
+        got = chan.collect(tid, len(small) + len(big))
+        if got != small + big:
+            raise AssertionError('client --> server data corrupted')
+
+        chan.send(frame(R2TCMD_DATA, tid, small))
+        for i in range(0, len(big), 16000):
+            chan.send(frame(R2TCMD_DATA, tid, big[i:i+16000]))
+        if chan.read_local(sock, len(small) + len(big)) != small + big:
+            raise AssertionError('server --> client data corrupted')
+
+        resets = [c for c in chan.chunks if c[0] & R2TCOMP_LEVEL_RESET]
+        if len(resets) != 1 or chan.chunks[0] != resets[0]:
+            raise AssertionError('client stream restarted: %r' % resets)
+
+        print(f"✓ {len(big) + len(small)} bytes each way "
+              f"in {len(chan.chunks)} client chunks")
+        return True
+
+    except Exception as e:
+        print(f"✗ Round trip test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def test_stream_resync():
+    """Test frames are not replayed and streams restart after a bad chunk"""
+    chan = None
+    try:
+        print("\nTesting stream resynchronisation...")
+        chan = start()
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        # a DATA frame followed by an invalid command in the same chunk
+        bad = b'\x00\x00\x00\x01\x7f'
+        chan.write(chan.chunk(b'\x00\x00\x00\x05' + frame(R2TCMD_DATA, tid,
+                                                            b'abc') + bad))
+
+        neg = chan.expect(R2TCMD_COMPRESS, R2TCOMP_NEGOTIATE)
+        print("✓ Client asked for a new stream")
+
+        # chunks of the old stream are ignored until the reset
+        chan.send(frame(R2TCMD_DATA, tid, b'lost'))
+        chan.answer_compress(neg)
+        chan.send(frame(R2TCMD_DATA, tid, b'def'))
+
+        got = chan.read_local(sock, 6)
+        if got != b'abcdef':
+            raise AssertionError('local socket got %r' % got)
+        print("✓ Frames handled before the error are not replayed")
+
+        count = len(chan.chunks)
+        sock.sendall(b'after resync')
+        if chan.collect(tid, 12) != b'after resync':
+            raise AssertionError('client --> server data corrupted')
+        if not (chan.chunks[count][0] & R2TCOMP_LEVEL_RESET):
+            raise AssertionError('client stream not restarted')
+        print("✓ Client restarted its stream")
+        return True
+
+    except Exception as e:
+        print(f"✗ Resync test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def main():
+    print("Channel Compression Test")
+    print("="*30)
+
+    if not test_round_trip():
+        print("\n❌ Round trip test failed!")
+        return False
+
+    if not test_stream_resync():
+        print("\n❌ Stream resynchronisation test failed!")
+        return False
+
+    print("\n🎉 All tests passed!")
+    return True
+
+if __name__ == '__main__':
+    success = main()
+    sys.exit(0 if success else 1)
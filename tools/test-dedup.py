@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""
+Test the chunk caches shared by all tunnels (R2T_DEDUP)
+
+Runs client/rdp2tcp against the emulated server of r2temu.py, no RDP
+session is needed.
+"""
+
+import os
+import struct
+import sys
+
+from r2temu import *
+
+PORT = 18620
+
+
+class ChunkCache:
+    """server side of the chunk caches, chunks are numbered from 0"""
+
+    def __init__(self):
+        self.chunks = []
+
+    def decode(self, records):
+        """decode DEDUP records, returns (payload, new bytes, ref bytes)"""
+        data, new, ref, off = b'', 0, 0, 0
+        while off < len(records):
+            if records[off] == DEDUP_REC_NEW:
+                n = struct.unpack('>H', records[off+1:off+3])[0]
+                chunk = records[off+3:off+3+n]
+                self.chunks.append(chunk)
+                new += n
+                off += 3 + n
+            elif records[off] == DEDUP_REC_REF:
+                seq = struct.unpack('>I', records[off+1:off+5])[0]
+                chunk = self.chunks[seq]
+                ref += len(chunk)
+                off += 5
+            else:
+                raise AssertionError('invalid record 0x%02x' % records[off])
+            data += chunk
+        return data, new, ref
+
+
+def start():
+    chan = Channel(PORT, {'R2T_DEDUP': '16'})
+    chan.connect()
+    neg = chan.expect(R2TCMD_DEDUP, R2TDEDUP_NEGOTIATE)
+    if struct.unpack('>I', neg[2:6])[0] != 16 << 20:
+        raise AssertionError('unexpected request %r' % neg)
+    chan.send(neg)
+    chan.idle(0.2)
+    chan.controller('t 127.0.0.1 %u target 80' % (PORT + 1))
+    return chan
+
+
+def receive(chan, cache, tid, size):
+    """decode the payloads of a tunnel until size bytes are received"""
+    data, new, ref = b'', 0, 0
+    while len(data) < size:
+        f = chan.wait(lambda f: (f[1] == tid)
+                      and (f[0] in (R2TCMD_DATA, R2TCMD_DEDUP)), 5)
+        if f[0] == R2TCMD_DATA:
+            data += f[2:]
+            continue
+        d, n, r = cache.decode(f[2:])
+        data, new, ref = data + d, new + n, ref + r
+    return data, new, ref
+
+
+def test_client_chunks():
+    """Test chunks sent on a tunnel are referenced on another one"""
+    chan = None
+    try:
+        print("Testing client --> server deduplication...")
+        chan = start()
+        cache = ChunkCache()
+        a, ta = chan.open_tunnel(PORT + 1)
+        b, tb = chan.open_tunnel(PORT + 1)
+        payload = os.urandom(64 * 1024)
+
+        a.sendall(payload)
+        data, new, ref = receive(chan, cache, ta, len(payload))
+        if data != payload:
+            raise AssertionError('first tunnel data corrupted')
+        if ref:
+            raise AssertionError('%u bytes of random data referenced' % ref)
+        print(f"✓ First copy sent as new chunks ({new} bytes)")
+
+        b.sendall(payload)
+        data, new, ref = receive(chan, cache, tb, len(payload))
+        if data != payload:
+            raise AssertionError('second tunnel data corrupted')
+        if ref < len(payload) * 3 // 4:
+            raise AssertionError('only %u bytes referenced' % ref)
+        print(f"✓ Second copy hits the cache ({ref} bytes referenced)")
+
+        other = os.urandom(64 * 1024)
+        b.sendall(other)
+        data, new, ref = receive(chan, cache, tb, len(other))
+        if (data != other) or ref:
+            raise AssertionError('new data not sent as new chunks')
+        print("✓ New data misses the cache")
+        return True
+
+    except Exception as e:
+        print(f"✗ Client deduplication test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def test_server_chunks():
+    """Test the client resolves references across tunnels"""
+    chan = None
+    try:
+        print("\nTesting server --> client deduplication...")
+        chan = start()
+        a, ta = chan.open_tunnel(PORT + 1)
+        b, tb = chan.open_tunnel(PORT + 1)
+        chunks = [os.urandom(4000), os.urandom(3000)]
+
+        records = b''.join(bytes([DEDUP_REC_NEW]) + struct.pack('>H', len(c))
+                           + c for c in chunks)
+        chan.send(frame(R2TCMD_DEDUP, ta, records))
+        if chan.read_local(a, 7000) != b''.join(chunks):
+            raise AssertionError('new chunks corrupted')
+        print("✓ New chunks delivered")
+
+        records = b''.join(bytes([DEDUP_REC_REF]) + struct.pack('>I', seq)
+                           for seq in (1, 0, 1))
+        chan.send(frame(R2TCMD_DEDUP, tb, records))
+        if chan.read_local(b, 10000) != chunks[1] + chunks[0] + chunks[1]:
+            raise AssertionError('referenced chunks corrupted')
+        print("✓ References resolved on another tunnel")
+
+        # a reference the client does not hold closes the tunnel
+        records = bytes([DEDUP_REC_REF]) + struct.pack('>I', 99)
+        chan.send(frame(R2TCMD_DEDUP, tb, records))
+        chan.expect(R2TCMD_CLOSE, tb)
+        if not chan.read_eof(b):
+            raise AssertionError('tunnel not closed')
+        print("✓ Unknown reference closes the tunnel")
+        return True
+
+    except Exception as e:
+        print(f"✗ Server deduplication test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def main():
+    print("Deduplication Test")
+    print("="*30)
+
+    if not test_client_chunks():
+        print("\n❌ Client deduplication test failed!")
+        return False
+
+    if not test_server_chunks():
+        print("\n❌ Server deduplication test failed!")
+        return False
+
+    print("\n🎉 All tests passed!")
+    return True
+
+if __name__ == '__main__':
+    success = main()
+    sys.exit(0 if success else 1)
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Test TCP half-close forwarding (R2TCMD_SHUTDOWN)
+
+Runs client/rdp2tcp against the emulated server of r2temu.py, no RDP
+session is needed.
+"""
+
+import socket
+import sys
+
+from r2temu import *
+
+PORT = 18640
+
+
+def start():
+    chan = Channel(PORT)
+    chan.connect()
+    chan.controller('t 127.0.0.1 %u target 80' % (PORT + 1))
+    return chan
+
+
+def closed(chan, tid):
+    return any(f[:2] == bytes([R2TCMD_CLOSE, tid]) for f in chan.queue)
+
+
+def test_local_fin():
+    """Test a local FIN keeps the server --> local direction open"""
+    chan = None
+    try:
+        print("Testing local half-close...")
+        chan = start()
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        sock.sendall(b'request')
+        sock.shutdown(socket.SHUT_WR)
+        if chan.collect(tid, 7) != b'request':
+            raise AssertionError('data before FIN lost')
+        chan.expect(R2TCMD_SHUTDOWN, tid)
+        print("✓ FIN forwarded after the data")
+
+        chan.idle(0.5)
+        if closed(chan, tid):
+            raise AssertionError('tunnel closed on FIN')
+
+        chan.send(frame(R2TCMD_DATA, tid, b'response'))
+        if chan.read_local(sock, 8) != b'response':
+            raise AssertionError('server data lost after FIN')
+        print("✓ Server data still flows")
+
+        chan.send(frame(R2TCMD_CLOSE, tid))
+        if not chan.read_eof(sock):
+            raise AssertionError('tunnel not closed')
+        return True
+
+    except Exception as e:
+        print(f"✗ Local half-close test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def test_remote_fin():
+    """Test a server FIN keeps the local --> server direction open"""
+    chan = None
+    try:
+        print("\nTesting remote half-close...")
+        chan = start()
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        chan.send(frame(R2TCMD_DATA, tid, b'banner'),
+                  frame(R2TCMD_SHUTDOWN, tid))
+        if chan.read_local(sock, 6) != b'banner':
+            raise AssertionError('data before FIN lost')
+        if not chan.read_eof(sock):
+            raise AssertionError('FIN not forwarded to the local socket')
+        print("✓ FIN forwarded after the data")
+
+        sock.sendall(b'still talking')
+        if chan.collect(tid, 13) != b'still talking':
+            raise AssertionError('local data lost after FIN')
+        if closed(chan, tid):
+            raise AssertionError('tunnel closed on FIN')
+        print("✓ Local data still flows")
+
+        sock.shutdown(socket.SHUT_WR)
+        chan.expect(R2TCMD_SHUTDOWN, tid)
+        print("✓ Second FIN forwarded")
+        return True
+
+    except Exception as e:
+        print(f"✗ Remote half-close test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def main():
+    print("Half-Close Test")
+    print("="*30)
+
+    if not test_local_fin():
+        print("\n❌ Local half-close test failed!")
+        return False
+
+    if not test_remote_fin():
+        print("\n❌ Remote half-close test failed!")
+        return False
+
+    print("\n🎉 All tests passed!")
+    return True
+
+if __name__ == '__main__':
+    success = main()
+    sys.exit(0 if success else 1)
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""
+Test tunnel rate limits (rate= and connrate= tunnel options)
+
+Runs client/rdp2tcp against the emulated server of r2temu.py, no RDP
+session is needed.
+"""
+
+import sys
+import time
+
+from r2temu import *
+
+PORT = 18650
+RATE = 100 * 1024
+
+
+def measure(chan, tids, secs):
+    """average read rate of tunnels in bytes per second"""
+    # the bucket starts full, skip its burst
+    chan.idle(0.5)
+    start = sum(chan.rx.get(tid, 0) for tid in tids)
+    t = time.time()
+    chan.idle(secs)
+    return (sum(chan.rx.get(tid, 0) for tid in tids) - start) / (time.time() - t)
+
+
+def check(rate, limit):
+    # reads are accounted whole, the bucket may end a window in debt
+    if not (limit * 0.7 <= rate <= limit * 1.2):
+        raise AssertionError('%u B/s for a %u B/s limit' % (rate, limit))
+
+
+def test_conn_rate():
+    """Test a single connection stays within connrate="""
+    chan = None
+    try:
+        print("Testing per-connection rate limit...")
+        chan = Channel(PORT)
+        chan.connect()
+        ans = chan.controller('t 127.0.0.1 %u target 80 connrate=100K'
+                              % (PORT + 1))
+        if 'error' in ans:
+            raise AssertionError(ans)
+
+        sock, tid = chan.open_tunnel(PORT + 1)
+        send_local(sock, b'x' * (4 << 20))
+        rate = measure(chan, [tid], 3)
+        check(rate, RATE)
+        print(f"✓ Tunnel read at {int(rate)} B/s")
+        return True
+
+    except Exception as e:
+        print(f"✗ Connection rate test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def test_listener_rate():
+    """Test the connections of a listener share rate="""
+    chan = None
+    try:
+        print("\nTesting shared listener rate limit...")
+        chan = Channel(PORT)
+        chan.connect()
+        ans = chan.controller('t 127.0.0.1 %u target 80 rate=100K'
+                              % (PORT + 1))
+        if 'error' in ans:
+            raise AssertionError(ans)
+
+        tids = []
+        for i in range(2):
+            sock, tid = chan.open_tunnel(PORT + 1)
+            send_local(sock, b'x' * (4 << 20))
+            tids.append(tid)
+
+        rate = measure(chan, tids, 3)
+        check(rate, RATE)
+        if not all(chan.rx.get(t, 0) for t in tids):
+            raise AssertionError('a tunnel is starved')
+        print(f"✓ Tunnels read at {int(rate)} B/s together")
+        return True
+
+    except Exception as e:
+        print(f"✗ Listener rate test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def main():
+    print("Rate Limit Test")
+    print("="*30)
+
+    if not test_conn_rate():
+        print("\n❌ Connection rate test failed!")
+        return False
+
+    if not test_listener_rate():
+        print("\n❌ Listener rate test failed!")
+        return False
+
+    print("\n🎉 All tests passed!")
+    return True
+
+if __name__ == '__main__':
+    success = main()
+    sys.exit(0 if success else 1)
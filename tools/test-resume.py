@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""
+Test tunnels surviving a virtual channel outage (R2TCMD_RESUME)
+
+Runs client/rdp2tcp against the emulated server of r2temu.py, no RDP
+session is needed.
+"""
+
+import os
+import struct
+import sys
+
+from r2temu import *
+
+PORT = 18630
+
+
+def outage(chan):
+    """stop answering until the client declares the channel down"""
+    chan.probes = False
+    chan.wait_log('virtual channel disconnected', len(chan.stderr()), 15)
+    chan.probes = True
+
+
+def test_reconnect():
+    """Test data lost both ways during an outage is sent again"""
+    chan = None
+    try:
+        print("Testing tunnel resume after a channel outage...")
+        chan = Channel(PORT, {'R2T_LOG_SYNC': '1'})
+        chan.connect()
+        chan.controller('t 127.0.0.1 %u target 80' % (PORT + 1))
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        up = os.urandom(1000)
+        down = os.urandom(1000)
+        sock.sendall(up)
+        chan.collect(tid, len(up))
+        chan.send(frame(R2TCMD_DATA, tid, down))
+        chan.read_local(sock, len(down))
+        print("✓ Tunnel established")
+
+        outage(chan)
+        sock.sendall(b'sent during the outage')
+        chan.idle(0.5)
+        print("✓ Channel declared down")
+
+        chan.connect()
+        req = chan.expect(R2TCMD_RESUME, tid)
+        seq = struct.unpack('>I', req[2:6])[0]
+        if seq != len(down):
+            raise AssertionError('client resumes at %u' % seq)
+        print("✓ Client asked to resume the tunnel")
+
+        # the server lost the last 200 bytes sent before the outage and
+        # the client did not get the ones sent while it was down
+        lost = os.urandom(500)
+        chan.send(frame(R2TCMD_RESUME, tid, struct.pack('>I', len(up) - 200)),
+                  frame(R2TCMD_DATA, tid, lost))
+
+        expected = up[-200:] + b'sent during the outage'
+        got = chan.collect(tid, len(expected))
+        if got != expected:
+            raise AssertionError('client sent again %r' % got)
+        print("✓ Client sent again what the server missed")
+
+        if chan.read_local(sock, len(lost)) != lost:
+            raise AssertionError('local socket missed resent data')
+        print("✓ Server data resumed on the local socket")
+
+        sock.sendall(b'after')
+        if chan.collect(tid, 5) != b'after':
+            raise AssertionError('tunnel stalled after resume')
+        print("✓ Tunnel keeps working")
+        return True
+
+    except Exception as e:
+        print(f"✗ Resume test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def test_no_resume():
+    """Test tunnels are closed when resume is disabled"""
+    chan = None
+    try:
+        print("\nTesting R2T_RESUME=0...")
+        chan = Channel(PORT, {'R2T_LOG_SYNC': '1', 'R2T_RESUME': '0'})
+        chan.connect()
+        chan.controller('t 127.0.0.1 %u target 80' % (PORT + 1))
+        sock, tid = chan.open_tunnel(PORT + 1)
+
+        outage(chan)
+        if not chan.read_eof(sock):
+            raise AssertionError('tunnel kept during the outage')
+        print("✓ Tunnel closed with the channel")
+        return True
+
+    except Exception as e:
+        print(f"✗ No resume test failed: {e}")
+        return False
+
+    finally:
+        if chan:
+            chan.close()
+
+
+def main():
+    print("Tunnel Resume Test")
+    print("="*30)
+
+    if not test_reconnect():
+        print("\n❌ Resume test failed!")
+        return False
+
+    if not test_no_resume():
+        print("\n❌ No resume test failed!")
+        return False
+
+    print("\n🎉 All tests passed!")
+    return True
+
+if __name__ == '__main__':
+    success = main()
+    sys.exit(0 if success else 1)